@@ -34,8 +34,8 @@
 #define BUFSZ 1024		/* buffer size to read mapping file */
 #define MAPPINGFILE ".NTFS-3G/UserMapping" /* default mapping file */
 #define LINESZ 120              /* maximum useful size of a mapping line */
-#define CACHE_PERMISSIONS_BITS 6  /* log2 of unitary allocation of permissions */
-#define CACHE_PERMISSIONS_SIZE 262144 /* max cacheable permissions */
+#define CACHE_PERMISSIONS_SIZE 16384 /* slots in permissions cache, power of 2 */
+#define CACHE_PERMISSIONS_PROBES 8 /* slots searched for a key */
 
 /*
  *		Matching of ntfs permissions to Linux permissions
@@ -43,6 +43,9 @@
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "param.h"
 #include "compat.h"
@@ -335,6 +338,7 @@ static void __ntfs_attr_init(ntfs_attr *na, ntfs_inode *ni,
         const ATTR_TYPES type, ntfschar *name, const u32 name_len)
 {
     na->rl = NULL;
+    ntfs_attr_rl_changed(na);
     na->ni = ni;
     na->type = type;
     na->name = name;
@@ -634,6 +638,7 @@ int ntfs_attr_map_runlist(ntfs_attr *na, VCN vcn)
                 na->rl);
         if (rl) {
             na->rl = rl;
+            ntfs_attr_rl_changed(na);
             ntfs_attr_put_search_ctx(ctx);
             return 0;
         }
@@ -696,6 +701,7 @@ static int ntfs_attr_map_partial_runlist(ntfs_attr *na, VCN vcn)
                 rl = na->rl;
             if (rl) {
                 na->rl = rl;
+                ntfs_attr_rl_changed(na);
                 highest_vcn = sle64_to_cpu(a->highest_vcn);
                 if (highest_vcn < needed) {
                 /* corruption detection on unchanged runlists */
@@ -791,6 +797,7 @@ int ntfs_attr_map_whole_runlist(ntfs_attr *na)
             if (!rl)
                 goto err_out;
             na->rl = rl;
+            ntfs_attr_rl_changed(na);
         }
 
         /* Are we in the first extent? */
@@ -905,6 +912,56 @@ retry:
     return lcn;
 }
 
+/*
+ *		Locate the run of @na->rl containing @vcn, which must not be
+ *	before the first run.
+ *
+ *	Returns the run, or the terminator when @vcn is beyond the last run.
+ *
+ *	The run count is cached with the runlist, so random accesses are
+ *	a binary search, and the last run found is remembered, so that
+ *	sequential accesses only have to check it and its successor.
+ */
+
+static runlist_element *ntfs_attr_rl_lookup(ntfs_attr *na, const VCN vcn)
+{
+    runlist_element *rl = na->rl;
+    int count;
+    int lo, hi, mid;
+
+    if ((na->rl_cursor_base != rl)
+        || rl[na->rl_cursor_count].length) {
+        for (count = 0; rl[count].length; count++) { }
+        na->rl_cursor_base = rl;
+        na->rl_cursor_count = count;
+        na->rl_cursor = 0;
+    }
+    count = na->rl_cursor_count;
+    mid = na->rl_cursor;
+    if ((mid < count) && (rl[mid].vcn <= vcn)) {
+        if (vcn < rl[mid + 1].vcn)
+            return (&rl[mid]);
+        if ((mid + 1 < count) && (vcn < rl[mid + 2].vcn)) {
+            na->rl_cursor = mid + 1;
+            return (&rl[mid + 1]);
+        }
+    }
+    if (vcn >= rl[count].vcn)
+        return (&rl[count]);
+        /* keep rl[lo].vcn <= vcn < rl[hi].vcn */
+    lo = 0;
+    hi = count;
+    while ((hi - lo) > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (rl[mid].vcn <= vcn)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    na->rl_cursor = lo;
+    return (&rl[lo]);
+}
+
 /**
  * ntfs_attr_find_vcn - find a vcn in the runlist of an ntfs attribute
  * @na:        ntfs attribute whose runlist to search
@@ -944,14 +1001,9 @@ retry:
         goto map_rl;
     if (vcn < rl[0].vcn)
         goto map_rl;
-    while (rl->length) {
-        if (vcn < rl[1].vcn) {
-            if (rl->lcn >= (LCN)LCN_HOLE)
-                return rl;
-            break;
-        }
-        rl++;
-    }
+    rl = ntfs_attr_rl_lookup(na, vcn);
+    if (rl->length && (rl->lcn >= (LCN)LCN_HOLE))
+        return rl;
     switch (rl->lcn) {
     case (LCN)LCN_RL_NOT_MAPPED:
         goto map_rl;
@@ -986,12 +1038,36 @@ map_rl:
 /**
  * ntfs_attr_pread_i - see description at ntfs_attr_pread()
  */ 
+#define ATTR_PREAD_BATCH 16 /* runs read with one ntfs_pread_many() */
+
+/*
+ * Read the runs gathered by ntfs_attr_pread_i() with a single submission.
+ * Return @total if all of them were read, otherwise the number of bytes from
+ * @start up to where the first short run stopped.
+ */
+static s64 ntfs_attr_pread_runs(ntfs_volume *vol, struct ntfs_io_req *reqs,
+        int nr, const u8 *start, s64 total)
+{
+    int i;
+
+    if (!nr || !ntfs_pread_many(vol->dev, reqs, nr))
+        return total;
+    for (i = 0; i < nr; i++) {
+        if (reqs[i].done != reqs[i].count)
+            return (const u8*)reqs[i].buf - start + reqs[i].done;
+    }
+    return total;
+}
+
 static s64 ntfs_attr_pread_i(ntfs_attr *na, const s64 pos, s64 count, void *b)
 {
-    s64 br, to_read, ofs, total, total2, max_read, max_init;
+    s64 to_read, ofs, total, total2, max_read, max_init, good;
     ntfs_volume *vol;
     runlist_element *rl;
     u16 efs_padding_length;
+    struct ntfs_io_req reqs[ATTR_PREAD_BATCH];
+    int nr_reqs = 0;
+    const u8 *start = b;
 
     /* Sanity checking arguments is done in ntfs_attr_pread(). */
 
@@ -1156,33 +1232,40 @@ res_err_out:
             b = (u8*)b + to_read;
             continue;
         }
-        /* It is a real lcn, read it into @dst. */
+        /*
+         * It is a real lcn, queue it for @dst. The runs are read in
+         * batches so that a fragmented read is a single submission.
+         */
         to_read = min(count, (rl->length << vol->cluster_size_bits) - ofs);
-retry:
         C_LOG_VERB("Reading %lld bytes from vcn %lld, lcn %lld, ofs %lld.\n", (long long)to_read, (long long)rl->vcn,
                    (long long )rl->lcn, (long long)ofs);
-        br = ntfs_pread(vol->dev, (rl->lcn << vol->cluster_size_bits) + ofs, to_read, b);
-        /* If everything ok, update progress counters and continue. */
-        if (br > 0) {
-            total += br;
-            count -= br;
-            b = (u8*)b + br;
-        }
-        if (br == to_read)
-            continue;
-        /* If the syscall was interrupted, try again. */
-        if (br == (s64)-1 && errno == EINTR)
-            goto retry;
-        if (total)
-            return total;
-        if (!br)
-            errno = EIO;
-        C_LOG_WARNING("%s: ntfs_pread failed", __FUNCTION__);
-        return -1;
-    }
+        reqs[nr_reqs].pos = (rl->lcn << vol->cluster_size_bits) + ofs;
+        reqs[nr_reqs].count = to_read;
+        reqs[nr_reqs].buf = b;
+        nr_reqs++;
+        total += to_read;
+        count -= to_read;
+        b = (u8*)b + to_read;
+        if (nr_reqs == ATTR_PREAD_BATCH) {
+            good = ntfs_attr_pread_runs(vol, reqs, nr_reqs, start, total);
+            if (good != total)
+                goto read_err_out;
+            nr_reqs = 0;
+        }
+    }
+    good = ntfs_attr_pread_runs(vol, reqs, nr_reqs, start, total);
+    if (good != total)
+        goto read_err_out;
     /* Finally, return the number of bytes read. */
     return total + total2;
+read_err_out:
+    if (good)
+        return good;
+    C_LOG_WARNING("%s: ntfs_pread failed", __FUNCTION__);
+    return -1;
 rl_err_out:
+    /* Runs queued before the bad one still have to be read. */
+    total = ntfs_attr_pread_runs(vol, reqs, nr_reqs, start, total);
     if (total)
         return total;
     errno = EIO;
@@ -1417,6 +1500,7 @@ static int ntfs_attr_fill_hole(ntfs_attr *na, s64 count, s64 *ofs,
         na->compressed_size += need << vol->cluster_size_bits;
 
     *rl = ntfs_runlists_merge(na->rl, rlc);
+    ntfs_attr_rl_changed(na);
     NAttrSetRunlistDirty(na);
         /*
          * For a compressed attribute, we must be sure there are two
@@ -1440,6 +1524,7 @@ static int ntfs_attr_fill_hole(ntfs_attr *na, s64 count, s64 *ofs,
     }
     na->unused_runs = 2;
     na->rl = *rl;
+    ntfs_attr_rl_changed(na);
     if ((*update_from == -1) || (from_vcn < *update_from))
         *update_from = from_vcn;
     *rl = ntfs_attr_find_vcn(na, cur_vcn);
@@ -1512,6 +1597,7 @@ static int split_compressed_hole(ntfs_attr *na, runlist_element **prl,
     int cluster_size_bits = na->ni->vol->cluster_size_bits;
     runlist_element *rl = *prl;
 
+    ntfs_attr_rl_changed(na); /* runs are split in place */
     compressed_part
         = na->compression_block_clusters;
         /* reserve entries in runlist if we have to split */
@@ -1680,6 +1766,7 @@ static int borrow_from_hole(ntfs_attr *na, runlist_element **prl,
     BOOL undecided;
     BOOL nothole;
 
+    ntfs_attr_rl_changed(na); /* runs are split in place */
         /* check whether the compression block is fully allocated */
     endblock = (((pos + count - 1) >> cluster_size_bits) | (na->compression_block_clusters - 1)) + 1 - rl->vcn;
     allocated = 0;
@@ -5107,6 +5194,7 @@ int ntfs_attr_make_non_resident(ntfs_attr *na,
     NAttrSetNonResident(na);
     NAttrSetBeingNonResident(na);
     na->rl = rl;
+    ntfs_attr_rl_changed(na);
     na->allocated_size = new_allocated_size;
     na->data_size = na->initialized_size = le32_to_cpu(a->value_length);
     /*
@@ -5227,6 +5315,7 @@ cluster_free_err_out:
     NAttrClearFullyMapped(na);
     na->allocated_size = na->data_size;
     na->rl = NULL;
+    ntfs_attr_rl_changed(na);
     free(rl);
     errno = err;
     return -1;
@@ -5708,6 +5797,7 @@ static int ntfs_attr_make_resident(ntfs_attr *na, ntfs_attr_search_ctx *ctx)
     /* Throw away the now unused runlist. */
     free(na->rl);
     na->rl = NULL;
+    ntfs_attr_rl_changed(na);
 
     /* Update in-memory struct ntfs_attr. */
     NAttrClearNonResident(na);
@@ -6357,6 +6447,7 @@ static int ntfs_non_resident_attr_shrink(ntfs_attr *na, const s64 newsize)
         }
 
         /* Truncate the runlist itself. */
+        ntfs_attr_rl_changed(na);
         if (ntfs_rl_truncate(&na->rl, first_free_vcn)) {
             /*
              * Failed to truncate the runlist, so just throw it
@@ -6584,6 +6675,7 @@ static int ntfs_non_resident_attr_expand_i(ntfs_attr *na, const s64 newsize,
             return -1;
         }
         na->rl = rln;
+        ntfs_attr_rl_changed(na);
         NAttrSetRunlistDirty(na);
 
         /* Prepare to mapping pairs update. */
@@ -6660,6 +6752,7 @@ rollback:
         ntfs_log_perror("Leaking clusters");
     }
     /* Now, truncate the runlist itself. */
+    ntfs_attr_rl_changed(na);
     if (ntfs_rl_truncate(&na->rl, org_alloc_size >>
             vol->cluster_size_bits)) {
         /*
@@ -7148,63 +7241,96 @@ int ntfs_attr_remove(ntfs_inode *ni, const ATTR_TYPES type, ntfschar *name,
     return ret;
 }
 
-/* Below macros are 32-bit ready. */
-#define BCX(x) ((x) - (((x) >> 1) & 0x77777777) - \
-              (((x) >> 2) & 0x33333333) - \
-              (((x) >> 3) & 0x11111111))
-#define BITCOUNT(x) (((BCX(x) + (BCX(x) >> 4)) & 0x0F0F0F0F) % 255)
+/*
+ *		Count the bits set in a buffer
+ *
+ *	The AVX2 version looks up the count of each nibble with a shuffle
+ *	(byte counters are folded every 31 vectors, before they can
+ *	overflow), the other one counts 64-bit words.
+ */
 
-static u8 *ntfs_init_lut256(void)
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static s64 ntfs_bits_set_avx2(const u8 *buf, s64 size)
 {
-    int i;
-    u8 *lut;
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                         1, 2, 2, 3, 2, 3, 3, 4,
+                         0, 1, 1, 2, 1, 2, 2, 3,
+                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    __m256i bytes, v, lo, hi;
+    s64 i = 0;
+    s64 count;
+    int n;
+
+    while (i + 32 <= size) {
+        bytes = _mm256_setzero_si256();
+        for (n = 0; (n < 31) && (i + 32 <= size); n++, i += 32) {
+            v = _mm256_loadu_si256((const __m256i*)(buf + i));
+            lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble));
+            hi = _mm256_shuffle_epi8(lut,
+                    _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            bytes = _mm256_add_epi8(bytes, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total,
+                _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1)
+        + _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    for (; i < size; i++)
+        count += __builtin_popcount(buf[i]);
+    return count;
+}
+
+#endif
 
-    lut = ntfs_malloc(256);
-    if (lut)
-        for(i = 0; i < 256; i++)
-            *(lut + i) = 8 - BITCOUNT(i);
-    return lut;
+static s64 ntfs_bits_set_scalar(const u8 *buf, s64 size)
+{
+    s64 i = 0;
+    s64 count = 0;
+    u64 word;
+
+    for (; i + 8 <= size; i += 8) {
+        memcpy(&word, buf + i, 8);
+        count += __builtin_popcountll(word);
+    }
+    for (; i < size; i++)
+        count += __builtin_popcount(buf[i]);
+    return count;
+}
+
+static s64 ntfs_bits_set(const u8 *buf, s64 size)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return ntfs_bits_set_avx2(buf, size);
+#endif
+    return ntfs_bits_set_scalar(buf, size);
 }
 
+#define FREE_BITS_BUFSZ (1024 * 1024)
+
 s64 ntfs_attr_get_free_bits(ntfs_attr *na)
 {
-    u8 *buf, *lut;
+    u8 *buf;
     s64 br      = 0;
     s64 total   = 0;
     s64 nr_free = 0;
 
-    lut = ntfs_init_lut256();
-    if (!lut)
-        return -1;
-
-    buf = ntfs_malloc(65536);
+    buf = ntfs_malloc(FREE_BITS_BUFSZ);
     if (!buf)
-        goto out;
+        return -1;
 
     while (1) {
-        u32 *p;
-        br = ntfs_attr_pread(na, total, 65536, buf);
+        br = ntfs_attr_pread(na, total, FREE_BITS_BUFSZ, buf);
         if (br <= 0)
             break;
         total += br;
-        p = (u32 *)buf + br / 4 - 1;
-        for (; (u8 *)p >= buf; p--) {
-            nr_free += lut[ *p        & 255] +
-                       lut[(*p >>  8) & 255] +
-                       lut[(*p >> 16) & 255] +
-                       lut[(*p >> 24)      ];
-        }
-        switch (br % 4) {
-            case 3:  nr_free += lut[*(buf + br - 3)];
-            /* FALLTHRU */
-            case 2:  nr_free += lut[*(buf + br - 2)];
-            /* FALLTHRU */
-            case 1:  nr_free += lut[*(buf + br - 1)];
-        }
+        nr_free += (br << 3) - ntfs_bits_set(buf, br);
     }
     free(buf);
-out:
-    free(lut);
     if (!total || br < 0)
         return -1;
     return nr_free;
@@ -198,8 +198,20 @@ struct _ntfs_attr {
     u8 compression_block_size_bits;
     u8 compression_block_clusters;
     s8 unused_runs; /* pre-reserved entries available */
+    runlist_element *rl_cursor_base; /* runlist the cursor refers to */
+    int rl_cursor_count; /* number of runs before the terminator */
+    int rl_cursor; /* run found by the last ntfs_attr_find_vcn() */
 };
 
+/*
+ * The lookup cursor caches the run count and last hit of @na->rl. Whoever
+ * reallocates the runlist or inserts/removes runs in place must drop it.
+ */
+static __inline__ void ntfs_attr_rl_changed(ntfs_attr *na)
+{
+    na->rl_cursor_base = NULL;
+}
+
 /**
  * enum ntfs_attr_state_bits - bits for the state field in the ntfs_attr
  * structure
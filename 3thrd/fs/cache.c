@@ -577,10 +577,6 @@ void ntfs_create_lru_caches(ntfs_volume *vol)
 #endif
 	vol->securid_cache = ntfs_create_cache("securid",(cache_free)NULL,
 		(cache_hash)NULL,sizeof(struct CACHED_SECURID), CACHE_SECURID_SIZE, 0);
-#if CACHE_LEGACY_SIZE
-	vol->legacy_cache = ntfs_create_cache("legacy",(cache_free)NULL,
-		(cache_hash)NULL, sizeof(struct CACHED_PERMISSIONS_LEGACY), CACHE_LEGACY_SIZE, 0);
-#endif
 }
 
 /*
@@ -599,7 +595,4 @@ void ntfs_free_lru_caches(ntfs_volume *vol)
 	ntfs_free_cache(vol->lookup_cache);
 #endif
 	ntfs_free_cache(vol->securid_cache);
-#if CACHE_LEGACY_SIZE
-	ntfs_free_cache(vol->legacy_cache);
-#endif
 }
@@ -1244,6 +1244,7 @@ static int ntfs_compress_overwr_free(ntfs_attr *na, runlist_element *rl,
 	int res;
 
 	vol = na->ni->vol;
+	ntfs_attr_rl_changed(na); /* runs are merged in place */
 	res = 0;
 	freelcn = rl->lcn + usedcnt;
 	freevcn = rl->vcn + usedcnt;
@@ -1456,6 +1457,7 @@ static int ntfs_compress_free(ntfs_attr *na, runlist_element *rl,
 	ntfs_volume *vol;
 	runlist_element *freerl;
 
+	ntfs_attr_rl_changed(na); /* runs are merged in place */
 	res = -1; /* default return */
 	vol = na->ni->vol;
 	freecnt = (reserved - used) >> vol->cluster_size_bits;
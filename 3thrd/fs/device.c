@@ -303,6 +303,117 @@ out:
     return ret;
 }
 
+/**
+ * ntfs_io_reqs_valid - check the ranges of a batched read or write
+ */
+static BOOL ntfs_io_reqs_valid(struct ntfs_io_req *reqs, int nr)
+{
+    int i;
+
+    if (!reqs || nr < 0)
+        return FALSE;
+    for (i = 0; i < nr; i++) {
+        if (!reqs[i].buf || reqs[i].pos < 0 || reqs[i].count < 0)
+            return FALSE;
+        reqs[i].done = 0;
+    }
+    return TRUE;
+}
+
+/**
+ * ntfs_pread_many - positioned reads of several ranges at once
+ * @dev:    device to read from
+ * @reqs:   ranges to read, @reqs[i].done is set to the bytes read
+ * @nr:     number of ranges
+ *
+ * Devices with batched operations (uring_io) submit all the ranges together,
+ * for the others this is ntfs_pread() on each range in turn.
+ *
+ * Return 0 if every range was read completely. Otherwise return -1 with errno
+ * set (EIO for a short read), the @done fields tell how far each range got.
+ */
+int ntfs_pread_many(struct ntfs_device *dev, struct ntfs_io_req *reqs, int nr)
+{
+    struct ntfs_device_operations *dops;
+    int i, err = 0;
+    s64 br;
+
+    if (!dev || !ntfs_io_reqs_valid(reqs, nr)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!nr)
+        return 0;
+
+    dops = dev->d_ops;
+    if (dops->pread_many)
+        return dops->pread_many(dev, reqs, nr);
+
+    for (i = 0; i < nr; i++) {
+        do {
+            br = ntfs_pread(dev, reqs[i].pos, reqs[i].count, reqs[i].buf);
+        } while (br < 0 && errno == EINTR);
+        reqs[i].done = (br > 0) ? br : 0;
+        if (br != reqs[i].count && !err)
+            err = (br < 0) ? errno : EIO;
+    }
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * ntfs_pwrite_many - positioned writes of several ranges at once
+ * @dev:    device to write to
+ * @reqs:   ranges to write, @reqs[i].done is set to the bytes written
+ * @nr:     number of ranges
+ *
+ * Same as ntfs_pread_many() for writing. The device is synced once at the
+ * end when mounted with "-o sync".
+ *
+ * Return 0 if every range was written completely, otherwise -1 with errno set.
+ */
+int ntfs_pwrite_many(struct ntfs_device *dev, struct ntfs_io_req *reqs, int nr)
+{
+    struct ntfs_device_operations *dops;
+    int i, ret, err = 0;
+    s64 written;
+
+    if (!dev || !ntfs_io_reqs_valid(reqs, nr)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!nr)
+        return 0;
+    if (NDevReadOnly(dev)) {
+        errno = EROFS;
+        return -1;
+    }
+
+    dops = dev->d_ops;
+    NDevSetDirty(dev);
+    if (dops->pwrite_many) {
+        ret = dops->pwrite_many(dev, reqs, nr);
+        err = ret ? errno : 0;
+    } else {
+        for (i = 0; i < nr; i++) {
+            written = ntfs_pwrite(dev, reqs[i].pos, reqs[i].count, reqs[i].buf);
+            reqs[i].done = (written > 0) ? written : 0;
+            if (written != reqs[i].count && !err)
+                err = (written < 0) ? errno : EIO;
+        }
+    }
+    if (NDevSync(dev) && dops->sync(dev) && !err)
+        err = errno;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * ntfs_mst_pread - multi sector transfer (mst) positioned read
  * @dev:    device to read from
@@ -44,6 +44,7 @@ typedef enum
     ND_Dirty,       /* 1: Device is dirty, needs sync. */
     ND_Block,       /* 1: Device is a block device. */
     ND_Sync,        /* 1: Device is mounted with "-o sync" */
+    ND_Direct,      /* 1: Device is opened with O_DIRECT */
 } ntfs_device_state_bits;
 
 #define  test_ndev_flag(nd, flag)       test_bit(ND_##flag, (nd)->d_state)
@@ -70,6 +71,10 @@ typedef enum
 #define NDevSetSync(nd)          set_ndev_flag(nd, Sync)
 #define NDevClearSync(nd)    clear_ndev_flag(nd, Sync)
 
+#define NDevDirect(nd)       test_ndev_flag(nd, Direct)
+#define NDevSetDirect(nd)        set_ndev_flag(nd, Direct)
+#define NDevClearDirect(nd)  clear_ndev_flag(nd, Direct)
+
 /**
  * struct ntfs_device -
  *
@@ -93,6 +98,20 @@ struct ntfs_device
 
 struct stat;
 
+/**
+ * struct ntfs_io_req -
+ *
+ * One range of a batched positioned read or write, see ntfs_pread_many() and
+ * ntfs_pwrite_many(). @done is set to the number of bytes transferred.
+ */
+struct ntfs_io_req
+{
+    s64 pos;                                    /* Position on the device. */
+    s64 count;                                  /* Number of bytes. */
+    void *buf;                                  /* Data buffer. */
+    s64 done;                                   /* Bytes transferred. */
+};
+
 /**
  * struct ntfs_device_operations -
  *
@@ -111,6 +130,9 @@ struct ntfs_device_operations
     int (*sync)(struct ntfs_device *dev);
     int (*stat)(struct ntfs_device *dev, struct stat *buf);
     int (*ioctl)(struct ntfs_device *dev, unsigned long request, void *argp);
+    /* Optional, ntfs_pread_many()/ntfs_pwrite_many() loop when NULL. */
+    int (*pread_many)(struct ntfs_device *dev, struct ntfs_io_req *reqs, int nr);
+    int (*pwrite_many)(struct ntfs_device *dev, struct ntfs_io_req *reqs, int nr);
 };
 
 extern struct ntfs_device *ntfs_device_alloc(const char *name, const long state, struct ntfs_device_operations *dops, void *priv_data);
@@ -119,6 +141,8 @@ extern int ntfs_device_sync(struct ntfs_device *dev);
 
 extern s64 ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b);
 extern s64 ntfs_pwrite(struct ntfs_device *dev, const s64 pos, s64 count, const void *b);
+extern int ntfs_pread_many(struct ntfs_device *dev, struct ntfs_io_req *reqs, int nr);
+extern int ntfs_pwrite_many(struct ntfs_device *dev, struct ntfs_io_req *reqs, int nr);
 extern s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count, const u32 bksize, void *b);
 extern s64 ntfs_mst_pwrite(struct ntfs_device *dev, const s64 pos, s64 count, const u32 bksize, void *b);
 extern s64 ntfs_cluster_read(const ntfs_volume *vol, const s64 lcn, const s64 count, void *b);
@@ -36,9 +36,29 @@
 
 #ifndef HAVE_WINDOWS_H
 
+/* Linux with io_uring headers: uring_io.c, falls back to unix_io at open. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NTFS_HAVE_URING_IO 1
+#endif
+#endif
+
+struct ntfs_device;
+struct ntfs_device_operations;
+
 /* Not for Windows use standard Unix style low level device operations. */
 // unix_io.c
+extern struct ntfs_device_operations ntfs_device_unix_io_ops;
+#ifdef NTFS_HAVE_URING_IO
+// uring_io.c
+extern struct ntfs_device_operations ntfs_device_uring_io_ops;
+#define ntfs_device_default_io_ops ntfs_device_uring_io_ops
+#else
 #define ntfs_device_default_io_ops ntfs_device_unix_io_ops
+#endif
+
+/* Raw descriptor of an opened unix_io device, -1 for other devices. */
+int ntfs_device_unix_io_fd(struct ntfs_device *dev);
 
 #else /* HAVE_WINDOWS_H */
 
@@ -29,6 +29,7 @@ file(GLOB SANDBOX_FS_SRC
         ${CMAKE_SOURCE_DIR}/3thrd/fs/security.c
         ${CMAKE_SOURCE_DIR}/3thrd/fs/unistr.c
         ${CMAKE_SOURCE_DIR}/3thrd/fs/unix_io.c
+        ${CMAKE_SOURCE_DIR}/3thrd/fs/uring_io.c
         ${CMAKE_SOURCE_DIR}/3thrd/fs/volume.c
         ${CMAKE_SOURCE_DIR}/3thrd/fs/xattrs.c
 )
\ No newline at end of file
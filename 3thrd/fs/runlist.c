@@ -139,6 +139,7 @@ runlist_element *ntfs_rl_extend(ntfs_attr *na, runlist_element *rl,
 			rl = (runlist_element*)NULL;
 		} else {
 			na->rl = newrl;
+			ntfs_attr_rl_changed(na);
 			rl = &newrl[irl];
 		}
 	} else {
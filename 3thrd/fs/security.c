@@ -1388,23 +1388,24 @@ static int ntfs_basic_perms(const struct SECURITY_CONTEXT *scx,
  *	which should not be too long to be efficient. Its optimal
  *	size is depends on usage and is hard to determine.
  *
- *	CACHED_PERMISSIONS data is kept in a two-level indexed array. It
- *	is optimal at the expense of storage. Use of a most-recent-first
- *	list would save memory and provide similar performances for
- *	standard usage, but not for file servers with too many file
- *	owners
+ *	CACHED_PERMISSIONS data is kept in an open-addressed table of
+ *	CACHE_PERMISSIONS_SIZE slots, keyed by the securid, or by the mft
+ *	number for legacy directories which were not allocated a
+ *	security_id. A key may only be stored in the
+ *	CACHE_PERMISSIONS_PROBES slots following its hash, when they are
+ *	all used, one of them is recycled.
  *
- *	CACHED_PERMISSIONS_LEGACY is a special case for CACHED_PERMISSIONS
- *	for legacy directories which were not allocated a security_id
- *	it is organized in a most-recent-first list.
+ *	The table is allocated once and never relocated, so that lookups
+ *	need no lock : each slot has a sequence count which is odd while
+ *	the slot is being updated, lookups copy the entry and retry if
+ *	the count has changed meanwhile. Updates are serialized by a mutex.
  *
- *	In main caches, data is never invalidated, as the meaning of
- *	a security_id only changes when user mapping is changed, which
- *	current implies remounting. However returned entries may be
- *	overwritten at next update, so data has to be copied elsewhere
- *	before another cache update is made.
- *	In legacy cache, data has to be invalidated when protection is
- *	changed.
+ *	Data is never invalidated for a security_id, as its meaning
+ *	only changes when user mapping is changed, which current implies
+ *	remounting. However entries may be overwritten at next update,
+ *	so lookups return a copy.
+ *	For legacy directories, data has to be invalidated when protection
+ *	is changed.
  *
  *	Though the same data may be found in both list, they
  *	must be kept separately : the interpretation of ACL
@@ -1416,63 +1417,6 @@ static int ntfs_basic_perms(const struct SECURITY_CONTEXT *scx,
  *	and 30% if the cache is disabled.
  */
 
-static struct PERMISSIONS_CACHE *create_caches(struct SECURITY_CONTEXT *scx,
-			u32 securindex)
-{
-	struct PERMISSIONS_CACHE *cache;
-	unsigned int index1;
-	unsigned int i;
-
-	cache = (struct PERMISSIONS_CACHE*)NULL;
-		/* create the first permissions blocks */
-	index1 = securindex >> CACHE_PERMISSIONS_BITS;
-	cache = (struct PERMISSIONS_CACHE*)
-		ntfs_malloc(sizeof(struct PERMISSIONS_CACHE)
-		      + index1*sizeof(struct CACHED_PERMISSIONS*));
-	if (cache) {
-		cache->head.last = index1;
-		cache->head.p_reads = 0;
-		cache->head.p_hits = 0;
-		cache->head.p_writes = 0;
-		*scx->pseccache = cache;
-		for (i=0; i<=index1; i++)
-			cache->cachetable[i]
-			   = (struct CACHED_PERMISSIONS*)NULL;
-	}
-	return (cache);
-}
-
-/*
- *		Free memory used by caches
- *	The only purpose is to facilitate the detection of memory leaks
- */
-
-static void free_caches(struct SECURITY_CONTEXT *scx)
-{
-	unsigned int index1;
-	struct PERMISSIONS_CACHE *pseccache;
-
-	pseccache = *scx->pseccache;
-	if (pseccache) {
-		for (index1=0; index1<=pseccache->head.last; index1++)
-			if (pseccache->cachetable[index1]) {
-#if POSIXACLS
-				struct CACHED_PERMISSIONS *cacheentry;
-				unsigned int index2;
-
-				for (index2=0; index2<(1<< CACHE_PERMISSIONS_BITS); index2++) {
-					cacheentry = &pseccache->cachetable[index1][index2];
-					if (cacheentry->valid
-					    && cacheentry->pxdesc)
-						free(cacheentry->pxdesc);
-					}
-#endif
-				free(pseccache->cachetable[index1]);
-			}
-		free(pseccache);
-	}
-}
-
 static int compare(const struct CACHED_SECURID *cached,
 			const struct CACHED_SECURID *item)
 {
@@ -1508,277 +1452,303 @@ static int compare(const struct CACHED_SECURID *cached,
 #endif
 }
 
-static int leg_compare(const struct CACHED_PERMISSIONS_LEGACY *cached,
-			const struct CACHED_PERMISSIONS_LEGACY *item)
+/*
+ *		Hash a key of the permissions cache
+ */
+
+static unsigned int permissions_hash(u64 key, unsigned int mask)
 {
-	return (cached->mft_no != item->mft_no);
+	return ((unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask);
 }
 
 /*
- *	Resize permission cache table
- *	do not call unless resizing is needed
- *	
- *	If allocation fails, the cache size is not updated
- *	Lack of memory is not considered as an error, the cache is left
- *	consistent and errno is not set.
+ *		Get the key of an inode in the permissions cache
+ *
+ *	returns zero if the permissions of the inode cannot be cached
+ */
+
+static u64 permissions_key(ntfs_inode *ni)
+{
+	u64 key;
+
+	key = 0;
+	/* cacheing is mostly possible if a security_id has been defined */
+	if (test_nino_flag(ni, v3_Extensions)
+	   && ni->security_id)
+		key = le32_to_cpu(ni->security_id);
+#if CACHE_LEGACY
+	else
+		if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
+			key = CACHE_KEY_LEGACY | ni->mft_no;
+#endif
+	return (key);
+}
+
+/*
+ *		Create the permissions cache
+ *
+ *	Two threads may race for creating it, the loser frees its own
+ *	copy and uses the winner's one.
+ *	Lack of memory is not considered as an error, the permissions are
+ *	just not cached.
+ */
+
+static struct PERMISSIONS_CACHE *create_caches(struct SECURITY_CONTEXT *scx)
+{
+	struct PERMISSIONS_CACHE *cache;
+	struct PERMISSIONS_CACHE *current;
+
+	cache = (struct PERMISSIONS_CACHE*)
+		ntfs_calloc(sizeof(struct PERMISSIONS_CACHE)
+		      + (CACHE_PERMISSIONS_SIZE - 1)
+			*sizeof(struct CACHED_PERMISSIONS_SLOT));
+	if (cache) {
+		cache->head.mask = CACHE_PERMISSIONS_SIZE - 1;
+		pthread_mutex_init(&cache->lock, (pthread_mutexattr_t*)NULL);
+		current = (struct PERMISSIONS_CACHE*)NULL;
+		if (!__atomic_compare_exchange_n(scx->pseccache, &current,
+				cache, FALSE,
+				__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_destroy(&cache->lock);
+			free(cache);
+			cache = current;
+		}
+	}
+	return (cache);
+}
+
+/*
+ *		Free memory used by caches
+ *	The only purpose is to facilitate the detection of memory leaks
  */
 
-static void resize_cache(struct SECURITY_CONTEXT *scx,
-			u32 securindex)
+static void free_caches(struct SECURITY_CONTEXT *scx)
 {
-	struct PERMISSIONS_CACHE *oldcache;
-	struct PERMISSIONS_CACHE *newcache;
-	int newcnt;
-	int oldcnt;
-	unsigned int index1;
+	struct PERMISSIONS_CACHE *pseccache;
+#if POSIXACLS
 	unsigned int i;
+#endif
+
+	pseccache = *scx->pseccache;
+	if (pseccache) {
+#if POSIXACLS
+		for (i=0; i<=pseccache->head.mask; i++)
+			if (pseccache->slots[i].key)
+				free(pseccache->slots[i].perm.pxdesc);
+		for (i=0; i<pseccache->retiredcnt; i++)
+			free(pseccache->retired[i]);
+		free(pseccache->retired);
+#endif
+		pthread_mutex_destroy(&pseccache->lock);
+		free(pseccache);
+	}
+}
 
-	oldcache = *scx->pseccache;
-	index1 = securindex >> CACHE_PERMISSIONS_BITS;
-	newcnt = index1 + 1;
-	if (newcnt <= ((CACHE_PERMISSIONS_SIZE
-			+ (1 << CACHE_PERMISSIONS_BITS)
-			- 1) >> CACHE_PERMISSIONS_BITS)) {
-		/* expand cache beyond current end, do not use realloc() */
-		/* to avoid losing data when there is no more memory */
-		oldcnt = oldcache->head.last + 1;
-		newcache = (struct PERMISSIONS_CACHE*)
-			ntfs_malloc(
-			    sizeof(struct PERMISSIONS_CACHE)
-			      + (newcnt - 1)*sizeof(struct CACHED_PERMISSIONS*));
-		if (newcache) {
-			memcpy(newcache,oldcache,
-			    sizeof(struct PERMISSIONS_CACHE)
-			      + (oldcnt - 1)*sizeof(struct CACHED_PERMISSIONS*));
-			free(oldcache);
-			     /* mark new entries as not valid */
-			for (i=newcache->head.last+1; i<=index1; i++)
-				newcache->cachetable[i]
-					 = (struct CACHED_PERMISSIONS*)NULL;
-			newcache->head.last = index1;
-			*scx->pseccache = newcache;
+#if POSIXACLS
+
+/*
+ *		Keep a replaced Posix descriptor until the cache is freed,
+ *	as a concurrent lookup may still be using it.
+ *
+ *	Replacements are rare (chmod of a legacy directory, or eviction),
+ *	if memory is lacking the descriptor is leaked rather than freed.
+ */
+
+static void retire_pxdesc(struct PERMISSIONS_CACHE *pcache,
+			struct POSIX_SECURITY *pxdesc)
+{
+	struct POSIX_SECURITY **retired;
+
+	if (pxdesc) {
+		retired = (struct POSIX_SECURITY**)realloc(pcache->retired,
+			(pcache->retiredcnt + 1)*sizeof(struct POSIX_SECURITY*));
+		if (retired) {
+			retired[pcache->retiredcnt++] = pxdesc;
+			pcache->retired = retired;
 		}
 	}
 }
 
+#endif /* POSIXACLS */
+
 /*
- *	Enter uid, gid and mode into cache, if possible
+ *		Find the slot of a key, to be called with the cache locked
  *
- *	returns the updated or created cache entry,
- *	or NULL if not possible (typically if there is no
- *		security id associated)
+ *	returns the slot holding the key, otherwise a free slot, otherwise
+ *	a slot to recycle if @create is set, otherwise NULL
+ */
+
+static struct CACHED_PERMISSIONS_SLOT *find_slot(
+		struct PERMISSIONS_CACHE *pcache, u64 key, BOOL create)
+{
+	struct CACHED_PERMISSIONS_SLOT *slot;
+	struct CACHED_PERMISSIONS_SLOT *freeslot;
+	unsigned int hash;
+	unsigned int i;
+
+	freeslot = (struct CACHED_PERMISSIONS_SLOT*)NULL;
+	hash = permissions_hash(key, pcache->head.mask);
+	for (i=0; i<CACHE_PERMISSIONS_PROBES; i++) {
+		slot = &pcache->slots[(hash + i) & pcache->head.mask];
+		if (slot->key == key)
+			return (slot);
+		if (!slot->key && !freeslot)
+			freeslot = slot;
+	}
+	if (!freeslot && create)
+		freeslot = &pcache->slots[(hash
+			+ pcache->head.victim++ % CACHE_PERMISSIONS_PROBES)
+				& pcache->head.mask];
+	return (freeslot);
+}
+
+/*
+ *	Updates of a slot are bracketed by incrementing its sequence
+ *	count, so that it is odd while the slot is inconsistent.
+ */
+
+static void begin_slot_update(struct CACHED_PERMISSIONS_SLOT *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_slot_update(struct CACHED_PERMISSIONS_SLOT *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *		Copy the permissions of a slot if it holds the key
+ *	No lock is taken, the copy is retried if the slot was updated
+ *	meanwhile.
+ */
+
+static BOOL read_slot(const struct CACHED_PERMISSIONS_SLOT *slot, u64 key,
+			struct CACHED_PERMISSIONS *copy)
+{
+	unsigned int seq;
+	BOOL found;
+
+	do {
+		do {
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		} while (seq & 1);
+		found = (slot->key == key);
+		if (found)
+			*copy = slot->perm;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq);
+	return (found);
+}
+
+/*
+ *	Enter uid, gid and mode into cache, if possible
+ *	(typically not possible if there is no security id associated
+ *	to a file)
  */
 
 #if POSIXACLS
-static struct CACHED_PERMISSIONS *enter_cache(struct SECURITY_CONTEXT *scx,
+static void enter_cache(struct SECURITY_CONTEXT *scx,
 		ntfs_inode *ni, uid_t uid, gid_t gid,
 		struct POSIX_SECURITY *pxdesc)
 #else
-static struct CACHED_PERMISSIONS *enter_cache(struct SECURITY_CONTEXT *scx,
+static void enter_cache(struct SECURITY_CONTEXT *scx,
 		ntfs_inode *ni, uid_t uid, gid_t gid, mode_t mode)
 #endif
 {
-	struct CACHED_PERMISSIONS *cacheentry;
-	struct CACHED_PERMISSIONS *cacheblock;
+	struct CACHED_PERMISSIONS perm;
+	struct CACHED_PERMISSIONS_SLOT *slot;
 	struct PERMISSIONS_CACHE *pcache;
-	u32 securindex;
+	u64 key;
 #if POSIXACLS
 	int pxsize;
-	struct POSIX_SECURITY *pxcached;
 #endif
-	unsigned int index1;
-	unsigned int index2;
-	int i;
 
-	/* cacheing is only possible if a security_id has been defined */
-	if (test_nino_flag(ni, v3_Extensions)
-	   && ni->security_id) {
-		/*
-		 *  Immediately test the most frequent situation
-		 *  where the entry exists
-		 */
-		securindex = le32_to_cpu(ni->security_id);
-		index1 = securindex >> CACHE_PERMISSIONS_BITS;
-		index2 = securindex & ((1 << CACHE_PERMISSIONS_BITS) - 1);
-		pcache = *scx->pseccache;
-		if (pcache
-		     && (pcache->head.last >= index1)
-		     && pcache->cachetable[index1]) {
-			cacheentry = &pcache->cachetable[index1][index2];
-			cacheentry->uid = uid;
-			cacheentry->gid = gid;
+	key = permissions_key(ni);
+	if (key) {
+		pcache = __atomic_load_n(scx->pseccache, __ATOMIC_ACQUIRE);
+		if (!pcache)
+			pcache = create_caches(scx);
+		if (pcache) {
+			memset(&perm, 0, sizeof(perm));
+			perm.uid = uid;
+			perm.gid = gid;
+			perm.inh_fileid = const_cpu_to_le32(0);
+			perm.inh_dirid = const_cpu_to_le32(0);
+			perm.valid = 1;
 #if POSIXACLS
-			if (cacheentry->valid && cacheentry->pxdesc)
-				free(cacheentry->pxdesc);
+			perm.pxdesc = (struct POSIX_SECURITY*)NULL;
 			if (pxdesc) {
 				pxsize = sizeof(struct POSIX_SECURITY)
 					+ (pxdesc->acccnt + pxdesc->defcnt)*sizeof(struct POSIX_ACE);
-				pxcached = (struct POSIX_SECURITY*)malloc(pxsize);
-				if (pxcached) {
-					memcpy(pxcached, pxdesc, pxsize);
-					cacheentry->pxdesc = pxcached;
-				} else {
-					cacheentry->valid = 0;
-					cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-				}
-				cacheentry->mode = pxdesc->mode & 07777;
-			} else
-				cacheentry->pxdesc = (struct POSIX_SECURITY*)NULL;
-#else
-			cacheentry->mode = mode & 07777;
-#endif
-			cacheentry->inh_fileid = const_cpu_to_le32(0);
-			cacheentry->inh_dirid = const_cpu_to_le32(0);
-			cacheentry->valid = 1;
-			pcache->head.p_writes++;
-		} else {
-			if (!pcache) {
-				/* create the first cache block */
-				pcache = create_caches(scx, securindex);
-			} else {
-				if (index1 > pcache->head.last) {
-					resize_cache(scx, securindex);
-					pcache = *scx->pseccache;
-				}
+				perm.pxdesc = (struct POSIX_SECURITY*)malloc(pxsize);
+				if (perm.pxdesc)
+					memcpy(perm.pxdesc, pxdesc, pxsize);
+				else
+					perm.valid = 0;
+				perm.mode = pxdesc->mode & 07777;
 			}
-			/* allocate block, if cache table was allocated */
-			if (pcache && (index1 <= pcache->head.last)) {
-				cacheblock = (struct CACHED_PERMISSIONS*)
-					malloc(sizeof(struct CACHED_PERMISSIONS)
-						<< CACHE_PERMISSIONS_BITS);
-				pcache->cachetable[index1] = cacheblock;
-				for (i=0; i<(1 << CACHE_PERMISSIONS_BITS); i++)
-					cacheblock[i].valid = 0;
-				cacheentry = &cacheblock[index2];
-				if (cacheentry) {
-					cacheentry->uid = uid;
-					cacheentry->gid = gid;
-#if POSIXACLS
-					if (pxdesc) {
-						pxsize = sizeof(struct POSIX_SECURITY)
-							+ (pxdesc->acccnt + pxdesc->defcnt)*sizeof(struct POSIX_ACE);
-						pxcached = (struct POSIX_SECURITY*)malloc(pxsize);
-						if (pxcached) {
-							memcpy(pxcached, pxdesc, pxsize);
-							cacheentry->pxdesc = pxcached;
-						} else {
-							cacheentry->valid = 0;
-							cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-						}
-						cacheentry->mode = pxdesc->mode & 07777;
-					} else
-						cacheentry->pxdesc = (struct POSIX_SECURITY*)NULL;
-#else
-					cacheentry->mode = mode & 07777;
-#endif
-					cacheentry->inh_fileid = const_cpu_to_le32(0);
-					cacheentry->inh_dirid = const_cpu_to_le32(0);
-					cacheentry->valid = 1;
-					pcache->head.p_writes++;
-				}
-			} else
-				cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-		}
-	} else {
-		cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-#if CACHE_LEGACY_SIZE
-		if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
-			struct CACHED_PERMISSIONS_LEGACY wanted;
-			struct CACHED_PERMISSIONS_LEGACY *legacy;
-
-			wanted.perm.uid = uid;
-			wanted.perm.gid = gid;
-#if POSIXACLS
-			wanted.perm.mode = pxdesc->mode & 07777;
-			wanted.perm.inh_fileid = const_cpu_to_le32(0);
-			wanted.perm.inh_dirid = const_cpu_to_le32(0);
-			wanted.mft_no = ni->mft_no;
-			wanted.variable = (void*)pxdesc;
-			wanted.varsize = sizeof(struct POSIX_SECURITY)
-					+ (pxdesc->acccnt + pxdesc->defcnt)*sizeof(struct POSIX_ACE);
 #else
-			wanted.perm.mode = mode & 07777;
-			wanted.perm.inh_fileid = const_cpu_to_le32(0);
-			wanted.perm.inh_dirid = const_cpu_to_le32(0);
-			wanted.mft_no = ni->mft_no;
-			wanted.variable = (void*)NULL;
-			wanted.varsize = 0;
+			perm.mode = mode & 07777;
 #endif
-			legacy = (struct CACHED_PERMISSIONS_LEGACY*)ntfs_enter_cache(
-				scx->vol->legacy_cache, GENERIC(&wanted),
-				(cache_compare)leg_compare);
-			if (legacy) {
-				cacheentry = &legacy->perm;
+			pthread_mutex_lock(&pcache->lock);
+			slot = find_slot(pcache, key, TRUE);
+			begin_slot_update(slot);
 #if POSIXACLS
-				/*
-				 * give direct access to the cached pxdesc
-				 * in the permissions structure
-				 */
-				cacheentry->pxdesc = legacy->variable;
+			if (slot->key)
+				retire_pxdesc(pcache, slot->perm.pxdesc);
 #endif
+			if (perm.valid) {
+				slot->key = key;
+				slot->perm = perm;
+			} else {
+				slot->key = 0;
+				slot->perm.valid = 0;
 			}
+			end_slot_update(slot);
+			pcache->head.p_writes++;
+			pthread_mutex_unlock(&pcache->lock);
 		}
-#endif
 	}
-	return (cacheentry);
 }
 
 /*
  *	Fetch owner, group and permission of a file, if cached
  *
- *	Beware : do not use the returned entry after a cache update :
- *	the cache may be relocated making the returned entry meaningless
+ *	The entry is copied into @copy, so it remains usable whatever
+ *	the cache updates.
  *
- *	returns the cache entry, or NULL if not available
+ *	returns @copy, or NULL if not available
  */
 
 static struct CACHED_PERMISSIONS *fetch_cache(struct SECURITY_CONTEXT *scx,
-		ntfs_inode *ni)
+		ntfs_inode *ni, struct CACHED_PERMISSIONS *copy)
 {
 	struct CACHED_PERMISSIONS *cacheentry;
 	struct PERMISSIONS_CACHE *pcache;
-	u32 securindex;
-	unsigned int index1;
-	unsigned int index2;
+	unsigned int hash;
+	unsigned int i;
+	u64 key;
 
-	/* cacheing is only possible if a security_id has been defined */
 	cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-	if (test_nino_flag(ni, v3_Extensions)
-	   && (ni->security_id)) {
-		securindex = le32_to_cpu(ni->security_id);
-		index1 = securindex >> CACHE_PERMISSIONS_BITS;
-		index2 = securindex & ((1 << CACHE_PERMISSIONS_BITS) - 1);
-		pcache = *scx->pseccache;
-		if (pcache
-		     && (pcache->head.last >= index1)
-		     && pcache->cachetable[index1]) {
-			cacheentry = &pcache->cachetable[index1][index2];
-			/* reject if entry is not valid */
-			if (!cacheentry->valid)
-				cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-			else
-				pcache->head.p_hits++;
-		if (pcache)
-			pcache->head.p_reads++;
-		}
-	}
-#if CACHE_LEGACY_SIZE
-	else {
-		cacheentry = (struct CACHED_PERMISSIONS*)NULL;
-		if (ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) {
-			struct CACHED_PERMISSIONS_LEGACY wanted;
-			struct CACHED_PERMISSIONS_LEGACY *legacy;
-
-			wanted.mft_no = ni->mft_no;
-			wanted.variable = (void*)NULL;
-			wanted.varsize = 0;
-			legacy = (struct CACHED_PERMISSIONS_LEGACY*)ntfs_fetch_cache(
-				scx->vol->legacy_cache, GENERIC(&wanted),
-				(cache_compare)leg_compare);
-			if (legacy) cacheentry = &legacy->perm;
-		}
+	key = permissions_key(ni);
+	pcache = __atomic_load_n(scx->pseccache, __ATOMIC_ACQUIRE);
+	if (key && pcache) {
+		hash = permissions_hash(key, pcache->head.mask);
+		for (i=0; !cacheentry && (i<CACHE_PERMISSIONS_PROBES); i++)
+			if (read_slot(&pcache->slots[(hash + i)
+					& pcache->head.mask], key, copy)
+			    && copy->valid)
+				cacheentry = copy;
+		__atomic_fetch_add(&pcache->head.p_reads, 1, __ATOMIC_RELAXED);
+		if (cacheentry)
+			__atomic_fetch_add(&pcache->head.p_hits, 1,
+					__ATOMIC_RELAXED);
+		else
+			__atomic_fetch_add(&pcache->head.p_misses, 1,
+					__ATOMIC_RELAXED);
 	}
-#endif
 #if POSIXACLS
 	if (cacheentry && !cacheentry->pxdesc) {
 		ntfs_log_error("No Posix descriptor in cache\n");
@@ -1788,6 +1758,72 @@ static struct CACHED_PERMISSIONS *fetch_cache(struct SECURITY_CONTEXT *scx,
 	return (cacheentry);
 }
 
+/*
+ *	Record an inherited securid into the cache entry of a directory,
+ *	if it is still owned by the given user and group
+ */
+
+static void enter_inherited_cache(struct SECURITY_CONTEXT *scx,
+		ntfs_inode *dir_ni, uid_t uid, gid_t gid,
+		le32 securid, BOOL fordir)
+{
+	struct CACHED_PERMISSIONS_SLOT *slot;
+	struct PERMISSIONS_CACHE *pcache;
+	u64 key;
+
+	key = permissions_key(dir_ni);
+	pcache = __atomic_load_n(scx->pseccache, __ATOMIC_ACQUIRE);
+	if (key && pcache) {
+		pthread_mutex_lock(&pcache->lock);
+		slot = find_slot(pcache, key, FALSE);
+		if (slot && (slot->key == key)
+		    && (slot->perm.uid == uid) && (slot->perm.gid == gid)) {
+			begin_slot_update(slot);
+			if (fordir)
+				slot->perm.inh_dirid = securid;
+			else
+				slot->perm.inh_fileid = securid;
+			end_slot_update(slot);
+		}
+		pthread_mutex_unlock(&pcache->lock);
+	}
+}
+
+#if CACHE_LEGACY
+
+/*
+ *	Invalidate the cache entry of a directory with no security id,
+ *	to be done when its protection is changed
+ */
+
+static void invalidate_legacy_cache(struct SECURITY_CONTEXT *scx,
+		ntfs_inode *ni)
+{
+	struct CACHED_PERMISSIONS_SLOT *slot;
+	struct PERMISSIONS_CACHE *pcache;
+	u64 key;
+
+	key = CACHE_KEY_LEGACY | ni->mft_no;
+	pcache = __atomic_load_n(scx->pseccache, __ATOMIC_ACQUIRE);
+	if (pcache) {
+		pthread_mutex_lock(&pcache->lock);
+		slot = find_slot(pcache, key, FALSE);
+		if (slot && (slot->key == key)) {
+			begin_slot_update(slot);
+#if POSIXACLS
+			retire_pxdesc(pcache, slot->perm.pxdesc);
+			slot->perm.pxdesc = (struct POSIX_SECURITY*)NULL;
+#endif
+			slot->key = 0;
+			slot->perm.valid = 0;
+			end_slot_update(slot);
+		}
+		pthread_mutex_unlock(&pcache->lock);
+	}
+}
+
+#endif /* CACHE_LEGACY */
+
 /*
  *	Retrieve a security attribute from $Secure
  */
@@ -2070,6 +2106,7 @@ static int ntfs_get_perm(struct SECURITY_CONTEXT *scx,
 {
 	const SECURITY_DESCRIPTOR_RELATIVE *phead;
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	char *securattr;
 	const SID *usid;	/* owner of file/directory */
 	const SID *gsid;	/* group of file/directory */
@@ -2083,7 +2120,7 @@ static int ntfs_get_perm(struct SECURITY_CONTEXT *scx,
 		perm = 07777;
 	else {
 		/* check whether available in cache */
-		cached = fetch_cache(scx,ni);
+		cached = fetch_cache(scx, ni, &cachecopy);
 		if (cached) {
 			uid = cached->uid;
 			gid = cached->gid;
@@ -2172,6 +2209,7 @@ int ntfs_get_posix_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 	const SECURITY_DESCRIPTOR_RELATIVE *phead;
 	struct POSIX_SECURITY *pxdesc;
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	char *securattr;
 	const SID *usid;	/* owner of file/directory */
 	const SID *gsid;	/* group of file/directory */
@@ -2185,7 +2223,7 @@ int ntfs_get_posix_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 		errno = ENOTSUP;
 	else {
 			/* check whether available in cache */
-		cached = fetch_cache(scx,ni);
+		cached = fetch_cache(scx, ni, &cachecopy);
 		if (cached)
 			pxdesc = cached->pxdesc;
 		else {
@@ -2303,6 +2341,7 @@ static int ntfs_get_perm(struct SECURITY_CONTEXT *scx,
 {
 	const SECURITY_DESCRIPTOR_RELATIVE *phead;
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	char *securattr;
 	const SID *usid;	/* owner of file/directory */
 	const SID *gsid;	/* group of file/directory */
@@ -2315,7 +2354,7 @@ static int ntfs_get_perm(struct SECURITY_CONTEXT *scx,
 		perm = 07777;
 	else {
 		/* check whether available in cache */
-		cached = fetch_cache(scx,ni);
+		cached = fetch_cache(scx, ni, &cachecopy);
 		if (cached) {
 			perm = cached->mode;
 			uid = cached->uid;
@@ -2443,6 +2482,7 @@ int ntfs_get_owner_mode(struct SECURITY_CONTEXT *scx,
 	const SID *usid;	/* owner of file/directory */
 	const SID *gsid;	/* group of file/directory */
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	int perm;
 	BOOL isdir;
 #if POSIXACLS
@@ -2453,7 +2493,7 @@ int ntfs_get_owner_mode(struct SECURITY_CONTEXT *scx,
 		perm = 07777;
 	else {
 			/* check whether available in cache */
-		cached = fetch_cache(scx,ni);
+		cached = fetch_cache(scx, ni, &cachecopy);
 		if (cached) {
 #if POSIXACLS
 			if (!(scx->vol->secure_flags & (1 << SECURITY_ACL))
@@ -2555,6 +2595,7 @@ static struct POSIX_SECURITY *inherit_posix(struct SECURITY_CONTEXT *scx,
 			ntfs_inode *dir_ni, mode_t mode, BOOL isdir)
 {
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	const SECURITY_DESCRIPTOR_RELATIVE *phead;
 	struct POSIX_SECURITY *pxdesc;
 	struct POSIX_SECURITY *pydesc;
@@ -2566,7 +2607,7 @@ static struct POSIX_SECURITY *inherit_posix(struct SECURITY_CONTEXT *scx,
 
 	pydesc = (struct POSIX_SECURITY*)NULL;
 		/* check whether parent directory is available in cache */
-	cached = fetch_cache(scx,dir_ni);
+	cached = fetch_cache(scx, dir_ni, &cachecopy);
 	if (cached) {
 		uid = cached->uid;
 		gid = cached->gid;
@@ -2761,19 +2802,10 @@ int ntfs_set_inherited_posix(struct SECURITY_CONTEXT *scx,
 				else
 					ni->flags |= FILE_ATTR_READONLY;
 			}
-#if CACHE_LEGACY_SIZE
+#if CACHE_LEGACY
 			/* also invalidate legacy cache */
-			if (isdir && !ni->security_id) {
-				struct CACHED_PERMISSIONS_LEGACY legacy;
-
-				legacy.mft_no = ni->mft_no;
-				legacy.variable = pxdesc;
-				legacy.varsize = sizeof(struct POSIX_SECURITY)
-					+ (pxdesc->acccnt + pxdesc->defcnt)*sizeof(struct POSIX_ACE);
-				ntfs_invalidate_cache(scx->vol->legacy_cache,
-						GENERIC(&legacy),
-						(cache_compare)leg_compare,0);
-			}
+			if (isdir && !ni->security_id)
+				invalidate_legacy_cache(scx, ni);
 #endif
 			free(newattr);
 
@@ -2966,23 +2998,10 @@ int ntfs_set_owner_mode(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 							GENERIC(&wanted),
 							(cache_compare)compare);
 				}
-#if CACHE_LEGACY_SIZE
+#if CACHE_LEGACY
 				/* also invalidate legacy cache */
-				if (isdir && !ni->security_id) {
-					struct CACHED_PERMISSIONS_LEGACY legacy;
-
-					legacy.mft_no = ni->mft_no;
-#if POSIXACLS
-					legacy.variable = wanted.variable;
-					legacy.varsize = wanted.varsize;
-#else
-					legacy.variable = (void*)NULL;
-					legacy.varsize = 0;
-#endif
-					ntfs_invalidate_cache(scx->vol->legacy_cache,
-						GENERIC(&legacy),
-						(cache_compare)leg_compare,0);
-				}
+				if (isdir && !ni->security_id)
+					invalidate_legacy_cache(scx, ni);
 #endif
 			}
 			free(newattr);
@@ -3007,6 +3026,7 @@ int ntfs_set_owner_mode(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 BOOL ntfs_allowed_as_owner(struct SECURITY_CONTEXT *scx, ntfs_inode *ni)
 {
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	char *oldattr;
 	const SID *usid;
 	uid_t processuid;
@@ -3025,7 +3045,7 @@ BOOL ntfs_allowed_as_owner(struct SECURITY_CONTEXT *scx, ntfs_inode *ni)
 	else {
 		gotowner = FALSE; /* default */
 		/* get the owner, either from cache or from old attribute  */
-		cached = fetch_cache(scx, ni);
+		cached = fetch_cache(scx, ni, &cachecopy);
 		if (cached) {
 			uid = cached->uid;
 			gotowner = TRUE;
@@ -3077,6 +3097,7 @@ int ntfs_set_posix_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 {
 	const SECURITY_DESCRIPTOR_RELATIVE *phead;
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	char *oldattr;
 	uid_t processuid;
 	const SID *usid;
@@ -3103,7 +3124,7 @@ int ntfs_set_posix_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 	if ((!value
 		|| (((const struct POSIX_ACL*)value)->version == POSIX_VERSION))
 	    && (!deflt || isdir || (!size && !value))) {
-		cached = fetch_cache(scx, ni);
+		cached = fetch_cache(scx, ni, &cachecopy);
 		if (cached) {
 			uid = cached->uid;
 			gid = cached->gid;
@@ -3211,24 +3232,16 @@ int ntfs_set_ntfs_acl(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 			 * only the relation between a file and
 			 * its securid and protection is changed.
 			 */
-#if CACHE_LEGACY_SIZE
+#if CACHE_LEGACY
 			/*
 			 * we must however invalidate the legacy
-			 * cache, which is based on inode numbers.
+			 * cache entry, which is based on inode numbers.
 			 * For safety, invalidate even if updating
 			 * failed.
 			 */
 			if ((ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)
-			   && !ni->security_id) {
-				struct CACHED_PERMISSIONS_LEGACY legacy;
-
-				legacy.mft_no = ni->mft_no;
-				legacy.variable = (char*)NULL;
-				legacy.varsize = 0;
-				ntfs_invalidate_cache(scx->vol->legacy_cache,
-					GENERIC(&legacy),
-					(cache_compare)leg_compare,0);
-			}
+			   && !ni->security_id)
+				invalidate_legacy_cache(scx, ni);
 #endif
 			free(attr);
 		} else
@@ -3253,6 +3266,7 @@ int ntfs_set_mode(struct SECURITY_CONTEXT *scx, ntfs_inode *ni, mode_t mode)
 {
 	const SECURITY_DESCRIPTOR_RELATIVE *phead;
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	char *oldattr;
 	const SID *usid;
 	const SID *gsid;
@@ -3269,7 +3283,7 @@ int ntfs_set_mode(struct SECURITY_CONTEXT *scx, ntfs_inode *ni, mode_t mode)
 
 	/* get the current owner, either from cache or from old attribute  */
 	res = 0;
-	cached = fetch_cache(scx, ni);
+	cached = fetch_cache(scx, ni, &cachecopy);
 	if (cached) {
 		uid = cached->uid;
 		gid = cached->gid;
@@ -3630,6 +3644,7 @@ int ntfs_set_owner(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 {
 	const SECURITY_DESCRIPTOR_RELATIVE *phead;
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	char *oldattr;
 	const SID *usid;
 	const SID *gsid;
@@ -3647,7 +3662,7 @@ int ntfs_set_owner(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 	res = 0;
 	/* get the current owner and mode from cache or security attributes */
 	oldattr = (char*)NULL;
-	cached = fetch_cache(scx,ni);
+	cached = fetch_cache(scx, ni, &cachecopy);
 	if (cached) {
 		fileuid = cached->uid;
 		filegid = cached->gid;
@@ -3753,6 +3768,7 @@ int ntfs_set_ownmod(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 			uid_t uid, gid_t gid, const mode_t mode)
 {
 	const struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	char *oldattr;
 	uid_t fileuid;
 	uid_t filegid;
@@ -3770,7 +3786,7 @@ int ntfs_set_ownmod(struct SECURITY_CONTEXT *scx, ntfs_inode *ni,
 	res = 0;
 	/* get the current owner and mode from cache or security attributes */
 	oldattr = (char*)NULL;
-	cached = fetch_cache(scx,ni);
+	cached = fetch_cache(scx, ni, &cachecopy);
 	if (cached) {
 		fileuid = cached->uid;
 		filegid = cached->gid;
@@ -4030,6 +4046,7 @@ le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 			ntfs_inode *dir_ni, BOOL fordir)
 {
 	struct CACHED_PERMISSIONS *cached;
+	struct CACHED_PERMISSIONS cachecopy;
 	char *parentattr;
 	le32 securid;
 
@@ -4041,7 +4058,7 @@ le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 		 */
 	if (test_nino_flag(dir_ni, v3_Extensions)
 			&& dir_ni->security_id) {
-		cached = fetch_cache(scx, dir_ni);
+		cached = fetch_cache(scx, dir_ni, &cachecopy);
 		if (cached
 		    && (cached->uid == scx->uid) && (cached->gid == scx->gid))
 			securid = (fordir ? cached->inh_dirid
@@ -4061,17 +4078,9 @@ le32 ntfs_inherited_id(struct SECURITY_CONTEXT *scx,
 			 * Store the result into cache for further use
 			 * if the current process owns the parent directory
 			 */
-			if (securid) {
-				cached = fetch_cache(scx, dir_ni);
-				if (cached
-				    && (cached->uid == scx->uid)
-				    && (cached->gid == scx->gid)) {
-					if (fordir)
-						cached->inh_dirid = securid;
-					else
-						cached->inh_fileid = securid;
-				}
-			}
+			if (securid)
+				enter_inherited_cache(scx, dir_ni,
+					scx->uid, scx->gid, securid, fordir);
 		}
 	}
 	return (securid);
@@ -25,6 +25,8 @@
 #ifndef _NTFS_SECURITY_H
 #define _NTFS_SECURITY_H
 
+#include <pthread.h>
+
 #include "./types.h"
 #include "./layout.h"
 #include "./inode.h"
@@ -66,17 +68,17 @@ struct CACHED_PERMISSIONS {
 } ;
 
 /*
- *	Entry in the permissions cache for directories with no security_id
+ *	Slot in the permissions cache
+ *	the key is the security_id, or the mft number of a directory
+ *	with no security_id (legacy), tagged by CACHE_KEY_LEGACY.
+ *	A zero key denotes an empty slot.
  */
 
-struct CACHED_PERMISSIONS_LEGACY {
-	struct CACHED_PERMISSIONS_LEGACY *next;
-	struct CACHED_PERMISSIONS_LEGACY *previous;
-	void *variable;
-	size_t varsize;
-	union ALIGNMENT payload[0];
-		/* above fields must match "struct CACHED_GENERIC" */
-	u64 mft_no;
+#define CACHE_KEY_LEGACY ((u64)1 << 63)
+
+struct CACHED_PERMISSIONS_SLOT {
+	unsigned int seq; /* odd while the slot is being updated */
+	u64 key;
 	struct CACHED_PERMISSIONS perm;
 } ;
 
@@ -103,20 +105,29 @@ struct CACHED_SECURID {
  */
 
 struct CACHED_PERMISSIONS_HEADER {
-	unsigned int last;
+	unsigned int mask; /* number of slots - 1 */
+	unsigned int victim; /* rotates over the probed slots */
 			/* statistics for permissions */
 	unsigned long p_writes;
 	unsigned long p_reads;
 	unsigned long p_hits;
+	unsigned long p_misses;
 } ;
 
 /*
  *	The whole permissions cache
+ *	an open-addressed table, allocated once and never resized.
+ *	Lookups take no lock, updates are serialized by the mutex.
  */
 
 struct PERMISSIONS_CACHE {
 	struct CACHED_PERMISSIONS_HEADER head;
-	struct CACHED_PERMISSIONS *cachetable[1]; /* array of variable size */
+	pthread_mutex_t lock;
+#if POSIXACLS
+	struct POSIX_SECURITY **retired; /* replaced while possibly in use */
+	unsigned int retiredcnt;
+#endif
+	struct CACHED_PERMISSIONS_SLOT slots[1]; /* array of variable size */
 } ;
 
 /*
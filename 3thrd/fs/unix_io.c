@@ -58,6 +58,7 @@
 #endif
 
 #include <glib.h>
+#include <pthread.h>
 
 #include "mst.h"
 #include "misc.h"
@@ -75,6 +76,53 @@
 #    define O_EXCL 0
 #endif
 
+#define UNIX_IO_DIRECT_ALIGN    4096                /* O_DIRECT offset, length and buffer alignment */
+#define UNIX_IO_DIRECT_CHUNK    (1024 * 1024)       /* bounce buffer size */
+#define UNIX_IO_DIRECT_POOL     4                   /* bounce buffers kept for reuse */
+#define UNIX_IO_RA_MIN          (128 * 1024)        /* first read-ahead window */
+#define UNIX_IO_RA_MAX          (8 * 1024 * 1024)   /* largest read-ahead window */
+#define UNIX_IO_RA_SEQ          2                   /* sequential reads before read-ahead starts */
+
+#define DIRECT_ALIGN_DOWN(x)    ((x) & ~(s64)(UNIX_IO_DIRECT_ALIGN - 1))
+#define DIRECT_ALIGN_UP(x)      DIRECT_ALIGN_DOWN((x) + UNIX_IO_DIRECT_ALIGN - 1)
+
+/**
+ * struct unix_io_window - image data read ahead, still encrypted
+ */
+struct unix_io_window {
+    s64 pos;                    /* aligned position on the image */
+    s64 len;                    /* valid bytes, 0 if empty */
+    u8 *buf;                    /* UNIX_IO_RA_MAX bytes, aligned */
+};
+
+/**
+ * struct unix_io_direct - private data of a device opened with O_DIRECT
+ *
+ * The image is read and written around the host page cache, every transfer
+ * goes through aligned bounce buffers. Sequential reads are detected and
+ * served from read-ahead windows: @cur holds the data being consumed, a
+ * thread fills @ahead with the window after it, the window doubles from
+ * UNIX_IO_RA_MIN up to UNIX_IO_RA_MAX while the stream stays sequential.
+ */
+struct unix_io_direct {
+    int fd;                     /* must stay first, see DEV_FD() */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    BOOL thread_started;
+    BOOL stop;
+    BOOL pending;               /* @ahead is being filled */
+    void *pool[UNIX_IO_DIRECT_POOL];
+    int nr_pool;
+    s64 last_end;               /* end of the previous read */
+    int seq;                    /* sequential reads in a row */
+    s64 window;                 /* size of the next read-ahead */
+    struct unix_io_window cur;
+    struct unix_io_window ahead;
+};
+
+#define DEV_DIRECT(dev)    ((struct unix_io_direct *)dev->d_private)
+
 /**
  * fsync replacement which makes every effort to try to get the data down to
  * disk, using different means for different operating systems. Specifically,
@@ -109,6 +157,328 @@ static int ntfs_fsync(int fildes)
     return ret;
 }
 
+static void unix_io_crypt(void *buf, s64 offset, s64 count, bool isEnc)
+{
+    uint8_t bufT[LOCK_FILE_BLOCK_SIZE] = {0};
+    uint8_t* key = "12345678";
+
+    lock_file_buffer(buf, offset, count, key, strlen((char*)key), bufT, sizeof(bufT), isEnc);
+}
+
+static void *unix_io_direct_get_buf(struct unix_io_direct *d)
+{
+    void *buf = NULL;
+
+    if (d->nr_pool)
+        return d->pool[--d->nr_pool];
+    if (posix_memalign(&buf, UNIX_IO_DIRECT_ALIGN, UNIX_IO_DIRECT_CHUNK))
+        return NULL;
+    return buf;
+}
+
+static void unix_io_direct_put_buf(struct unix_io_direct *d, void *buf)
+{
+    if (d->nr_pool < UNIX_IO_DIRECT_POOL)
+        d->pool[d->nr_pool++] = buf;
+    else
+        free(buf);
+}
+
+/*
+ * Aligned read of @count bytes at @pos into @buf, both aligned. Returns the
+ * bytes read, fewer at end of the image, or -1 if nothing could be read.
+ */
+static s64 unix_io_direct_raw_pread(int fd, void *buf, s64 count, s64 pos)
+{
+    s64 br, total = 0;
+
+    while (total < count) {
+        br = pread(fd, (u8*)buf + total, count - total, pos + total);
+        if (br > 0) {
+            total += br;
+            /* a short read which is not aligned is the end of the image */
+            if (total & (UNIX_IO_DIRECT_ALIGN - 1))
+                break;
+            continue;
+        }
+        if (br < 0 && errno == EINTR)
+            continue;
+        if (br < 0 && !total)
+            return -1;
+        break;
+    }
+    return total;
+}
+
+static s64 unix_io_direct_raw_pwrite(int fd, const void *buf, s64 count, s64 pos)
+{
+    s64 bw, total = 0;
+
+    while (total < count) {
+        bw = pwrite(fd, (const u8*)buf + total, count - total, pos + total);
+        if (bw > 0) {
+            total += bw;
+            continue;
+        }
+        if (bw < 0 && errno == EINTR)
+            continue;
+        return total ? total : -1;
+    }
+    return total;
+}
+
+static void *unix_io_direct_ra_thread(void *data)
+{
+    struct unix_io_direct *d = data;
+    s64 pos, len, br;
+
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        while (!d->pending && !d->stop)
+            pthread_cond_wait(&d->cond, &d->lock);
+        if (d->stop)
+            break;
+        pos = d->ahead.pos;
+        len = d->ahead.len;
+        pthread_mutex_unlock(&d->lock);
+
+        br = unix_io_direct_raw_pread(d->fd, d->ahead.buf, len, pos);
+
+        pthread_mutex_lock(&d->lock);
+        d->ahead.len = (br > 0) ? br : 0;
+        d->pending = FALSE;
+        pthread_cond_broadcast(&d->cond);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+/* Wait for the read-ahead thread, with the lock held. */
+static void unix_io_direct_ra_wait(struct unix_io_direct *d)
+{
+    while (d->pending)
+        pthread_cond_wait(&d->cond, &d->lock);
+}
+
+static void unix_io_direct_ra_drop(struct unix_io_direct *d)
+{
+    unix_io_direct_ra_wait(d);
+    d->cur.len = 0;
+    d->ahead.len = 0;
+    d->seq = 0;
+    d->window = UNIX_IO_RA_MIN;
+}
+
+/* Ask the thread for the window after @cur, with the lock held. */
+static void unix_io_direct_ra_start(struct unix_io_direct *d)
+{
+    s64 next = d->cur.pos + d->cur.len;
+
+    if (d->pending || !d->cur.len || (d->cur.len & (UNIX_IO_DIRECT_ALIGN - 1)))
+        return;
+    if (d->ahead.len && d->ahead.pos == next)
+        return;
+    if (!d->ahead.buf && posix_memalign((void**)&d->ahead.buf, UNIX_IO_DIRECT_ALIGN, UNIX_IO_RA_MAX))
+        return;
+    if (!d->thread_started) {
+        if (pthread_create(&d->thread, NULL, unix_io_direct_ra_thread, d))
+            return;
+        d->thread_started = TRUE;
+    }
+    d->ahead.pos = next;
+    d->ahead.len = d->window;
+    d->pending = TRUE;
+    d->window = min(d->window * 2, (s64)UNIX_IO_RA_MAX);
+    pthread_cond_signal(&d->cond);
+}
+
+/* Copy what @w holds of [@pos, @pos + @count) to @dst, return the bytes copied. */
+static s64 unix_io_window_copy(const struct unix_io_window *w, s64 pos, s64 count, u8 *dst)
+{
+    s64 n;
+
+    if (!w->len || pos < w->pos || pos >= w->pos + w->len)
+        return 0;
+    n = min(count, w->pos + w->len - pos);
+    memcpy(dst, w->buf + (pos - w->pos), n);
+    return n;
+}
+
+static s64 unix_io_direct_pread(struct ntfs_device *dev, void *buf, s64 count, s64 offset)
+{
+    struct unix_io_direct *d = DEV_DIRECT(dev);
+    s64 total = 0, n, pos, len, br;
+    void *bounce;
+    int err = 0;
+
+    pthread_mutex_lock(&d->lock);
+
+    if (offset == d->last_end)
+        d->seq++;
+    else {
+        d->seq = 0;
+        d->window = UNIX_IO_RA_MIN;
+    }
+    d->last_end = offset + count;
+
+    while (total < count) {
+        pos = offset + total;
+        n = unix_io_window_copy(&d->cur, pos, count - total, (u8*)buf + total);
+        if (n) {
+            total += n;
+            continue;
+        }
+        if (d->ahead.len && pos >= d->ahead.pos && pos < d->ahead.pos + d->ahead.len) {
+            unix_io_direct_ra_wait(d);
+            if (d->ahead.len && pos >= d->ahead.pos && pos < d->ahead.pos + d->ahead.len) {
+                struct unix_io_window w = d->cur;
+
+                d->cur = d->ahead;
+                d->ahead = w;
+                d->ahead.len = 0;
+                continue;
+            }
+        }
+        if (d->seq >= UNIX_IO_RA_SEQ && count - total <= UNIX_IO_RA_MAX / 2) {
+            /* start of a stream: read a whole window into @cur */
+            if (!d->cur.buf && posix_memalign((void**)&d->cur.buf, UNIX_IO_DIRECT_ALIGN, UNIX_IO_RA_MAX)) {
+                err = ENOMEM;
+                break;
+            }
+            d->cur.pos = DIRECT_ALIGN_DOWN(pos);
+            len = max(d->window, DIRECT_ALIGN_UP(offset + count) - d->cur.pos);
+            br = unix_io_direct_raw_pread(d->fd, d->cur.buf, min(len, (s64)UNIX_IO_RA_MAX), d->cur.pos);
+            d->cur.len = (br > 0) ? br : 0;
+            if (br < 0)
+                err = errno;
+            if (d->cur.pos + d->cur.len <= pos)
+                break;
+            continue;
+        }
+        /* random read, bypass the windows */
+        bounce = unix_io_direct_get_buf(d);
+        if (!bounce) {
+            err = ENOMEM;
+            break;
+        }
+        len = min(DIRECT_ALIGN_UP(offset + count) - DIRECT_ALIGN_DOWN(pos), (s64)UNIX_IO_DIRECT_CHUNK);
+        br = unix_io_direct_raw_pread(d->fd, bounce, len, DIRECT_ALIGN_DOWN(pos));
+        n = (br > 0) ? br - (pos - DIRECT_ALIGN_DOWN(pos)) : 0;
+        if (n > 0) {
+            n = min(n, count - total);
+            memcpy((u8*)buf + total, (u8*)bounce + (pos - DIRECT_ALIGN_DOWN(pos)), n);
+            total += n;
+        }
+        unix_io_direct_put_buf(d, bounce);
+        if (br < 0)
+            err = errno;
+        if (n <= 0)
+            break;
+    }
+
+    if (d->seq >= UNIX_IO_RA_SEQ)
+        unix_io_direct_ra_start(d);
+
+    pthread_mutex_unlock(&d->lock);
+
+    if (!total && err) {
+        errno = err;
+        return -1;
+    }
+    unix_io_crypt(buf, offset, total, false);
+    return total;
+}
+
+/*
+ * Unaligned edges are read, patched and written back. A write ending in a
+ * partial block must not leave the image padded to the block boundary.
+ */
+static s64 unix_io_direct_pwrite(struct ntfs_device *dev, const void *buf, s64 count, s64 offset)
+{
+    struct unix_io_direct *d = DEV_DIRECT(dev);
+    s64 start = DIRECT_ALIGN_DOWN(offset);
+    s64 end = DIRECT_ALIGN_UP(offset + count);
+    s64 total = 0, pos, len, ofs, n, br, old_size = -1;
+    struct stat st;
+    void *bounce;
+    int err = 0;
+
+    pthread_mutex_lock(&d->lock);
+
+    /* the windows may hold the old data */
+    unix_io_direct_ra_wait(d);
+    if (d->cur.len && offset < d->cur.pos + d->cur.len && offset + count > d->cur.pos)
+        d->cur.len = 0;
+    if (d->ahead.len && offset < d->ahead.pos + d->ahead.len && offset + count > d->ahead.pos)
+        d->ahead.len = 0;
+
+    if (end != offset + count && !fstat(d->fd, &st))
+        old_size = st.st_size;
+
+    bounce = unix_io_direct_get_buf(d);
+    if (!bounce) {
+        pthread_mutex_unlock(&d->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (pos = start; pos < end; pos += len) {
+        len = min(end - pos, (s64)UNIX_IO_DIRECT_CHUNK);
+        ofs = max(offset, pos);
+        n = min(offset + count, pos + len) - ofs;
+
+        if (ofs > pos || ofs + n < pos + len) {
+            /* partial first or last block, merge with what is there */
+            memset(bounce, 0, len);
+            if (ofs > pos)
+                unix_io_direct_raw_pread(d->fd, bounce, UNIX_IO_DIRECT_ALIGN, pos);
+            if (ofs + n < pos + len)
+                unix_io_direct_raw_pread(d->fd, (u8*)bounce + len - UNIX_IO_DIRECT_ALIGN,
+                                         UNIX_IO_DIRECT_ALIGN, pos + len - UNIX_IO_DIRECT_ALIGN);
+        }
+        memcpy((u8*)bounce + (ofs - pos), (const u8*)buf + (ofs - offset), n);
+        unix_io_crypt((u8*)bounce + (ofs - pos), ofs, n, true);
+
+        br = unix_io_direct_raw_pwrite(d->fd, bounce, len, pos);
+        if (br != len) {
+            err = (br < 0) ? errno : EIO;
+            if (br > ofs - pos)
+                total += min(br - (ofs - pos), n);
+            break;
+        }
+        total += n;
+    }
+    unix_io_direct_put_buf(d, bounce);
+
+    if (old_size >= 0 && end > old_size && ftruncate(d->fd, max(old_size, offset + total)))
+        ntfs_log_perror("Failed to trim '%s'", dev->d_name);
+
+    pthread_mutex_unlock(&d->lock);
+
+    if (!total && err) {
+        errno = err;
+        return -1;
+    }
+    return total;
+}
+
+static void unix_io_direct_free(struct unix_io_direct *d)
+{
+    if (d->thread_started) {
+        pthread_mutex_lock(&d->lock);
+        d->stop = TRUE;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+        pthread_join(d->thread, NULL);
+    }
+    while (d->nr_pool)
+        free(d->pool[--d->nr_pool]);
+    free(d->cur.buf);
+    free(d->ahead.buf);
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->lock);
+}
+
 /**
  * ntfs_device_unix_io_open - Open a device and lock it exclusively
  * @dev:
@@ -135,7 +505,8 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
     if (S_ISBLK(sbuf.st_mode))
         NDevSetBlock(dev);
 
-    dev->d_private = ntfs_malloc(sizeof(int));
+    /* DEV_FD() works on both, the descriptor comes first */
+    dev->d_private = ntfs_calloc(NDevDirect(dev) ? sizeof(struct unix_io_direct) : sizeof(int));
     if (!dev->d_private)
         return -1;
     /*
@@ -144,7 +515,13 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
      */
     if (!NDevBlock(dev) && (flags & O_RDWR) == O_RDWR)
         flags |= O_EXCL;
-    *(int*)dev->d_private = open(dev->d_name, flags);
+    *(int*)dev->d_private = open(dev->d_name, NDevDirect(dev) ? (flags | O_DIRECT) : flags);
+    if (*(int*)dev->d_private == -1 && NDevDirect(dev) && errno == EINVAL) {
+        /* the host file system has no O_DIRECT (tmpfs...) */
+        C_LOG_WARNING("O_DIRECT not supported for '%s', using buffered io", dev->d_name);
+        NDevClearDirect(dev);
+        *(int*)dev->d_private = open(dev->d_name, flags);
+    }
     if (*(int*)dev->d_private == -1) {
         err = errno;
             /* if permission error and rw, retry read-only */
@@ -186,6 +563,15 @@ static int ntfs_device_unix_io_open(struct ntfs_device *dev, int flags)
         goto err_out;
     }
 
+    if (NDevDirect(dev)) {
+        struct unix_io_direct *d = DEV_DIRECT(dev);
+
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->cond, NULL);
+        d->last_end = -1;
+        d->window = UNIX_IO_RA_MIN;
+    }
+
     NDevSetOpen(dev);
     return 0;
 err_out:
@@ -225,6 +611,8 @@ static int ntfs_device_unix_io_close(struct ntfs_device *dev)
     flk.l_start = flk.l_len = 0LL;
     if (fcntl(DEV_FD(dev), F_SETLK, &flk))
         ntfs_log_perror("Could not unlock %s", dev->d_name);
+    if (NDevDirect(dev))
+        unix_io_direct_free(DEV_DIRECT(dev));
     if (close(DEV_FD(dev))) {
         ntfs_log_perror("Failed to close device %s", dev->d_name);
         return -1;
@@ -262,12 +650,21 @@ static s64 ntfs_device_unix_io_seek(struct ntfs_device *dev, s64 offset, int whe
  */
 static s64 ntfs_device_unix_io_read(struct ntfs_device *dev, void *buf, s64 count)
 {
+    if (NDevDirect(dev)) {
+        s64 pos = lseek(DEV_FD(dev), 0, SEEK_CUR);
+        s64 br = (pos < 0) ? -1 : unix_io_direct_pread(dev, buf, count, pos);
+
+        if (br > 0)
+            lseek(DEV_FD(dev), pos + br, SEEK_SET);
+        return br;
+    }
+
     // if (count == 1) {
         // return read(DEV_FD(dev), buf, count);
     // }
 
     s64 ret = 0;
-    uint8_t bufT[512] = {0};
+    uint8_t bufT[LOCK_FILE_BLOCK_SIZE] = {0};
 
     s64 offset = 0;
     uint8_t* key = "12345678";
@@ -308,6 +705,15 @@ static s64 ntfs_device_unix_io_write(struct ntfs_device *dev, const void *buf, s
 
     NDevSetDirty(dev);
 
+    if (NDevDirect(dev)) {
+        s64 pos = lseek(DEV_FD(dev), 0, SEEK_CUR);
+        s64 bw = (pos < 0) ? -1 : unix_io_direct_pwrite(dev, buf, count, pos);
+
+        if (bw > 0)
+            lseek(DEV_FD(dev), pos + bw, SEEK_SET);
+        return bw;
+    }
+
     s64 ret = 0;
     s64 offset = 0;
 
@@ -316,7 +722,7 @@ static s64 ntfs_device_unix_io_write(struct ntfs_device *dev, const void *buf, s
         // return ret;
     // }
 
-    uint8_t bufT[512] = {0};
+    uint8_t bufT[LOCK_FILE_BLOCK_SIZE] = {0};
     uint8_t* key = "12345678";
 
     uint8_t* bufTT = (uint8_t*) malloc(count);
@@ -357,13 +763,16 @@ static s64 ntfs_device_unix_io_write(struct ntfs_device *dev, const void *buf, s
  */
 static s64 ntfs_device_unix_io_pread(struct ntfs_device *dev, void *buf, s64 count, s64 offset)
 {
+    if (NDevDirect(dev))
+        return unix_io_direct_pread(dev, buf, count, offset);
+
     // if (count == 1) {
         // return pread(DEV_FD(dev), buf, count, offset);
     // }
 
     s64 ret = 0;
     s64 offsetT = 0;
-    uint8_t bufT[512] = {0};
+    uint8_t bufT[LOCK_FILE_BLOCK_SIZE] = {0};
     uint8_t* key = "12345678";
 
     ret = pread(DEV_FD(dev), buf, count, offset);
@@ -402,13 +811,16 @@ static s64 ntfs_device_unix_io_pwrite(struct ntfs_device *dev, const void *buf,
 
     NDevSetDirty(dev);
 
+    if (NDevDirect(dev))
+        return unix_io_direct_pwrite(dev, buf, count, offset);
+
     // if (1 == count) {
         // return pwrite(DEV_FD(dev), buf, count, offset);
     // }
 
     s64 ret = 0;
     s64 offsetT = 0;
-    uint8_t bufT[512] = {0};
+    uint8_t bufT[LOCK_FILE_BLOCK_SIZE] = {0};
     uint8_t* key = "12345678";
 
     uint8_t* bufTT = (uint8_t*) malloc(count);
@@ -488,6 +900,42 @@ static int ntfs_device_unix_io_ioctl(struct ntfs_device *dev, unsigned long requ
     return ioctl(DEV_FD(dev), request, argp);
 }
 
+/**
+ * ntfs_device_unix_io_fd - Get the file descriptor of an opened unix_io device
+ * @dev:
+ *
+ * The descriptor gives access to the raw (encrypted) image, callers must not
+ * use it for anything that depends on the plaintext. Devices opened with
+ * uring_io share the same descriptor. With O_DIRECT the read-ahead windows
+ * are dropped, so the caller may change the image through it.
+ *
+ * Returns: the descriptor, or -1 if @dev is not an opened unix_io device
+ */
+int ntfs_device_unix_io_fd(struct ntfs_device *dev)
+{
+    if (!dev || !NDevOpen(dev) || !dev->d_private) {
+        return -1;
+    }
+
+    /* uring_io keeps the descriptor first in its private data */
+#ifdef NTFS_HAVE_URING_IO
+    if ((dev->d_ops != &ntfs_device_unix_io_ops) && (dev->d_ops != &ntfs_device_uring_io_ops)) {
+#else
+    if (dev->d_ops != &ntfs_device_unix_io_ops) {
+#endif
+        return -1;
+    }
+
+    /* the caller works on the image behind the read-ahead windows */
+    if (NDevDirect(dev)) {
+        pthread_mutex_lock(&DEV_DIRECT(dev)->lock);
+        unix_io_direct_ra_drop(DEV_DIRECT(dev));
+        pthread_mutex_unlock(&DEV_DIRECT(dev)->lock);
+    }
+
+    return DEV_FD(dev);
+}
+
 /**
  * Device operations for working with unix style devices and files.
  */
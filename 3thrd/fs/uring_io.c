@@ -0,0 +1,669 @@
+/**
+ * uring_io.c - io_uring device io for the encrypted sandbox image.
+ *
+ * Positioned reads and writes go through an io_uring instead of one pread()
+ * or pwrite() per call. The image is registered as a fixed file, writes are
+ * encrypted into a set of registered buffers (unix_io needs a copy for the
+ * encryption anyway), reads land directly in the caller's buffer and are
+ * decrypted as their completions are reaped. ntfs_pread_many() and
+ * ntfs_pwrite_many() hand a whole batch of ranges to a single
+ * io_uring_enter().
+ *
+ * Everything else (open and locking, seek, read/write at the current
+ * position, sync, stat, ioctl) is done by unix_io, the descriptor is kept
+ * first in the private data so DEV_FD() works on both. When io_uring can't
+ * be set up, NTFS_IO_URING=0 is set in the environment or the device is
+ * opened with O_DIRECT, the device is switched to ntfs_device_unix_io_ops
+ * when it is opened.
+ *
+ * This program/include file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program/include file is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "device.h"
+
+#ifdef NTFS_HAVE_URING_IO
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "misc.h"
+#include "types.h"
+#include "c/log.h"
+#include "logging.h"
+#include "../../app/rc4.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter     426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register  427
+#endif
+
+#define URING_IO_ENTRIES    32              /* ring depth and chunks in flight */
+#define URING_IO_BUF_SIZE   (128 * 1024)    /* registered write buffer per chunk */
+#define URING_IO_MAX_READ   (1 << 30)       /* largest read in one sqe */
+#define URING_IO_CANCEL     (~0ULL)         /* user_data of the cancel sqes */
+#define URING_IO_DRAIN_TRY  16              /* failed io_uring_enter() calls before giving up a drain */
+
+/**
+ * struct uring_io_chunk - part of a request in flight, indexed by user_data
+ */
+struct uring_io_chunk {
+    int req;                    /* request in the batch */
+    s64 ofs;                    /* offset of the chunk in the request */
+    s64 len;                    /* length of the chunk */
+    s64 did;                    /* bytes already transferred */
+};
+
+/**
+ * struct uring_io_state - progress of one request of a batch
+ */
+struct uring_io_state {
+    s64 issued;                 /* bytes handed to the ring */
+    s64 end;                    /* first byte known bad, count if none */
+    int err;
+};
+
+struct uring_io {
+    int fd;                     /* must stay first, see DEV_FD() in unix_io.c */
+    int ring_fd;
+    pid_t owner;                /* a forked child can't share the ring */
+    BOOL stuck;                 /* requests could not be reaped, keep the ring mapped */
+    BOOL fixed_file;
+    BOOL fixed_bufs;
+    pthread_mutex_t lock;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_sz;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+
+    u8 *bufs;                   /* URING_IO_ENTRIES * URING_IO_BUF_SIZE */
+    struct uring_io_chunk chunks[URING_IO_ENTRIES];
+    int free_chunks[URING_IO_ENTRIES];
+    int nr_free;
+};
+
+#define DEV_URING(dev)  ((struct uring_io *)dev->d_private)
+
+static void uring_io_crypt(void *buf, s64 offset, s64 count, bool isEnc)
+{
+    uint8_t bufT[LOCK_FILE_BLOCK_SIZE] = {0};
+    uint8_t* key = "12345678";
+
+    lock_file_buffer(buf, offset, count, key, strlen((char*)key), bufT, sizeof(bufT), isEnc);
+}
+
+static void uring_io_teardown(struct uring_io *u)
+{
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_sz);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_sz);
+    if (u->bufs && (void*)u->bufs != MAP_FAILED)
+        munmap(u->bufs, (size_t)URING_IO_ENTRIES * URING_IO_BUF_SIZE);
+    if (u->ring_fd >= 0)
+        close(u->ring_fd);
+    u->sqes = NULL;
+    u->sq_ring = u->cq_ring = NULL;
+    u->bufs = NULL;
+    u->ring_fd = -1;
+}
+
+static int uring_io_setup(struct uring_io *u)
+{
+    struct io_uring_params p;
+    struct iovec iov[URING_IO_ENTRIES];
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    u->ring_fd = syscall(__NR_io_uring_setup, URING_IO_ENTRIES, &p);
+    if (u->ring_fd < 0)
+        return -1;
+    /* IORING_OP_READ/WRITE came with the same kernel (5.6) */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        errno = EOPNOTSUPP;
+        goto err_out;
+    }
+
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_sz > u->sq_ring_sz)
+            u->sq_ring_sz = u->cq_ring_sz;
+        u->cq_ring_sz = u->sq_ring_sz;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto err_out;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_ring = u->sq_ring;
+    else {
+        u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto err_out;
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto err_out;
+
+    u->sq_head = (unsigned*)((u8*)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned*)((u8*)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned*)((u8*)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)((u8*)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned*)((u8*)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned*)((u8*)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned*)((u8*)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((u8*)u->cq_ring + p.cq_off.cqes);
+
+    u->bufs = mmap(NULL, (size_t)URING_IO_ENTRIES * URING_IO_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((void*)u->bufs == MAP_FAILED)
+        goto err_out;
+    for (i = 0; i < URING_IO_ENTRIES; i++) {
+        iov[i].iov_base = u->bufs + (size_t)i * URING_IO_BUF_SIZE;
+        iov[i].iov_len = URING_IO_BUF_SIZE;
+        u->free_chunks[i] = i;
+    }
+    u->nr_free = URING_IO_ENTRIES;
+
+    /* Both are optimizations, a low RLIMIT_MEMLOCK must not disable the ring */
+    u->fixed_bufs = !syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_IO_ENTRIES);
+    u->fixed_file = !syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_FILES, &u->fd, 1);
+    if (!u->fixed_bufs || !u->fixed_file)
+        C_LOG_INFO("io_uring: registered buffers %d, fixed file %d", u->fixed_bufs, u->fixed_file);
+
+    u->owner = getpid();
+    pthread_mutex_init(&u->lock, NULL);
+    return 0;
+err_out:
+    i = errno;
+    uring_io_teardown(u);
+    errno = i;
+    return -1;
+}
+
+static BOOL uring_io_usable(struct uring_io *u)
+{
+    return u->ring_fd >= 0 && u->owner == getpid();
+}
+
+/*
+ * Cancel the @inflight chunks and reap their completions, so that nothing
+ * can land in a caller's buffer or in the registered buffers once we give
+ * up on the ring. Chunks not yet submitted go in with the cancels. Returns
+ * -1 when the kernel keeps refusing io_uring_enter() and chunks may still
+ * be in flight.
+ */
+static int uring_io_drain(struct uring_io *u, int inflight)
+{
+    BOOL busy[URING_IO_ENTRIES];
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    unsigned head, tail, idx, to_submit;
+    int i, cancels = 0, failures = 0;
+
+    for (i = 0; i < URING_IO_ENTRIES; i++)
+        busy[i] = TRUE;
+    for (i = 0; i < u->nr_free; i++)
+        busy[u->free_chunks[i]] = FALSE;
+
+    for (i = 0; i < URING_IO_ENTRIES; i++) {
+        tail = *u->sq_tail;
+        if (!busy[i] || tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask)
+            continue;
+        idx = tail & *u->sq_mask;
+        sqe = &u->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = i;
+        sqe->user_data = URING_IO_CANCEL;
+        u->sq_array[idx] = idx;
+        __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        cancels++;
+    }
+
+    while (inflight + cancels > 0) {
+        to_submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, u->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+            && errno != EINTR && errno != EAGAIN && errno != EBUSY
+            && ++failures >= URING_IO_DRAIN_TRY)
+            return -1;
+
+        head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &u->cqes[head & *u->cq_mask];
+            if (cqe->user_data == URING_IO_CANCEL)
+                cancels--;
+            else {
+                u->free_chunks[u->nr_free++] = (int)cqe->user_data;
+                inflight--;
+            }
+            __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+        }
+    }
+    return 0;
+}
+
+/* Queue the untransferred part of @chunk, the caller submits it. */
+static void uring_io_queue(struct uring_io *u, struct ntfs_io_req *reqs, int chunk, BOOL write)
+{
+    struct uring_io_chunk *c = &u->chunks[chunk];
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    tail = *u->sq_tail;
+    idx = tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    if (u->fixed_file) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else
+        sqe->fd = u->fd;
+    if (write) {
+        sqe->opcode = u->fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->addr = (unsigned long)(u->bufs + (size_t)chunk * URING_IO_BUF_SIZE + c->did);
+        if (u->fixed_bufs)
+            sqe->buf_index = chunk;
+    } else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (unsigned long)((u8*)reqs[c->req].buf + c->ofs + c->did);
+    }
+    sqe->off = reqs[c->req].pos + c->ofs + c->did;
+    sqe->len = c->len - c->did;
+    sqe->user_data = chunk;
+
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Transfer a whole batch. Every request is cut into chunks (the size of a
+ * write buffer for writes), as many chunks as there are ring entries are in
+ * flight, finished ones are refilled from the next requests. Short transfers
+ * are resubmitted, a request ends at its first failed chunk. Hitting the end
+ * of the device fails with ENODATA so that pread() can tell it from EIO.
+ */
+static int uring_io_rw(struct uring_io *u, struct ntfs_io_req *reqs, int nr, BOOL write)
+{
+    struct uring_io_state stack_state[URING_IO_ENTRIES];
+    struct uring_io_state *state = stack_state;
+    struct uring_io_chunk *c;
+    struct io_uring_cqe *cqe;
+    unsigned head, to_submit;
+    int i, chunk, inflight = 0, next = 0, err = 0;
+    s64 len;
+    int res;
+
+    if (nr > URING_IO_ENTRIES) {
+        state = ntfs_malloc(nr * sizeof(*state));
+        if (!state)
+            return -1;
+    }
+    for (i = 0; i < nr; i++) {
+        state[i].issued = 0;
+        state[i].end = reqs[i].count;
+        state[i].err = 0;
+    }
+
+    for (;;) {
+        while (u->nr_free && next < nr) {
+            if (state[next].issued >= state[next].end) {
+                next++;
+                continue;
+            }
+            len = reqs[next].count - state[next].issued;
+            len = min(len, write ? (s64)URING_IO_BUF_SIZE : (s64)URING_IO_MAX_READ);
+            chunk = u->free_chunks[--u->nr_free];
+            c = &u->chunks[chunk];
+            c->req = next;
+            c->ofs = state[next].issued;
+            c->len = len;
+            c->did = 0;
+            if (write) {
+                u8 *buf = u->bufs + (size_t)chunk * URING_IO_BUF_SIZE;
+
+                memcpy(buf, (u8*)reqs[next].buf + c->ofs, len);
+                uring_io_crypt(buf, reqs[next].pos + c->ofs, len, true);
+            }
+            uring_io_queue(u, reqs, chunk, write);
+            state[next].issued += len;
+            inflight++;
+        }
+        if (!inflight)
+            break;
+
+        to_submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        res = syscall(__NR_io_uring_enter, u->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            /* the ring can't be trusted, but the chunks in flight must finish first */
+            err = errno;
+            ntfs_log_perror("io_uring_enter failed");
+            if (uring_io_drain(u, inflight)) {
+                C_LOG_WARNING("io_uring: requests still in flight, giving up the ring");
+                u->stuck = TRUE;
+            }
+            break;
+        }
+
+        head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &u->cqes[head & *u->cq_mask];
+            chunk = (int)cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+
+            c = &u->chunks[chunk];
+            if (res > 0) {
+                if (!write)
+                    uring_io_crypt((u8*)reqs[c->req].buf + c->ofs + c->did,
+                                   reqs[c->req].pos + c->ofs + c->did, res, false);
+                c->did += res;
+                if (c->did < c->len) {
+                    uring_io_queue(u, reqs, chunk, write);
+                    continue;
+                }
+            } else if (res == -EINTR || res == -EAGAIN) {
+                uring_io_queue(u, reqs, chunk, write);
+                continue;
+            } else if (c->ofs + c->did < state[c->req].end) {
+                /* end of device or error, the request stops here */
+                state[c->req].end = c->ofs + c->did;
+                state[c->req].err = res ? -res : ENODATA;
+            }
+            u->free_chunks[u->nr_free++] = chunk;
+            inflight--;
+        }
+    }
+
+    if (err) {
+        /* A stuck ring stays mapped, the kernel may still write to its buffers */
+        if (u->stuck)
+            u->ring_fd = -1;
+        else
+            uring_io_teardown(u);
+        errno = u->stuck ? EIO : err;
+        if (state != stack_state)
+            free(state);
+        return -1;
+    }
+
+    for (i = 0; i < nr; i++) {
+        reqs[i].done = state[i].end;
+        if (state[i].err && !err)
+            err = state[i].err;
+    }
+    if (state != stack_state)
+        free(state);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int ntfs_device_uring_io_many(struct ntfs_device *dev, struct ntfs_io_req *reqs, int nr, BOOL write)
+{
+    struct uring_io *u = DEV_URING(dev);
+    int i, ret, err = 0;
+    s64 br;
+
+    /* the lock may be held by a thread that didn't survive fork() */
+    if (u->owner == getpid()) {
+        pthread_mutex_lock(&u->lock);
+        /* another thread may have torn the ring down while we waited */
+        if (uring_io_usable(u)) {
+            ret = uring_io_rw(u, reqs, nr, write);
+            if (ret >= 0 || uring_io_usable(u) || u->stuck) {
+                pthread_mutex_unlock(&u->lock);
+                return ret;
+            }
+        }
+        pthread_mutex_unlock(&u->lock);
+        /*
+         * The ring broke down and every chunk has been reaped. Part of the
+         * batch may have been transferred, doing it again is harmless.
+         */
+    }
+
+    for (i = 0; i < nr; i++) {
+        if (write)
+            br = ntfs_device_unix_io_ops.pwrite(dev, reqs[i].buf, reqs[i].count, reqs[i].pos);
+        else
+            br = ntfs_device_unix_io_ops.pread(dev, reqs[i].buf, reqs[i].count, reqs[i].pos);
+        reqs[i].done = (br > 0) ? br : 0;
+        if (br != reqs[i].count && !err)
+            err = (br < 0) ? errno : ENODATA;
+    }
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * ntfs_device_uring_io_open - Open the image with unix_io and set up the ring
+ * @dev:
+ * @flags:
+ *
+ * Falls back to plain unix_io (and switches @dev->d_ops to it) when io_uring
+ * is disabled or not available.
+ *
+ * Returns:
+ */
+static int ntfs_device_uring_io_open(struct ntfs_device *dev, int flags)
+{
+    struct uring_io *u;
+    const char *env;
+
+    if (ntfs_device_unix_io_ops.open(dev, flags))
+        return -1;
+
+    /* O_DIRECT needs the aligned bounce buffers of unix_io */
+    env = getenv("NTFS_IO_URING");
+    if (NDevDirect(dev) || (env && !strcmp(env, "0")))
+        goto fallback;
+
+    u = ntfs_calloc(sizeof(*u));
+    if (!u)
+        goto fallback;
+    u->fd = *(int *)dev->d_private;
+    if (uring_io_setup(u)) {
+        C_LOG_INFO("io_uring not available for '%s': %s", dev->d_name, strerror(errno));
+        free(u);
+        goto fallback;
+    }
+    free(dev->d_private);
+    dev->d_private = u;
+    return 0;
+fallback:
+    dev->d_ops = &ntfs_device_unix_io_ops;
+    return 0;
+}
+
+/**
+ * ntfs_device_uring_io_close - Tear down the ring and close the device
+ * @dev:
+ *
+ * Returns:
+ */
+static int ntfs_device_uring_io_close(struct ntfs_device *dev)
+{
+    struct uring_io *u = DEV_URING(dev);
+
+    if (NDevOpen(dev) && u && u->owner == getpid()) {
+        pthread_mutex_lock(&u->lock);
+        if (uring_io_usable(u))
+            uring_io_teardown(u);
+        pthread_mutex_unlock(&u->lock);
+        pthread_mutex_destroy(&u->lock);
+    }
+    /* unix_io frees the private data */
+    return ntfs_device_unix_io_ops.close(dev);
+}
+
+static s64 ntfs_device_uring_io_seek(struct ntfs_device *dev, s64 offset, int whence)
+{
+    return ntfs_device_unix_io_ops.seek(dev, offset, whence);
+}
+
+static s64 ntfs_device_uring_io_read(struct ntfs_device *dev, void *buf, s64 count)
+{
+    return ntfs_device_unix_io_ops.read(dev, buf, count);
+}
+
+static s64 ntfs_device_uring_io_write(struct ntfs_device *dev, const void *buf, s64 count)
+{
+    return ntfs_device_unix_io_ops.write(dev, buf, count);
+}
+
+/**
+ * ntfs_device_uring_io_pread - Perform a positioned read from the device
+ * @dev:
+ * @buf:
+ * @count:
+ * @offset:
+ *
+ * Returns: bytes read, 0 at end of device, -1 on error with nothing read
+ */
+static s64 ntfs_device_uring_io_pread(struct ntfs_device *dev, void *buf, s64 count, s64 offset)
+{
+    struct ntfs_io_req req = { .pos = offset, .count = count, .buf = buf, .done = 0 };
+
+    if (!ntfs_device_uring_io_many(dev, &req, 1, FALSE) || req.done || errno == ENODATA)
+        return req.done;
+    return -1;
+}
+
+/**
+ * ntfs_device_uring_io_pwrite - Perform a positioned write to the device
+ * @dev:
+ * @buf:
+ * @count:
+ * @offset:
+ *
+ * Returns: bytes written, -1 on error with nothing written
+ */
+static s64 ntfs_device_uring_io_pwrite(struct ntfs_device *dev, const void *buf, s64 count, s64 offset)
+{
+    struct ntfs_io_req req = { .pos = offset, .count = count, .buf = (void *)buf, .done = 0 };
+
+    if (NDevReadOnly(dev)) {
+        errno = EROFS;
+        return -1;
+    }
+    NDevSetDirty(dev);
+
+    if (!ntfs_device_uring_io_many(dev, &req, 1, TRUE) || req.done || errno == ENODATA)
+        return req.done;
+    return -1;
+}
+
+static int ntfs_device_uring_io_pread_many(struct ntfs_device *dev, struct ntfs_io_req *reqs, int nr)
+{
+    int ret = ntfs_device_uring_io_many(dev, reqs, nr, FALSE);
+
+    if (ret && errno == ENODATA)
+        errno = EIO;
+    return ret;
+}
+
+static int ntfs_device_uring_io_pwrite_many(struct ntfs_device *dev, struct ntfs_io_req *reqs, int nr)
+{
+    int ret = ntfs_device_uring_io_many(dev, reqs, nr, TRUE);
+
+    if (ret && errno == ENODATA)
+        errno = EIO;
+    return ret;
+}
+
+static int ntfs_device_uring_io_sync(struct ntfs_device *dev)
+{
+    return ntfs_device_unix_io_ops.sync(dev);
+}
+
+static int ntfs_device_uring_io_stat(struct ntfs_device *dev, struct stat *buf)
+{
+    return ntfs_device_unix_io_ops.stat(dev, buf);
+}
+
+static int ntfs_device_uring_io_ioctl(struct ntfs_device *dev, unsigned long request, void *argp)
+{
+    return ntfs_device_unix_io_ops.ioctl(dev, request, argp);
+}
+
+/**
+ * Device operations for the sandbox image with io_uring.
+ */
+struct ntfs_device_operations ntfs_device_uring_io_ops = {
+    .open        = ntfs_device_uring_io_open,
+    .close       = ntfs_device_uring_io_close,
+    .seek        = ntfs_device_uring_io_seek,
+    .read        = ntfs_device_uring_io_read,
+    .write       = ntfs_device_uring_io_write,
+    .pread       = ntfs_device_uring_io_pread,
+    .pwrite      = ntfs_device_uring_io_pwrite,
+    .sync        = ntfs_device_uring_io_sync,
+    .stat        = ntfs_device_uring_io_stat,
+    .ioctl       = ntfs_device_uring_io_ioctl,
+    .pread_many  = ntfs_device_uring_io_pread_many,
+    .pwrite_many = ntfs_device_uring_io_pwrite_many,
+};
+
+#endif /* NTFS_HAVE_URING_IO */
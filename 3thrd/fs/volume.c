@@ -377,6 +377,7 @@ mft_has_no_attr_list:
             goto error_exit;
         }
         vol->mft_na->rl = nrl;
+        ntfs_attr_rl_changed(vol->mft_na);
 
         /* Get the lowest vcn for the next extent. */
         highest_vcn = sle64_to_cpu(a->highest_vcn);
@@ -1454,6 +1455,7 @@ int ntfs_set_ignore_case(ntfs_volume *vol)
  * the mount system call (man 2 mount). Currently only the following flags
  * is implemented:
  *    NTFS_MNT_RDONLY    - mount volume read-only
+ *    NTFS_MNT_DIRECT_IO - open the device or file with O_DIRECT
  *
  * The function opens the device or file @name and verifies that it contains a
  * valid bootsector. Then, it allocates an ntfs_volume structure and initializes
@@ -1474,7 +1476,7 @@ ntfs_volume *ntfs_mount(const char *name __attribute__((unused)), ntfs_mount_fla
     ntfs_volume *vol;
 
     /* Allocate an ntfs_device structure. */
-    dev = ntfs_device_alloc(name, 0, &ntfs_device_default_io_ops, NULL);
+    dev = ntfs_device_alloc(name, (flags & NTFS_MNT_DIRECT_IO) ? (1 << ND_Direct) : 0, &ntfs_device_default_io_ops, NULL);
     if (!dev) {
         return NULL;
     }
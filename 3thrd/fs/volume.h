@@ -66,6 +66,7 @@ enum
     NTFS_MNT_EXCLUSIVE              = 0x08000000,
     NTFS_MNT_RECOVER                = 0x10000000,
     NTFS_MNT_IGNORE_HIBERFILE       = 0x20000000,
+    NTFS_MNT_DIRECT_IO              = 0x40000000, /* Open the device with O_DIRECT. */
 };
 typedef unsigned long ntfs_mount_flags;
 
@@ -268,9 +269,6 @@ struct _ntfs_volume
 #if CACHE_SECURID_SIZE
     struct CACHE_HEADER *securid_cache;
 #endif
-#if CACHE_LEGACY_SIZE
-    struct CACHE_HEADER *legacy_cache;
-#endif
 };
 
 extern const char *ntfs_home;
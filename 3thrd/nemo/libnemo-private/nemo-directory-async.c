@@ -32,6 +32,7 @@
 #include "nemo-signaller.h"
 #include "nemo-global-preferences.h"
 #include "nemo-link.h"
+#include "nemo-thumbnails.h"
 #include "../eel/eel-glib-extensions.h"
 #include <gtk/gtk.h>
 // #include <libxml/parser.h>
@@ -56,6 +57,9 @@
 
 #define DIRECTORY_LOAD_ITEMS_PER_CALLBACK 100
 
+/* Thumbnails read and decoded together on one worker thread. */
+#define THUMBNAIL_BATCH_SIZE 8
+
 /* Keep async. jobs down to this number for all directories. */
 #define MAX_ASYNC_JOBS 10
 
@@ -65,14 +69,39 @@ struct LinkInfoReadState {
 	NemoFile *file;
 };
 
+typedef struct {
+	NemoFile *file; /* NULL once the file is gone, main thread only */
+	GFile *original; /* NULL unless the file wants the original */
+	GFile *thumbnail;
+	GdkPixbuf *pixbuf; /* set by the worker */
+	gboolean tried_original;
+} ThumbnailLoad;
+
 struct ThumbnailState {
 	NemoDirectory *directory;
 	GCancellable *cancellable;
-	NemoFile *file;
-	gboolean trying_original;
-	gboolean tried_original;
+	ThumbnailLoad loads[THUMBNAIL_BATCH_SIZE];
+	int n_loads;
 };
 
+/* Returns TRUE if the file was part of the batch */
+static gboolean
+thumbnail_state_forget_file (ThumbnailState *state,
+			     NemoFile *file)
+{
+	gboolean found;
+	int i;
+
+	found = FALSE;
+	for (i = 0; i < state->n_loads; i++) {
+		if (state->loads[i].file == file) {
+			state->loads[i].file = NULL;
+			found = TRUE;
+		}
+	}
+	return found;
+}
+
 struct MountState {
 	NemoDirectory *directory;
 	GCancellable *cancellable;
@@ -1603,8 +1632,7 @@ nemo_async_destroying_file (NemoFile *file)
 	}
 
 	if (directory->details->thumbnail_state != NULL &&
-	    directory->details->thumbnail_state->file ==  file) {
-		directory->details->thumbnail_state->file = NULL;
+	    thumbnail_state_forget_file (directory->details->thumbnail_state, file)) {
 		changed = TRUE;
 	}
 	
@@ -3634,6 +3662,7 @@ thumbnail_done (NemoDirectory *directory,
 	
 	file->details->thumbnail_is_up_to_date = TRUE;
 	file->details->thumbnail_tried_original  = tried_original;
+	nemo_thumbnail_cache_forget (file);
 	if (file->details->thumbnail) {
 		g_object_unref (file->details->thumbnail);
 		file->details->thumbnail = NULL;
@@ -3654,6 +3683,7 @@ thumbnail_done (NemoDirectory *directory,
 			file->details->thumbnail = g_object_ref (pixbuf);
 			file->details->thumbnail_mtime = thumb_mtime;
             file->details->thumbnail_throttle_count = 1;
+			nemo_thumbnail_cache_add (file);
 		} else {
 			g_free (file->details->thumbnail_path);
 			file->details->thumbnail_path = NULL;
@@ -3667,22 +3697,27 @@ thumbnail_done (NemoDirectory *directory,
 static void
 thumbnail_stop (NemoDirectory *directory)
 {
+	ThumbnailState *state;
 	NemoFile *file;
+	int i;
 
-	if (directory->details->thumbnail_state != NULL) {
-		file = directory->details->thumbnail_state->file;
-
-		if (file != NULL) {
-			g_assert (NEMO_IS_FILE (file));
-			g_assert (file->details->directory == directory);
-			if (is_needy (file,
-				      lacks_thumbnail,
-				      REQUEST_THUMBNAIL)) {
-				return;
+	state = directory->details->thumbnail_state;
+	if (state != NULL) {
+		for (i = 0; i < state->n_loads; i++) {
+			file = state->loads[i].file;
+
+			if (file != NULL) {
+				g_assert (NEMO_IS_FILE (file));
+				g_assert (file->details->directory == directory);
+				if (is_needy (file,
+					      lacks_thumbnail,
+					      REQUEST_THUMBNAIL)) {
+					return;
+				}
 			}
 		}
 
-		/* The link info is not wanted, so stop it. */
+		/* None of the thumbnails is wanted, so stop it. */
 		thumbnail_cancel (directory);
 	}
 }
@@ -3710,6 +3745,15 @@ thumbnail_got_pixbuf (NemoDirectory *directory,
 static void
 thumbnail_state_free (ThumbnailState *state)
 {
+	ThumbnailLoad *load;
+	int i;
+
+	for (i = 0; i < state->n_loads; i++) {
+		load = &state->loads[i];
+		g_clear_object (&load->original);
+		g_clear_object (&load->thumbnail);
+		g_clear_object (&load->pixbuf);
+	}
 	g_object_unref (state->cancellable);
 	g_free (state);
 }
@@ -3783,69 +3827,116 @@ get_pixbuf_for_content (goffset file_len,
 }
 
 
+static GdkPixbuf *
+thumbnail_load_pixbuf (GFile *location,
+		       GCancellable *cancellable)
+{
+	GdkPixbuf *pixbuf;
+	char *file_contents;
+	gsize file_size;
+
+	pixbuf = NULL;
+	if (g_file_load_contents (location, cancellable,
+				  &file_contents, &file_size,
+				  NULL, NULL)) {
+		pixbuf = get_pixbuf_for_content (file_size, file_contents);
+		g_free (file_contents);
+	}
+	return pixbuf;
+}
+
+/* Worker thread: only the GFiles and pixbufs of the loads are touched here. */
 static void
-thumbnail_read_callback (GObject *source_object,
-			 GAsyncResult *res,
-			 gpointer user_data)
+thumbnail_read_thread (GTask *task,
+		       gpointer source_object,
+		       gpointer task_data,
+		       GCancellable *cancellable)
+{
+	ThumbnailState *state;
+	ThumbnailLoad *load;
+	int i;
+
+	state = task_data;
+
+	for (i = 0; i < state->n_loads; i++) {
+		if (g_cancellable_is_cancelled (cancellable)) {
+			break;
+		}
+
+		load = &state->loads[i];
+		if (load->original != NULL) {
+			load->pixbuf = thumbnail_load_pixbuf (load->original, cancellable);
+		}
+		if (load->pixbuf == NULL) {
+			load->pixbuf = thumbnail_load_pixbuf (load->thumbnail, cancellable);
+		}
+	}
+
+	g_task_return_boolean (task, TRUE);
+}
+
+static void
+thumbnail_read_done (GObject *source_object,
+		     GAsyncResult *res,
+		     gpointer user_data)
 {
 	ThumbnailState *state;
-	gsize file_size;
-	char *file_contents;
-	gboolean result;
 	NemoDirectory *directory;
-	GdkPixbuf *pixbuf;
-	GFile *location;
+	ThumbnailLoad *load;
+	int i;
 
-	state = user_data;
+	state = g_task_get_task_data (G_TASK (res));
 
 	if (state->directory == NULL) {
 		/* Operation was cancelled. Bail out */
-		thumbnail_state_free (state);
 		return;
 	}
 
 	directory = nemo_directory_ref (state->directory);
 
-	result = g_file_load_contents_finish (G_FILE (source_object),
-					      res,
-					      &file_contents, &file_size,
-					      NULL, NULL);
+	directory->details->thumbnail_state = NULL;
+	async_job_end (directory, "thumbnail");
 
-	pixbuf = NULL;
-	if (result) {
-		pixbuf = get_pixbuf_for_content (file_size, file_contents);
-		g_free (file_contents);
+	/* Changed signals may drop files of the batch */
+	for (i = 0; i < state->n_loads; i++) {
+		if (state->loads[i].file != NULL) {
+			nemo_file_ref (state->loads[i].file);
+		}
 	}
-	
-	if (pixbuf == NULL && state->trying_original) {
-		state->trying_original = FALSE;
 
-		location = g_file_new_for_path (state->file->details->thumbnail_path);
-
-		g_file_load_contents_async (location,
-					    state->cancellable,
-					    thumbnail_read_callback,
-					    state);
-		g_object_unref (location);
-	} else {
-		state->directory->details->thumbnail_state = NULL;
-		async_job_end (state->directory, "thumbnail");
-		
-		thumbnail_got_pixbuf (state->directory, state->file, pixbuf, state->tried_original);
-	
-		thumbnail_state_free (state);
+	for (i = 0; i < state->n_loads; i++) {
+		load = &state->loads[i];
+		if (load->file != NULL) {
+			thumbnail_got_pixbuf (directory, load->file, load->pixbuf, load->tried_original);
+			load->pixbuf = NULL;
+			nemo_file_unref (load->file);
+		}
 	}
-	
+
 	nemo_directory_unref (directory);
 }
 
+static void
+thumbnail_load_init (ThumbnailLoad *load,
+		     NemoFile *file)
+{
+	load->file = file;
+	load->tried_original = file->details->thumbnail_wants_original;
+	if (load->tried_original) {
+		load->original = nemo_file_get_location (file);
+	}
+	load->thumbnail = g_file_new_for_path (file->details->thumbnail_path);
+}
+
 static void
 thumbnail_start (NemoDirectory *directory,
 		 NemoFile *file,
 		 gboolean *doing_io)
 {
-	GFile *location;
 	ThumbnailState *state;
+	NemoFile *other;
+	GList *node;
+	GTask *task;
 
 	if (directory->details->thumbnail_state != NULL) {
 		*doing_io = TRUE;
@@ -3865,24 +3956,28 @@ thumbnail_start (NemoDirectory *directory,
 	
 	state = g_new0 (ThumbnailState, 1);
 	state->directory = directory;
-	state->file = file;
 	state->cancellable = g_cancellable_new ();
 
-	if (file->details->thumbnail_wants_original) {
-		state->tried_original = TRUE;
-		state->trying_original = TRUE;
-		location = nemo_file_get_location (file);
-	} else {
-		location = g_file_new_for_path (file->details->thumbnail_path);
+	/* One job per folder instead of one per file: take the other files
+	 * still missing their thumbnail along with this one. */
+	thumbnail_load_init (&state->loads[state->n_loads++], file);
+	for (node = directory->details->file_list;
+	     node != NULL && state->n_loads < THUMBNAIL_BATCH_SIZE;
+	     node = node->next) {
+		other = node->data;
+		if (other != file &&
+		    lacks_thumbnail (other) &&
+		    is_needy (other, lacks_thumbnail, REQUEST_THUMBNAIL)) {
+			thumbnail_load_init (&state->loads[state->n_loads++], other);
+		}
 	}
-	
+
 	directory->details->thumbnail_state = state;
 
-	g_file_load_contents_async (location,
-				    state->cancellable,
-				    thumbnail_read_callback,
-				    state);
-	g_object_unref (location);
+	task = g_task_new (NULL, state->cancellable, thumbnail_read_done, NULL);
+	g_task_set_task_data (task, state, (GDestroyNotify) thumbnail_state_free);
+	g_task_run_in_thread (task, thumbnail_read_thread);
+	g_object_unref (task);
 }
 
 static void
@@ -4573,8 +4668,16 @@ static void
 cancel_thumbnail_for_file (NemoDirectory *directory,
 			   NemoFile      *file)
 {
-	if (directory->details->thumbnail_state != NULL &&
-	    directory->details->thumbnail_state->file == file) {
+	ThumbnailState *state;
+	int i;
+
+	state = directory->details->thumbnail_state;
+	if (state != NULL && thumbnail_state_forget_file (state, file)) {
+		for (i = 0; i < state->n_loads; i++) {
+			if (state->loads[i].file != NULL) {
+				return;
+			}
+		}
 		thumbnail_cancel (directory);
 	}
 }
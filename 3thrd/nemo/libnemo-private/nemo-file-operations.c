@@ -26,6 +26,7 @@
             Pavel Cisler <pavel@eazel.com>
  */
 
+#define _GNU_SOURCE /* copy_file_range */
 #include "../config.h"
 #include <string.h>
 #include <stdio.h>
@@ -34,8 +35,12 @@
 #include <math.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <linux/fs.h>
 
 #include "nemo-file-operations.h"
 
@@ -118,6 +123,7 @@ typedef struct {
 	gchar *target_name;
 	NemoCopyCallback  done_callback;
 	gpointer done_callback_data;
+	GThreadPool *small_copy_pool;
 } CopyMoveJob;
 
 typedef struct {
@@ -193,6 +199,17 @@ typedef struct {
 
 #define MAXIMUM_DISPLAYED_FILE_NAME_LENGTH 50
 
+/* Native copies: bytes per copy_file_range() call, and the buffer used when
+ * the kernel can't copy between the two files itself. */
+#define NATIVE_COPY_RANGE_SIZE (8 * 1024 * 1024)
+#define NATIVE_COPY_BUFFER_SIZE (1024 * 1024)
+
+/* Files up to this size in a copied folder go to a pool of workers, so the
+ * per-file round trips (through FUSE on the sandbox) overlap. */
+#define SMALL_COPY_MAX_SIZE (256 * 1024)
+#define SMALL_COPY_MAX_THREADS 4
+#define SMALL_COPY_MAX_PENDING 64
+
 #define IS_IO_ERROR(__error, KIND) (((__error)->domain == G_IO_ERROR && (__error)->code == G_IO_ERROR_ ## KIND))
 
 #define SKIP _("_Skip")
@@ -3802,6 +3819,438 @@ create_dest_dir (CommonJob *job,
 	return CREATE_DEST_DIR_SUCCESS;
 }
 
+/* Local path of a file the copy engine can open directly: native files and
+ * sandbox:// files, which live under the FUSE mount point. */
+static char *
+copy_native_path (GFile *file)
+{
+	char *uri, *path, *result;
+
+	if (g_file_is_native (file)) {
+		return g_file_get_path (file);
+	}
+
+	result = NULL;
+#ifdef SANDBOX_MOUNT_POINT
+	if (g_file_has_uri_scheme (file, "sandbox")) {
+		uri = g_file_get_uri (file);
+		path = g_uri_unescape_string (uri + strlen ("sandbox://"), NULL);
+		if (path != NULL) {
+			result = g_build_filename (SANDBOX_MOUNT_POINT, path, NULL);
+		}
+		g_free (path);
+		g_free (uri);
+	}
+#endif
+	return result;
+}
+
+static gboolean
+write_all (int fd, const char *buffer, gssize len)
+{
+	gssize n;
+
+	while (len > 0) {
+		n = write (fd, buffer, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FALSE;
+		}
+		buffer += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+/* Moves the finished temporary file to @dest_path. Without
+ * G_FILE_COPY_OVERWRITE an existing destination is never replaced. */
+static int
+commit_native_copy (const char *tmp_path,
+		    const char *dest_path,
+		    GFileCopyFlags flags)
+{
+	if (flags & G_FILE_COPY_OVERWRITE) {
+		return rename (tmp_path, dest_path);
+	}
+
+#ifdef RENAME_NOREPLACE
+	if (renameat2 (AT_FDCWD, tmp_path, AT_FDCWD, dest_path, RENAME_NOREPLACE) == 0) {
+		return 0;
+	}
+	if (errno != EINVAL && errno != ENOSYS) {
+		return -1;
+	}
+#endif
+	if (link (tmp_path, dest_path) != 0) {
+		return -1;
+	}
+	unlink (tmp_path);
+
+	return 0;
+}
+
+/* Same contract as g_file_copy() for a regular file. Returns
+ * G_IO_ERROR_NOT_SUPPORTED before touching the destination when the copy
+ * should be left to GIO: non local files, directories, links and special
+ * files. Tries a reflink, then copy_file_range(), then large buffers.
+ * The data goes to a temporary file next to @dest which only replaces
+ * @dest once it is complete and synced, so a failed or cancelled copy
+ * leaves an existing destination untouched. */
+static gboolean
+copy_file_native (GFile *src,
+		  GFile *dest,
+		  GFileCopyFlags flags,
+		  GCancellable *cancellable,
+		  GFileProgressCallback progress_callback,
+		  gpointer progress_callback_data,
+		  GError **error)
+{
+	char *src_path, *dest_path, *dest_dir, *tmp_path;
+	char *buffer;
+	struct stat st, dest_st;
+	int src_fd, dest_fd;
+	int errsv;
+	gboolean use_range, res;
+	goffset copied;
+	gssize n;
+
+	res = FALSE;
+	buffer = NULL;
+	tmp_path = NULL;
+	src_fd = dest_fd = -1;
+	src_path = copy_native_path (src);
+	dest_path = copy_native_path (dest);
+
+	if (src_path == NULL || dest_path == NULL) {
+		goto not_supported;
+	}
+
+	src_fd = open (src_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src_fd < 0 || fstat (src_fd, &st) != 0 || !S_ISREG (st.st_mode)) {
+		goto not_supported;
+	}
+
+	if (lstat (dest_path, &dest_st) == 0) {
+		if (!(flags & G_FILE_COPY_OVERWRITE)) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+				     _("Error opening file '%s': %s"), dest_path, g_strerror (EEXIST));
+			goto out;
+		}
+		if (!S_ISREG (dest_st.st_mode)) {
+			/* Replacing a symlink or a special file */
+			goto not_supported;
+		}
+		if (dest_st.st_dev == st.st_dev && dest_st.st_ino == st.st_ino) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+				     _("Error copying file '%s': %s"), src_path,
+				     _("The source and the destination are the same file"));
+			goto out;
+		}
+	}
+
+	dest_dir = g_path_get_dirname (dest_path);
+	tmp_path = g_build_filename (dest_dir, ".nemo-copy-XXXXXX", NULL);
+	g_free (dest_dir);
+	dest_fd = g_mkstemp_full (tmp_path, O_WRONLY | O_CLOEXEC,
+				  (flags & G_FILE_COPY_TARGET_DEFAULT_PERMS) ? 0666 : (st.st_mode & 0777));
+	if (dest_fd < 0) {
+		errsv = errno;
+		g_clear_pointer (&tmp_path, g_free);
+		g_set_error (error, G_IO_ERROR,
+			     errsv == EINVAL ? G_IO_ERROR_INVALID_FILENAME : g_io_error_from_errno (errsv),
+			     _("Error opening file '%s': %s"), dest_path, g_strerror (errsv));
+		goto out;
+	}
+
+#ifdef FICLONE
+	if (ioctl (dest_fd, FICLONE, src_fd) == 0) {
+		if (progress_callback) {
+			progress_callback (st.st_size, st.st_size, progress_callback_data);
+		}
+		res = TRUE;
+		goto out;
+	}
+#endif
+
+	/* Files reporting no size (procfs and friends) are read until EOF */
+	use_range = st.st_size > 0;
+	copied = 0;
+	for (;;) {
+		if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+			goto out;
+		}
+
+		if (use_range) {
+			n = copy_file_range (src_fd, NULL, dest_fd, NULL, NATIVE_COPY_RANGE_SIZE, 0);
+			if (n < 0 && copied == 0 &&
+			    (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+				use_range = FALSE;
+				continue;
+			}
+		} else {
+			if (buffer == NULL) {
+				buffer = g_malloc (NATIVE_COPY_BUFFER_SIZE);
+			}
+			n = read (src_fd, buffer, NATIVE_COPY_BUFFER_SIZE);
+			if (n > 0 && !write_all (dest_fd, buffer, n)) {
+				n = -1;
+			}
+		}
+
+		if (n < 0) {
+			errsv = errno;
+			if (errsv == EINTR) {
+				continue;
+			}
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+				     _("Error copying file '%s': %s"), src_path, g_strerror (errsv));
+			goto out;
+		}
+		if (n == 0) {
+			break;
+		}
+
+		copied += n;
+		if (progress_callback) {
+			progress_callback (copied, st.st_size, progress_callback_data);
+		}
+	}
+
+	res = TRUE;
+	goto out;
+
+ not_supported:
+	g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			     "Native copy not supported");
+ out:
+	if (dest_fd >= 0) {
+		if (res && fsync (dest_fd) != 0) {
+			errsv = errno;
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+				     _("Error writing to file '%s': %s"), dest_path, g_strerror (errsv));
+			res = FALSE;
+		}
+		if (close (dest_fd) != 0 && res) {
+			errsv = errno;
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+				     _("Error closing file '%s': %s"), dest_path, g_strerror (errsv));
+			res = FALSE;
+		}
+		if (res && commit_native_copy (tmp_path, dest_path, flags) != 0) {
+			errsv = errno;
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+				     _("Error opening file '%s': %s"), dest_path, g_strerror (errsv));
+			res = FALSE;
+		}
+		if (!res) {
+			/* Only the temporary file, never the destination */
+			unlink (tmp_path);
+		}
+	}
+	if (src_fd >= 0) {
+		close (src_fd);
+	}
+	g_free (buffer);
+	g_free (tmp_path);
+	g_free (src_path);
+	g_free (dest_path);
+
+	return res;
+}
+
+typedef struct {
+	GFile *src;
+	GFile *dest;
+	goffset size;
+	GFileCopyFlags flags;
+	GCancellable *cancellable;
+	GAsyncQueue *done;
+	GError *error;
+} SmallCopy;
+
+/* The small files of one folder being copied. Files the workers could not
+ * copy are handed to copy_move_file() on the job thread, which takes care
+ * of conflicts, invalid names and error dialogs. */
+typedef struct {
+	CopyMoveJob *copy_job;
+	GAsyncQueue *done;
+	int pending;
+	GFile *dest_dir;
+	gboolean same_fs;
+	char **dest_fs_type;
+	SourceInfo *source_info;
+	TransferInfo *transfer_info;
+	gboolean *skipped_file;
+	gboolean readonly_source_fs;
+} SmallCopyBatch;
+
+/* Worker thread */
+static void
+small_copy_thread (gpointer data,
+		   gpointer user_data)
+{
+	SmallCopy *copy = data;
+
+	if (copy_file_native (copy->src, copy->dest, copy->flags,
+			      copy->cancellable, NULL, NULL, &copy->error)) {
+		/* Ignore errors here. Failure to copy metadata is not a hard error */
+		g_file_copy_attributes (copy->src, copy->dest,
+					copy->flags | G_FILE_COPY_ALL_METADATA,
+					copy->cancellable, NULL);
+	}
+
+	g_async_queue_push (copy->done, copy);
+}
+
+static gboolean
+small_copy_batch_init (SmallCopyBatch *batch,
+		       CopyMoveJob *copy_job,
+		       GFile *src,
+		       GFile *dest_dir,
+		       gboolean same_fs,
+		       char **dest_fs_type,
+		       SourceInfo *source_info,
+		       TransferInfo *transfer_info,
+		       gboolean *skipped_file,
+		       gboolean readonly_source_fs)
+{
+	char *src_path, *dest_path;
+	gboolean native;
+
+	memset (batch, 0, sizeof (SmallCopyBatch));
+
+	/* Moves are renames, and the desktop needs the per-file handling */
+	if (copy_job->is_move ||
+	    (copy_job->desktop_location != NULL && g_file_equal (copy_job->desktop_location, dest_dir))) {
+		return FALSE;
+	}
+
+	src_path = copy_native_path (src);
+	dest_path = copy_native_path (dest_dir);
+	native = src_path != NULL && dest_path != NULL;
+	g_free (src_path);
+	g_free (dest_path);
+	if (!native) {
+		return FALSE;
+	}
+
+	if (copy_job->small_copy_pool == NULL) {
+		copy_job->small_copy_pool = g_thread_pool_new (small_copy_thread, NULL,
+							       SMALL_COPY_MAX_THREADS,
+							       FALSE, NULL);
+	}
+
+	batch->copy_job = copy_job;
+	batch->done = g_async_queue_new ();
+	batch->dest_dir = dest_dir;
+	batch->same_fs = same_fs;
+	batch->dest_fs_type = dest_fs_type;
+	batch->source_info = source_info;
+	batch->transfer_info = transfer_info;
+	batch->skipped_file = skipped_file;
+	batch->readonly_source_fs = readonly_source_fs;
+
+	return TRUE;
+}
+
+static gboolean
+small_copy_wanted (SmallCopyBatch *batch,
+		   GFileInfo *info,
+		   GFile *src)
+{
+	return batch->done != NULL &&
+		g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR &&
+		g_file_info_get_size (info) <= SMALL_COPY_MAX_SIZE &&
+		!should_skip_file ((CommonJob *) batch->copy_job, src);
+}
+
+static void
+small_copy_finish (SmallCopyBatch *batch,
+		   SmallCopy *copy)
+{
+	CopyMoveJob *copy_job;
+	CommonJob *job;
+
+	copy_job = batch->copy_job;
+	job = (CommonJob *) copy_job;
+
+	if (copy->error == NULL) {
+		batch->transfer_info->num_files ++;
+		batch->transfer_info->num_bytes += copy->size;
+		report_copy_progress (copy_job, batch->source_info, batch->transfer_info);
+
+		nemo_file_changes_queue_file_added (copy->dest);
+
+		if (job->undo_info != NULL) {
+			nemo_file_undo_info_ext_add_origin_target_pair (NEMO_FILE_UNDO_INFO_EXT (job->undo_info),
+									    copy->src, copy->dest);
+		}
+	} else if (IS_IO_ERROR (copy->error, CANCELLED) || job_aborted (job)) {
+		*batch->skipped_file = TRUE;
+	} else {
+		copy_move_file (copy_job, copy->src, batch->dest_dir, batch->same_fs, FALSE,
+				batch->dest_fs_type, batch->source_info, batch->transfer_info,
+				NULL, NULL, FALSE, batch->skipped_file,
+				batch->readonly_source_fs);
+	}
+
+	g_clear_error (&copy->error);
+	g_object_unref (copy->src);
+	g_object_unref (copy->dest);
+	g_free (copy);
+}
+
+static void
+small_copy_queue (SmallCopyBatch *batch,
+		  GFile *src,
+		  GFileInfo *info)
+{
+	CommonJob *job;
+	SmallCopy *copy;
+
+	job = (CommonJob *) batch->copy_job;
+
+	copy = g_new0 (SmallCopy, 1);
+	copy->src = g_object_ref (src);
+	copy->dest = get_target_file (src, batch->dest_dir, *batch->dest_fs_type, batch->same_fs);
+	copy->size = g_file_info_get_size (info);
+	copy->flags = G_FILE_COPY_NOFOLLOW_SYMLINKS;
+	if (batch->readonly_source_fs) {
+		copy->flags |= G_FILE_COPY_TARGET_DEFAULT_PERMS;
+	}
+	copy->cancellable = job->cancellable;
+	copy->done = batch->done;
+
+	g_thread_pool_push (batch->copy_job->small_copy_pool, copy, NULL);
+	batch->pending++;
+
+	/* Keep the progress moving, and the queue bounded */
+	while ((copy = batch->pending >= SMALL_COPY_MAX_PENDING ?
+		g_async_queue_pop (batch->done) : g_async_queue_try_pop (batch->done)) != NULL) {
+		batch->pending--;
+		small_copy_finish (batch, copy);
+	}
+}
+
+/* Waits for the batch, the folder attributes can only be copied after it */
+static void
+small_copy_batch_finish (SmallCopyBatch *batch)
+{
+	if (batch->done == NULL) {
+		return;
+	}
+
+	while (batch->pending > 0) {
+		batch->pending--;
+		small_copy_finish (batch, g_async_queue_pop (batch->done));
+	}
+
+	g_async_queue_unref (batch->done);
+	batch->done = NULL;
+}
+
 /* a return value of FALSE means retry, i.e.
  * the destination has changed and the source
  * is expected to re-try the preceeding
@@ -3832,6 +4281,7 @@ copy_move_directory (CopyMoveJob *copy_job,
 	gboolean local_skipped_file;
 	CommonJob *job;
 	GFileCopyFlags flags;
+	SmallCopyBatch small_copies;
 
 	job = (CommonJob *)copy_job;
 
@@ -3866,23 +4316,34 @@ copy_move_directory (CopyMoveJob *copy_job,
  retry:
 	error = NULL;
 	enumerator = g_file_enumerate_children (src,
-						G_FILE_ATTRIBUTE_STANDARD_NAME,
+						G_FILE_ATTRIBUTE_STANDARD_NAME","
+						G_FILE_ATTRIBUTE_STANDARD_TYPE","
+						G_FILE_ATTRIBUTE_STANDARD_SIZE,
 						G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
 						job->cancellable,
 						&error);
 	if (enumerator) {
 		error = NULL;
 
+		small_copy_batch_init (&small_copies, copy_job, src, *dest, same_fs, &dest_fs_type,
+				       source_info, transfer_info, &local_skipped_file,
+				       readonly_source_fs);
+
 		while (!job_aborted (job) &&
 		       (info = g_file_enumerator_next_file (enumerator, job->cancellable, skip_error?NULL:&error)) != NULL) {
 			src_file = g_file_get_child (src,
 						     g_file_info_get_name (info));
-			copy_move_file (copy_job, src_file, *dest, same_fs, FALSE, &dest_fs_type,
-					source_info, transfer_info, NULL, NULL, FALSE, &local_skipped_file,
-					readonly_source_fs);
+			if (small_copy_wanted (&small_copies, info, src_file)) {
+				small_copy_queue (&small_copies, src_file, info);
+			} else {
+				copy_move_file (copy_job, src_file, *dest, same_fs, FALSE, &dest_fs_type,
+						source_info, transfer_info, NULL, NULL, FALSE, &local_skipped_file,
+						readonly_source_fs);
+			}
 			g_object_unref (src_file);
 			g_object_unref (info);
 		}
+		small_copy_batch_finish (&small_copies);
 		g_file_enumerator_close (enumerator, job->cancellable, NULL);
 		g_object_unref (enumerator);
 
@@ -4533,12 +4994,21 @@ copy_move_file (CopyMoveJob *copy_job,
 				   &pdata,
 				   &error);
 	} else {
-		res = g_file_copy (src, dest,
-				   flags,
-				   job->cancellable,
-				   copy_file_progress_callback,
-				   &pdata,
-				   &error);
+		res = copy_file_native (src, dest,
+					flags,
+					job->cancellable,
+					copy_file_progress_callback,
+					&pdata,
+					&error);
+		if (!res && IS_IO_ERROR (error, NOT_SUPPORTED)) {
+			g_clear_error (&error);
+			res = g_file_copy (src, dest,
+					   flags,
+					   job->cancellable,
+					   copy_file_progress_callback,
+					   &pdata,
+					   &error);
+		}
 	}
 
 	if (res) {
@@ -4924,6 +5394,10 @@ copy_job_done (gpointer user_data)
 	g_free (job->icon_positions);
 	g_free (job->target_name);
 
+	if (job->small_copy_pool != NULL) {
+		g_thread_pool_free (job->small_copy_pool, FALSE, TRUE);
+	}
+
 	g_clear_object (&job->fake_display_source);
 
 	finalize_common ((CommonJob *)job);
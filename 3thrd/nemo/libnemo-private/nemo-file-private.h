@@ -106,6 +106,8 @@ struct NemoFileDetails
     time_t thumbnail_mtime;
     gint thumbnail_throttle_count;
     time_t last_thumbnail_try_mtime;
+    GList *thumbnail_cache_link;    /* in the decoded thumbnail LRU, see nemo-thumbnails.c */
+    gsize thumbnail_cache_bytes;
 
     GList *mime_list; /* If this is a directory, the list of MIME types in it. */
 
@@ -185,6 +187,7 @@ struct NemoFileDetails
     eel_boolean_bit thumbnail_wants_original      : 1;
     eel_boolean_bit thumbnail_tried_original      : 1;
     eel_boolean_bit thumbnailing_failed           : 1;
+    eel_boolean_bit thumbnail_evicted             : 1;
 
     eel_boolean_bit is_thumbnailing               : 1;
 
@@ -481,6 +481,7 @@ nemo_file_clear_info (NemoFile *file)
         file->details->icon = NULL;
     }
 
+    nemo_thumbnail_cache_forget (file);
     g_clear_object (&file->details->thumbnail);
 
     g_free (file->details->thumbnail_path);
@@ -855,6 +856,7 @@ finalize (GObject *object)
     if (file->details->description) {g_free(file->details->description); file->details->description = NULL;}
     if (file->details->activation_uri) {g_free(file->details->activation_uri); file->details->activation_uri = NULL;}
     if (file->details->custom_icon) {g_object_unref (file->details->custom_icon); file->details->custom_icon = NULL;}
+    nemo_thumbnail_cache_forget (file);
     if (file->details->thumbnail) {g_object_unref (file->details->thumbnail); file->details->thumbnail = NULL;}
 
     if (file->details->mount) {
@@ -4570,6 +4572,7 @@ nemo_file_delete_thumbnail (NemoFile *file)
     gint success;
 
     nemo_file_invalidate_attributes (file, NEMO_FILE_ATTRIBUTE_THUMBNAIL);
+    nemo_thumbnail_cache_forget (file);
     g_clear_object (&file->details->thumbnail);
 
     success = g_unlink (file->details->thumbnail_path);
@@ -4922,6 +4925,9 @@ nemo_file_get_icon (NemoFile *file,
                    modified_size, cached_thumbnail_size);
         }
 
+        /* Reloads the thumbnail if it was evicted from memory */
+        nemo_thumbnail_cache_touch (file);
+
         if (file->details->thumbnail) {
             int w, h, s;
             double thumb_scale;
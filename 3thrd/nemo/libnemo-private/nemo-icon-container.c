@@ -5605,6 +5605,9 @@ update_visible_icons_cb (NemoIconContainer *container)
 
     container->details->update_visible_icons_id = 0;
 
+	/* Queued thumbnails not seen again in this pass sort behind the visible ones */
+	nemo_thumbnail_viewport_changed ();
+
 	hadj = gtk_scrollable_get_hadjustment (GTK_SCROLLABLE (container));
 	vadj = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (container));
 	gtk_widget_get_allocation (GTK_WIDGET (container), &allocation);
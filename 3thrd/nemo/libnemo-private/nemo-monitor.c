@@ -28,6 +28,7 @@
 #include "nemo-monitor.h"
 #include "nemo-file-changes-queue.h"
 #include "nemo-file-utilities.h"
+#include "nemo-sandbox-monitor.h"
 
 #include <gio/gio.h>
 
@@ -35,6 +36,7 @@ struct NemoMonitor {
 	GFileMonitor *monitor;
     GVolumeMonitor *volume_monitor;
     GFile *location;
+    GFile *sandbox_location;
 };
 
 gboolean
@@ -155,6 +157,13 @@ nemo_monitor_directory (GFile *location)
 	NemoMonitor *ret;
 
     ret = g_new0 (NemoMonitor, 1);
+
+    /* The sandbox volume pushes its own changes, inotify misses many of them on FUSE */
+    if (nemo_sandbox_monitor_subscribe (location)) {
+        ret->sandbox_location = g_object_ref (location);
+        return ret;
+    }
+
 	dir_monitor = g_file_monitor_directory (location, G_FILE_MONITOR_WATCH_MOUNTS, NULL, NULL);
 
     if (dir_monitor != NULL) {
@@ -193,6 +202,11 @@ nemo_monitor_cancel (NemoMonitor *monitor)
         g_object_unref (monitor->volume_monitor);
     }
 
+    if (monitor->sandbox_location != NULL) {
+        nemo_sandbox_monitor_unsubscribe (monitor->sandbox_location);
+        g_object_unref (monitor->sandbox_location);
+    }
+
     g_clear_object (&monitor->location);
 	g_free (monitor);
 }
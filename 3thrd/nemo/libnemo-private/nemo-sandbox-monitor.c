@@ -0,0 +1,441 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*-
+
+   nemo-sandbox-monitor.c: change notifications pushed by the sandbox volume
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 51 Franklin Street - Suite 500,
+   Boston, MA 02110-1335, USA.
+*/
+
+#include "../config.h"
+#include "nemo-sandbox-monitor.h"
+#include "nemo-directory.h"
+#include "nemo-file-changes-queue.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
+#include <sys/socket.h>
+
+#include "../../../app/fs/change-notify.h"
+
+#define DEBUG_FLAG NEMO_DEBUG_DIRECTORY_VIEW
+#include "nemo-debug.h"
+
+#define FUSE_SUPER_MAGIC 0x65735546
+
+/* Retry a lost connection this often while directories are subscribed */
+#define RECONNECT_INTERVAL_SECONDS 2
+
+typedef struct {
+	GFile *location;
+	int ref_count;
+} Subscription;
+
+/* Volume paths ("/a/b") of the watched directories */
+static GHashTable *subscriptions = NULL;
+static GSocket *events_socket = NULL;
+static GSource *events_source = NULL;
+static guint reconnect_id = 0;
+
+static void
+subscription_free (gpointer data)
+{
+	Subscription *sub = data;
+
+	g_object_unref (sub->location);
+	g_free (sub);
+}
+
+static gboolean
+is_on_fuse (const char *path)
+{
+	struct statfs st;
+
+	return statfs (path, &st) == 0 && st.f_type == FUSE_SUPER_MAGIC;
+}
+
+/* The volume is mounted at SANDBOX_MOUNT_POINT, and is the root of the
+ * sandbox for the processes running inside it. */
+static char *
+get_volume_path (GFile *location)
+{
+	char *uri, *path, *result;
+
+	result = NULL;
+
+	if (g_file_has_uri_scheme (location, "sandbox")) {
+		uri = g_file_get_uri (location);
+		result = g_uri_unescape_string (uri + strlen ("sandbox://"), NULL);
+		g_free (uri);
+		/* Same form as the daemon's paths: "/" or no trailing slash */
+		while (result != NULL && strlen (result) > 1 && g_str_has_suffix (result, "/")) {
+			result[strlen (result) - 1] = '\0';
+		}
+		return result;
+	}
+
+	path = g_file_get_path (location);
+	if (path == NULL) {
+		return NULL;
+	}
+
+#ifdef SANDBOX_MOUNT_POINT
+	if (g_str_has_prefix (path, SANDBOX_MOUNT_POINT) &&
+	    (path[strlen (SANDBOX_MOUNT_POINT)] == '/' || path[strlen (SANDBOX_MOUNT_POINT)] == '\0')) {
+		result = g_strdup (path[strlen (SANDBOX_MOUNT_POINT)] == '\0' ? "/" : path + strlen (SANDBOX_MOUNT_POINT));
+	} else
+#endif
+	if (is_on_fuse ("/") && is_on_fuse (path)) {
+		/* Inside the sandbox; folders bind mounted from the host are not on the volume */
+		result = g_strdup (path);
+	}
+
+	g_free (path);
+	return result;
+}
+
+static void
+reload_all (void)
+{
+	GHashTableIter iter;
+	Subscription *sub;
+	NemoDirectory *directory;
+	GList *locations, *l;
+
+	DEBUG ("Sandbox monitor: events lost, reloading %u folders", g_hash_table_size (subscriptions));
+
+	/* Reloading may cancel and restart monitors */
+	locations = NULL;
+	g_hash_table_iter_init (&iter, subscriptions);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &sub)) {
+		locations = g_list_prepend (locations, g_object_ref (sub->location));
+	}
+
+	for (l = locations; l != NULL; l = l->next) {
+		directory = nemo_directory_get (l->data);
+		nemo_directory_force_reload (directory);
+		nemo_directory_unref (directory);
+	}
+	g_list_free_full (locations, g_object_unref);
+}
+
+/* A watched folder or a file directly in one; NULL for the rest of the volume */
+static GFile *
+get_file_for_volume_path (const char *path)
+{
+	Subscription *sub;
+	const char *slash;
+	char *dir;
+
+	sub = g_hash_table_lookup (subscriptions, path);
+	if (sub != NULL) {
+		return g_object_ref (sub->location);
+	}
+
+	slash = strrchr (path, '/');
+	if (slash == NULL || slash[1] == '\0') {
+		return NULL;
+	}
+
+	dir = slash == path ? g_strdup ("/") : g_strndup (path, slash - path);
+	sub = g_hash_table_lookup (subscriptions, dir);
+	g_free (dir);
+
+	return sub != NULL ? g_file_get_child (sub->location, slash + 1) : NULL;
+}
+
+static void
+handle_event (Subscription *sub,
+	      const char *dir,
+	      const SandboxFsEvent *event,
+	      const char *name,
+	      const char *from)
+{
+	GFile *file, *from_file;
+	char *path;
+
+	/* Folders themselves may be watched without their parent */
+	if (sub == NULL &&
+	    event->type != SANDBOX_FS_EVENT_DELETED &&
+	    event->type != SANDBOX_FS_EVENT_MOVED) {
+		return;
+	}
+
+	path = g_build_filename (dir, name, NULL);
+	file = get_file_for_volume_path (path);
+	from_file = from != NULL ? get_file_for_volume_path (from) : NULL;
+	g_free (path);
+
+	switch (event->type) {
+	case SANDBOX_FS_EVENT_CREATED:
+		if (file != NULL) {
+			nemo_file_changes_queue_file_added (file);
+		}
+		break;
+	case SANDBOX_FS_EVENT_CHANGED:
+		if (file != NULL) {
+			nemo_file_changes_queue_file_changed (file);
+		}
+		break;
+	case SANDBOX_FS_EVENT_DELETED:
+		if (file != NULL) {
+			nemo_file_changes_queue_file_removed (file);
+		}
+		break;
+	case SANDBOX_FS_EVENT_MOVED:
+		if (file != NULL && from_file != NULL) {
+			nemo_file_changes_queue_file_moved (from_file, file);
+		} else if (file != NULL) {
+			nemo_file_changes_queue_file_added (file);
+		} else if (from_file != NULL) {
+			nemo_file_changes_queue_file_removed (from_file);
+		}
+		break;
+	default:
+		break;
+	}
+
+	g_clear_object (&file);
+	g_clear_object (&from_file);
+}
+
+static void
+handle_batch (const char *buffer,
+	      gssize len)
+{
+	const SandboxFsEventBatch *batch;
+	const SandboxFsEvent *event;
+	const char *name, *from;
+	Subscription *sub;
+	gsize off, need;
+	guint i;
+
+	batch = (const SandboxFsEventBatch *) buffer;
+	if (len < (gssize) sizeof (SandboxFsEventBatch) ||
+	    batch->magic != SANDBOX_FS_EVENTS_MAGIC ||
+	    sizeof (SandboxFsEventBatch) + batch->dirLen + 1 > (gsize) len ||
+	    batch->dir[batch->dirLen] != '\0') {
+		return;
+	}
+
+	if (batch->flags & SANDBOX_FS_EVENTS_RESCAN) {
+		reload_all ();
+		return;
+	}
+
+	sub = g_hash_table_lookup (subscriptions, batch->dir);
+
+	off = sizeof (SandboxFsEventBatch) + batch->dirLen + 1;
+	for (i = 0; i < batch->count; i++) {
+		event = (const SandboxFsEvent *) (buffer + off);
+		if (off + sizeof (SandboxFsEvent) > (gsize) len) {
+			break;
+		}
+		need = sizeof (SandboxFsEvent) + event->nameLen + 1 + (event->fromLen ? event->fromLen + 1 : 0);
+		if (off + need > (gsize) len) {
+			break;
+		}
+
+		name = event->data;
+		from = event->fromLen ? event->data + event->nameLen + 1 : NULL;
+		if (name[event->nameLen] == '\0' && (from == NULL || from[event->fromLen] == '\0')) {
+			handle_event (sub, batch->dir, event, name, from);
+		}
+		off += need;
+	}
+}
+
+static void disconnect (void);
+static gboolean try_connect (void);
+
+static gboolean
+reconnect_cb (gpointer user_data)
+{
+	if (g_hash_table_size (subscriptions) == 0) {
+		reconnect_id = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	if (try_connect ()) {
+		/* Changes made while disconnected were missed */
+		reload_all ();
+		reconnect_id = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+events_ready_cb (GSocket *socket,
+		 GIOCondition condition,
+		 gpointer user_data)
+{
+	char buffer[SANDBOX_FS_EVENTS_PACKET_MAX];
+	GError *error;
+	gssize len;
+	gboolean lost;
+
+	lost = FALSE;
+	for (;;) {
+		error = NULL;
+		len = g_socket_receive (socket, buffer, sizeof (buffer), NULL, &error);
+		if (len > 0) {
+			handle_batch (buffer, len);
+			continue;
+		}
+
+		if (len < 0 && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+			g_error_free (error);
+			break;
+		}
+
+		DEBUG ("Sandbox monitor: connection lost: %s", error ? error->message : "closed");
+		g_clear_error (&error);
+		lost = TRUE;
+		break;
+	}
+
+	/* One round of the changes queue for everything read in this wakeup */
+	nemo_file_changes_consume_changes (TRUE);
+
+	if (lost) {
+		disconnect ();
+		if (reconnect_id == 0) {
+			reconnect_id = g_timeout_add_seconds (RECONNECT_INTERVAL_SECONDS, reconnect_cb, NULL);
+		}
+		return G_SOURCE_REMOVE;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+disconnect (void)
+{
+	if (events_source != NULL) {
+		g_source_destroy (events_source);
+		g_source_unref (events_source);
+		events_source = NULL;
+	}
+	g_clear_object (&events_socket);
+}
+
+static gboolean
+try_connect (void)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	GError *error;
+	int fd;
+
+	if (events_socket != NULL) {
+		return TRUE;
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	g_strlcpy (addr.sun_path, SANDBOX_FS_EVENTS_SOCKET, sizeof (addr.sun_path));
+	addr_len = sizeof (addr);
+
+	fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return FALSE;
+	}
+	if (connect (fd, (struct sockaddr *) &addr, addr_len) != 0) {
+		close (fd);
+		return FALSE;
+	}
+
+	error = NULL;
+	events_socket = g_socket_new_from_fd (fd, &error);
+	if (events_socket == NULL) {
+		DEBUG ("Sandbox monitor: %s", error->message);
+		g_error_free (error);
+		close (fd);
+		return FALSE;
+	}
+	g_socket_set_blocking (events_socket, FALSE);
+
+	events_source = g_socket_create_source (events_socket, G_IO_IN | G_IO_HUP | G_IO_ERR, NULL);
+	g_source_set_callback (events_source, (GSourceFunc) events_ready_cb, NULL, NULL);
+	g_source_attach (events_source, NULL);
+
+	DEBUG ("Sandbox monitor: connected");
+
+	return TRUE;
+}
+
+gboolean
+nemo_sandbox_monitor_subscribe (GFile *location)
+{
+	Subscription *sub;
+	char *path;
+
+	path = get_volume_path (location);
+	if (path == NULL) {
+		return FALSE;
+	}
+
+	if (subscriptions == NULL) {
+		subscriptions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, subscription_free);
+	}
+
+	if (!try_connect ()) {
+		g_free (path);
+		return FALSE;
+	}
+
+	sub = g_hash_table_lookup (subscriptions, path);
+	if (sub != NULL) {
+		sub->ref_count++;
+		g_free (path);
+		return TRUE;
+	}
+
+	sub = g_new0 (Subscription, 1);
+	sub->location = g_object_ref (location);
+	sub->ref_count = 1;
+	g_hash_table_insert (subscriptions, path, sub);
+
+	return TRUE;
+}
+
+void
+nemo_sandbox_monitor_unsubscribe (GFile *location)
+{
+	Subscription *sub;
+	char *path;
+
+	path = get_volume_path (location);
+	if (path == NULL || subscriptions == NULL) {
+		g_free (path);
+		return;
+	}
+
+	sub = g_hash_table_lookup (subscriptions, path);
+	if (sub != NULL && --sub->ref_count == 0) {
+		g_hash_table_remove (subscriptions, path);
+	}
+
+	if (g_hash_table_size (subscriptions) == 0) {
+		/* Nothing to watch, the daemon stops recording once nobody listens */
+		disconnect ();
+	}
+
+	g_free (path);
+}
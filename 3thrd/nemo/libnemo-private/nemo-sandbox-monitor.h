@@ -0,0 +1,34 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 8; tab-width: 8 -*-
+
+   nemo-sandbox-monitor.h: change notifications pushed by the sandbox volume
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with this program; if not, write to the
+   Free Software Foundation, Inc., 51 Franklin Street - Suite 500,
+   Boston, MA 02110-1335, USA.
+*/
+
+#ifndef NEMO_SANDBOX_MONITOR_H
+#define NEMO_SANDBOX_MONITOR_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/* Inotify is unreliable on the FUSE mount, so directories on the sandbox
+ * volume take their changes from the stream published by the FUSE daemon.
+ * Returns FALSE when the location is not on the volume or the daemon can't
+ * be reached, the caller then falls back to a GFileMonitor. */
+gboolean nemo_sandbox_monitor_subscribe   (GFile *location);
+void     nemo_sandbox_monitor_unsubscribe (GFile *location);
+
+#endif /* NEMO_SANDBOX_MONITOR_H */
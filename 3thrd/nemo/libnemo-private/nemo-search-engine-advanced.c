@@ -17,6 +17,8 @@
  *
  */
 
+#define _GNU_SOURCE /* memmem */
+
 #include "../config.h"
 #include "nemo-file.h"
 #include "nemo-directory.h"
@@ -24,12 +26,16 @@
 #include "nemo-search-engine-advanced.h"
 #include "nemo-global-preferences.h"
 
+#include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib.h>
 #include <gio/gio.h>
 
+#include "../../../app/fs/name-index.h"
+
 #define DEBUG_FLAG NEMO_DEBUG_SEARCH
 #include "nemo-debug.h"
 
@@ -38,6 +44,8 @@
 #define FILE_SEARCH_ONLY_BATCH_SIZE 500
 #define CONTENT_SEARCH_BATCH_SIZE 1
 #define SNIPPET_EXTEND_SIZE 100
+#define SEARCH_MAX_WORKERS 8
+#define SEARCH_IDLE_WAIT_USEC 2000
 
 typedef struct {
     gchar *exec_format;
@@ -72,9 +80,31 @@ typedef struct {
     gboolean file_case_sensitive;
     gboolean location_supports_content_search;
 
+    /* Literal (non-regex) content pattern, used to reject files with a
+     * plain byte scan before any copy, UTF-8 validation or regex work. */
+    gchar *literal;
+    gsize literal_len;
+    gboolean literal_caseless;
+
+    /* Parallel walk: one deque per worker, owners pop from the tail,
+     * idle workers steal from the head of the others. */
+    GQueue *worker_dirs;
+    GMutex *worker_locks;
+    gint n_workers;
+    gint pending_dirs;  /* queued + being visited, atomic */
+    gint n_idle;        /* atomic */
+    GMutex idle_lock;
+    GCond idle_cond;
+    GMutex visited_lock;
+
     GTimer *timer;
 } SearchThreadData;
 
+typedef struct {
+    SearchThreadData *data;
+    gint index;
+} SearchWorker;
+
 struct NemoSearchEngineAdvancedDetails {
 	NemoQuery *query;
 
@@ -376,6 +406,40 @@ strsplit_esc_n (const gchar *string,
 	return str_array;
 }
 
+/* Only enable the byte-level prefilter when it can never reject a file the
+ * regex would match:
+ *  - newline runs are collapsed before matching, so no newlines in the pattern
+ *  - invalid UTF-8 becomes U+FFFD before matching, so no U+FFFD in the pattern
+ *  - caseless: ASCII only, and no 'k'/'s' (U+212A KELVIN SIGN and U+017F LONG S
+ *    fold to them under Unicode caseless matching)
+ */
+static void
+setup_literal_prefilter (SearchThreadData *data,
+                         const gchar      *pattern,
+                         gboolean          caseless)
+{
+    gsize i, len = strlen (pattern);
+
+    if (len == 0 || strpbrk (pattern, "\n\r") != NULL || strstr (pattern, "\xef\xbf\xbd") != NULL) {
+        return;
+    }
+
+    if (caseless) {
+        for (i = 0; i < len; i++) {
+            guchar c = (guchar) pattern[i];
+            if (c >= 0x80 || g_ascii_tolower (c) == 'k' || g_ascii_tolower (c) == 's') {
+                return;
+            }
+        }
+        data->literal = g_ascii_strdown (pattern, len);
+    } else {
+        data->literal = g_strdup (pattern);
+    }
+
+    data->literal_len = len;
+    data->literal_caseless = caseless;
+}
+
 static SearchThreadData *
 search_thread_data_new (NemoSearchEngineAdvanced *engine,
 			NemoQuery *query)
@@ -470,6 +534,9 @@ search_thread_data_new (NemoSearchEngineAdvanced *engine,
     data->timer = g_timer_new ();
 
     g_mutex_init (&data->hit_list_lock);
+    g_mutex_init (&data->idle_lock);
+    g_cond_init (&data->idle_cond);
+    g_mutex_init (&data->visited_lock);
 
     gchar *content_pattern = nemo_query_get_content_pattern (query);
 
@@ -480,6 +547,7 @@ search_thread_data_new (NemoSearchEngineAdvanced *engine,
             escaped = g_strdup (content_pattern);
         } else {
             escaped = g_regex_escape_string (content_pattern, -1);
+            setup_literal_prefilter (data, content_pattern, !nemo_query_get_content_case_sensitive (query));
         }
 
         flags = G_REGEX_MULTILINE |
@@ -555,7 +623,11 @@ search_thread_data_free (SearchThreadData *data)
     g_clear_pointer (&data->match_re, g_regex_unref);
     g_clear_pointer (&data->newline_re, g_regex_unref);
     g_timer_destroy (data->timer);
+    g_free (data->literal);
     g_mutex_clear (&data->hit_list_lock);
+    g_mutex_clear (&data->idle_lock);
+    g_cond_clear (&data->idle_cond);
+    g_mutex_clear (&data->visited_lock);
 
     g_free (data);
 }
@@ -611,7 +683,7 @@ send_batch (SearchThreadData *data)
 	SearchHits *hits;
 
     g_mutex_lock (&data->hit_list_lock);
-	data->n_processed_files = 0;
+	g_atomic_int_set (&data->n_processed_files, 0);
 
 	if (data->hit_list) {
 		hits = g_new0 (SearchHits, 1);
@@ -830,6 +902,85 @@ load_contents (SearchThreadData *data,
     return g_string_free (str, FALSE);
 }
 
+/* Returns TRUE if the literal occurs in the buffer.  Case-sensitive search
+ * is glibc's memmem; the caseless one walks both cases of the first byte
+ * with memchr and confirms the rest in place. */
+static gboolean
+content_prefilter_match (SearchThreadData *data,
+                         const gchar      *hay,
+                         gsize             len)
+{
+    const gchar *end, *lo, *up, *p;
+    gchar first;
+
+    if (len < data->literal_len) {
+        return FALSE;
+    }
+
+    if (!data->literal_caseless) {
+        return memmem (hay, len, data->literal, data->literal_len) != NULL;
+    }
+
+    end = hay + len - data->literal_len + 1;
+    first = data->literal[0];
+    lo = memchr (hay, first, end - hay);
+    up = g_ascii_isalpha (first) ? memchr (hay, g_ascii_toupper (first), end - hay) : NULL;
+
+    while (lo != NULL || up != NULL) {
+        if (g_cancellable_is_cancelled (data->cancellable)) {
+            return FALSE;
+        }
+
+        p = (up == NULL || (lo != NULL && lo < up)) ? lo : up;
+        if (g_ascii_strncasecmp (p + 1, data->literal + 1, data->literal_len - 1) == 0) {
+            return TRUE;
+        }
+
+        if (p == lo) {
+            lo = memchr (p + 1, first, end - p - 1);
+        } else {
+            up = memchr (p + 1, g_ascii_toupper (first), end - p - 1);
+        }
+    }
+
+    return FALSE;
+}
+
+/* Local text files: map instead of copying through a GString in 4 KiB
+ * chunks, and reject non-matching files before UTF-8 validation. */
+static gchar *
+load_mapped_contents (SearchThreadData *data,
+                      GFile            *file,
+                      gboolean         *rejected,
+                      GError          **error)
+{
+    GMappedFile *mapped;
+    const gchar *contents;
+    gchar *utf8;
+    gsize len;
+
+    *rejected = FALSE;
+
+    mapped = g_mapped_file_new (g_file_peek_path (file), FALSE, error);
+    if (mapped == NULL) {
+        return NULL;
+    }
+
+    contents = g_mapped_file_get_contents (mapped);
+    len = g_mapped_file_get_length (mapped);
+
+    if (data->literal != NULL && (contents == NULL || !content_prefilter_match (data, contents, len))) {
+        *rejected = TRUE;
+        g_mapped_file_unref (mapped);
+        return NULL;
+    }
+
+    utf8 = g_utf8_make_valid (contents != NULL ? contents : "", contents != NULL ? (gssize) len : 0);
+    g_mapped_file_unref (mapped);
+
+    return utf8;
+}
+
 static void
 search_for_content_hits (SearchThreadData *data,
                          GFile            *file,
@@ -838,15 +989,25 @@ search_for_content_hits (SearchThreadData *data,
     GMatchInfo *match_info;
     GError *error;
     gchar *contents = NULL;
-    gchar *stripped, *utf8;
+    gchar *stripped, *utf8 = NULL;
 
     error = NULL;
 
-    contents = load_contents (data, file, helper, &error);
+    if (helper == NULL && g_file_peek_path (file) != NULL) {
+        gboolean rejected;
+
+        utf8 = load_mapped_contents (data, file, &rejected, &error);
+        if (rejected) {
+            return;
+        }
+    } else {
+        contents = load_contents (data, file, helper, &error);
+    }
 
     if (g_cancellable_is_cancelled (data->cancellable)) {
         g_clear_error (&error);
         g_free (contents);
+        g_free (utf8);
         return;
     }
 
@@ -856,11 +1017,14 @@ search_for_content_hits (SearchThreadData *data,
         g_free (uri);
         g_error_free (error);
         g_free (contents);
+        g_free (utf8);
         return;
     }
 
-    utf8 = g_utf8_make_valid (contents, -1);
-    g_free (contents);
+    if (utf8 == NULL) {
+        utf8 = g_utf8_make_valid (contents, -1);
+        g_free (contents);
+    }
 
     if (data->newline_re != NULL) {
         stripped = g_regex_replace_literal (data->newline_re, (const gchar *) utf8, -1, 0, "\n", 0, NULL);
@@ -961,16 +1125,230 @@ should_skip_child (SearchThreadData *data, GFileInfo *info, GFile *file, gboolea
     return TRUE;
 }
 
+/* Fast path for the common case: an ASCII display name is its own NFD form,
+ * and lowercasing it needs no allocation. */
+static gboolean
+file_name_matches (SearchThreadData *data, const char *display_name)
+{
+    gchar buf[256];
+    gchar *owned = NULL;
+    const gchar *cased = display_name;
+    gboolean hit;
+    gsize i;
+    int w;
+
+    for (i = 0; display_name[i] != 0 && !(display_name[i] & 0x80); i++);
+
+    if (display_name[i] == 0 && i < sizeof (buf)) {
+        if (!data->file_case_sensitive) {
+            for (i = 0; display_name[i] != 0; i++) {
+                buf[i] = g_ascii_tolower (display_name[i]);
+            }
+            buf[i] = 0;
+            cased = buf;
+        }
+    } else {
+        gchar *normalized = g_utf8_normalize (display_name, -1, G_NORMALIZE_NFD);
+
+        if (!data->file_case_sensitive) {
+            owned = g_utf8_strdown (normalized, -1);
+            g_free (normalized);
+        } else {
+            owned = normalized;
+        }
+        cased = owned;
+    }
+
+    hit = data->words_and;
+    for (w = 0; data->words[w] != NULL; w++) {
+        if (data->word_strstr[w]) {
+            if ((strstr (cased, data->words[w]) != NULL)^data->words_and) {
+                hit = !data->words_and;
+                break;
+            }
+        }
+        else if (strwildcardcmp (data->words[w], (char *) cased)^data->words_and) {
+            hit = !data->words_and;
+            break;
+        }
+    }
+
+    g_free (owned);
+
+    return hit;
+}
+
+static void
+add_hit (SearchThreadData *data, FileSearchResult *fsr)
+{
+    g_mutex_lock (&data->hit_list_lock);
+    data->hit_list = g_list_prepend (data->hit_list, fsr);
+    g_mutex_unlock (&data->hit_list_lock);
+}
+
+static void
+name_index_hit (SearchThreadData *data, GFile *location, const gchar *rel)
+{
+    const gchar *leaf, *p, *end;
+    GFile *child;
+
+    leaf = strrchr (rel, '/');
+    leaf = leaf ? leaf + 1 : rel;
+
+    /* What the walk would not have descended into: hidden directories and
+     * skip entries matched by basename or by absolute prefix. */
+    for (p = rel; p != NULL; p = end ? end + 1 : NULL) {
+        g_autofree gchar *component = NULL;
+
+        end = strchr (p, '/');
+
+        if (!data->show_hidden && *p == '.') {
+            goto count;
+        }
+        if (end == NULL || g_hash_table_size (data->skip_folders) == 0) {
+            continue;
+        }
+        component = g_strndup (p, end - p);
+        if (g_hash_table_contains (data->skip_folders, component)) {
+            goto count;
+        }
+    }
+
+    if (!file_name_matches (data, leaf)) {
+        goto count;
+    }
+
+    child = g_file_resolve_relative_path (location, rel);
+    if (leaf != rel && g_hash_table_size (data->skip_folders) > 0) {
+        g_autofree gchar *parent = g_path_get_dirname (g_file_peek_path (child));
+
+        if (g_hash_table_find (data->skip_folders, hash_func_check_skip_file, parent)) {
+            g_object_unref (child);
+            goto count;
+        }
+    }
+
+    add_hit (data, file_search_result_new (g_file_get_uri (child), NULL));
+    g_object_unref (child);
+
+count:
+    if (g_atomic_int_add (&data->n_processed_files, 1) >= FILE_SEARCH_ONLY_BATCH_SIZE) {
+        send_batch (data);
+    }
+}
+
+/* On the sandbox volume the FUSE daemon keeps a filename index built from
+ * $MFT. A plain recursive filename search asks it for candidates under
+ * @location instead of walking; each one is still checked with
+ * file_name_matches (). Returns FALSE when @location is not on that volume
+ * or the index is not ready yet, and the caller walks as before. */
+static gboolean
+search_name_index (SearchThreadData *data, GFile *location)
+{
+    SandboxFsNameQuery *req;
+    const gchar *word = NULL;
+    const gchar *path;
+    gboolean first = TRUE;
+    gint fd, w;
+
+    if (data->match_re || !data->recurse || !data->words_and) {
+        return FALSE;
+    }
+
+    /* Every word must match, the longest one has the shortest candidate list */
+    for (w = 0; data->words[w] != NULL; w++) {
+        if (word == NULL || strlen (data->words[w]) > strlen (word)) {
+            word = data->words[w];
+        }
+    }
+
+    path = g_file_peek_path (location);
+    if (word == NULL || *word == 0 || path == NULL) {
+        return FALSE;
+    }
+
+    fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    req = g_new0 (SandboxFsNameQuery, 1);
+    g_strlcpy (req->pattern, word, sizeof (req->pattern));
+
+    do {
+        const gchar *rel = req->results;
+        guint32 i;
+
+        if (ioctl (fd, SANDBOX_FS_IOC_NAME_QUERY, req) != 0) {
+            DEBUG ("Name index query failed: %s", g_strerror (errno));
+            break;
+        }
+        first = FALSE;
+
+        for (i = 0; i < req->count; i++) {
+            name_index_hit (data, location, rel);
+            rel += strlen (rel) + 1;
+        }
+    } while ((req->flags & SANDBOX_FS_NAME_QUERY_MORE) && !g_cancellable_is_cancelled (data->cancellable));
+
+    g_free (req);
+    close (fd);
+
+    if (!first) {
+        DEBUG ("Searched '%s' with the name index", word);
+    }
+
+    return !first;
+}
+
+/* Takes ownership of @dir. */
 static void
-visit_directory (GFile *dir, SearchThreadData *data)
+queue_directory (SearchThreadData *data, gint worker, GFile *dir)
+{
+    g_atomic_int_inc (&data->pending_dirs);
+
+    g_mutex_lock (&data->worker_locks[worker]);
+    g_queue_push_tail (&data->worker_dirs[worker], dir);
+    g_mutex_unlock (&data->worker_locks[worker]);
+
+    if (g_atomic_int_get (&data->n_idle) > 0) {
+        g_mutex_lock (&data->idle_lock);
+        g_cond_signal (&data->idle_cond);
+        g_mutex_unlock (&data->idle_lock);
+    }
+}
+
+/* Own deque from the tail (depth first, warm dentries), others from the
+ * head (the oldest entries are the largest unexplored subtrees). */
+static GFile *
+take_directory (SearchThreadData *data, gint worker)
+{
+    GFile *dir;
+    gint i;
+
+    g_mutex_lock (&data->worker_locks[worker]);
+    dir = g_queue_pop_tail (&data->worker_dirs[worker]);
+    g_mutex_unlock (&data->worker_locks[worker]);
+
+    for (i = 1; dir == NULL && i < data->n_workers; i++) {
+        gint victim = (worker + i) % data->n_workers;
+
+        g_mutex_lock (&data->worker_locks[victim]);
+        dir = g_queue_pop_head (&data->worker_dirs[victim]);
+        g_mutex_unlock (&data->worker_locks[victim]);
+    }
+
+    return dir;
+}
+
+static void
+visit_directory (GFile *dir, SearchThreadData *data, gint worker)
 {
 	GFileEnumerator *enumerator;
 	GFileInfo *info;
     GFile *child;
 	const char *display_name;
-	char *cased, *normalized;
-	gboolean hit, is_dir, skip_child;
-	int i;
+	gboolean hit, is_dir, skip_child, want_dir;
 
     const gchar *attrs;
 
@@ -997,33 +1375,17 @@ visit_directory (GFile *dir, SearchThreadData *data)
 			goto next;
 		}
 
-		normalized = g_utf8_normalize (display_name, -1, G_NORMALIZE_NFD);
+		hit = file_name_matches (data, display_name);
+        is_dir = g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY;
+        want_dir = is_dir && data->recurse;
 
-        if (!data->file_case_sensitive) {
-            cased = g_utf8_strdown (normalized, -1);
-        } else {
-            cased = g_strdup (normalized);
+        /* Nothing to report and nothing to descend into: skip the child
+         * GFile and the realpath() of the skip check. */
+        if (!hit && !want_dir) {
+            goto count;
         }
 
-		g_free (normalized);
-
-		hit = data->words_and;
-		for (i = 0; data->words[i] != NULL; i++) {
-			if (data->word_strstr[i]) {
-				if ((strstr (cased, data->words[i]) != NULL)^data->words_and) {
-					hit = !data->words_and;
-					break;
-				}
-			}
-			else if (strwildcardcmp (data->words[i], cased)^data->words_and) {
-				hit = !data->words_and;
-				break;
-			}
-		}
-		g_free (cased);
-
         child = g_file_get_child (dir, g_file_info_get_name (info));
-        is_dir = g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY;
 
         /* Long explanation, to preserve intent in the future ...
          *
@@ -1052,7 +1414,8 @@ visit_directory (GFile *dir, SearchThreadData *data)
          * Entering 'ccc':
          * - recursive filename search for 'aaa' finds 'aaachild' (a skip entry is ignored if we're in that directory or one of its descendants.)
          */
-        skip_child = should_skip_child (data, info, child, is_dir);
+        skip_child = (want_dir || (hit && data->match_re && data->location_supports_content_search))
+                     ? should_skip_child (data, info, child, is_dir) : FALSE;
 
         if (hit) {
             const gchar *mime_type;
@@ -1080,43 +1443,38 @@ visit_directory (GFile *dir, SearchThreadData *data)
                     }
                 }
             } else {
-                FileSearchResult *fsr = NULL;
-
-                fsr = file_search_result_new (g_file_get_uri (child), NULL);
-                g_mutex_lock (&data->hit_list_lock);
-                data->hit_list = g_list_prepend (data->hit_list, fsr);
-                g_mutex_unlock (&data->hit_list_lock);
+                add_hit (data, file_search_result_new (g_file_get_uri (child), NULL));
             }
         }
 
-		data->n_processed_files++;
-
-        if (data->n_processed_files > (data->match_re ? CONTENT_SEARCH_BATCH_SIZE :
-                                                        FILE_SEARCH_ONLY_BATCH_SIZE)) {
-            send_batch (data);
-        }
-
-		if (is_dir && data->recurse && !skip_child) {
+		if (want_dir && !skip_child) {
             gboolean visited;
             const char *id;
 
 			id = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILE);
 			visited = FALSE;
 			if (id) {
+                g_mutex_lock (&data->visited_lock);
 				if (g_hash_table_lookup_extended (data->visited,
 								  id, NULL, NULL)) {
 					visited = TRUE;
 				} else {
 					g_hash_table_insert (data->visited, g_strdup (id), NULL);
 				}
+                g_mutex_unlock (&data->visited_lock);
 			}
 
 			if (!visited) {
-				g_queue_push_tail (data->directories, g_object_ref (child));
+				queue_directory (data, worker, g_object_ref (child));
 			}
 		}
 
 		g_object_unref (child);
+	count:
+        if (g_atomic_int_add (&data->n_processed_files, 1) >= (data->match_re ? CONTENT_SEARCH_BATCH_SIZE :
+                                                                               FILE_SEARCH_ONLY_BATCH_SIZE)) {
+            send_batch (data);
+        }
 	next:
 		g_object_unref (info);
 	}
@@ -1124,16 +1482,63 @@ visit_directory (GFile *dir, SearchThreadData *data)
 	g_object_unref (enumerator);
 }
 
+static gpointer
+search_worker_func (gpointer user_data)
+{
+    SearchWorker *worker = user_data;
+    SearchThreadData *data = worker->data;
+    GFile *dir;
+
+    while (!g_cancellable_is_cancelled (data->cancellable)) {
+        dir = take_directory (data, worker->index);
+
+        if (dir != NULL) {
+            visit_directory (dir, data, worker->index);
+            g_object_unref (dir);
+
+            if (g_atomic_int_dec_and_test (&data->pending_dirs)) {
+                g_mutex_lock (&data->idle_lock);
+                g_cond_broadcast (&data->idle_cond);
+                g_mutex_unlock (&data->idle_lock);
+            }
+            continue;
+        }
+
+        /* Nothing to steal: done when no directory is queued or being
+         * visited anywhere, otherwise wait for one to be queued. */
+        g_mutex_lock (&data->idle_lock);
+        if (g_atomic_int_get (&data->pending_dirs) == 0) {
+            g_mutex_unlock (&data->idle_lock);
+            break;
+        }
+        g_atomic_int_inc (&data->n_idle);
+        g_cond_wait_until (&data->idle_cond, &data->idle_lock,
+                           g_get_monotonic_time () + SEARCH_IDLE_WAIT_USEC);
+        g_atomic_int_add (&data->n_idle, -1);
+        g_mutex_unlock (&data->idle_lock);
+    }
+
+    return NULL;
+}
 
 static gpointer
 search_thread_func (gpointer user_data)
 {
 	SearchThreadData *data;
+	SearchWorker *workers;
+	GThread **threads;
 	GFile *dir;
 	GFileInfo *info;
 	const char *id;
+	gint i;
 	data = user_data;
 
+	if (search_name_index (data, g_queue_peek_head (data->directories))) {
+		send_batch (data);
+		g_idle_add (search_thread_done_idle, data);
+		return NULL;
+	}
+
 	/* Insert id for toplevel directory into visited */
 	dir = g_queue_peek_head (data->directories);
 	info = g_file_query_info (dir, G_FILE_ATTRIBUTE_ID_FILE, 0, data->cancellable, NULL);
@@ -1145,12 +1550,45 @@ search_thread_func (gpointer user_data)
 		g_object_unref (info);
 	}
 
-    while (!g_cancellable_is_cancelled (data->cancellable) &&
-           (dir = g_queue_pop_head (data->directories)) != NULL) {
+    /* A single directory needs no helpers; the rest only pay off when recursing. */
+    data->n_workers = data->recurse ? CLAMP ((gint) g_get_num_processors (), 1, SEARCH_MAX_WORKERS) : 1;
+    data->worker_dirs = g_new0 (GQueue, data->n_workers);
+    data->worker_locks = g_new0 (GMutex, data->n_workers);
+    for (i = 0; i < data->n_workers; i++) {
+        g_queue_init (&data->worker_dirs[i]);
+        g_mutex_init (&data->worker_locks[i]);
+    }
+
+    while ((dir = g_queue_pop_head (data->directories)) != NULL) {
+        queue_directory (data, 0, dir);
+    }
+
+    workers = g_new0 (SearchWorker, data->n_workers);
+    threads = g_new0 (GThread *, data->n_workers);
+    for (i = 0; i < data->n_workers; i++) {
+        workers[i].data = data;
+        workers[i].index = i;
+        if (i > 0) {
+            threads[i] = g_thread_new ("nemo-search-worker", search_worker_func, &workers[i]);
+        }
+    }
+
+    search_worker_func (&workers[0]);
+
+    for (i = 1; i < data->n_workers; i++) {
+        g_thread_join (threads[i]);
+    }
+
+    /* Left over when cancelled */
+    for (i = 0; i < data->n_workers; i++) {
+        g_queue_clear_full (&data->worker_dirs[i], g_object_unref);
+        g_mutex_clear (&data->worker_locks[i]);
+    }
+    g_clear_pointer (&data->worker_dirs, g_free);
+    g_clear_pointer (&data->worker_locks, g_free);
+    g_free (workers);
+    g_free (threads);
 
-		visit_directory (dir, data);
-		g_object_unref (dir);
-	}
 	send_batch (data);
 
 	g_idle_add (search_thread_done_idle, data);
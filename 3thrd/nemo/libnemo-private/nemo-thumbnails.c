@@ -63,6 +63,21 @@
 #define NEMO_THUMBNAIL_FRAME_RIGHT 3
 #define NEMO_THUMBNAIL_FRAME_BOTTOM 3
 
+/* Upper bound of thumbnails waiting for a worker. Past it the oldest one
+ * outside the viewport is dropped, reading a source through FUSE and the
+ * cipher is too slow to let a scrolled-through folder pile up. */
+#define NEMO_THUMBNAIL_MAX_QUEUED 256
+
+/* A queued thumbnail not prioritized again for this many viewport passes
+ * has been scrolled away. */
+#define NEMO_THUMBNAIL_SCROLL_AWAY_PASSES 2
+
+/* Commands the feeder applies under a single lock */
+#define NEMO_THUMBNAIL_FEEDER_BATCH 64
+
+/* Decoded thumbnails kept in memory by NemoFiles */
+#define NEMO_THUMBNAIL_CACHE_MAX_BYTES (64 * 1024 * 1024)
+
 
 typedef enum {
     THUMBNAIL_ADD,
@@ -77,6 +92,8 @@ typedef struct {
     char *mime_type;
     time_t original_file_mtime;
     gint64 add_time;
+    gint viewport_gen;
+    GList *queue_link;
     ThumbnailCommandType cmd_type;
     guint cancelled : 1;
 } NemoThumbnailInfo;
@@ -101,6 +118,12 @@ typedef struct {
  * - nemo_thumbnail_prioritize (THUMBNAIL_BUMP): The info is looked up by uri in thumbnails_to_make_hash. If found,
  *   it gets moved to the front of the threadpool queue.
  *
+ * - Every info carries the viewport pass it was last added or prioritized in. nemo_thumbnail_viewport_changed
+ *   starts a new pass. Infos of the current pass sort ahead of the rest; an info that misses
+ *   NEMO_THUMBNAIL_SCROLL_AWAY_PASSES passes is dropped when it reaches a worker, and past
+ *   NEMO_THUMBNAIL_MAX_QUEUED the oldest info outside the viewport is dropped on add. A dropped file
+ *   is no longer marked thumbnailing, so it is requested again when its icon is drawn.
+ *
  *
  * - No mutex locking occurs in the public methods, only in the feeder and threadpool threads.
  * - NemoThumbnailInfos are garbage-collected in the threadpool worker only.
@@ -120,6 +143,21 @@ static GTask *feeder_task = NULL;
 /* Causes the feeder_task to end. Only called when Nemo is shutting down. */
 GCancellable *cancellable = NULL;
 
+/* Infos in thumbnails_to_make_hash, oldest first (under thumbnails_mutex) */
+static GQueue queued_infos = G_QUEUE_INIT;
+
+/* Bumped by the views for each pass over their visible items */
+static gint viewport_generation = 1;
+
+/* Counters, under thumbnails_mutex */
+static NemoThumbnailStats stats;
+static gint64 stats_start_time = 0;
+
+/* Decoded thumbnails, least recently used first. Main loop only. */
+static GQueue thumbnail_cache = G_QUEUE_INIT;
+static gsize thumbnail_cache_bytes = 0;
+static guint64 thumbnail_cache_evicted = 0;
+
 // static GnomeDesktopThumbnailFactory *thumbnail_factory = NULL;
 
 static gint
@@ -154,15 +192,23 @@ get_max_threads (void) {
     return max_threads;
 }
 
+/* Current viewport first, then last in first out */
 static gint
-lifo_sorter (gconstpointer a,
-             gconstpointer b,
-             gpointer      data)
+priority_sorter (gconstpointer a,
+                 gconstpointer b,
+                 gpointer      data)
 {
-    gint64 ta = ((const NemoThumbnailInfo *) a)->add_time;
-    gint64 tb = ((const NemoThumbnailInfo *) b)->add_time;
+    const NemoThumbnailInfo *ia = a;
+    const NemoThumbnailInfo *ib = b;
+    gint gen = g_atomic_int_get (&viewport_generation);
+    gboolean va = ia->viewport_gen == gen;
+    gboolean vb = ib->viewport_gen == gen;
+
+    if (va != vb) {
+        return va ? -1 : +1;
+    }
 
-    return tb > ta ? +1 : ta == tb ? 0 : -1;
+    return ib->add_time > ia->add_time ? +1 : ia->add_time == ib->add_time ? 0 : -1;
 }
 
 static gboolean
@@ -299,12 +345,81 @@ thumbnail_thread_notify_file_changed (gpointer image_uri)
     return G_SOURCE_REMOVE;
 }
 
+/* Mainloop: a dropped file is requested again the next time its icon is drawn. */
+static gboolean
+thumbnail_thread_notify_dropped (gpointer image_uri)
+{
+    NemoFile *file;
+
+    file = nemo_file_get_existing_by_uri ((char *) image_uri);
+
+    if (file != NULL) {
+        nemo_file_set_is_thumbnailing (file, FALSE);
+        nemo_file_unref (file);
+    }
+
+    g_free (image_uri);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* thumbnails_mutex held. A newer info for the same uri may already be queued. */
+static void
+unqueue_info_locked (NemoThumbnailInfo *info)
+{
+    if (g_hash_table_lookup (thumbnails_to_make_hash, info->image_uri) == info) {
+        g_hash_table_remove (thumbnails_to_make_hash, info->image_uri);
+    }
+
+    if (info->queue_link != NULL) {
+        g_queue_delete_link (&queued_infos, info->queue_link);
+        info->queue_link = NULL;
+    }
+}
+
+/* thumbnails_mutex held. The worker frees the info when it comes up. */
+static void
+drop_info_locked (NemoThumbnailInfo *info)
+{
+    unqueue_info_locked (info);
+    info->cancelled = TRUE;
+    stats.cancelled++;
+
+    g_idle_add (thumbnail_thread_notify_dropped, g_strdup (info->image_uri));
+}
+
+/* thumbnails_mutex held */
+static void
+drop_oldest_outside_viewport_locked (void)
+{
+    gint gen = g_atomic_int_get (&viewport_generation);
+    GList *l;
+
+    for (l = queued_infos.head; l != NULL; l = l->next) {
+        NemoThumbnailInfo *info = l->data;
+
+        /* The current pass and the one before it are still on screen */
+        if (gen - info->viewport_gen > 1) {
+            DEBUG ("(Feeder) Queue full, dropping: %s", info->image_uri);
+            drop_info_locked (info);
+            return;
+        }
+    }
+}
+
 /* Always on thumbnail thread */
 static void
-remove_from_hash_table (NemoThumbnailInfo *info)
+remove_from_hash_table (NemoThumbnailInfo *info, gboolean made)
 {
     g_mutex_lock (&thumbnails_mutex);
-    g_hash_table_remove (thumbnails_to_make_hash, info->image_uri);
+    unqueue_info_locked (info);
+    if (made) {
+        stats.made++;
+        if (stats.made % 100 == 0) {
+            DEBUG ("(Thumbnail Thread) %" G_GUINT64_FORMAT " made, %u queued, %" G_GUINT64_FORMAT " cancelled",
+                   stats.made, g_hash_table_size (thumbnails_to_make_hash), stats.cancelled);
+        }
+    }
     g_mutex_unlock (&thumbnails_mutex);
 
     free_thumbnail_info (info);
@@ -319,9 +434,19 @@ static void thumbnail_thread (gpointer data, gpointer user_data)
     gchar *image_uri = info->image_uri;
     gboolean free_uri = FALSE;
 
+    if (!info->cancelled &&
+        g_atomic_int_get (&viewport_generation) - info->viewport_gen > NEMO_THUMBNAIL_SCROLL_AWAY_PASSES) {
+        DEBUG ("Dropping scrolled away file: %s", info->image_uri);
+        g_mutex_lock (&thumbnails_mutex);
+        if (!info->cancelled) {
+            drop_info_locked (info);
+        }
+        g_mutex_unlock (&thumbnails_mutex);
+    }
+
     if (g_cancellable_is_cancelled (cancellable) || info->cancelled) {
         DEBUG ("Skipping cancelled file: %s", info->image_uri);
-        remove_from_hash_table (info);
+        remove_from_hash_table (info, FALSE);
         return;
     }
 
@@ -335,7 +460,7 @@ static void thumbnail_thread (gpointer data, gpointer user_data)
 
         /* Reschedule thumbnailing via a change notification */
         g_timeout_add_seconds (RECENT_MTIME_COOLDOWN, thumbnail_thread_notify_file_changed, g_strdup (info->image_uri));
-        remove_from_hash_table (info);
+        remove_from_hash_table (info, FALSE);
         return;
     }
 
@@ -391,7 +516,7 @@ static void thumbnail_thread (gpointer data, gpointer user_data)
                g_thread_pool_unprocessed ((GThreadPool *) tpool),
                g_thread_pool_get_num_unused_threads ());
 #endif
-    remove_from_hash_table (info);
+    remove_from_hash_table (info, TRUE);
 }
 
 /* Mainloop */
@@ -404,6 +529,71 @@ feeder_task_complete (GObject      *source,
     DEBUG ("(Finalize) Feeder task done");
 }
 
+/* Feeder thread, thumbnails_mutex held. Returns TRUE when the info was queued and must not be freed. */
+static gboolean
+feeder_handle_command_locked (NemoThumbnailInfo *feeder_info)
+{
+    NemoThumbnailInfo *existing_info = NULL;
+
+    switch (feeder_info->cmd_type) {
+        case THUMBNAIL_ADD:
+            existing_info = g_hash_table_lookup (thumbnails_to_make_hash, feeder_info->image_uri);
+
+            if (existing_info == NULL) {
+                DEBUG ("(Main Thread) Adding new file to thumbnail: %s", feeder_info->image_uri);
+#if DEBUG_THREADS
+                g_message ("%u unprocessed (Add)", g_thread_pool_unprocessed ((GThreadPool *) tpool));
+#endif
+                if (g_hash_table_size (thumbnails_to_make_hash) >= NEMO_THUMBNAIL_MAX_QUEUED) {
+                    drop_oldest_outside_viewport_locked ();
+                }
+
+                g_hash_table_insert (thumbnails_to_make_hash, feeder_info->image_uri, feeder_info);
+                g_queue_push_tail (&queued_infos, feeder_info);
+                feeder_info->queue_link = queued_infos.tail;
+                stats.requested++;
+                g_thread_pool_push ((GThreadPool *) tpool, feeder_info, NULL);
+
+                return TRUE;
+            }
+
+            DEBUG ("(Main Thread) Updating existing file mtime and prioritizing: %s", feeder_info->image_uri);
+
+            /* The file in the queue might need a new original mtime */
+            existing_info->original_file_mtime = feeder_info->original_file_mtime;
+            existing_info->add_time = g_get_monotonic_time ();
+            existing_info->viewport_gen = feeder_info->viewport_gen;
+            g_thread_pool_move_to_front ((GThreadPool *) tpool, existing_info);
+            break;
+        case THUMBNAIL_REMOVE:
+            existing_info = g_hash_table_lookup (thumbnails_to_make_hash, feeder_info->image_uri);
+
+            if (existing_info) {
+                DEBUG ("(Remove from queue) Removing %s", feeder_info->image_uri);
+                unqueue_info_locked (existing_info);
+                existing_info->cancelled = TRUE;
+                stats.cancelled++;
+            }
+            break;
+        case THUMBNAIL_BUMP:
+            existing_info = g_hash_table_lookup (thumbnails_to_make_hash, feeder_info->image_uri);
+
+            if (existing_info) {
+                DEBUG ("(Prioritize) Moving to front: %s", feeder_info->image_uri);
+                existing_info->add_time = g_get_monotonic_time ();
+                existing_info->viewport_gen = feeder_info->viewport_gen;
+                g_thread_pool_move_to_front ((GThreadPool *) tpool, existing_info);
+            }
+            break;
+        case THUMBNAIL_THREAD_EXIT:
+            DEBUG ("(Finalize) Received THUMBNAIL_THREAD_EXIT, cancelling");
+            g_cancellable_cancel (cancellable);
+            break;
+    }
+
+    return FALSE;
+}
+
 /* Feeder thread */
 static void
 feeder_thread (GTask        *task,
@@ -411,82 +601,33 @@ feeder_thread (GTask        *task,
                 gpointer      task_data,
                 GCancellable *cancellable)
 {
+    NemoThumbnailInfo *batch[NEMO_THUMBNAIL_FEEDER_BATCH];
     gpointer data;
+    gint n, i;
 
     while (!g_cancellable_is_cancelled (cancellable) && (data = g_async_queue_pop (feeder_queue))) {
+        /* Scrolling sends a burst of adds and bumps, take them under one lock */
+        n = 0;
+        batch[n++] = data;
+        while (n < NEMO_THUMBNAIL_FEEDER_BATCH && (data = g_async_queue_try_pop (feeder_queue))) {
+            batch[n++] = data;
+        }
 
 #if DEBUG_THREADS
-    g_message ("Pop from feeder (Add) %i items in feeder", g_async_queue_length (feeder_queue));
+        g_message ("Pop %d from feeder, %i items in feeder", n, g_async_queue_length (feeder_queue));
 #endif
-        NemoThumbnailInfo *feeder_info = (NemoThumbnailInfo *) data;
-        NemoThumbnailInfo *existing_info = NULL;
-
-        switch (feeder_info->cmd_type) {
-            case THUMBNAIL_ADD:
-                DEBUG ("(Add thumbnail) Locking mutex");
-                g_mutex_lock (&thumbnails_mutex);
-                existing_info = g_hash_table_lookup (thumbnails_to_make_hash, feeder_info->image_uri);
 
-                if (existing_info == NULL) {
-                    DEBUG ("(Main Thread) Adding new file to thumbnail: %s", feeder_info->image_uri);
-#if DEBUG_THREADS
-                    g_message ("%u unprocessed (Add)", g_thread_pool_unprocessed ((GThreadPool *) tpool));
-#endif
-                    g_hash_table_insert (thumbnails_to_make_hash, feeder_info->image_uri, feeder_info);
-                    g_thread_pool_push ((GThreadPool *) tpool, feeder_info, NULL);
-
-                    // Don't free this later.
-                    feeder_info = NULL;
-                } else {
-                    DEBUG ("(Main Thread) Updating existing file mtime and prioritizing: %s", feeder_info->image_uri);
-
-                    /* The file in the queue might need a new original mtime */
-                    existing_info->original_file_mtime = feeder_info->original_file_mtime;
-                    existing_info->add_time = g_get_monotonic_time ();
-                    g_thread_pool_move_to_front ((GThreadPool *) tpool, existing_info);
-                }
-                DEBUG ("(Add thumbnail) Unlocking mutex");
-                g_mutex_unlock (&thumbnails_mutex);
-                break;
-            case THUMBNAIL_REMOVE:
-                if (!thumbnails_to_make_hash)
-                    break;
-
-                DEBUG ("(Remove from queue) Locking mutex");
-                g_mutex_lock (&thumbnails_mutex);
-                existing_info = g_hash_table_lookup (thumbnails_to_make_hash, feeder_info->image_uri);
-
-                if (existing_info) {
-                    DEBUG ("(Remove from queue) Removing %s", feeder_info->image_uri);
-                    g_hash_table_remove (thumbnails_to_make_hash, feeder_info->image_uri);
-                    existing_info->cancelled = TRUE;
-                }
-                DEBUG ("(Remove from queue) Unlocking mutex");
-                g_mutex_unlock (&thumbnails_mutex);
-                break;
-            case THUMBNAIL_BUMP:
-                if (!thumbnails_to_make_hash)
-                    break;
-
-                DEBUG ("(Prioritize) Locking mutex");
-                g_mutex_lock (&thumbnails_mutex);
-                existing_info = g_hash_table_lookup (thumbnails_to_make_hash, feeder_info->image_uri);
-
-                if (existing_info) {
-                    DEBUG ("(Prioritize) Moving to front: %s", feeder_info->image_uri);
-                    existing_info->add_time = g_get_monotonic_time ();
-                    g_thread_pool_move_to_front ((GThreadPool *) tpool, existing_info);
-                }
-                DEBUG ("(Prioritize) Unlocking mutex");
-                g_mutex_unlock (&thumbnails_mutex);
-                break;
-            case THUMBNAIL_THREAD_EXIT:
-                DEBUG ("(Finalize) Received THUMBNAIL_THREAD_EXIT, cancelling");
-                g_cancellable_cancel (cancellable);
-                break;
+        g_mutex_lock (&thumbnails_mutex);
+        for (i = 0; i < n; i++) {
+            if (feeder_handle_command_locked (batch[i])) {
+                batch[i] = NULL;
+            }
         }
+        g_mutex_unlock (&thumbnails_mutex);
 
-        g_clear_pointer (&feeder_info, free_thumbnail_info);
+        for (i = 0; i < n; i++) {
+            g_clear_pointer (&batch[i], free_thumbnail_info);
+        }
     }
 
     g_task_return_boolean (task, TRUE);
@@ -542,7 +683,8 @@ nemo_create_thumbnail (NemoFile *file)
         tpool = g_thread_pool_new ((GFunc) thumbnail_thread, NULL,
                                    get_max_threads (),
                                    FALSE, NULL);
-        g_thread_pool_set_sort_function ((GThreadPool *) tpool, (GCompareDataFunc) lifo_sorter, NULL);
+        g_thread_pool_set_sort_function ((GThreadPool *) tpool, (GCompareDataFunc) priority_sorter, NULL);
+        stats_start_time = g_get_monotonic_time ();
 
         feeder_queue = g_async_queue_new ();
         cancellable = g_cancellable_new ();
@@ -590,6 +732,7 @@ nemo_create_thumbnail (NemoFile *file)
     info->mime_type = nemo_file_get_mime_type (file);
     info->original_file_mtime = file_mtime;
     info->add_time = g_get_monotonic_time ();
+    info->viewport_gen = g_atomic_int_get (&viewport_generation);
     info->cmd_type = THUMBNAIL_ADD;
 
     nemo_file_set_is_thumbnailing (file, TRUE);
@@ -632,6 +775,7 @@ nemo_thumbnail_prioritize (const char *file_uri)
 
     info = g_new0 (NemoThumbnailInfo, 1);
     info->image_uri = g_strdup (file_uri);
+    info->viewport_gen = g_atomic_int_get (&viewport_generation);
     info->cmd_type = THUMBNAIL_BUMP;
 
 #if DEBUG_THREADS
@@ -641,6 +785,98 @@ nemo_thumbnail_prioritize (const char *file_uri)
     g_async_queue_push (feeder_queue, info);
 }
 
+/* Mainloop */
+void
+nemo_thumbnail_viewport_changed (void)
+{
+    g_atomic_int_inc (&viewport_generation);
+}
+
+void
+nemo_thumbnail_get_stats (NemoThumbnailStats *out)
+{
+    gint64 elapsed;
+
+    g_mutex_lock (&thumbnails_mutex);
+    *out = stats;
+    out->queued = thumbnails_to_make_hash ? g_hash_table_size (thumbnails_to_make_hash) : 0;
+    g_mutex_unlock (&thumbnails_mutex);
+
+    out->feeder = feeder_queue ? MAX (g_async_queue_length (feeder_queue), 0) : 0;
+    out->cache_bytes = thumbnail_cache_bytes;
+    out->evicted = thumbnail_cache_evicted;
+
+    elapsed = stats_start_time ? g_get_monotonic_time () - stats_start_time : 0;
+    out->made_per_sec = elapsed > 0 ? out->made * (gdouble) G_USEC_PER_SEC / elapsed : 0;
+}
+
+/* Mainloop */
+static gboolean
+thumbnail_cache_reload_idle (gpointer user_data)
+{
+    NemoFile *file = user_data;
+
+    nemo_file_invalidate_attributes (file, NEMO_FILE_ATTRIBUTE_THUMBNAIL);
+    nemo_file_unref (file);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Evicted thumbnails keep thumbnail_is_up_to_date, so the directory does not
+ * reload every one of them; the one being drawn again is reloaded here. */
+void
+nemo_thumbnail_cache_touch (NemoFile *file)
+{
+    if (file->details->thumbnail_evicted) {
+        file->details->thumbnail_evicted = FALSE;
+        g_idle_add (thumbnail_cache_reload_idle, nemo_file_ref (file));
+        return;
+    }
+
+    if (file->details->thumbnail_cache_link != NULL) {
+        g_queue_unlink (&thumbnail_cache, file->details->thumbnail_cache_link);
+        g_queue_push_tail_link (&thumbnail_cache, file->details->thumbnail_cache_link);
+    }
+}
+
+void
+nemo_thumbnail_cache_forget (NemoFile *file)
+{
+    if (file->details->thumbnail_cache_link != NULL) {
+        g_queue_delete_link (&thumbnail_cache, file->details->thumbnail_cache_link);
+        file->details->thumbnail_cache_link = NULL;
+        thumbnail_cache_bytes -= file->details->thumbnail_cache_bytes;
+        file->details->thumbnail_cache_bytes = 0;
+    }
+    file->details->thumbnail_evicted = FALSE;
+}
+
+/* Call after setting file->details->thumbnail */
+void
+nemo_thumbnail_cache_add (NemoFile *file)
+{
+    GdkPixbuf *pixbuf = file->details->thumbnail;
+
+    nemo_thumbnail_cache_forget (file);
+    if (pixbuf == NULL) {
+        return;
+    }
+
+    file->details->thumbnail_cache_bytes = (gsize) gdk_pixbuf_get_rowstride (pixbuf) * gdk_pixbuf_get_height (pixbuf);
+    thumbnail_cache_bytes += file->details->thumbnail_cache_bytes;
+    g_queue_push_tail (&thumbnail_cache, file);
+    file->details->thumbnail_cache_link = thumbnail_cache.tail;
+
+    while (thumbnail_cache_bytes > NEMO_THUMBNAIL_CACHE_MAX_BYTES && thumbnail_cache.head->data != file) {
+        NemoFile *victim = thumbnail_cache.head->data;
+
+        nemo_thumbnail_cache_forget (victim);
+        g_clear_object (&victim->details->thumbnail);
+        victim->details->thumbnail_evicted = TRUE;
+        thumbnail_cache_evicted++;
+    }
+}
+
 gboolean
 nemo_can_thumbnail_internally (NemoFile *file)
 {
@@ -41,6 +41,28 @@ void       nemo_thumbnail_pad_top_and_bottom    (GdkPixbuf **pixbuf,
 /* Queue handling: */
 void       nemo_thumbnail_remove_from_queue     (const char   *file_uri);
 void       nemo_thumbnail_prioritize            (const char   *file_uri);
+/* Views call this before each pass over their visible items. Queued
+ * thumbnails that are not prioritized again for a few passes were
+ * scrolled away and get dropped. */
+void       nemo_thumbnail_viewport_changed      (void);
+
+typedef struct {
+    guint64 requested;      /* thumbnails accepted into the queue */
+    guint64 made;           /* processed by the workers */
+    guint64 cancelled;      /* removed, scrolled away or pushed out by the queue bound */
+    guint64 evicted;        /* decoded thumbnails dropped by the memory bound */
+    guint   queued;         /* waiting for a worker */
+    guint   feeder;         /* commands waiting for the feeder thread */
+    gsize   cache_bytes;    /* decoded thumbnails held in memory */
+    gdouble made_per_sec;   /* since the pipeline started */
+} NemoThumbnailStats;
+
+void       nemo_thumbnail_get_stats             (NemoThumbnailStats *stats);
+
+/* Memory bound for decoded thumbnails (NemoFile's thumbnail pixbuf), main loop only */
+void       nemo_thumbnail_cache_add             (NemoFile *file);
+void       nemo_thumbnail_cache_touch           (NemoFile *file);
+void       nemo_thumbnail_cache_forget          (NemoFile *file);
 
 gboolean   nemo_thumbnail_factory_check_status          (void);
 
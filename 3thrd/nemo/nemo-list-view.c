@@ -2291,6 +2291,9 @@ prioritize_visible_files (NemoListView *view)
 
     stepdown = icon_size * .75;
 
+    /* Queued thumbnails not seen again in this pass sort behind the visible ones */
+    nemo_thumbnail_viewport_changed ();
+
     start_y = bin_y - (vrect.height / 2);
     end_y = bin_y + vrect.height + (vrect.height / 2);
 
@@ -452,11 +452,28 @@ typedef struct _EfsFileHeader
 } EfsFileHeader;
 C_STRUCT_SIZE_CHECK(EfsFileHeader, 256)
 
+#define SANDBOX_FREE_SPACE_MAGIC    0x45455246      // "FREE"
+#define SANDBOX_FREE_SPACE_CLEAN    1               // ntfs_umount 成功后写入，挂载后立即清掉
+
+// 正常卸载时保存的空闲簇/空闲 MFT 记录数，下次挂载校验通过就不再扫描 $Bitmap 和 $MFT 位图
+typedef struct _SandboxFreeSpace
+{
+    uint32_t            magic;                      // SANDBOX_FREE_SPACE_MAGIC
+    uint32_t            state;                      // SANDBOX_FREE_SPACE_CLEAN 才可信
+    uint64_t            nrClusters;                 // 卷的簇数，扩容后对不上就重新扫描
+    uint64_t            mftSize;                    // $MFT 的 data_size
+    uint64_t            mftBitmapSize;              // $MFT 位图的 data_size
+    uint64_t            freeClusters;               //
+    uint64_t            freeMftRecords;             //
+} SandboxFreeSpace;
+C_STRUCT_SIZE_CHECK(SandboxFreeSpace, 48)
+
 typedef struct _EfsSandboxFileHeader
 {
     uint8_t             ps[1024];                   // 预留 1KB 不用
     EfsFileHeader       fileHeader;                 // 公共头部 256
-    uint8_t             padding[7936];              // 保留后续使用
+    SandboxFreeSpace    freeSpace;                  // 48
+    uint8_t             padding[7888];              // 保留后续使用
     uint8_t             pe[1024];                   // 预留 1KB 不用
 } EfsSandboxFileHeader;
 C_STRUCT_SIZE_CHECK(EfsSandboxFileHeader, 10240)
@@ -3,11 +3,49 @@
 //
 
 #include "cgroup.h"
+
+#include <poll.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#define SANDBOX_CGROUP2_ROOT                    "/sys/fs/cgroup"
+#define SANDBOX_CGROUP2_HYBRID_ROOT             "/sys/fs/cgroup/unified"                // 混合挂载时 v2 只管进程，不带控制器
+#define SANDBOX_PROCESS_MONITOR_NAME            "sandbox_process_monitor"             // 限额加在这一层，下面分两个兄弟 cgroup
+#define SANDBOX_WORKLOAD_NAME                   "workload"                              // 沙盒内程序
+#define SANDBOX_FS_WORKER_NAME                  "fs"                                    // FUSE/ntfs 挂载进程
+#define SANDBOX_NET_CLS_ROOT                    "/sys/fs/cgroup/net_cls"
+#define SANDBOX_NET_PATH                        SANDBOX_NET_CLS_ROOT "/sandbox_net_monitor"
+
+#define SB_CGROUP_RESCAN_MS                     5000                    // 有 proc connector 时兜底重扫 cgroup.procs 的间隔
+#define SB_CGROUP_POLL_MS                       1000                    // 没有 proc connector 或 cgroup v1 时只能靠重扫发现新进程
+#define SB_CGROUP_NETLINK_RCVBUF                (4 << 20)
 
-#define SANDBOX_PROCESS_MONITOR_PATH            "/sys/fs/cgroup/sandbox_process_monitor"
-#define SANDBOX_NET_PATH                        "/sys/fs/cgroup/net_cls/sandbox_net_monitor"
+#define SB_CGROUP_CPU_PERIOD                    100000                  // cpu.max 周期(us)
+#define SB_CGROUP_FS_WEIGHT                     "1000"                  // fs 的 cpu/io 权重，默认 100
+#define SB_CGROUP_FS_MEMORY_LOW                 (128ULL << 20)          // fs 的内存保护，沙盒内存吃紧时先回收程序的
+
+// epoll 事件来源放在 data.u64 的高 32 位，pidfd 的低 32 位是 pid
+#define SB_EPOLL_TYPE_MASK                      (0xFFFFFFFFULL << 32)
+#define SB_EPOLL_STOP                           (1ULL << 32)
+#define SB_EPOLL_EVENTS                         (2ULL << 32)
+#define SB_EPOLL_PROC                           (3ULL << 32)
+#define SB_EPOLL_PIDFD                          (4ULL << 32)
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open                          434
+#endif
 
 #define SB_CGROUP_GET_PRIVATE(obj)              (sb_cgroup_get_instance_private(obj))
 #define SB_CGROUP_GET_OBJ(klass)                (sb_cgroup_get_instance_object(klass))
@@ -19,6 +57,7 @@ static void         sb_cgroup_constructed       (GObject* klass);
 static GObject*     sb_cgroup_constructor       (GType type, guint nProperties, GObjectConstructParam * properties);
 
 static gpointer     sb_monitor_thread           (gpointer data);
+static void         sb_cgroup_stop              (SbCgroup* obj);
 
 
 typedef struct _SbCgroupClass
@@ -33,17 +72,37 @@ typedef struct _SbCgroup
 
 typedef struct _SbCgroupPrivate
 {
-    FILE*                           processMonitor;
-    FILE*                           netMonitor;
-    FILE*                           netProcessMonitorFile;
-
     char*                           netProcessMonitorPath;
     char*                           processMonitorPath;
+    char*                           cgroupEventsPath;
     char*                           cgroupNetPath;
+    char*                           cgroupPath;         // cgroup v2 下沙盒 cgroup 的目录，限额加在这一层
+    char*                           workloadPath;       // 沙盒内程序，监控的就是它
+    char*                           fsPath;             // FUSE/ntfs 挂载进程，和 workload 是兄弟
 
+    SbCgroupLimits                  limits;
+
+    bool                            isV2;
     bool                            isRunning;
     GThread*                        monitorThread;
 
+    int                             epollFd;
+    int                             stopFd;             // eventfd，通知监控线程退出
+    int                             inotifyFd;          // 监听 cgroup.events
+    int                             procFd;             // proc connector，拿 fork 事件
+
+    // 以下只在监控线程里访问
+    GHashTable*                     tracked;            // pid -> pidfd，拿不到 pidfd 时为 -1
+    bool                            populated;
+    bool                            procsChanged;
+
+    // 进程快照: 监控线程原子替换指针，等读者计数归零后释放旧快照，读者不加锁
+    SbCgroupProcs*                  procs;
+    gint                            procsReaders;
+
+    SbCgroupEventFunc               eventFunc;
+    gpointer                        eventData;
+
     GMutex                          locker;
 } SbCgroupPrivate;
 
@@ -57,6 +116,11 @@ static void sb_cgroup_init(SbCgroup* obj)
 
     gsCGroupError = g_quark_from_string("sandbox-cgroup-error");
 
+    priv->epollFd = -1;
+    priv->stopFd = -1;
+    priv->inotifyFd = -1;
+    priv->procFd = -1;
+
     g_mutex_init(&priv->locker);
 }
 
@@ -73,10 +137,10 @@ static void sb_cgroup_class_init(SbCgroupClass* klass)
 static void sb_cgroup_dispose (GObject* obj)
 {
     SbCgroup* self = SB_CGROUP(obj);
-    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(self);
 
     // dispose 当引用计数为0时候首先调用，之后检查对象引用已经彻底清空就会调用finalize
     // 通常解除对其他对象的引用、断开信号连接等
+    sb_cgroup_stop(self);
 
     // 调用父类析构函数
     G_OBJECT_CLASS (sb_cgroup_parent_class)->dispose (obj);
@@ -89,29 +153,34 @@ static void sb_cgroup_finalize (GObject* obj)
 
     g_mutex_lock(&priv->locker);
 
-    if (priv->monitorThread) {
-        g_thread_join(priv->monitorThread);
-        priv->monitorThread = NULL;
+    if (priv->procs) {
+        sb_cgroup_procs_unref(priv->procs);
+        priv->procs = NULL;
     }
 
-    if (priv->processMonitor) {
-        fclose(priv->processMonitor);
-        priv->processMonitor = NULL;
+    if (priv->cgroupNetPath) {
+        g_free(priv->cgroupNetPath);
+        priv->cgroupNetPath = NULL;
     }
 
-    if (priv->netMonitor) {
-        fclose(priv->netMonitor);
-        priv->netMonitor = NULL;
+    if (priv->cgroupPath) {
+        g_free(priv->cgroupPath);
+        priv->cgroupPath = NULL;
     }
 
-    if (priv->netProcessMonitorFile) {
-        fclose(priv->netProcessMonitorFile);
-        priv->netProcessMonitorFile = NULL;
+    if (priv->workloadPath) {
+        g_free(priv->workloadPath);
+        priv->workloadPath = NULL;
     }
 
-    if (priv->cgroupNetPath) {
-        g_free(priv->cgroupNetPath);
-        priv->cgroupNetPath = NULL;
+    if (priv->fsPath) {
+        g_free(priv->fsPath);
+        priv->fsPath = NULL;
+    }
+
+    if (priv->cgroupEventsPath) {
+        g_free(priv->cgroupEventsPath);
+        priv->cgroupEventsPath = NULL;
     }
 
     if (priv->processMonitorPath) {
@@ -125,6 +194,7 @@ static void sb_cgroup_finalize (GObject* obj)
     }
 
     g_mutex_unlock(&priv->locker);
+    g_mutex_clear(&priv->locker);
 
     G_OBJECT_CLASS(sb_cgroup_parent_class)->finalize(obj);
 }
@@ -139,143 +209,842 @@ static GObject * sb_cgroup_constructor(GType type, guint nProperties, GObjectCon
     return G_OBJECT_CLASS(sb_cgroup_parent_class)->constructor(type, nProperties, properties);
 }
 
-gpointer sb_monitor_thread(gpointer data)
+static bool sb_cgroup_write_file (const char* path, const char* str)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        g_warning("failed to open '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    ssize_t len = (ssize_t) strlen(str);
+    ssize_t ret = write(fd, str, len);
+    if (ret != len) {
+        g_warning("failed to write '%s' to '%s': %s\n", str, path, strerror(errno));
+    }
+    close(fd);
+
+    return (ret == len);
+}
+
+/**
+ * @brief 控制器没打开时接口文件不存在，直接返回 false
+ */
+static bool sb_cgroup_write_attr (const char* dir, const char* name, const char* value)
+{
+    g_autofree char* path = g_strdup_printf("%s/%s", dir, name);
+    if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+        return false;
+    }
+
+    return sb_cgroup_write_file(path, value);
+}
+
+static bool sb_cgroup_mkdir (const char* path)
+{
+    if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+        errno = 0;
+        if (0 != g_mkdir_with_parents(path, 0700)) {
+            g_warning("mkdir('%s') failed: %s\n", path, strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief 给 dir 的子 cgroup 打开 cpu/memory/io/pids 控制器，dir 里没有的控制器跳过
+ */
+static void sb_cgroup_enable_controllers (const char* dir)
+{
+    static const char* controllers[] = { "cpu", "memory", "io", "pids" };
+
+    g_autofree char* path = g_strdup_printf("%s/cgroup.controllers", dir);
+    g_autofree char* avail = NULL;
+    if (!g_file_get_contents(path, &avail, NULL, NULL)) {
+        return;
+    }
+
+    char** arr = g_strsplit_set(g_strstrip(avail), " ", -1);
+    g_autofree char* subtree = g_strdup_printf("%s/cgroup.subtree_control", dir);
+    for (int i = 0; i < G_N_ELEMENTS(controllers); ++i) {
+        if (g_strv_contains((const char* const*) arr, controllers[i])) {
+            g_autofree char* ctrl = g_strdup_printf("+%s", controllers[i]);
+            sb_cgroup_write_file(subtree, ctrl);
+        }
+    }
+    g_strfreev(arr);
+}
+
+/**
+ * @brief 打开了控制器的 cgroup 不能再直接放进程，老版本留在上层的进程挪到 workload
+ */
+static void sb_cgroup_move_procs (const char* fromDir, const char* toDir)
+{
+    g_autofree char* from = g_strdup_printf("%s/cgroup.procs", fromDir);
+    g_autofree char* to = g_strdup_printf("%s/cgroup.procs", toDir);
+    g_autofree char* buf = NULL;
+    if (!g_file_get_contents(from, &buf, NULL, NULL)) {
+        return;
+    }
+
+    char** pids = g_strsplit(buf, "\n", -1);
+    for (int i = 0; pids[i]; ++i) {
+        if (pids[i][0]) {
+            sb_cgroup_write_file(to, pids[i]);
+        }
+    }
+    g_strfreev(pids);
+}
+
+/**
+ * @brief io.max 只认整块盘，分区换成所在的盘
+ */
+static dev_t sb_cgroup_whole_disk (dev_t dev)
+{
+    g_autofree char* part = g_strdup_printf("/sys/dev/block/%u:%u/partition", major(dev), minor(dev));
+    if (!g_file_test(part, G_FILE_TEST_EXISTS)) {
+        return dev;
+    }
+
+    g_autofree char* diskPath = g_strdup_printf("/sys/dev/block/%u:%u/../dev", major(dev), minor(dev));
+    g_autofree char* buf = NULL;
+    unsigned int maj = 0, min = 0;
+    if (g_file_get_contents(diskPath, &buf, NULL, NULL) && 2 == sscanf(buf, "%u:%u", &maj, &min)) {
+        return makedev(maj, min);
+    }
+
+    return dev;
+}
+
+static void sb_cgroup_format_limit (char* buf, gsize bufSize, guint64 val)
+{
+    if (val) {
+        snprintf(buf, bufSize, "%" G_GUINT64_FORMAT, val);
+    }
+    else {
+        g_strlcpy(buf, "max", bufSize);
+    }
+}
+
+static void sb_cgroup_apply_limits (SbCgroupPrivate* priv)
+{
+    const SbCgroupLimits* limits = &priv->limits;
+    const char* dir = priv->cgroupPath;
+
+    char buf[128] = {0};
+    char val[2][32] = {0};
+
+    if (limits->cpuPercent) {
+        snprintf(buf, sizeof(buf), "%" G_GUINT64_FORMAT " %d",
+            (guint64) limits->cpuPercent * SB_CGROUP_CPU_PERIOD / 100, SB_CGROUP_CPU_PERIOD);
+    }
+    else {
+        snprintf(buf, sizeof(buf), "max %d", SB_CGROUP_CPU_PERIOD);
+    }
+    if (!sb_cgroup_write_attr(dir, "cpu.max", buf) && limits->cpuPercent) {
+        g_warning("cpu controller is unavailable, cpu.max not applied\n");
+    }
+
+    sb_cgroup_format_limit(buf, sizeof(buf), limits->memoryMax);
+    if (!sb_cgroup_write_attr(dir, "memory.max", buf) && limits->memoryMax) {
+        g_warning("memory controller is unavailable, memory.max not applied\n");
+    }
+    sb_cgroup_format_limit(buf, sizeof(buf), limits->memoryHigh);
+    if (!sb_cgroup_write_attr(dir, "memory.high", buf) && limits->memoryHigh) {
+        g_warning("memory controller is unavailable, memory.high not applied\n");
+    }
+
+    sb_cgroup_format_limit(buf, sizeof(buf), limits->pidsMax);
+    if (!sb_cgroup_write_attr(dir, "pids.max", buf) && limits->pidsMax) {
+        g_warning("pids controller is unavailable, pids.max not applied\n");
+    }
+
+    if (limits->ioDevice) {
+        dev_t disk = sb_cgroup_whole_disk(limits->ioDevice);
+        sb_cgroup_format_limit(val[0], sizeof(val[0]), limits->ioReadBps);
+        sb_cgroup_format_limit(val[1], sizeof(val[1]), limits->ioWriteBps);
+        snprintf(buf, sizeof(buf), "%u:%u rbps=%s wbps=%s", major(disk), minor(disk), val[0], val[1]);
+        if (!sb_cgroup_write_attr(dir, "io.max", buf)) {
+            g_warning("io.max '%s' not applied\n", buf);
+        }
+    }
+}
+
+static void sb_cgroup_protect_fs (SbCgroupPrivate* priv)
+{
+    char buf[32] = {0};
+
+    // 没有对应控制器就算了，io.weight 还需要 BFQ 或 iocost
+    sb_cgroup_write_attr(priv->fsPath, "cpu.weight", SB_CGROUP_FS_WEIGHT);
+    sb_cgroup_write_attr(priv->fsPath, "io.weight", "default " SB_CGROUP_FS_WEIGHT);
+    sb_cgroup_format_limit(buf, sizeof(buf), SB_CGROUP_FS_MEMORY_LOW);
+    sb_cgroup_write_attr(priv->fsPath, "memory.low", buf);
+}
+
+static void sb_cgroup_emit (SbCgroup* obj, SbCgroupEvent event, pid_t pid)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    g_mutex_lock(&priv->locker);
+    SbCgroupEventFunc func = priv->eventFunc;
+    gpointer udata = priv->eventData;
+    g_mutex_unlock(&priv->locker);
+
+    if (func) {
+        func(obj, event, pid, udata);
+    }
+}
+
+static void sb_cgroup_track (SbCgroup* obj, pid_t pid)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    if (g_hash_table_contains(priv->tracked, GINT_TO_POINTER(pid))) {
+        return;
+    }
+
+    int pidFd = (int) syscall(SYS_pidfd_open, pid, 0);
+    if (pidFd < 0 && ESRCH == errno) {
+        // 已经被回收了，进程来去都要通知到
+        sb_cgroup_emit(obj, SB_CGROUP_EVENT_PROCESS_STARTED, pid);
+        sb_cgroup_emit(obj, SB_CGROUP_EVENT_PROCESS_EXITED, pid);
+        return;
+    }
+
+    if (pidFd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = SB_EPOLL_PIDFD | (guint32) pid };
+        if (0 != epoll_ctl(priv->epollFd, EPOLL_CTL_ADD, pidFd, &ev)) {
+            close(pidFd);
+            pidFd = -1;
+        }
+    }
+
+    // 没有 pidfd(老内核)时，退出靠 proc connector 或者重扫发现
+    g_hash_table_insert(priv->tracked, GINT_TO_POINTER(pid), GINT_TO_POINTER(pidFd));
+    priv->procsChanged = true;
+
+    sb_cgroup_emit(obj, SB_CGROUP_EVENT_PROCESS_STARTED, pid);
+}
+
+static void sb_cgroup_untrack (SbCgroup* obj, pid_t pid)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    gpointer val = NULL;
+    if (!g_hash_table_lookup_extended(priv->tracked, GINT_TO_POINTER(pid), NULL, &val)) {
+        return;
+    }
+
+    int pidFd = GPOINTER_TO_INT(val);
+    if (pidFd >= 0) {
+        epoll_ctl(priv->epollFd, EPOLL_CTL_DEL, pidFd, NULL);
+        close(pidFd);
+    }
+
+    g_hash_table_remove(priv->tracked, GINT_TO_POINTER(pid));
+    priv->procsChanged = true;
+
+    sb_cgroup_emit(obj, SB_CGROUP_EVENT_PROCESS_EXITED, pid);
+}
+
+static bool sb_cgroup_is_exited (SbCgroupPrivate* priv, pid_t pid)
+{
+    gpointer val = NULL;
+    if (!g_hash_table_lookup_extended(priv->tracked, GINT_TO_POINTER(pid), NULL, &val)) {
+        return false;
+    }
+
+    // 同一批事件里 pid 可能已经被复用并重新跟踪，以 pidfd 当前状态为准
+    struct pollfd pfd = { .fd = GPOINTER_TO_INT(val), .events = POLLIN };
+
+    return (pfd.fd >= 0 && poll(&pfd, 1, 0) > 0);
+}
+
+static void sb_cgroup_rescan (SbCgroup* obj)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    g_autofree char* buf = NULL;
+    if (!g_file_get_contents(priv->processMonitorPath, &buf, NULL, NULL)) {
+        return;
+    }
+
+    GHashTable* seen = g_hash_table_new(NULL, NULL);
+    for (char* line = buf; line && *line; ) {
+        char* end = NULL;
+        long pid = strtol(line, &end, 10);
+        if (end == line) {
+            break;
+        }
+        if (pid > 0) {
+            g_hash_table_add(seen, GINT_TO_POINTER(pid));
+            sb_cgroup_track(obj, (pid_t) pid);
+        }
+        line = end;
+    }
+
+    // 不在 cgroup.procs 里的进程已经退出或者被移出了沙盒
+    GList* gone = NULL;
+    GHashTableIter iter;
+    gpointer key = NULL;
+    g_hash_table_iter_init(&iter, priv->tracked);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!g_hash_table_contains(seen, key)) {
+            gone = g_list_prepend(gone, key);
+        }
+    }
+    for (GList* l = gone; l; l = l->next) {
+        sb_cgroup_untrack(obj, GPOINTER_TO_INT(l->data));
+    }
+
+    g_list_free(gone);
+    g_hash_table_unref(seen);
+}
+
+static void sb_cgroup_check_populated (SbCgroup* obj)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    g_autofree char* buf = NULL;
+    if (!g_file_get_contents(priv->cgroupEventsPath, &buf, NULL, NULL)) {
+        return;
+    }
+
+    const char* p = strstr(buf, "populated ");
+    if (!p) {
+        return;
+    }
+
+    bool populated = ('0' != p[strlen("populated ")]);
+    if (populated != priv->populated) {
+        priv->populated = populated;
+        sb_cgroup_emit(obj, populated ? SB_CGROUP_EVENT_POPULATED : SB_CGROUP_EVENT_EMPTY, 0);
+    }
+}
+
+static int sb_cgroup_proc_connector_open (void)
 {
-    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(data);
-    char pidBuf[32] = {0};
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC };
+    if (0 != bind(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+
+    // fork 风暴时缓冲区溢出会丢事件(ENOBUFS)，丢了就重扫一遍
+    int rcvBuf = SB_CGROUP_NETLINK_RCVBUF;
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvBuf, sizeof(rcvBuf))) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+    }
+
+    struct __attribute__((aligned(NLMSG_ALIGNTO))) {
+        struct nlmsghdr                 hdr;
+        struct __attribute__((packed)) {
+            struct cn_msg               msg;
+            enum proc_cn_mcast_op       op;
+        } body;
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.hdr.nlmsg_len = sizeof(req);
+    req.hdr.nlmsg_type = NLMSG_DONE;
+    req.hdr.nlmsg_pid = getpid();
+    req.body.msg.id.idx = CN_IDX_PROC;
+    req.body.msg.id.val = CN_VAL_PROC;
+    req.body.msg.len = sizeof(enum proc_cn_mcast_op);
+    req.body.op = PROC_CN_MCAST_LISTEN;
+
+    if (send(fd, &req, sizeof(req), 0) != sizeof(req)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @return false 表示有事件丢失，需要重扫
+ */
+static bool sb_cgroup_read_proc_events (SbCgroup* obj)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    bool ok = true;
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
 
     while (true) {
-        g_mutex_lock(&priv->locker);
-        bool isRunning = priv->isRunning;
-        if (!isRunning) {
-            g_mutex_unlock(&priv->locker);
+        struct sockaddr_nl from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t len = recvfrom(priv->procFd, buf, sizeof(buf), 0, (struct sockaddr*) &from, &fromLen);
+        if (len < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            if (ENOBUFS == errno) {
+                ok = false;
+                continue;
+            }
+            return ok && (EAGAIN == errno || EWOULDBLOCK == errno);
+        }
+
+        // 只认内核发来的
+        if (0 == len || 0 != from.nl_pid) {
+            continue;
+        }
+
+        for (struct nlmsghdr* nh = (struct nlmsghdr*) buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+            if (NLMSG_NOOP == nh->nlmsg_type || NLMSG_ERROR == nh->nlmsg_type) {
+                continue;
+            }
+
+            struct cn_msg* msg = NLMSG_DATA(nh);
+            if (CN_IDX_PROC != msg->id.idx || CN_VAL_PROC != msg->id.val) {
+                continue;
+            }
+
+            // cn_msg 的负载只按 4 字节对齐，拷出来再用
+            struct proc_event event;
+            memset(&event, 0, sizeof(event));
+            memcpy(&event, msg->data, MIN(msg->len, sizeof(event)));
+
+            struct proc_event* ev = &event;
+            switch (ev->what) {
+                case PROC_EVENT_FORK: {
+                    // 子进程继承父进程的 cgroup，父进程在沙盒里子进程就在
+                    pid_t child = ev->event_data.fork.child_pid;
+                    if (child == ev->event_data.fork.child_tgid
+                        && g_hash_table_contains(priv->tracked, GINT_TO_POINTER(ev->event_data.fork.parent_tgid))) {
+                        sb_cgroup_track(obj, child);
+                    }
+                    break;
+                }
+                case PROC_EVENT_EXIT: {
+                    // 有 pidfd 的进程等 pidfd 通知，这里只处理拿不到 pidfd 的
+                    pid_t pid = ev->event_data.exit.process_pid;
+                    gpointer val = NULL;
+                    if (pid == ev->event_data.exit.process_tgid
+                        && g_hash_table_lookup_extended(priv->tracked, GINT_TO_POINTER(pid), NULL, &val)
+                        && GPOINTER_TO_INT(val) < 0) {
+                        sb_cgroup_untrack(obj, pid);
+                    }
+                    break;
+                }
+                default: {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static gint sb_cgroup_pid_cmp (gconstpointer a, gconstpointer b)
+{
+    pid_t pa = *(const pid_t*) a;
+    pid_t pb = *(const pid_t*) b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+static void sb_cgroup_publish (SbCgroup* obj)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    guint num = g_hash_table_size(priv->tracked);
+    SbCgroupProcs* procs = g_malloc(sizeof(SbCgroupProcs) + num * sizeof(pid_t));
+    procs->refCount = 1;
+    procs->num = 0;
+
+    GHashTableIter iter;
+    gpointer key = NULL;
+    g_hash_table_iter_init(&iter, priv->tracked);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        procs->pids[procs->num++] = GPOINTER_TO_INT(key);
+    }
+    qsort(procs->pids, procs->num, sizeof(pid_t), sb_cgroup_pid_cmp);
+
+    SbCgroupProcs* old = __atomic_exchange_n(&priv->procs, procs, __ATOMIC_ACQ_REL);
+
+    // 换下来的快照可能正被读者拿着还没来得及加引用
+    while (g_atomic_int_get(&priv->procsReaders) > 0) {
+        g_thread_yield();
+    }
+
+    if (old) {
+        sb_cgroup_procs_unref(old);
+    }
+
+    priv->procsChanged = false;
+}
+
+static gpointer sb_monitor_thread (gpointer data)
+{
+    SbCgroup* obj = SB_CGROUP(data);
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    struct epoll_event events[64];
+
+    if (priv->isV2) {
+        sb_cgroup_check_populated(obj);
+    }
+    sb_cgroup_rescan(obj);
+    sb_cgroup_publish(obj);
+
+    // cgroup v2 没有 fork 通知，新进程靠 proc connector 拿到，拿不到时只能定时重扫
+    const int timeout = (priv->isV2 && priv->procFd >= 0) ? SB_CGROUP_RESCAN_MS : SB_CGROUP_POLL_MS;
+
+    for (bool running = true; running; ) {
+        int n = epoll_wait(priv->epollFd, events, G_N_ELEMENTS(events), timeout);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            g_warning("epoll_wait() failed: %s\n", strerror(errno));
             break;
         }
 
-        if (priv->processMonitor) {
-            fseek(priv->processMonitor, 0, SEEK_SET);
-            while (fgets(pidBuf, sizeof(pidBuf) - 1, priv->processMonitor)) {
-                printf("%s\n", pidBuf);
-                memset(pidBuf, 0, sizeof(pidBuf));
+        bool rescan = (0 == n);
+        for (int i = 0; i < n; ++i) {
+            guint64 tag = events[i].data.u64;
+            switch (tag & SB_EPOLL_TYPE_MASK) {
+                case SB_EPOLL_STOP: {
+                    running = false;
+                    break;
+                }
+                case SB_EPOLL_EVENTS: {
+                    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+                    while (read(priv->inotifyFd, buf, sizeof(buf)) > 0);
+                    sb_cgroup_check_populated(obj);
+                    // 外部直接写 cgroup.procs 加进来的进程只能从这里发现
+                    rescan = true;
+                    break;
+                }
+                case SB_EPOLL_PROC: {
+                    if (!sb_cgroup_read_proc_events(obj)) {
+                        rescan = true;
+                    }
+                    break;
+                }
+                case SB_EPOLL_PIDFD: {
+                    pid_t pid = (pid_t) (tag & 0xFFFFFFFFULL);
+                    if (sb_cgroup_is_exited(priv, pid)) {
+                        sb_cgroup_untrack(obj, pid);
+                    }
+                    break;
+                }
+                default: {
+                    break;
+                }
             }
-            printf("\n");
-            sleep(1);
         }
 
-        g_mutex_unlock(&priv->locker);
+        if (running && rescan) {
+            sb_cgroup_rescan(obj);
+        }
+
+        if (priv->procsChanged) {
+            sb_cgroup_publish(obj);
+        }
     }
 
     return NULL;
 }
 
-SbCgroup * sb_cgroup_new()
+static void sb_cgroup_close_fds (SbCgroupPrivate* priv)
 {
-    SbCgroup* cgroup = (SbCgroup*) g_object_new(SB_TYPE_CGROUP, NULL);
+    if (priv->tracked) {
+        GHashTableIter iter;
+        gpointer val = NULL;
+        g_hash_table_iter_init(&iter, priv->tracked);
+        while (g_hash_table_iter_next(&iter, NULL, &val)) {
+            if (GPOINTER_TO_INT(val) >= 0) {
+                close(GPOINTER_TO_INT(val));
+            }
+        }
+        g_hash_table_unref(priv->tracked);
+        priv->tracked = NULL;
+    }
 
-    return cgroup;
+    int* fds[] = { &priv->procFd, &priv->inotifyFd, &priv->stopFd, &priv->epollFd };
+    for (int i = 0; i < G_N_ELEMENTS(fds); ++i) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
 }
 
-bool sb_cgroup_run(SbCgroup* obj)
+static void sb_cgroup_stop (SbCgroup* obj)
 {
     SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
 
-    char pidStr[32] = {0};
+    g_mutex_lock(&priv->locker);
+    GThread* thread = priv->monitorThread;
+    priv->monitorThread = NULL;
+    priv->isRunning = false;
+    if (thread && priv->stopFd >= 0) {
+        eventfd_write(priv->stopFd, 1);
+    }
+    g_mutex_unlock(&priv->locker);
+
+    // 回调里会拿锁，不能持锁 join
+    if (thread) {
+        g_thread_join(thread);
+    }
 
     g_mutex_lock(&priv->locker);
+    sb_cgroup_close_fds(priv);
+    g_mutex_unlock(&priv->locker);
+}
 
-    if (!g_file_test(SANDBOX_PROCESS_MONITOR_PATH, G_FILE_TEST_EXISTS)) {
-        errno = 0;
-        if (0 != g_mkdir_with_parents(SANDBOX_PROCESS_MONITOR_PATH, 0700)) {
-            g_warning("process mkdir() failed: %s\n", strerror(errno));
-            return false;
-        }
+static const char* sb_cgroup_v2_root (void)
+{
+    if (g_file_test(SANDBOX_CGROUP2_ROOT "/cgroup.controllers", G_FILE_TEST_EXISTS)) {
+        return SANDBOX_CGROUP2_ROOT;
+    }
+
+    if (g_file_test(SANDBOX_CGROUP2_HYBRID_ROOT "/cgroup.controllers", G_FILE_TEST_EXISTS)) {
+        return SANDBOX_CGROUP2_HYBRID_ROOT;
     }
 
+    return NULL;
+}
+
+static bool sb_cgroup_setup_net_cls (SbCgroupPrivate* priv, const char* pidStr)
+{
     if (!g_file_test(SANDBOX_NET_PATH, G_FILE_TEST_EXISTS)) {
         errno = 0;
         if (0 != g_mkdir_with_parents(SANDBOX_NET_PATH, 0700)) {
             g_warning("net mkdir() failed: %s\n", strerror(errno));
-            goto err;
+            return false;
         }
     }
 
-    if (priv->processMonitor) {
-        g_free(priv->processMonitor);
-        priv->processMonitor = NULL;
-    }
-
-    if (priv->cgroupNetPath) {
-        g_free(priv->cgroupNetPath);
-        priv->cgroupNetPath = NULL;
-    }
-
+    g_free(priv->netProcessMonitorPath);
+    g_free(priv->cgroupNetPath);
     priv->netProcessMonitorPath = g_strdup_printf("%s/tasks", SANDBOX_NET_PATH);
     priv->cgroupNetPath = g_strdup_printf("%s/net_cls.classid", SANDBOX_NET_PATH);
-    priv->processMonitorPath = g_strdup_printf("%s/cgroup.procs", SANDBOX_PROCESS_MONITOR_PATH);
 
-    if (!priv->cgroupNetPath || !priv->processMonitorPath) {
-        g_warning("process or net monitor path is null\n");
-        goto err;
+    return sb_cgroup_write_file(priv->netProcessMonitorPath, pidStr)
+        && sb_cgroup_write_file(priv->cgroupNetPath, pidStr);
+}
+
+static bool sb_cgroup_epoll_add (SbCgroupPrivate* priv, int fd, guint64 tag)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = tag };
+
+    return (0 == epoll_ctl(priv->epollFd, EPOLL_CTL_ADD, fd, &ev));
+}
+
+SbCgroup * sb_cgroup_new()
+{
+    SbCgroup* cgroup = (SbCgroup*) g_object_new(SB_TYPE_CGROUP, NULL);
+
+    return cgroup;
+}
+
+bool sb_cgroup_run(SbCgroup* obj)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    char pidStr[32] = {0};
+    snprintf(pidStr, sizeof(pidStr), "%d", getpid());
+
+    g_mutex_lock(&priv->locker);
+
+    if (priv->monitorThread) {
+        g_mutex_unlock(&priv->locker);
+        return true;
     }
 
-    // 打开 process monitor
-    priv->processMonitor = fopen(priv->processMonitorPath, "w+");
-    if (!priv->processMonitor) {
-        g_warning("failed to open process monitor file\n");
-        goto err;
+    const char* v2Root = sb_cgroup_v2_root();
+    priv->isV2 = (NULL != v2Root);
+    g_free(priv->processMonitorPath);
+    g_free(priv->cgroupEventsPath);
+    g_free(priv->cgroupPath);
+    priv->processMonitorPath = NULL;
+    priv->cgroupEventsPath = NULL;
+    priv->cgroupPath = NULL;
+
+    if (priv->isV2) {
+        g_free(priv->workloadPath);
+        g_free(priv->fsPath);
+        priv->cgroupPath = g_strdup_printf("%s/%s", v2Root, SANDBOX_PROCESS_MONITOR_NAME);
+        priv->workloadPath = g_strdup_printf("%s/%s", priv->cgroupPath, SANDBOX_WORKLOAD_NAME);
+        priv->fsPath = g_strdup_printf("%s/%s", priv->cgroupPath, SANDBOX_FS_WORKER_NAME);
+        if (!sb_cgroup_mkdir(priv->workloadPath) || !sb_cgroup_mkdir(priv->fsPath)) {
+            goto err;
+        }
+
+        // 沙盒整体限额，workload 和 fs 在里面按权重分
+        sb_cgroup_move_procs(priv->cgroupPath, priv->workloadPath);
+        sb_cgroup_enable_controllers(v2Root);
+        sb_cgroup_enable_controllers(priv->cgroupPath);
+        sb_cgroup_apply_limits(priv);
+        sb_cgroup_protect_fs(priv);
+
+        priv->processMonitorPath = g_strdup_printf("%s/cgroup.procs", priv->workloadPath);
+        priv->cgroupEventsPath = g_strdup_printf("%s/cgroup.events", priv->workloadPath);
+        if (!sb_cgroup_write_file(priv->processMonitorPath, pidStr)) {
+            goto err;
+        }
+
+        // 混合挂载时 net_cls 仍是 v1 层级，有就顺便打上标记
+        if (g_file_test(SANDBOX_NET_CLS_ROOT, G_FILE_TEST_IS_DIR) && !sb_cgroup_setup_net_cls(priv, pidStr)) {
+            g_warning("net_cls is unavailable, network traffic of sandbox will not be marked\n");
+        }
     }
-    snprintf(pidStr, sizeof(pidStr), "%d", getpid());
-    if (fwrite(pidStr, 1, strlen(pidStr), priv->processMonitor) <= 0) {
-        g_warning("failed to write pid file\n");
-        goto err;
+    else {
+        // cgroup v1: 进程集合就取 net_cls 层级里的
+        if (!sb_cgroup_setup_net_cls(priv, pidStr)) {
+            goto err;
+        }
+        priv->processMonitorPath = g_strdup_printf("%s/cgroup.procs", SANDBOX_NET_PATH);
     }
 
-    // mem process
-    priv->netProcessMonitorFile = fopen(priv->netProcessMonitorPath, "w+");
-    if (!priv->netProcessMonitorFile) {
-        g_warning("failed to open net process monitor file\n");
+    priv->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    priv->stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (priv->epollFd < 0 || priv->stopFd < 0 || !sb_cgroup_epoll_add(priv, priv->stopFd, SB_EPOLL_STOP)) {
+        g_warning("failed to create epoll: %s\n", strerror(errno));
         goto err;
     }
 
-    if (fwrite(pidStr, 1, strlen(pidStr), priv->netProcessMonitorFile) <= 0) {
-        g_warning("failed to write net pid file\n");
-        goto err;
+    if (priv->isV2) {
+        priv->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (priv->inotifyFd < 0
+            || inotify_add_watch(priv->inotifyFd, priv->cgroupEventsPath, IN_MODIFY) < 0
+            || !sb_cgroup_epoll_add(priv, priv->inotifyFd, SB_EPOLL_EVENTS)) {
+            g_warning("failed to watch '%s': %s\n", priv->cgroupEventsPath, strerror(errno));
+            goto err;
+        }
     }
 
-    // 打开 mem monitor
-    priv->netMonitor = fopen(priv->cgroupNetPath, "w+");
-    if (!priv->netMonitor) {
-        g_warning("failed to open net monitor file,'%s'\n", priv->cgroupNetPath);
-        goto err;
+    priv->procFd = sb_cgroup_proc_connector_open();
+    if (priv->procFd >= 0 && !sb_cgroup_epoll_add(priv, priv->procFd, SB_EPOLL_PROC)) {
+        close(priv->procFd);
+        priv->procFd = -1;
     }
-    memset(pidStr, 0, sizeof(pidStr));
-    snprintf(pidStr, sizeof(pidStr), "%d", getpid());
-    if (fwrite(pidStr, 1, strlen(pidStr), priv->netMonitor) <= 0) {
-        g_warning("failed to write pid file\n");
-        goto err;
+    if (priv->procFd < 0) {
+        g_warning("proc connector is unavailable, fall back to rescan every %d ms\n", SB_CGROUP_POLL_MS);
     }
 
+    priv->tracked = g_hash_table_new(NULL, NULL);
+    priv->populated = false;
+
     // 开启线程
-    if (!priv->monitorThread) {
-        priv->isRunning = true;
-        priv->monitorThread = g_thread_new("monitor_thread", sb_monitor_thread, obj);
-    }
+    priv->isRunning = true;
+    priv->monitorThread = g_thread_new("monitor_thread", sb_monitor_thread, obj);
 
     g_mutex_unlock(&priv->locker);
     return true;
 
 err:
-    if (priv->processMonitor) {
-        fclose(priv->processMonitor);
-        priv->processMonitor = NULL;
+    sb_cgroup_close_fds(priv);
+
+    g_mutex_unlock(&priv->locker);
+
+    return false;
+}
+
+void sb_cgroup_set_event_func (SbCgroup* obj, SbCgroupEventFunc func, gpointer udata)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    g_mutex_lock(&priv->locker);
+    priv->eventFunc = func;
+    priv->eventData = udata;
+    g_mutex_unlock(&priv->locker);
+}
+
+SbCgroupProcs* sb_cgroup_get_procs (SbCgroup* obj)
+{
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    g_atomic_int_inc(&priv->procsReaders);
+    SbCgroupProcs* procs = __atomic_load_n(&priv->procs, __ATOMIC_ACQUIRE);
+    if (procs) {
+        g_atomic_int_inc(&procs->refCount);
     }
+    g_atomic_int_add(&priv->procsReaders, -1);
 
-    if (priv->netMonitor) {
-        fclose(priv->netMonitor);
-        priv->netMonitor = NULL;
+    return procs;
+}
+
+void sb_cgroup_procs_unref (SbCgroupProcs* procs)
+{
+    if (procs && g_atomic_int_dec_and_test(&procs->refCount)) {
+        g_free(procs);
     }
+}
+
+bool sb_cgroup_procs_contains (const SbCgroupProcs* procs, pid_t pid)
+{
+    return procs && bsearch(&pid, procs->pids, procs->num, sizeof(pid_t), sb_cgroup_pid_cmp);
+}
+
+void sb_cgroup_set_limits (SbCgroup* obj, const SbCgroupLimits* limits)
+{
+    g_return_if_fail(obj && limits);
 
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    g_mutex_lock(&priv->locker);
+    priv->limits = *limits;
+    if (priv->isV2 && priv->cgroupPath) {
+        sb_cgroup_apply_limits(priv);
+    }
     g_mutex_unlock(&priv->locker);
+}
 
-    return false;
+char* sb_cgroup_get_fs_procs_path (SbCgroup* obj)
+{
+    g_return_val_if_fail(obj, NULL);
+
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    g_mutex_lock(&priv->locker);
+    char* path = (priv->isV2 && priv->fsPath) ? g_strdup_printf("%s/cgroup.procs", priv->fsPath) : NULL;
+    g_mutex_unlock(&priv->locker);
+
+    return path;
+}
+
+char* sb_cgroup_read_stat (SbCgroup* obj)
+{
+    g_return_val_if_fail(obj, NULL);
+
+    static const char* files[] = { "cpu.stat", "memory.stat", "io.stat" };
+
+    SbCgroupPrivate* priv = (SbCgroupPrivate*) SB_CGROUP_GET_PRIVATE(obj);
+
+    g_mutex_lock(&priv->locker);
+    if (!priv->isV2 || !priv->cgroupPath) {
+        g_mutex_unlock(&priv->locker);
+        return NULL;
+    }
+
+    const char* groups[][2] = {
+        { "sandbox", priv->cgroupPath },
+        { SANDBOX_WORKLOAD_NAME, priv->workloadPath },
+        { SANDBOX_FS_WORKER_NAME, priv->fsPath },
+    };
+
+    GString* str = g_string_new(NULL);
+    for (int i = 0; i < G_N_ELEMENTS(groups); ++i) {
+        for (int j = 0; j < G_N_ELEMENTS(files); ++j) {
+            g_autofree char* path = g_strdup_printf("%s/%s", groups[i][1], files[j]);
+            g_autofree char* buf = NULL;
+            if (g_file_get_contents(path, &buf, NULL, NULL)) {
+                g_string_append_printf(str, "[%s/%s]\n%s", groups[i][0], files[j], buf);
+            }
+        }
+    }
+    g_mutex_unlock(&priv->locker);
+
+    return g_string_free(str, false);
 }
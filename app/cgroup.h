@@ -6,6 +6,7 @@
 #define sandbox_CGROUP_H
 #include <glib.h>
 #include <glib-object.h>
+#include <sys/types.h>
 #include "../3thrd/clib/c/clib.h"
 
 G_BEGIN_DECLS
@@ -16,6 +17,43 @@ G_BEGIN_DECLS
 
 typedef struct _SbCgroup                            SbCgroup;
 
+typedef enum
+{
+    SB_CGROUP_EVENT_POPULATED = 1,                  // cgroup 里有了第一个进程
+    SB_CGROUP_EVENT_EMPTY,                          // cgroup 里最后一个进程退出
+    SB_CGROUP_EVENT_PROCESS_STARTED,
+    SB_CGROUP_EVENT_PROCESS_EXITED,
+} SbCgroupEvent;
+
+/**
+ * @brief 沙盒进程集合的只读快照，pids 升序
+ */
+typedef struct
+{
+    gint                                            refCount;
+    guint                                           num;
+    pid_t                                           pids[];
+} SbCgroupProcs;
+
+/**
+ * @brief 沙盒整体的资源限额(cgroup v2)，0 表示不限制
+ */
+typedef struct
+{
+    guint                                           cpuPercent;         // cpu.max，100 表示一个核
+    guint64                                         memoryHigh;         // memory.high，字节，超过后限速回收
+    guint64                                         memoryMax;          // memory.max，字节，超过后 OOM
+    dev_t                                           ioDevice;           // io.max 限速的块设备，分区会换成所在的盘
+    guint64                                         ioReadBps;
+    guint64                                         ioWriteBps;
+    guint64                                         pidsMax;            // pids.max
+} SbCgroupLimits;
+
+/**
+ * @brief 在监控线程里回调，POPULATED/EMPTY 事件的 pid 为 0
+ */
+typedef void (*SbCgroupEventFunc)                   (SbCgroup* cgroup, SbCgroupEvent event, pid_t pid, gpointer udata);
+
 /**
  * @brief 监控沙盒进程创建以及给沙盒创建进程的产生的流量打标记
  */
@@ -23,6 +61,22 @@ typedef struct _SbCgroup                            SbCgroup;
 GType         sb_cgroup_get_type                    (void);
 SbCgroup*     sb_cgroup_new                         (void);
 bool          sb_cgroup_run                         (SbCgroup* cgroup);
+void          sb_cgroup_set_event_func              (SbCgroup* cgroup, SbCgroupEventFunc func, gpointer udata);
+
+/**
+ * @brief 不加锁取当前进程快照，用完调用 sb_cgroup_procs_unref，还没有开始监控时返回 NULL
+ */
+SbCgroupProcs* sb_cgroup_get_procs                  (SbCgroup* cgroup);
+void          sb_cgroup_procs_unref                 (SbCgroupProcs* procs);
+bool          sb_cgroup_procs_contains              (const SbCgroupProcs* procs, pid_t pid);
+
+/**
+ * @brief cgroup v2 下沙盒分成 workload(沙盒内程序，sb_cgroup_run 的调用者也在这里)和 fs(FUSE 挂载进程)两个兄弟 cgroup，
+ *        限额加在它们的父 cgroup 上，fs 的 cpu/io 权重更高并有内存保护，沙盒内程序抢不过挂载进程
+ */
+void          sb_cgroup_set_limits                  (SbCgroup* cgroup, const SbCgroupLimits* limits);
+char*         sb_cgroup_get_fs_procs_path           (SbCgroup* cgroup);                 // 挂载进程往里写 "0" 把自己移过去，不是 v2 时返回 NULL
+char*         sb_cgroup_read_stat                   (SbCgroup* cgroup);                 // 各层的 cpu.stat/memory.stat/io.stat，不是 v2 时返回 NULL
 
 G_END_DECLS
 
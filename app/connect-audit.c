@@ -0,0 +1,707 @@
+//
+// Created by dingjing on 12/8/24.
+//
+
+#include "connect-audit.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "../hook/hook-connect.h"
+#include "../3thrd/clib/c/clib.h"
+
+#define CONNECT_AUDIT_INTERVAL_MS       100                         // 取审计事件和检查策略文件的间隔
+
+typedef struct
+{
+    pid_t                   pid;
+    ino_t                   ino;                                    // 进程 exec 后会换新文件
+    uid_t                   uid;                                    // 文件属主，和目录属主、进程的 uid 都核对过
+    guint                   gen;                                    // 最近一次扫描时见到的轮次
+    HookConnectRing*        ring;
+    guint64                 tail;                                   // 只信自己记的位置，不读共享的 tail
+    guint64                 dropped;
+    char                    exe[HOOK_CONNECT_EXE_MAX];
+} AuditRing;
+
+typedef struct
+{
+    char*                   policyFile;
+    char*                   procRoot;                               // 沙盒 pid 命名空间的 proc，队列文件名里的 pid 在这里查
+    struct timespec         policyMtime;
+    gboolean                policyExists;
+    HookConnectPolicy*      policy;                                 // 读写映射，只在 start 和审计线程中写
+
+    GThread*                thread;
+    gint                    stop;
+    GHashTable*             rings;                                  // pid -> AuditRing，只在审计线程中访问
+    guint                   gen;
+
+    guint64                 events;
+} ConnectAudit;
+
+static ConnectAudit*            gsAudit = NULL;
+static __thread sigjmp_buf*     tsBusJmp = NULL;                   // 正在读某个队列，被进程截断时从这里跳出
+
+static void         audit_ring_free             (gpointer data);
+static void         connect_audit_sigbus        (int sig);
+static bool         connect_audit_parse_addr    (const char* str, HookConnectRule* rule);
+static bool         connect_audit_parse_port    (const char* str, HookConnectRule* rule);
+static bool         connect_audit_parse         (const char* policyFile, HookConnectPolicy* out);
+static void         connect_audit_publish       (ConnectAudit* ca, const HookConnectPolicy* np);
+static void         connect_audit_load          (ConnectAudit* ca, bool force);
+static bool         connect_audit_prepare_dir   (void);
+static int          connect_audit_check_owner   (const ConnectAudit* ca, pid_t pid, uid_t uid);
+static AuditRing*   connect_audit_map           (ConnectAudit* ca, int dirFd, const char* name, pid_t pid, uid_t uid);
+static bool         connect_audit_drain         (ConnectAudit* ca, AuditRing* ar);
+static void         connect_audit_log           (ConnectAudit* ca, const AuditRing* ar, const HookConnectEvent* ev);
+static void         connect_audit_scan_user     (ConnectAudit* ca, int dirFd, uid_t uid);
+static void         connect_audit_scan          (ConnectAudit* ca);
+static gpointer     connect_audit_thread        (gpointer udata);
+
+
+bool connect_audit_start(const char* policyFile, const char* procRoot)
+{
+    g_return_val_if_fail(!gsAudit && policyFile && procRoot, false);
+
+    if (!connect_audit_prepare_dir()) {
+        return false;
+    }
+
+    int fd = open(HOOK_CONNECT_POLICY_PATH, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        C_LOG_WARNING("connect audit open '%s' error: %s", HOOK_CONNECT_POLICY_PATH, strerror(errno));
+        return false;
+    }
+
+    void* ptr = MAP_FAILED;
+    if (0 == fchmod(fd, 0644) && 0 == ftruncate(fd, sizeof(HookConnectPolicy))) {
+        ptr = mmap(NULL, sizeof(HookConnectPolicy), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == ptr) {
+        C_LOG_WARNING("connect audit map '%s' error: %s", HOOK_CONNECT_POLICY_PATH, strerror(errno));
+        return false;
+    }
+
+    ConnectAudit* ca = g_new0(ConnectAudit, 1);
+    ca->policyFile = g_strdup(policyFile);
+    ca->procRoot = g_strdup(procRoot);
+    ca->policy = (HookConnectPolicy*) ptr;
+    ca->rings = g_hash_table_new_full(NULL, NULL, NULL, audit_ring_free);
+
+    // 上次守护进程更新到一半退出了，先让 seq 回到偶数
+    if (ca->policy->seq & 1) {
+        __atomic_add_fetch(&ca->policy->seq, 1, __ATOMIC_RELEASE);
+    }
+    connect_audit_load(ca, true);
+    __atomic_store_n(&ca->policy->magic, HOOK_CONNECT_POLICY_MAGIC, __ATOMIC_RELEASE);
+
+    struct sigaction sa = {0};
+    sa.sa_handler = connect_audit_sigbus;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+
+    ca->thread = g_thread_try_new("connect-audit", connect_audit_thread, ca, NULL);
+    if (!ca->thread) {
+        C_LOG_WARNING("start connect audit thread error");
+        munmap(ca->policy, sizeof(HookConnectPolicy));
+        g_hash_table_unref(ca->rings);
+        g_free(ca->policyFile);
+        g_free(ca->procRoot);
+        g_free(ca);
+        return false;
+    }
+
+    gsAudit = ca;
+    connect_audit_add_user(0, 0);
+    C_LOG_INFO("connect audit started, policy: '%s'", policyFile);
+
+    return true;
+}
+
+void connect_audit_stop(void)
+{
+    ConnectAudit* ca = gsAudit;
+    if (!ca) {
+        return;
+    }
+    gsAudit = NULL;
+
+    g_atomic_int_set(&ca->stop, 1);
+    g_thread_join(ca->thread);
+
+    C_LOG_INFO("connect audit: %" G_GUINT64_FORMAT " events", ca->events);
+
+    // 策略文件和队列文件留着，沙盒内的进程还映射着
+    g_hash_table_unref(ca->rings);
+    munmap(ca->policy, sizeof(HookConnectPolicy));
+    g_free(ca->policyFile);
+    g_free(ca->procRoot);
+    g_free(ca);
+}
+
+/**
+ * 子目录只有该用户能写，别的用户既不能替它建队列，也不能删它的队列
+ */
+void connect_audit_add_user(uid_t uid, gid_t gid)
+{
+    if (!gsAudit) {
+        return;
+    }
+
+    char path[HOOK_CONNECT_RING_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%u", HOOK_CONNECT_RING_DIR, (unsigned) uid);
+    if (0 != mkdir(path, 0700) && EEXIST != errno) {
+        C_LOG_WARNING("connect audit mkdir '%s' error: %s", path, strerror(errno));
+        return;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || 0 != fchown(fd, uid, gid) || 0 != fchmod(fd, 0700)) {
+        C_LOG_WARNING("connect audit prepare '%s' error: %s", path, strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/**
+ * 宿主机上的用户不应该能往审计目录里放队列或删掉队列: 在守护进程私有的挂载命名空间里
+ * 挂一个 tmpfs，宿主机上只能看到底下的空目录，沙盒通过 rootfs 的绑定挂载访问它。
+ * 根目录 root 所有、0711，只能按路径访问策略文件和自己用户的子目录
+ */
+static bool connect_audit_prepare_dir (void)
+{
+    if (0 != mkdir(HOOK_CONNECT_DIR, 0711) && EEXIST != errno) {
+        C_LOG_WARNING("connect audit mkdir '%s' error: %s", HOOK_CONNECT_DIR, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (0 != lstat(HOOK_CONNECT_DIR, &st) || !S_ISDIR(st.st_mode) || 0 != st.st_uid
+        || 0 != chmod(HOOK_CONNECT_DIR, 0711)) {
+        C_LOG_WARNING("connect audit '%s' is not a directory owned by root", HOOK_CONNECT_DIR);
+        return false;
+    }
+
+    if (0 != mount("tmpfs", HOOK_CONNECT_DIR, "tmpfs", MS_NOSUID | MS_NODEV | MS_NOEXEC, "mode=0711,size=64m")) {
+        C_LOG_WARNING("connect audit mount tmpfs on '%s' error: %s, host users can reach the rings", HOOK_CONNECT_DIR, strerror(errno));
+    }
+
+    return true;
+}
+
+/**
+ * 队列文件属主必须是 pid 对应进程的某个 uid(实际/有效/保存/文件系统)；进程已经退出时只能靠目录属主
+ * @return 1 属于该进程；0 不属于；-1 进程还在但读不到 status，下一轮再看
+ */
+static int connect_audit_check_owner (const ConnectAudit* ca, pid_t pid, uid_t uid)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%d/status", ca->procRoot, pid);
+
+    char* content = NULL;
+    if (!g_file_get_contents(path, &content, NULL, NULL)) {
+        return (0 != kill(pid, 0) && ESRCH == errno) ? 1 : -1;
+    }
+
+    int ret = 0;
+    const char* line = strstr(content, "\nUid:");
+    if (line) {
+        unsigned ids[4] = {0};
+        if (4 == sscanf(line + strlen("\nUid:"), "%u %u %u %u", &ids[0], &ids[1], &ids[2], &ids[3])) {
+            for (int i = 0; i < 4 && !ret; ++i) {
+                ret = (ids[i] == uid) ? 1 : 0;
+            }
+        }
+    }
+    g_free(content);
+
+    return ret;
+}
+
+/**
+ * 打开并核对一个队列文件，不合格的返回 NULL，还没初始化完的也返回 NULL(下一轮再看)
+ */
+static AuditRing* connect_audit_map (ConnectAudit* ca, int dirFd, const char* name, pid_t pid, uid_t uid)
+{
+    int fd = openat(dirFd, name, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    void* ptr = MAP_FAILED;
+    if (0 != fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < (off_t) sizeof(HookConnectRing)) {
+        close(fd);
+        return NULL;
+    }
+
+    const int owner = (st.st_uid == uid) ? connect_audit_check_owner(ca, pid, st.st_uid) : 0;
+    if (1 == owner) {
+        ptr = mmap(NULL, sizeof(HookConnectRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    else if (0 == owner) {
+        C_LOG_WARNING("connect audit ring '%s' of uid %u does not belong to pid %d, removed", name, (unsigned) st.st_uid, pid);
+        unlinkat(dirFd, name, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == ptr) {
+        return NULL;
+    }
+    if (HOOK_CONNECT_RING_MAGIC != __atomic_load_n(&((HookConnectRing*) ptr)->magic, __ATOMIC_ACQUIRE)) {
+        munmap(ptr, sizeof(HookConnectRing));
+        return NULL;
+    }
+
+    AuditRing* ar = g_new0(AuditRing, 1);
+    ar->pid = pid;
+    ar->ino = st.st_ino;
+    ar->uid = st.st_uid;
+    ar->ring = (HookConnectRing*) ptr;
+
+    // 进程名以 /proc 为准，队列头里的是进程自己写的
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%d/exe", ca->procRoot, pid);
+    const ssize_t len = readlink(path, ar->exe, sizeof(ar->exe) - 1);
+    ar->exe[len > 0 ? len : 0] = '\0';
+    if (!ar->exe[0]) {
+        g_strlcpy(ar->exe, "<unknown>", sizeof(ar->exe));
+    }
+
+    return ar;
+}
+
+static void audit_ring_free (gpointer data)
+{
+    AuditRing* ar = (AuditRing*) data;
+
+    munmap(ar->ring, sizeof(HookConnectRing));
+    g_free(ar);
+}
+
+static void connect_audit_sigbus (int sig)
+{
+    if (tsBusJmp) {
+        siglongjmp(*tsBusJmp, 1);
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static bool connect_audit_parse_addr (const char* str, HookConnectRule* rule)
+{
+    if (0 == g_ascii_strcasecmp(str, "any")) {
+        rule->family = 0;
+        rule->prefixLen = 0;
+        return true;
+    }
+
+    char** parts = g_strsplit(str, "/", 2);
+    bool ret = true;
+    int maxBits = 0;
+    if (1 == inet_pton(AF_INET, parts[0], rule->addr)) {
+        rule->family = AF_INET;
+        maxBits = 32;
+    }
+    else if (1 == inet_pton(AF_INET6, parts[0], rule->addr)) {
+        rule->family = AF_INET6;
+        maxBits = 128;
+    }
+    else {
+        ret = false;
+    }
+
+    rule->prefixLen = (guint8) maxBits;
+    if (ret && parts[1]) {
+        char* end = NULL;
+        guint64 bits = g_ascii_strtoull(parts[1], &end, 10);
+        if (!parts[1][0] || *end || bits > (guint64) maxBits) {
+            ret = false;
+        }
+        rule->prefixLen = (guint8) bits;
+    }
+    g_strfreev(parts);
+
+    return ret;
+}
+
+static bool connect_audit_parse_port (const char* str, HookConnectRule* rule)
+{
+    if (0 == g_ascii_strcasecmp(str, "any")) {
+        rule->portMin = 0;
+        rule->portMax = G_MAXUINT16;
+        return true;
+    }
+
+    char* end = NULL;
+    guint64 min = g_ascii_strtoull(str, &end, 10);
+    guint64 max = min;
+    if (end == str) {
+        return false;
+    }
+    if ('-' == *end) {
+        const char* next = end + 1;
+        max = g_ascii_strtoull(next, &end, 10);
+        if (end == next) {
+            return false;
+        }
+    }
+    if (*end || min > max || max > G_MAXUINT16) {
+        return false;
+    }
+
+    rule->portMin = (guint16) min;
+    rule->portMax = (guint16) max;
+
+    return true;
+}
+
+static bool connect_audit_parse (const char* policyFile, HookConnectPolicy* out)
+{
+    char* content = NULL;
+    if (!g_file_get_contents(policyFile, &content, NULL, NULL)) {
+        return false;
+    }
+
+    memset(out, 0, sizeof(HookConnectPolicy));
+    out->defaultAction = HOOK_CONNECT_ALLOW;
+    out->audit = HOOK_CONNECT_AUDIT_DENY;
+
+    char** lines = g_strsplit(content, "\n", -1);
+    for (int i = 0; lines[i]; ++i) {
+        char* hash = strchr(lines[i], '#');
+        if (hash) {
+            *hash = '\0';
+        }
+
+        char** tokens = g_strsplit_set(g_strstrip(lines[i]), " \t", -1);
+        int n = 0;
+        for (int j = 0; tokens[j]; ++j) {
+            if (tokens[j][0]) {
+                tokens[n++] = tokens[j];
+            }
+            else {
+                g_free(tokens[j]);
+            }
+        }
+        tokens[n] = NULL;
+
+        bool ok = true;
+        if (0 == n) {
+            // 空行
+        }
+        else if (2 == n && 0 == g_ascii_strcasecmp(tokens[0], "default")) {
+            if (0 == g_ascii_strcasecmp(tokens[1], "allow"))        { out->defaultAction = HOOK_CONNECT_ALLOW; }
+            else if (0 == g_ascii_strcasecmp(tokens[1], "deny"))    { out->defaultAction = HOOK_CONNECT_DENY; }
+            else                                                    { ok = false; }
+        }
+        else if (2 == n && 0 == g_ascii_strcasecmp(tokens[0], "audit")) {
+            if (0 == g_ascii_strcasecmp(tokens[1], "none"))         { out->audit = 0; }
+            else if (0 == g_ascii_strcasecmp(tokens[1], "deny"))    { out->audit = HOOK_CONNECT_AUDIT_DENY; }
+            else if (0 == g_ascii_strcasecmp(tokens[1], "allow"))   { out->audit = HOOK_CONNECT_AUDIT_ALLOW; }
+            else if (0 == g_ascii_strcasecmp(tokens[1], "all"))     { out->audit = HOOK_CONNECT_AUDIT_ALLOW | HOOK_CONNECT_AUDIT_DENY; }
+            else                                                    { ok = false; }
+        }
+        else if (n >= 2 && n <= 4 && (0 == g_ascii_strcasecmp(tokens[0], "allow") || 0 == g_ascii_strcasecmp(tokens[0], "deny"))) {
+            HookConnectRule rule = {0};
+            rule.action = (0 == g_ascii_strcasecmp(tokens[0], "allow")) ? HOOK_CONNECT_ALLOW : HOOK_CONNECT_DENY;
+            rule.portMax = G_MAXUINT16;
+            ok = connect_audit_parse_addr(tokens[1], &rule);
+            for (int j = 2; ok && j < n; ++j) {
+                if (0 == g_ascii_strcasecmp(tokens[j], "tcp"))      { rule.proto = IPPROTO_TCP; }
+                else if (0 == g_ascii_strcasecmp(tokens[j], "udp")) { rule.proto = IPPROTO_UDP; }
+                else                                                { ok = connect_audit_parse_port(tokens[j], &rule); }
+            }
+
+            if (ok && out->nRules >= HOOK_CONNECT_RULES_MAX) {
+                C_LOG_WARNING("connect policy '%s': more than %d rules, the rest are ignored", policyFile, HOOK_CONNECT_RULES_MAX);
+            }
+            else if (ok) {
+                out->rules[out->nRules++] = rule;
+                if (rule.proto) {
+                    out->flags |= HOOK_CONNECT_POLICY_NEED_PROTO;
+                }
+            }
+        }
+        else {
+            ok = false;
+        }
+
+        if (!ok) {
+            C_LOG_WARNING("connect policy '%s' line %d is invalid, ignored", policyFile, i + 1);
+        }
+        g_strfreev(tokens);
+    }
+    g_strfreev(lines);
+    g_free(content);
+
+    return true;
+}
+
+static void connect_audit_publish (ConnectAudit* ca, const HookConnectPolicy* np)
+{
+    HookConnectPolicy* p = ca->policy;
+
+    // seqlock: 读者看到奇数或者前后 seq 不一致就重新匹配
+    const uint32_t seq = __atomic_load_n(&p->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    p->defaultAction = np->defaultAction;
+    p->audit = np->audit;
+    p->flags = np->flags;
+    p->nRules = np->nRules;
+    memcpy(p->rules, np->rules, sizeof(HookConnectRule) * np->nRules);
+
+    __atomic_store_n(&p->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void connect_audit_load (ConnectAudit* ca, bool force)
+{
+    struct stat st;
+    const bool exists = (0 == stat(ca->policyFile, &st));
+    if (!force && exists == ca->policyExists
+        && (!exists || (st.st_mtim.tv_sec == ca->policyMtime.tv_sec && st.st_mtim.tv_nsec == ca->policyMtime.tv_nsec))) {
+        return;
+    }
+    ca->policyExists = exists;
+    ca->policyMtime = exists ? st.st_mtim : (struct timespec) {0};
+
+    HookConnectPolicy* np = g_new0(HookConnectPolicy, 1);
+    if (!exists || !connect_audit_parse(ca->policyFile, np)) {
+        // 没有策略文件: 全部放行，只审计拒绝(也就没有)
+        memset(np, 0, sizeof(HookConnectPolicy));
+        np->defaultAction = HOOK_CONNECT_ALLOW;
+        np->audit = HOOK_CONNECT_AUDIT_DENY;
+    }
+
+    connect_audit_publish(ca, np);
+    C_LOG_INFO("connect policy loaded: %u rules, default %s", np->nRules,
+               (HOOK_CONNECT_DENY == np->defaultAction) ? "deny" : "allow");
+    g_free(np);
+}
+
+/**
+ * @return false 队列文件被截断等无法再读，调用者丢掉这个队列
+ */
+static bool connect_audit_drain (ConnectAudit* ca, AuditRing* ar)
+{
+    // 队列文件由沙盒内的进程创建，它随时可以截断文件，访问映射会 SIGBUS
+    sigjmp_buf jmp;
+    if (sigsetjmp(jmp, 1)) {
+        tsBusJmp = NULL;
+        C_LOG_WARNING("connect audit ring of pid %d is truncated", ar->pid);
+        return false;
+    }
+    tsBusJmp = &jmp;
+
+    HookConnectRing* ring = ar->ring;
+
+    // 一次最多取一圈，防止生产者一直写
+    const uint64_t mask = HOOK_CONNECT_RING_SLOTS - 1;
+    for (int i = 0; i < HOOK_CONNECT_RING_SLOTS; ++i) {
+        HookConnectEvent* slot = &ring->slots[ar->tail & mask];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ar->tail + 1) {
+            break;
+        }
+
+        HookConnectEvent ev = *slot;
+        __atomic_store_n(&slot->seq, ar->tail + HOOK_CONNECT_RING_SLOTS, __ATOMIC_RELEASE);
+        ++ar->tail;
+        __atomic_store_n(&ring->tail, ar->tail, __ATOMIC_RELAXED);
+
+        connect_audit_log(ca, ar, &ev);
+    }
+
+    const uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    tsBusJmp = NULL;
+
+    if (dropped > ar->dropped) {
+        C_LOG_WARNING("[connect] pid: %d, exe: '%s', %" G_GUINT64_FORMAT " events dropped",
+                      ar->pid, ar->exe, (guint64) (dropped - ar->dropped));
+        ar->dropped = dropped;
+    }
+
+    return true;
+}
+
+static void connect_audit_log (ConnectAudit* ca, const AuditRing* ar, const HookConnectEvent* ev)
+{
+    char addr[INET6_ADDRSTRLEN] = {0};
+    const bool v6 = (AF_INET6 == ev->family);
+    if (!inet_ntop(v6 ? AF_INET6 : AF_INET, ev->addr, addr, sizeof(addr))) {
+        g_strlcpy(addr, "?", sizeof(addr));
+    }
+
+    const char* call = "connect";
+    switch (ev->call) {
+        case HOOK_CONNECT_CALL_SENDTO:  { call = "sendto";  break; }
+        case HOOK_CONNECT_CALL_SENDMSG: { call = "sendmsg"; break; }
+        default: break;
+    }
+
+    const char* proto = (IPPROTO_TCP == ev->proto) ? "tcp" : ((IPPROTO_UDP == ev->proto) ? "udp" : "-");
+
+    ++ca->events;
+    C_LOG_INFO("[connect] %s pid: %d, uid: %u, exe: '%s', %s %s%s%s:%u by %s, time: %" G_GUINT64_FORMAT ".%03u",
+               ev->action ? "deny" : "allow", ar->pid, ar->uid, ar->exe, proto,
+               v6 ? "[" : "", addr, v6 ? "]" : "", ev->port, call,
+               (guint64) (ev->time / 1000000000ULL), (guint) (ev->time % 1000000000ULL / 1000000));
+}
+
+static void connect_audit_scan_user (ConnectAudit* ca, int dirFd, uid_t uid)
+{
+    DIR* dir = fdopendir(dirFd);
+    if (!dir) {
+        close(dirFd);
+        return;
+    }
+
+    const size_t prefixLen = strlen(HOOK_CONNECT_RING_PREFIX);
+    struct dirent* ent = NULL;
+    while ((ent = readdir(dir))) {
+        if (0 != strncmp(ent->d_name, HOOK_CONNECT_RING_PREFIX, prefixLen)) {
+            continue;
+        }
+
+        // ring-<pid> 或 exec 前留下的 ring-<pid>.<inode>
+        char* end = NULL;
+        const char* pidStr = ent->d_name + prefixLen;
+        gint64 pid = g_ascii_strtoll(pidStr, &end, 10);
+        const bool retired = ('.' == *end);
+        if (end == pidStr || (*end && !retired) || pid <= 0 || pid > G_MAXINT32) {
+            continue;
+        }
+
+        struct stat st;
+        if (0 != fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size < (off_t) sizeof(HookConnectRing)) {
+            if (retired || (0 != kill((pid_t) pid, 0) && ESRCH == errno)) {
+                unlinkat(dirfd(dir), ent->d_name, 0);
+            }
+            continue;
+        }
+
+        AuditRing* ar = g_hash_table_lookup(ca->rings, GINT_TO_POINTER(pid));
+        if (retired) {
+            // 已经映射着的就用原来的位置取，否则从共享的 tail 开始，取空后删除
+            if (ar && ar->ino == st.st_ino) {
+                connect_audit_drain(ca, ar);
+                g_hash_table_remove(ca->rings, GINT_TO_POINTER(pid));
+            }
+            else {
+                AuditRing* old = connect_audit_map(ca, dirfd(dir), ent->d_name, (pid_t) pid, uid);
+                if (old) {
+                    old->tail = __atomic_load_n(&old->ring->tail, __ATOMIC_RELAXED);
+                    connect_audit_drain(ca, old);
+                    audit_ring_free(old);
+                }
+            }
+            unlinkat(dirfd(dir), ent->d_name, 0);
+            continue;
+        }
+
+        if (ar && ar->ino != st.st_ino) {
+            // exec 或 pid 复用后是新文件，旧的取完再换
+            connect_audit_drain(ca, ar);
+            g_hash_table_remove(ca->rings, GINT_TO_POINTER(pid));
+            ar = NULL;
+        }
+
+        if (!ar) {
+            ar = connect_audit_map(ca, dirfd(dir), ent->d_name, (pid_t) pid, uid);
+            if (!ar) {
+                continue;
+            }
+            g_hash_table_insert(ca->rings, GINT_TO_POINTER(pid), ar);
+        }
+
+        ar->gen = ca->gen;
+        if (!connect_audit_drain(ca, ar)) {
+            unlinkat(dirfd(dir), ent->d_name, 0);
+            g_hash_table_remove(ca->rings, GINT_TO_POINTER(pid));
+            continue;
+        }
+
+        // 进程退出后取空就删掉
+        if (0 != kill(ar->pid, 0) && ESRCH == errno) {
+            connect_audit_drain(ca, ar);
+            unlinkat(dirfd(dir), ent->d_name, 0);
+            g_hash_table_remove(ca->rings, GINT_TO_POINTER(pid));
+        }
+    }
+    closedir(dir);
+}
+
+static void connect_audit_scan (ConnectAudit* ca)
+{
+    DIR* dir = opendir(HOOK_CONNECT_RING_DIR);
+    if (!dir) {
+        return;
+    }
+
+    ++ca->gen;
+    struct dirent* ent = NULL;
+    while ((ent = readdir(dir))) {
+        // 只看 connect_audit_add_user 建的 <uid> 子目录，属主必须就是这个 uid
+        char* end = NULL;
+        const guint64 uid = g_ascii_strtoull(ent->d_name, &end, 10);
+        if (end == ent->d_name || *end || uid > G_MAXUINT32) {
+            continue;
+        }
+
+        const int fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        struct stat st;
+        if (0 != fstat(fd, &st) || st.st_uid != (uid_t) uid || (st.st_mode & 022)) {
+            close(fd);
+            continue;
+        }
+        connect_audit_scan_user(ca, fd, (uid_t) uid);
+    }
+    closedir(dir);
+
+    // 文件被别人删了
+    GHashTableIter iter;
+    gpointer value = NULL;
+    g_hash_table_iter_init(&iter, ca->rings);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        if (((AuditRing*) value)->gen != ca->gen) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+}
+
+static gpointer connect_audit_thread (gpointer udata)
+{
+    ConnectAudit* ca = (ConnectAudit*) udata;
+
+    while (!g_atomic_int_get(&ca->stop)) {
+        connect_audit_load(ca, false);
+        connect_audit_scan(ca);
+        g_usleep(CONNECT_AUDIT_INTERVAL_MS * 1000);
+    }
+
+    connect_audit_scan(ca);
+
+    return NULL;
+}
@@ -0,0 +1,24 @@
+//
+// Created by dingjing on 12/8/24.
+//
+
+#ifndef sandbox_CONNECT_AUDIT_H
+#define sandbox_CONNECT_AUDIT_H
+
+/**
+ * 沙盒网络访问策略与审计(守护进程一侧)，和 hook-connect.so 共享的内存布局见 hook/hook-connect.h
+ *
+ * 策略文件是文本，每行一条，# 开头为注释，规则按出现顺序匹配，第一条命中的生效:
+ *   default allow|deny                                  没有规则命中时的动作，默认 allow
+ *   audit none|deny|allow|all                           哪些动作要记审计，默认 deny
+ *   allow|deny <any|地址[/前缀]> [端口[-端口]] [tcp|udp]  地址可以是 IPv4 或 IPv6
+ * 文件修改后自动重新加载。
+ */
+#include <stdbool.h>
+#include <sys/types.h>
+
+bool    connect_audit_start     (const char* policyFile, const char* procRoot);                 // 创建共享目录，发布策略，启动取审计事件的线程；procRoot 是沙盒 pid 命名空间的 proc
+void    connect_audit_add_user  (uid_t uid, gid_t gid);                                         // 为沙盒内以该用户运行的进程创建队列目录
+void    connect_audit_stop      (void);
+
+#endif // sandbox_CONNECT_AUDIT_H
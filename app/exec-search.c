@@ -0,0 +1,66 @@
+//
+// Created by dingjing on 12/16/24.
+//
+
+#include "exec-search.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "../3thrd/clib/c/clib.h"
+
+
+#define CHECK_AND_RUN(dir)                              \
+do {                                                    \
+    char* cmdPath = c_strdup_printf("%s/%s", dir, cmd); \
+    C_LOG_VERB("Found cmd: '%s'", cmdPath);             \
+    if (c_file_test(cmdPath, C_FILE_TEST_EXISTS)) {     \
+        C_LOG_VERB("run cmd: '%s'", cmdPath);           \
+        char* argv[] = { cmdPath, NULL };               \
+        errno = 0;                                      \
+        execvpe(cmdPath, argv, env);                    \
+        err = errno;                                    \
+        C_LOG_ERROR("execute cmd '%s' error: %s",       \
+            cmdPath, c_strerror(err));                  \
+    }                                                   \
+    c_free(cmdPath);                                    \
+} while (0)
+
+
+int exec_search_run (const char* cmd, char** env, int notifyFd)
+{
+    int err = ENOENT;
+
+    C_LOG_VERB("Start execute cmd '%s' ...", cmd);
+    if (cmd[0] == '/') {
+        C_LOG_VERB("run cmd: '%s'", cmd);
+        char* argv[] = { (char*) cmd, NULL };
+        errno = 0;
+        execvpe(cmd, argv, env);
+        err = errno;
+        C_LOG_ERROR("execute cmd '%s' error: %s", cmd, c_strerror(err));
+    }
+    else {
+        CHECK_AND_RUN("/usr/local/andsec/sandbox/bin");
+
+        CHECK_AND_RUN("/bin");
+        CHECK_AND_RUN("/usr/bin");
+        CHECK_AND_RUN("/usr/local/bin");
+
+        CHECK_AND_RUN("/sbin");
+        CHECK_AND_RUN("/usr/sbin");
+        CHECK_AND_RUN("/usr/local/sbin");
+
+        if (ENOENT == err) {
+            C_LOG_ERROR("Cannot found binary path");
+        }
+    }
+
+    // exec 失败时 errno 不会是 0，保险起见仍按找不到处理，避免父进程把它当成启动成功
+    if (0 == err) {
+        err = ENOENT;
+    }
+    ssize_t C_UNUSED ret = write(notifyFd, &err, sizeof(err));
+
+    return err;
+}
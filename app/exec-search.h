@@ -0,0 +1,18 @@
+//
+// Created by dingjing on 12/16/24.
+//
+
+#ifndef sandbox_EXEC_SEARCH_H
+#define sandbox_EXEC_SEARCH_H
+
+/**
+ * 在 fork 出的子进程里启动沙盒程序: cmd 是绝对路径时直接 exec，
+ * 否则依次在沙盒自带目录和 bin/sbin 目录中查找，找到就 exec，exec 失败接着找下一个目录。
+ *
+ * 成功时不返回，通知管道随 exec 关闭(O_CLOEXEC)，父进程读到 EOF；
+ * 都失败时把最后一次 exec 的 errno(一个都没找到则为 ENOENT)写入 notifyFd 后返回该 errno。
+ */
+
+int         exec_search_run             (const char* cmd, char** env, int notifyFd);
+
+#endif // sandbox_EXEC_SEARCH_H
@@ -0,0 +1,592 @@
+//
+// Created by dingjing on 12/2/24.
+//
+
+#include "change-notify.h"
+
+#include <glib.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "../../3thrd/clib/c/clib.h"
+
+#define CHANGE_NOTIFY_WINDOW_MS         50                          // 合并窗口
+#define CHANGE_NOTIFY_MAX_PENDING       (64 * 1024)                 // 一个窗口内最多记录的路径数，再多就让订阅者重新读取
+#define CHANGE_NOTIFY_MAX_SUBSCRIBERS   32
+#define CHANGE_NOTIFY_SNDBUF            (1 << 20)
+#define CHANGE_NOTIFY_MAX_USERS         16                          // 可以订阅的非 root 用户数
+
+typedef struct
+{
+    guint32                 seq;                                    // 第一次出现的顺序，发送时按它排序
+    guint8                  type;                                   // 合并后的 SandboxFsEventType
+    gboolean                changed;                                // MOVED 之后又有修改
+    char*                   from;                                   // MOVED 的旧路径
+} PendingEvent;
+
+typedef struct
+{
+    int                     fd;
+    gboolean                overflow;                               // 有事件没发出去，下一个包必须是 RESCAN
+} Subscriber;
+
+typedef struct
+{
+    GMutex                  lock;
+    GHashTable*             pending;                                // 路径 -> PendingEvent
+    guint32                 seq;
+    gboolean                overflow;                               // 本窗口记录不下了
+    gint                    nrSubscribers;                          // 原子读，没有订阅者时不记录
+    uid_t                   allowUids[CHANGE_NOTIFY_MAX_USERS];     // lock 保护，root 总是可以订阅
+    int                     nrAllowUids;
+
+    GThread*                thread;
+    gint                    stop;
+    int                     listenFd;
+    Subscriber              subscribers[CHANGE_NOTIFY_MAX_SUBSCRIBERS];
+    int                     nrSubs;                                 // 只在发送线程中访问
+
+    guint64                 posted;
+    guint64                 sent;
+} ChangeNotify;
+
+typedef struct
+{
+    const char*             path;
+    PendingEvent*           ev;
+} FlushItem;
+
+static ChangeNotify* gsNotify = NULL;
+
+static void         pending_event_free          (gpointer data);
+static void         change_record_locked        (ChangeNotify* cn, const char* path, SandboxFsEventType type);
+static gint         flush_item_compare          (gconstpointer a, gconstpointer b);
+static void         subscriber_send             (ChangeNotify* cn, Subscriber* sub, const char* buf, gsize len);
+static void         change_flush                (ChangeNotify* cn);
+static bool         change_prepare_dir          (void);
+static void         change_accept               (ChangeNotify* cn);
+static bool         change_uid_allowed          (ChangeNotify* cn, uid_t uid);
+static void         subscriber_remove           (ChangeNotify* cn, int i);
+static gpointer     change_notify_thread        (gpointer udata);
+
+
+bool change_notify_start(void)
+{
+    g_return_val_if_fail(!gsNotify, false);
+
+    if (!change_prepare_dir()) {
+        return false;
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    g_strlcpy(addr.sun_path, SANDBOX_FS_EVENTS_SOCKET, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        C_LOG_WARNING("change notify socket error: %s", strerror(errno));
+        return false;
+    }
+
+    // 上次异常退出留下的 socket 文件
+    unlink(SANDBOX_FS_EVENTS_SOCKET);
+    if (0 != bind(fd, (struct sockaddr*) &addr, sizeof(addr))
+        || 0 != chmod(SANDBOX_FS_EVENTS_SOCKET, 0666)
+        || 0 != listen(fd, 8)) {
+        C_LOG_WARNING("change notify bind error: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    ChangeNotify* cn = g_new0(ChangeNotify, 1);
+    g_mutex_init(&cn->lock);
+    cn->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, pending_event_free);
+    cn->listenFd = fd;
+
+    cn->thread = g_thread_try_new("change-notify", change_notify_thread, cn, NULL);
+    if (!cn->thread) {
+        C_LOG_WARNING("start change notify thread error");
+        gsNotify = cn;
+        change_notify_stop();
+        return false;
+    }
+
+    gsNotify = cn;
+
+    return true;
+}
+
+void change_notify_stop(void)
+{
+    ChangeNotify* cn = gsNotify;
+    if (!cn) {
+        return;
+    }
+
+    g_atomic_int_set(&cn->stop, 1);
+    if (cn->thread) {
+        g_thread_join(cn->thread);
+    }
+
+    for (int i = 0; i < cn->nrSubs; ++i) {
+        close(cn->subscribers[i].fd);
+    }
+    if (cn->listenFd >= 0) {
+        close(cn->listenFd);
+        unlink(SANDBOX_FS_EVENTS_SOCKET);
+    }
+
+    C_LOG_INFO("change notify: %" G_GUINT64_FORMAT " events posted, %" G_GUINT64_FORMAT " batches sent", cn->posted, cn->sent);
+
+    g_hash_table_destroy(cn->pending);
+    g_mutex_clear(&cn->lock);
+    g_free(cn);
+    gsNotify = NULL;
+}
+
+void change_notify_add(const char* path, SandboxFsEventType type)
+{
+    ChangeNotify* cn = gsNotify;
+    if (!cn || !path || 0 == g_atomic_int_get(&cn->nrSubscribers)) {
+        return;
+    }
+
+    g_mutex_lock(&cn->lock);
+    ++cn->posted;
+    change_record_locked(cn, path, type);
+    g_mutex_unlock(&cn->lock);
+}
+
+void change_notify_move(const char* from, const char* to)
+{
+    ChangeNotify* cn = gsNotify;
+    if (!cn || !from || !to || 0 == g_atomic_int_get(&cn->nrSubscribers)) {
+        return;
+    }
+
+    g_mutex_lock(&cn->lock);
+    do {
+        ++cn->posted;
+        if (cn->overflow) {
+            break;
+        }
+
+        char* oldKey = NULL;
+        PendingEvent* old = NULL;
+        if (!g_hash_table_steal_extended(cn->pending, from, (gpointer*) &oldKey, (gpointer*) &old)) {
+            old = NULL;
+        }
+        g_free(oldKey);
+
+        PendingEvent* ev = g_new0(PendingEvent, 1);
+        ev->seq = old ? old->seq : cn->seq++;
+        if (old && SANDBOX_FS_EVENT_CREATED == old->type) {
+            // 窗口内新建的文件，订阅者还没见过旧名字
+            ev->type = SANDBOX_FS_EVENT_CREATED;
+        }
+        else if (old && SANDBOX_FS_EVENT_MOVED == old->type && 0 == strcmp(old->from, to)) {
+            // 改回了原来的名字
+            ev->type = SANDBOX_FS_EVENT_CHANGED;
+        }
+        else {
+            ev->type = SANDBOX_FS_EVENT_MOVED;
+            ev->from = g_strdup((old && old->from) ? old->from : from);
+            ev->changed = old && (old->changed || SANDBOX_FS_EVENT_CHANGED == old->type);
+        }
+        pending_event_free(old);
+
+        g_hash_table_replace(cn->pending, g_strdup(to), ev);
+        if (g_hash_table_size(cn->pending) > CHANGE_NOTIFY_MAX_PENDING) {
+            cn->overflow = TRUE;
+        }
+    } while (0);
+    g_mutex_unlock(&cn->lock);
+}
+
+/**
+ * 只增不减，每个启动过沙盒程序的客户端用户都能订阅，后来的用户不会挤掉之前的
+ */
+void change_notify_allow(uid_t uid)
+{
+    ChangeNotify* cn = gsNotify;
+    if (!cn || 0 == uid) {
+        return;
+    }
+
+    g_mutex_lock(&cn->lock);
+    int i = 0;
+    for (; i < cn->nrAllowUids && cn->allowUids[i] != uid; ++i) {}
+    if (i == cn->nrAllowUids) {
+        if (cn->nrAllowUids < CHANGE_NOTIFY_MAX_USERS) {
+            cn->allowUids[cn->nrAllowUids++] = uid;
+        }
+        else {
+            C_LOG_WARNING("change notify: too many users, uid %u is not allowed", uid);
+        }
+    }
+    g_mutex_unlock(&cn->lock);
+}
+
+static void pending_event_free(gpointer data)
+{
+    PendingEvent* ev = data;
+    if (ev) {
+        g_free(ev->from);
+        g_free(ev);
+    }
+}
+
+static void change_record_locked(ChangeNotify* cn, const char* path, SandboxFsEventType type)
+{
+    if (cn->overflow) {
+        return;
+    }
+
+    PendingEvent* ev = g_hash_table_lookup(cn->pending, path);
+    if (!ev) {
+        if (g_hash_table_size(cn->pending) >= CHANGE_NOTIFY_MAX_PENDING) {
+            cn->overflow = TRUE;
+            return;
+        }
+        ev = g_new0(PendingEvent, 1);
+        ev->seq = cn->seq++;
+        ev->type = type;
+        g_hash_table_insert(cn->pending, g_strdup(path), ev);
+        return;
+    }
+
+    switch (type) {
+        case SANDBOX_FS_EVENT_CREATED: {
+            if (SANDBOX_FS_EVENT_DELETED == ev->type) {
+                ev->type = SANDBOX_FS_EVENT_CHANGED;                // 被替换
+            }
+            break;
+        }
+        case SANDBOX_FS_EVENT_CHANGED: {
+            if (SANDBOX_FS_EVENT_MOVED == ev->type) {
+                ev->changed = TRUE;
+            }
+            break;
+        }
+        case SANDBOX_FS_EVENT_DELETED: {
+            if (SANDBOX_FS_EVENT_CREATED == ev->type) {
+                g_hash_table_remove(cn->pending, path);             // 订阅者从没见过它
+            }
+            else if (SANDBOX_FS_EVENT_MOVED == ev->type) {
+                char* from = g_steal_pointer(&ev->from);
+                g_hash_table_remove(cn->pending, path);
+                change_record_locked(cn, from, SANDBOX_FS_EVENT_DELETED);
+                g_free(from);
+            }
+            else {
+                ev->type = SANDBOX_FS_EVENT_DELETED;
+            }
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+static gint flush_item_compare(gconstpointer a, gconstpointer b)
+{
+    const FlushItem* ia = a;
+    const FlushItem* ib = b;
+
+    return (ia->ev->seq > ib->ev->seq) - (ia->ev->seq < ib->ev->seq);
+}
+
+static void subscriber_send(ChangeNotify* cn, Subscriber* sub, const char* buf, gsize len)
+{
+    if (sub->fd < 0 || sub->overflow) {
+        return;
+    }
+
+    if (send(sub->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        if (EAGAIN == errno || EWOULDBLOCK == errno) {
+            sub->overflow = TRUE;
+        }
+        else {
+            close(sub->fd);
+            sub->fd = -1;
+        }
+        return;
+    }
+    ++cn->sent;
+}
+
+static void change_flush(ChangeNotify* cn)
+{
+    char buf[SANDBOX_FS_EVENTS_PACKET_MAX];
+    SandboxFsEventBatch* batch = (SandboxFsEventBatch*) buf;
+
+    g_mutex_lock(&cn->lock);
+    GHashTable* pending = cn->pending;
+    gboolean overflow = cn->overflow;
+    cn->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, pending_event_free);
+    cn->overflow = FALSE;
+    cn->seq = 0;
+    g_mutex_unlock(&cn->lock);
+
+    // 先补发 RESCAN
+    memset(batch, 0, sizeof(SandboxFsEventBatch));
+    batch->magic = SANDBOX_FS_EVENTS_MAGIC;
+    batch->flags = SANDBOX_FS_EVENTS_RESCAN;
+    batch->dirLen = 1;
+    memcpy(batch->dir, "/", 2);
+    for (int i = 0; i < cn->nrSubs; ++i) {
+        Subscriber* sub = &cn->subscribers[i];
+        if (overflow || sub->overflow) {
+            sub->overflow = FALSE;
+            subscriber_send(cn, sub, buf, sizeof(SandboxFsEventBatch) + 2);
+        }
+    }
+
+    if (overflow || 0 == g_hash_table_size(pending)) {
+        g_hash_table_destroy(pending);
+        return;
+    }
+
+    // 按出现顺序排好，再按目录分组；同一目录的事件尽量放在一个包里
+    GArray* items = g_array_sized_new(FALSE, FALSE, sizeof(FlushItem), g_hash_table_size(pending));
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, pending);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        FlushItem item = { key, value };
+        const char* slash = strrchr(key, '/');
+        if (!slash || '\0' == slash[1]) {
+            continue;                                               // 卷根目录自身
+        }
+        g_array_append_val(items, item);
+    }
+    g_array_sort(items, flush_item_compare);
+
+    GHashTable* dirs = g_hash_table_new(g_str_hash, g_str_equal);   // 目录 -> GPtrArray(FlushItem*)
+    GPtrArray* order = g_ptr_array_new_with_free_func(g_free);      // 目录第一次出现的顺序
+    for (guint i = 0; i < items->len; ++i) {
+        FlushItem* item = &g_array_index(items, FlushItem, i);
+        const char* slash = strrchr(item->path, '/');
+        char* dir = (slash == item->path) ? g_strdup("/") : g_strndup(item->path, slash - item->path);
+        GPtrArray* list = g_hash_table_lookup(dirs, dir);
+        if (!list) {
+            list = g_ptr_array_new();
+            g_hash_table_insert(dirs, dir, list);
+            g_ptr_array_add(order, dir);
+        }
+        else {
+            g_free(dir);
+        }
+        g_ptr_array_add(list, item);
+    }
+
+    for (guint d = 0; d < order->len; ++d) {
+        const char* dir = g_ptr_array_index(order, d);
+        GPtrArray* list = g_hash_table_lookup(dirs, dir);
+        gsize dirLen = strlen(dir);
+        gsize off = 0;
+
+        for (guint i = 0; i <= list->len; ++i) {
+            FlushItem* item = (i < list->len) ? g_ptr_array_index(list, i) : NULL;
+            const char* name = item ? strrchr(item->path, '/') + 1 : NULL;
+            gsize nameLen = name ? strlen(name) : 0;
+            gsize fromLen = (item && item->ev->from) ? strlen(item->ev->from) : 0;
+            gsize need = sizeof(SandboxFsEvent) + nameLen + 1 + (fromLen ? fromLen + 1 : 0);
+
+            // 包满了或者结束，先发出去
+            if (off > 0 && (!item || off + need > sizeof(buf))) {
+                for (int s = 0; s < cn->nrSubs; ++s) {
+                    subscriber_send(cn, &cn->subscribers[s], buf, off);
+                }
+                off = 0;
+            }
+            if (!item) {
+                break;
+            }
+            if (sizeof(SandboxFsEventBatch) + dirLen + 1 + need > sizeof(buf)) {
+                continue;
+            }
+
+            if (0 == off) {
+                memset(batch, 0, sizeof(SandboxFsEventBatch));
+                batch->magic = SANDBOX_FS_EVENTS_MAGIC;
+                batch->dirLen = dirLen;
+                memcpy(batch->dir, dir, dirLen + 1);
+                off = sizeof(SandboxFsEventBatch) + dirLen + 1;
+            }
+
+            SandboxFsEvent* ev = (SandboxFsEvent*) (buf + off);
+            ev->type = item->ev->type;
+            ev->reserved = 0;
+            ev->nameLen = nameLen;
+            ev->fromLen = fromLen;
+            memcpy(ev->data, name, nameLen + 1);
+            if (fromLen) {
+                memcpy(ev->data + nameLen + 1, item->ev->from, fromLen + 1);
+            }
+            off += need;
+            ++batch->count;
+
+            // 移动之后又改过，再补一条 CHANGED
+            if (item->ev->changed && SANDBOX_FS_EVENT_MOVED == item->ev->type) {
+                gsize extra = sizeof(SandboxFsEvent) + nameLen + 1;
+                if (off + extra <= sizeof(buf)) {
+                    ev = (SandboxFsEvent*) (buf + off);
+                    ev->type = SANDBOX_FS_EVENT_CHANGED;
+                    ev->reserved = 0;
+                    ev->nameLen = nameLen;
+                    ev->fromLen = 0;
+                    memcpy(ev->data, name, nameLen + 1);
+                    off += extra;
+                    ++batch->count;
+                }
+            }
+        }
+    }
+
+    GHashTableIter dirIter;
+    g_hash_table_iter_init(&dirIter, dirs);
+    while (g_hash_table_iter_next(&dirIter, NULL, &value)) {
+        g_ptr_array_free(value, TRUE);
+    }
+    g_hash_table_destroy(dirs);
+    g_ptr_array_free(order, TRUE);
+    g_array_free(items, TRUE);
+    g_hash_table_destroy(pending);
+}
+
+/**
+ * 目录必须是 root 所有的真实目录，权限 0711 不让列目录；谁能订阅只由 change_accept 按 SO_PEERCRED 判断
+ */
+static bool change_prepare_dir(void)
+{
+    if (0 != mkdir(SANDBOX_FS_EVENTS_DIR, 0711) && EEXIST != errno) {
+        C_LOG_WARNING("change notify mkdir '%s' error: %s", SANDBOX_FS_EVENTS_DIR, strerror(errno));
+        return false;
+    }
+
+    int fd = open(SANDBOX_FS_EVENTS_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        C_LOG_WARNING("change notify open '%s' error: %s", SANDBOX_FS_EVENTS_DIR, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    bool ret = (0 == fstat(fd, &st) && 0 == st.st_uid && 0 == fchmod(fd, 0711));
+    if (!ret) {
+        C_LOG_WARNING("change notify directory '%s' is not owned by root", SANDBOX_FS_EVENTS_DIR);
+    }
+    close(fd);
+
+    return ret;
+}
+
+static void change_accept(ChangeNotify* cn)
+{
+    int fd;
+    while ((fd = accept4(cn->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        // 先鉴权，被拒绝的连接不占订阅者名额
+        struct ucred peer = {0};
+        socklen_t peerLen = sizeof(peer);
+        if (0 != getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen)
+            || !change_uid_allowed(cn, peer.uid)) {
+            C_LOG_WARNING("change notify: reject subscriber uid: %u, pid: %d", peer.uid, peer.pid);
+            close(fd);
+            continue;
+        }
+        if (cn->nrSubs >= CHANGE_NOTIFY_MAX_SUBSCRIBERS) {
+            C_LOG_WARNING("change notify: too many subscribers");
+            close(fd);
+            continue;
+        }
+        int sndbuf = CHANGE_NOTIFY_SNDBUF;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        cn->subscribers[cn->nrSubs].fd = fd;
+        cn->subscribers[cn->nrSubs].overflow = FALSE;
+        ++cn->nrSubs;
+        g_atomic_int_set(&cn->nrSubscribers, cn->nrSubs);
+        C_LOG_VERB("change notify: new subscriber, %d in total", cn->nrSubs);
+    }
+}
+
+static bool change_uid_allowed(ChangeNotify* cn, uid_t uid)
+{
+    if (0 == uid) {
+        return true;
+    }
+
+    bool ret = false;
+    g_mutex_lock(&cn->lock);
+    for (int i = 0; i < cn->nrAllowUids && !ret; ++i) {
+        ret = (cn->allowUids[i] == uid);
+    }
+    g_mutex_unlock(&cn->lock);
+
+    return ret;
+}
+
+static void subscriber_remove(ChangeNotify* cn, int i)
+{
+    if (cn->subscribers[i].fd >= 0) {
+        close(cn->subscribers[i].fd);
+    }
+    cn->subscribers[i] = cn->subscribers[--cn->nrSubs];
+    g_atomic_int_set(&cn->nrSubscribers, cn->nrSubs);
+}
+
+static gpointer change_notify_thread(gpointer udata)
+{
+    ChangeNotify* cn = udata;
+    struct pollfd fds[CHANGE_NOTIFY_MAX_SUBSCRIBERS + 1];
+    gint64 lastFlush = g_get_monotonic_time();
+
+    while (!g_atomic_int_get(&cn->stop)) {
+        fds[0].fd = cn->listenFd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        for (int i = 0; i < cn->nrSubs; ++i) {
+            fds[i + 1].fd = cn->subscribers[i].fd;
+            fds[i + 1].events = POLLIN;
+            fds[i + 1].revents = 0;
+        }
+
+        int ret = poll(fds, cn->nrSubs + 1, CHANGE_NOTIFY_WINDOW_MS);
+        if (ret < 0 && EINTR != errno) {
+            C_LOG_WARNING("change notify poll error: %s", strerror(errno));
+            break;
+        }
+
+        // 订阅者不发数据，可读就是断开了
+        for (int i = cn->nrSubs - 1; i >= 0; --i) {
+            if (fds[i + 1].revents) {
+                char c;
+                if (recv(cn->subscribers[i].fd, &c, 1, MSG_DONTWAIT) <= 0) {
+                    subscriber_remove(cn, i);
+                }
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            change_accept(cn);
+        }
+
+        gint64 now = g_get_monotonic_time();
+        if (now - lastFlush >= CHANGE_NOTIFY_WINDOW_MS * 1000) {
+            lastFlush = now;
+            change_flush(cn);
+            for (int i = cn->nrSubs - 1; i >= 0; --i) {
+                if (cn->subscribers[i].fd < 0) {
+                    subscriber_remove(cn, i);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,62 @@
+//
+// Created by dingjing on 12/2/24.
+//
+
+#ifndef sandbox_CHANGE_NOTIFY_H
+#define sandbox_CHANGE_NOTIFY_H
+
+/**
+ * 沙箱卷的文件变化通知
+ *
+ * FUSE 上的 inotify 不可靠，FUSE 子进程在 create/link/unlink/rename/write 等操作
+ * 成功后把变化记下来，按路径合并，每个时间窗口按目录打包，通过本地 socket 推给订阅者
+ * (nemo)。路径都是卷内路径("/a/b")。本头文件不依赖 ntfs 头文件，nemo 也直接包含它。
+ *
+ * 连接: AF_UNIX + SOCK_SEQPACKET，socket 放在 root 所有、0711 的目录中，沙箱内通过 rootfs 的绑定
+ * 挂载访问同一目录；接受连接时按 SO_PEERCRED 只放行 root 和 change_notify_allow 登记过的用户。
+ * 订阅者不需要发送任何数据，收到的每个包是一个 SandboxFsEventBatch。
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define SANDBOX_FS_EVENTS_DIR           "/run/andsec-sandbox-events"
+#define SANDBOX_FS_EVENTS_SOCKET        SANDBOX_FS_EVENTS_DIR "/events.sock"
+#define SANDBOX_FS_EVENTS_MAGIC         0x45564653                                              // "SFVE"
+#define SANDBOX_FS_EVENTS_PACKET_MAX    (64 * 1024)
+
+#define SANDBOX_FS_EVENTS_RESCAN        (1 << 0)                                                // 有事件丢失(订阅者太慢或变化太多)，重新读取所有目录
+
+typedef enum
+{
+    SANDBOX_FS_EVENT_CREATED = 1,
+    SANDBOX_FS_EVENT_CHANGED,                                                                   // 内容或属性变化，也用于窗口内删除后又创建
+    SANDBOX_FS_EVENT_DELETED,
+    SANDBOX_FS_EVENT_MOVED,                                                                     // name 是新名字，from 是旧的完整卷内路径
+} SandboxFsEventType;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t        magic;                                                                      // SANDBOX_FS_EVENTS_MAGIC
+    uint16_t        count;                                                                      // 记录数
+    uint16_t        flags;                                                                      // SANDBOX_FS_EVENTS_RESCAN
+    uint16_t        dirLen;                                                                     // 不含 '\0'
+    char            dir[];                                                                      // 目录，'\0' 结尾，后面紧跟 count 条 SandboxFsEvent
+} SandboxFsEventBatch;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t         type;                                                                       // SandboxFsEventType
+    uint8_t         reserved;
+    uint16_t        nameLen;                                                                    // 不含 '\0'
+    uint16_t        fromLen;                                                                    // 只有 MOVED 不为 0，不含 '\0'
+    char            data[];                                                                     // name '\0' [from '\0']
+} SandboxFsEvent;
+
+bool    change_notify_start (void);                                                             // FUSE 子进程挂载后调用，启动监听/发送线程
+void    change_notify_stop  (void);                                                             // 卸载前调用
+void    change_notify_add   (const char* path, SandboxFsEventType type);                        // 没有订阅者时直接返回
+void    change_notify_move  (const char* from, const char* to);
+void    change_notify_allow (uid_t uid);                                                        // 增加一个可以订阅的用户
+
+#endif // sandbox_CHANGE_NOTIFY_H
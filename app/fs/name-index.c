@@ -0,0 +1,806 @@
+//
+// Created by dingjing on 11/28/24.
+//
+
+#include "name-index.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../3thrd/fs/types.h"
+#include "../../3thrd/fs/layout.h"
+#include "../../3thrd/fs/volume.h"
+#include "../../3thrd/fs/device.h"
+#include "../../3thrd/fs/attrib.h"
+#include "../../3thrd/fs/runlist.h"
+#include "../../3thrd/fs/unistr.h"
+#include "../../3thrd/clib/c/clib.h"
+
+#define NAME_INDEX_NONE             G_MAXUINT32
+#define NAME_INDEX_SCAN_CHUNK       (1 << 20)                   // 每次从设备顺序读 1MiB 的 $MFT
+#define NAME_INDEX_MAX_DEPTH        256
+#define NAME_INDEX_NAME_MAX         1024                        // 255 个 UTF-16 字符转成 UTF-8 后的上限
+#define NAME_INDEX_POOL_MAX         ((gsize) G_MAXUINT32)       // pool 偏移是 guint32
+#define NAME_INDEX_COMPACT_MIN      4096                        // 死条目至少这么多且过半时压缩
+#define NAME_INDEX_QUERY_BATCH      2048                        // 一次查询最多检查的候选数
+#define NAME_INDEX_PAGING_US        (10 * G_USEC_PER_SEC)       // 分页查询进行中(最近返回过 MORE)时推迟压缩
+
+#define NAME_ENTRY_DIR              (1 << 0)
+#define NAME_ENTRY_DEAD             (1 << 1)
+
+typedef struct
+{
+    guint64                 mft;
+    guint64                 parent;
+    guint32                 nameOff;                            // pool 中的原名，'\0' 结尾
+    guint32                 foldOff;                            // 折叠(NFD + 小写)后的名字，和原名相同时等于 nameOff
+    guint32                 foldLen;
+    guint32                 next;                               // 同一 mft 的下一个名字(硬链接)
+    guint32                 flags;
+} NameEntry;
+
+/* 短模式查询用的只读快照，索引没变时多次查询共用一份 */
+typedef struct
+{
+    gint                    ref;
+    guint64                 version;
+    guint32                 generation;
+    guint32                 len;
+    NameEntry*              entries;
+    char*                   pool;
+} NameSnapshot;
+
+typedef struct
+{
+    guint32                 index;
+    guint32                 pathOff;                            // 在 paths 中的偏移
+    guint32                 pathLen;                            // 含 '\0'
+    guint32                 dirsOff;                            // 在 dirs 中的偏移，第一个是直接父目录，最后一个是查询的根
+    guint32                 nDirs;
+} NameCandidate;
+
+typedef struct
+{
+    GMutex                  lock;
+    GArray*                 entries;                            // NameEntry，追加，删除先打标记，死条目多了再压缩
+    GString*                pool;
+    GHashTable*             byMft;                              // mft -> 第一个名字的下标 + 1
+    GHashTable*             trigrams;                           // 折叠名中的三个字节 -> GArray(guint32 下标，递增)
+    GHashTable*             tombstones;                         // 扫描期间删除的名字，扫描读到的旧记录不能再加回来
+    gboolean                ready;
+    gboolean                full;                               // 压缩后 pool 仍放不下，不再添加
+    guint32                 generation;                         // 每次压缩加一，条目下标只在同一轮内有效
+    guint32                 deadEntries;
+    gsize                   deadBytes;                          // 死条目在 pool 中占的字节
+    guint64                 version;                            // 每次增删加一
+    NameSnapshot*           snapshot;
+    gint64                  pagingUntil;
+
+    GThread*                thread;
+    gint                    stop;
+    struct ntfs_device*     dev;
+    runlist_element*        rl;                                 // $MFT runlist 的快照
+    guint64                 nrRecords;
+    guint32                 recordSize;
+    guint8                  recordBits;
+    guint8                  clusterBits;
+} NameIndex;
+
+static NameIndex* gsIndex = NULL;
+
+static const char*  name_fold                   (const char* name, gsize len, char* buf, gsize bufSize, char** owned, gsize* foldLen);
+static char*        name_tombstone_key          (guint64 mft, guint64 parent, const char* fold);
+static const NameEntry* name_dir_entry          (NameIndex* idx, guint64 mft);
+static void         name_entry_add_locked       (NameIndex* idx, guint64 mft, guint64 parent, const char* name, gsize len, bool isDir, bool fromScan);
+static int          name_build_path_locked      (NameIndex* idx, const NameEntry* e, guint64 root, char* out, gsize avail, GArray* dirs);
+static void         name_trigrams_add           (GHashTable* trigrams, const char* fold, gsize foldLen, guint32 i);
+static bool         name_index_compact_locked   (NameIndex* idx);
+static void         name_index_maybe_compact_locked (NameIndex* idx);
+static NameSnapshot* name_snapshot_get_locked   (NameIndex* idx);
+static void         name_snapshot_unref         (NameSnapshot* snap);
+static bool         name_check_access           (GHashTable* cache, guint64 dir, int mode, NameIndexAccessFunc access, void* udata);
+static void         name_scan_record_locked     (NameIndex* idx, guint64 mftNo, MFT_RECORD* m);
+static gpointer     name_scan_thread            (gpointer udata);
+
+
+bool name_index_start(ntfs_volume* vol)
+{
+    g_return_val_if_fail(vol && vol->mft_na && !gsIndex, false);
+
+    if (ntfs_attr_map_whole_runlist(vol->mft_na)) {
+        C_LOG_WARNING("map $MFT runlist error: %s", strerror(errno));
+        return false;
+    }
+
+    int n = 0;
+    while (vol->mft_na->rl[n].length) {
+        ++n;
+    }
+
+    NameIndex* idx = g_new0(NameIndex, 1);
+    g_mutex_init(&idx->lock);
+    idx->entries = g_array_new(FALSE, FALSE, sizeof(NameEntry));
+    idx->pool = g_string_sized_new(1 << 20);
+    idx->byMft = g_hash_table_new(g_direct_hash, g_direct_equal);
+    idx->trigrams = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_array_unref);
+    idx->tombstones = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    idx->dev = vol->dev;
+    idx->rl = g_new(runlist_element, n + 1);
+    memcpy(idx->rl, vol->mft_na->rl, sizeof(runlist_element) * (n + 1));
+    idx->nrRecords = vol->mft_na->initialized_size >> vol->mft_record_size_bits;
+    idx->recordSize = vol->mft_record_size;
+    idx->recordBits = vol->mft_record_size_bits;
+    idx->clusterBits = vol->cluster_size_bits;
+
+    idx->thread = g_thread_try_new("name-index", name_scan_thread, idx, NULL);
+    if (!idx->thread) {
+        C_LOG_WARNING("start name index thread error");
+        gsIndex = idx;
+        name_index_stop();
+        return false;
+    }
+
+    gsIndex = idx;
+
+    return true;
+}
+
+void name_index_stop(void)
+{
+    NameIndex* idx = gsIndex;
+    if (!idx) {
+        return;
+    }
+
+    g_atomic_int_set(&idx->stop, 1);
+    if (idx->thread) {
+        g_thread_join(idx->thread);
+    }
+    gsIndex = NULL;
+
+    if (idx->snapshot) {
+        name_snapshot_unref(idx->snapshot);
+    }
+    g_hash_table_destroy(idx->tombstones);
+    g_hash_table_destroy(idx->trigrams);
+    g_hash_table_destroy(idx->byMft);
+    g_string_free(idx->pool, TRUE);
+    g_array_free(idx->entries, TRUE);
+    g_mutex_clear(&idx->lock);
+    g_free(idx->rl);
+    g_free(idx);
+}
+
+void name_index_add(uint64_t mft, uint64_t parent, const char* name, bool isDir)
+{
+    NameIndex* idx = gsIndex;
+    c_return_if_fail(idx && name);
+
+    g_mutex_lock(&idx->lock);
+    name_entry_add_locked(idx, mft, parent, name, strlen(name), isDir, false);
+    g_mutex_unlock(&idx->lock);
+}
+
+void name_index_remove(uint64_t mft, uint64_t parent, const char* name)
+{
+    NameIndex* idx = gsIndex;
+    c_return_if_fail(idx && name);
+
+    char buf[NAME_INDEX_NAME_MAX];
+    char* owned = NULL;
+    gsize foldLen = 0;
+    const char* fold = name_fold(name, strlen(name), buf, sizeof(buf), &owned, &foldLen);
+    c_return_if_fail(fold);
+
+    g_mutex_lock(&idx->lock);
+    guint32 prev = NAME_INDEX_NONE;
+    guint32 i = GPOINTER_TO_UINT(g_hash_table_lookup(idx->byMft, GSIZE_TO_POINTER(mft))) - 1;
+    while (NAME_INDEX_NONE != i) {
+        NameEntry* e = &g_array_index(idx->entries, NameEntry, i);
+        if (e->parent == parent && e->foldLen == foldLen && 0 == memcmp(idx->pool->str + e->foldOff, fold, foldLen)) {
+            e->flags |= NAME_ENTRY_DEAD;
+            idx->deadEntries++;
+            idx->deadBytes += strlen(idx->pool->str + e->nameOff) + 1 + ((e->foldOff != e->nameOff) ? e->foldLen + 1 : 0);
+            idx->version++;
+            if (NAME_INDEX_NONE != prev) {
+                g_array_index(idx->entries, NameEntry, prev).next = e->next;
+            }
+            else if (NAME_INDEX_NONE != e->next) {
+                g_hash_table_insert(idx->byMft, GSIZE_TO_POINTER(mft), GUINT_TO_POINTER(e->next + 1));
+            }
+            else {
+                g_hash_table_remove(idx->byMft, GSIZE_TO_POINTER(mft));
+            }
+            break;
+        }
+        prev = i;
+        i = e->next;
+    }
+    if (!idx->ready) {
+        g_hash_table_add(idx->tombstones, name_tombstone_key(mft, parent, fold));
+    }
+    name_index_maybe_compact_locked(idx);
+    g_mutex_unlock(&idx->lock);
+
+    g_free(owned);
+}
+
+/**
+ * 先在锁内(短模式在快照上，不持锁)挑出候选并拼好路径，
+ * 再在锁外按调用者的目录权限过滤，写入结果区
+ */
+int name_index_query(uint64_t root, SandboxFsNameQuery* req, NameIndexAccessFunc access, void* udata)
+{
+    NameIndex* idx = gsIndex;
+    if (!idx) {
+        return -EOPNOTSUPP;
+    }
+
+    req->pattern[sizeof(req->pattern) - 1] = '\0';
+    req->count = 0;
+    req->flags = 0;
+
+    const gsize patternLen = strlen(req->pattern);
+    if (0 == patternLen || !g_utf8_validate(req->pattern, (gssize) patternLen, NULL)) {
+        return -EINVAL;
+    }
+
+    char buf[NAME_INDEX_NAME_MAX];
+    char* owned = NULL;
+    gsize foldLen = 0;
+    const char* fold = name_fold(req->pattern, patternLen, buf, sizeof(buf), &owned, &foldLen);
+    if (!fold || 0 == foldLen) {
+        g_free(owned);
+        return -EINVAL;
+    }
+
+    int ret = 0;
+    bool more = false;
+    guint32 nextCursor = 0;
+    GArray* indexes = g_array_sized_new(FALSE, FALSE, sizeof(guint32), 64);
+    GArray* cands = g_array_sized_new(FALSE, FALSE, sizeof(NameCandidate), 64);
+    GArray* dirs = g_array_sized_new(FALSE, FALSE, sizeof(guint64), 256);
+    GString* paths = g_string_sized_new(sizeof(req->results));
+    char* pathBuf = g_malloc(sizeof(req->results));
+
+    g_mutex_lock(&idx->lock);
+    if (!idx->ready) {
+        ret = -EAGAIN;
+        goto unlock;
+    }
+    if (0 != req->cursor && req->generation != idx->generation) {
+        ret = -ESTALE;
+        goto unlock;
+    }
+    req->generation = idx->generation;
+
+    if (foldLen >= 3) {
+        // 取最短的倒排表作为候选
+        GArray* list = NULL;
+        for (gsize i = 0; i + 3 <= foldLen; ++i) {
+            const guint32 key = ((guint8) fold[i] << 16) | ((guint8) fold[i + 1] << 8) | (guint8) fold[i + 2];
+            GArray* l = g_hash_table_lookup(idx->trigrams, GUINT_TO_POINTER(key));
+            if (!l) {
+                list = NULL;
+                break;
+            }
+            if (!list || l->len < list->len) {
+                list = l;
+            }
+        }
+
+        guint32 lo = 0, hi = list ? list->len : 0;
+        while (lo < hi) {
+            const guint32 mid = lo + (hi - lo) / 2;
+            if (g_array_index(list, guint32, mid) < req->cursor) { lo = mid + 1; }
+            else { hi = mid; }
+        }
+        for (guint32 pos = lo; list && pos < list->len; ++pos) {
+            const guint32 i = g_array_index(list, guint32, pos);
+            if (NAME_INDEX_QUERY_BATCH == indexes->len) {
+                more = true;
+                nextCursor = i;
+                break;
+            }
+            const NameEntry* e = &g_array_index(idx->entries, NameEntry, i);
+            if (!(e->flags & NAME_ENTRY_DEAD) && e->foldLen >= foldLen
+                && memmem(idx->pool->str + e->foldOff, e->foldLen, fold, foldLen)) {
+                g_array_append_val(indexes, i);
+            }
+        }
+    }
+    else {
+        // 不足三个字节只能逐条比较，在快照上做，不挡住 FUSE 线程的增删
+        NameSnapshot* snap = name_snapshot_get_locked(idx);
+        g_mutex_unlock(&idx->lock);
+
+        for (guint32 i = req->cursor; i < snap->len; ++i) {
+            if (NAME_INDEX_QUERY_BATCH == indexes->len) {
+                more = true;
+                nextCursor = i;
+                break;
+            }
+            const NameEntry* e = &snap->entries[i];
+            if (!(e->flags & NAME_ENTRY_DEAD) && e->foldLen >= foldLen
+                && memmem(snap->pool + e->foldOff, e->foldLen, fold, foldLen)) {
+                g_array_append_val(indexes, i);
+            }
+        }
+
+        g_mutex_lock(&idx->lock);
+        const guint32 generation = snap->generation;
+        name_snapshot_unref(snap);
+        if (generation != idx->generation) {
+            ret = -ESTALE;
+            goto unlock;
+        }
+    }
+
+    // 同一轮内条目只追加，快照里的下标在当前索引中仍指向同一条
+    for (guint32 k = 0; k < indexes->len; ++k) {
+        const guint32 i = g_array_index(indexes, guint32, k);
+        const NameEntry* e = &g_array_index(idx->entries, NameEntry, i);
+        if (e->flags & NAME_ENTRY_DEAD) {
+            continue;
+        }
+        NameCandidate c = { .index = i, .pathOff = (guint32) paths->len, .dirsOff = dirs->len };
+        const int len = name_build_path_locked(idx, e, root, pathBuf, sizeof(req->results), dirs);
+        if (len <= 0) {
+            // 不在 root 下，或路径比整个结果区还长
+            g_array_set_size(dirs, c.dirsOff);
+            continue;
+        }
+        c.pathLen = (guint32) len;
+        c.nDirs = dirs->len - c.dirsOff;
+        g_string_append_len(paths, pathBuf, len);
+        g_array_append_val(cands, c);
+    }
+
+unlock:
+    g_mutex_unlock(&idx->lock);
+
+    if (0 == ret) {
+        GHashTable* allowed = g_hash_table_new(g_direct_hash, g_direct_equal);
+        gsize used = 0;
+        for (guint32 k = 0; k < cands->len; ++k) {
+            const NameCandidate* c = &g_array_index(cands, NameCandidate, k);
+            bool ok = true;
+            for (guint32 d = 0; ok && access && d < c->nDirs; ++d) {
+                // 名字所在目录要能读，往上的目录要能进入
+                ok = name_check_access(allowed, g_array_index(dirs, guint64, c->dirsOff + d), d ? X_OK : (R_OK | X_OK), access, udata);
+            }
+            if (!ok) {
+                continue;
+            }
+            if (c->pathLen > sizeof(req->results) - used) {
+                more = true;
+                nextCursor = c->index;
+                break;
+            }
+            memcpy(req->results + used, paths->str + c->pathOff, c->pathLen);
+            used += c->pathLen;
+            req->count++;
+        }
+        g_hash_table_destroy(allowed);
+
+        if (more) {
+            req->cursor = nextCursor;
+            req->flags |= SANDBOX_FS_NAME_QUERY_MORE;
+            g_mutex_lock(&idx->lock);
+            idx->pagingUntil = g_get_monotonic_time() + NAME_INDEX_PAGING_US;
+            g_mutex_unlock(&idx->lock);
+        }
+    }
+
+    g_free(pathBuf);
+    g_string_free(paths, TRUE);
+    g_array_free(dirs, TRUE);
+    g_array_free(cands, TRUE);
+    g_array_free(indexes, TRUE);
+    g_free(owned);
+
+    return ret;
+}
+
+/**
+ * 与 nemo 的文件名匹配规则一致: NFD 后转小写。纯 ASCII 的名字直接折叠到 buf，
+ * 否则结果放在 *owned 中由调用者释放
+ */
+static const char* name_fold(const char* name, gsize len, char* buf, gsize bufSize, char** owned, gsize* foldLen)
+{
+    gsize i = 0;
+
+    *owned = NULL;
+    for (i = 0; i < len && !(name[i] & 0x80); ++i);
+
+    if (i == len && len < bufSize) {
+        for (i = 0; i < len; ++i) {
+            buf[i] = g_ascii_tolower(name[i]);
+        }
+        buf[len] = '\0';
+        *foldLen = len;
+        return buf;
+    }
+
+    g_autofree char* normalized = g_utf8_normalize(name, (gssize) len, G_NORMALIZE_NFD);
+    if (!normalized) {
+        return NULL;
+    }
+    *owned = g_utf8_strdown(normalized, -1);
+    *foldLen = strlen(*owned);
+
+    return *owned;
+}
+
+static char* name_tombstone_key(guint64 mft, guint64 parent, const char* fold)
+{
+    return g_strdup_printf("%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "/%s", mft, parent, fold);
+}
+
+static const NameEntry* name_dir_entry(NameIndex* idx, guint64 mft)
+{
+    const guint32 i = GPOINTER_TO_UINT(g_hash_table_lookup(idx->byMft, GSIZE_TO_POINTER(mft)));
+
+    return i ? &g_array_index(idx->entries, NameEntry, i - 1) : NULL;
+}
+
+/**
+ * 同一 (mft, parent, 折叠名) 只保留一条，扫描和 FUSE 回调可以重复添加。
+ * 扫描读到的记录可能早于一次删除，此时墓碑挡住它
+ */
+static void name_entry_add_locked(NameIndex* idx, guint64 mft, guint64 parent, const char* name, gsize len, bool isDir, bool fromScan)
+{
+    char buf[NAME_INDEX_NAME_MAX];
+    char* owned = NULL;
+    gsize foldLen = 0;
+    const char* fold = name_fold(name, len, buf, sizeof(buf), &owned, &foldLen);
+    c_return_if_fail(fold && foldLen > 0);
+
+    // guint32 偏移和下标放不下时先压缩，仍然放不下就不再收录新名字
+    if (idx->pool->len + len + foldLen + 2 > NAME_INDEX_POOL_MAX || idx->entries->len >= NAME_INDEX_NONE - 1) {
+        if (!name_index_compact_locked(idx)
+            || idx->pool->len + len + foldLen + 2 > NAME_INDEX_POOL_MAX || idx->entries->len >= NAME_INDEX_NONE - 1) {
+            if (!idx->full) {
+                C_LOG_WARNING("name index is full, %u names", idx->entries->len);
+                idx->full = TRUE;
+            }
+            goto out;
+        }
+    }
+
+    if (g_hash_table_size(idx->tombstones) > 0) {
+        g_autofree char* key = name_tombstone_key(mft, parent, fold);
+        if (fromScan && g_hash_table_contains(idx->tombstones, key)) {
+            goto out;
+        }
+        if (!fromScan) {
+            g_hash_table_remove(idx->tombstones, key);
+        }
+    }
+
+    const guint32 head = GPOINTER_TO_UINT(g_hash_table_lookup(idx->byMft, GSIZE_TO_POINTER(mft))) - 1;
+    for (guint32 i = head; NAME_INDEX_NONE != i; i = g_array_index(idx->entries, NameEntry, i).next) {
+        NameEntry* e = &g_array_index(idx->entries, NameEntry, i);
+        if (e->parent == parent && e->foldLen == foldLen && 0 == memcmp(idx->pool->str + e->foldOff, fold, foldLen)) {
+            e->flags = isDir ? (e->flags | NAME_ENTRY_DIR) : (e->flags & ~NAME_ENTRY_DIR);
+            goto out;
+        }
+    }
+
+    NameEntry entry = {
+        .mft = mft,
+        .parent = parent,
+        .nameOff = (guint32) idx->pool->len,
+        .foldLen = (guint32) foldLen,
+        .next = head,
+        .flags = isDir ? NAME_ENTRY_DIR : 0,
+    };
+    g_string_append_len(idx->pool, name, (gssize) len);
+    g_string_append_c(idx->pool, '\0');
+    if (foldLen == len && 0 == memcmp(name, fold, len)) {
+        entry.foldOff = entry.nameOff;
+    }
+    else {
+        entry.foldOff = (guint32) idx->pool->len;
+        g_string_append_len(idx->pool, fold, (gssize) foldLen);
+        g_string_append_c(idx->pool, '\0');
+    }
+
+    const guint32 i = idx->entries->len;
+    g_array_append_val(idx->entries, entry);
+    g_hash_table_insert(idx->byMft, GSIZE_TO_POINTER(mft), GUINT_TO_POINTER(i + 1));
+    name_trigrams_add(idx->trigrams, fold, foldLen, i);
+    idx->version++;
+
+out:
+    g_free(owned);
+}
+
+static void name_trigrams_add(GHashTable* trigrams, const char* fold, gsize foldLen, guint32 i)
+{
+    for (gsize j = 0; j + 3 <= foldLen; ++j) {
+        const guint32 key = ((guint8) fold[j] << 16) | ((guint8) fold[j + 1] << 8) | (guint8) fold[j + 2];
+        GArray* l = g_hash_table_lookup(trigrams, GUINT_TO_POINTER(key));
+        if (!l) {
+            l = g_array_sized_new(FALSE, FALSE, sizeof(guint32), 4);
+            g_hash_table_insert(trigrams, GUINT_TO_POINTER(key), l);
+        }
+        // 下标递增追加，同一名字中重复的三元组只记一次
+        if (0 == l->len || g_array_index(l, guint32, l->len - 1) != i) {
+            g_array_append_val(l, i);
+        }
+    }
+}
+
+/**
+ * 丢掉死条目，按原顺序重排活条目、pool、byMft 和倒排表，
+ * 下标随之改变，generation 加一让分页中的查询重新开始
+ */
+static bool name_index_compact_locked(NameIndex* idx)
+{
+    if (0 == idx->deadEntries) {
+        return false;
+    }
+
+    const guint32 oldLen = idx->entries->len;
+    const guint32 liveLen = oldLen - idx->deadEntries;
+    guint32* remap = g_new(guint32, oldLen);
+    GArray* entries = g_array_sized_new(FALSE, FALSE, sizeof(NameEntry), liveLen);
+    GString* pool = g_string_sized_new(idx->pool->len - idx->deadBytes + 1);
+    GHashTable* trigrams = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_array_unref);
+
+    for (guint32 i = 0; i < oldLen; ++i) {
+        const NameEntry* e = &g_array_index(idx->entries, NameEntry, i);
+        if (e->flags & NAME_ENTRY_DEAD) {
+            remap[i] = NAME_INDEX_NONE;
+            continue;
+        }
+        NameEntry n = *e;
+        const char* name = idx->pool->str + e->nameOff;
+        n.nameOff = (guint32) pool->len;
+        g_string_append_len(pool, name, (gssize) strlen(name) + 1);
+        if (e->foldOff == e->nameOff) {
+            n.foldOff = n.nameOff;
+        }
+        else {
+            n.foldOff = (guint32) pool->len;
+            g_string_append_len(pool, idx->pool->str + e->foldOff, (gssize) e->foldLen + 1);
+        }
+        remap[i] = entries->len;
+        name_trigrams_add(trigrams, pool->str + n.foldOff, n.foldLen, entries->len);
+        g_array_append_val(entries, n);
+    }
+
+    // 链表里只剩活条目
+    for (guint32 j = 0; j < entries->len; ++j) {
+        NameEntry* n = &g_array_index(entries, NameEntry, j);
+        if (NAME_INDEX_NONE != n->next) {
+            n->next = remap[n->next];
+        }
+    }
+    GHashTableIter iter;
+    gpointer value = NULL;
+    g_hash_table_iter_init(&iter, idx->byMft);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_hash_table_iter_replace(&iter, GUINT_TO_POINTER(remap[GPOINTER_TO_UINT(value) - 1] + 1));
+    }
+
+    C_LOG_INFO("name index compacted: %u -> %u names, pool %lu -> %lu bytes",
+        oldLen, entries->len, (unsigned long) idx->pool->len, (unsigned long) pool->len);
+
+    g_free(remap);
+    g_array_free(idx->entries, TRUE);
+    g_string_free(idx->pool, TRUE);
+    g_hash_table_destroy(idx->trigrams);
+    idx->entries = entries;
+    idx->pool = pool;
+    idx->trigrams = trigrams;
+    idx->deadEntries = 0;
+    idx->deadBytes = 0;
+    idx->generation++;
+    idx->version++;
+
+    return true;
+}
+
+static void name_index_maybe_compact_locked(NameIndex* idx)
+{
+    if (idx->ready && idx->deadEntries >= NAME_INDEX_COMPACT_MIN
+        && (gsize) idx->deadEntries * 2 >= idx->entries->len
+        && g_get_monotonic_time() >= idx->pagingUntil) {
+        name_index_compact_locked(idx);
+    }
+}
+
+static NameSnapshot* name_snapshot_get_locked(NameIndex* idx)
+{
+    if (idx->snapshot && idx->snapshot->version != idx->version) {
+        name_snapshot_unref(idx->snapshot);
+        idx->snapshot = NULL;
+    }
+
+    if (!idx->snapshot) {
+        NameSnapshot* snap = g_new0(NameSnapshot, 1);
+        snap->ref = 1;
+        snap->version = idx->version;
+        snap->generation = idx->generation;
+        snap->len = idx->entries->len;
+        snap->entries = g_new(NameEntry, idx->entries->len + 1);
+        memcpy(snap->entries, idx->entries->data, sizeof(NameEntry) * idx->entries->len);
+        snap->pool = g_malloc(idx->pool->len + 1);
+        memcpy(snap->pool, idx->pool->str, idx->pool->len + 1);
+        idx->snapshot = snap;
+    }
+    g_atomic_int_inc(&idx->snapshot->ref);
+
+    return idx->snapshot;
+}
+
+static void name_snapshot_unref(NameSnapshot* snap)
+{
+    if (g_atomic_int_dec_and_test(&snap->ref)) {
+        g_free(snap->entries);
+        g_free(snap->pool);
+        g_free(snap);
+    }
+}
+
+static bool name_check_access(GHashTable* cache, guint64 dir, int mode, NameIndexAccessFunc access, void* udata)
+{
+    const gpointer key = GSIZE_TO_POINTER((dir << 3) | (mode & (R_OK | W_OK | X_OK)));
+    const guint cached = GPOINTER_TO_UINT(g_hash_table_lookup(cache, key));
+    if (cached) {
+        return (1 == cached);
+    }
+
+    const bool ok = access(dir, mode, udata);
+    g_hash_table_insert(cache, key, GUINT_TO_POINTER(ok ? 1 : 2));
+
+    return ok;
+}
+
+/**
+ * 沿父目录号拼出相对 root 的路径，写入 out(含结尾的 '\0')，经过的目录(直接父目录到 root)追加到 dirs
+ * 返回写入的字节数，空间不够返回 0，不在 root 下返回 -1
+ */
+static int name_build_path_locked(NameIndex* idx, const NameEntry* e, guint64 root, char* out, gsize avail, GArray* dirs)
+{
+    const NameEntry* chain[NAME_INDEX_MAX_DEPTH];
+    gsize total = 0;
+    int depth = 0;
+
+    if (e->mft == root) {
+        return -1;
+    }
+
+    while (true) {
+        if (NAME_INDEX_MAX_DEPTH == depth) {
+            return -1;
+        }
+        chain[depth++] = e;
+        total += strlen(idx->pool->str + e->nameOff) + 1;
+        g_array_append_val(dirs, e->parent);
+        if (e->parent == root) {
+            break;
+        }
+        if (FILE_root == e->parent || e->parent == e->mft) {
+            return -1;
+        }
+        e = name_dir_entry(idx, e->parent);
+        if (!e) {
+            return -1;
+        }
+    }
+
+    if (total > avail) {
+        return 0;
+    }
+
+    char* p = out;
+    while (depth > 0) {
+        const char* name = idx->pool->str + chain[--depth]->nameOff;
+        const gsize len = strlen(name);
+        memcpy(p, name, len);
+        p += len;
+        *p++ = depth ? '/' : '\0';
+    }
+
+    return (int) total;
+}
+
+/**
+ * 只看常驻的 $FILE_NAME，DOS 8.3 短名跳过。
+ * 扩展记录中的名字归到 base_mft_record 上，目录标志取自 $FILE_NAME 本身
+ */
+static void name_scan_record_locked(NameIndex* idx, guint64 mftNo, MFT_RECORD* m)
+{
+    if (!ntfs_is_file_record(m->magic) || !(m->flags & MFT_RECORD_IN_USE)) {
+        return;
+    }
+
+    const guint64 owner = m->base_mft_record ? MREF(le64_to_cpu(m->base_mft_record)) : mftNo;
+    if (owner < FILE_first_user) {
+        return;
+    }
+
+    const guint32 used = MIN(le32_to_cpu(m->bytes_in_use), idx->recordSize);
+    guint32 off = le16_to_cpu(m->attrs_offset);
+    while (off + offsetof(ATTR_RECORD, resident_end) <= used) {
+        const ATTR_RECORD* a = (const ATTR_RECORD*) ((const u8*) m + off);
+        const guint32 alen = le32_to_cpu(a->length);
+        if (AT_END == a->type || 0 == alen || off + alen > used) {
+            break;
+        }
+
+        if (AT_FILE_NAME == a->type && !a->non_resident) {
+            const guint32 voff = le16_to_cpu(a->value_offset);
+            const guint32 vlen = le32_to_cpu(a->value_length);
+            const FILE_NAME_ATTR* fn = (const FILE_NAME_ATTR*) ((const u8*) a + voff);
+            if (voff + vlen <= alen && vlen >= sizeof(FILE_NAME_ATTR)
+                && sizeof(FILE_NAME_ATTR) + fn->file_name_length * sizeof(ntfschar) <= vlen
+                && FILE_NAME_DOS != fn->file_name_type) {
+                char buf[NAME_INDEX_NAME_MAX];
+                char* name = buf;
+                const int len = ntfs_ucstombs(fn->file_name, fn->file_name_length, &name, sizeof(buf));
+                if (len > 0) {
+                    name_entry_add_locked(idx, owner, MREF(le64_to_cpu(fn->parent_directory)), name, len,
+                        0 != (fn->file_attributes & FILE_ATTR_I30_INDEX_PRESENT), true);
+                }
+            }
+        }
+        off += alen;
+    }
+}
+
+/**
+ * 只通过设备层的 pread 顺序读 $MFT 的簇(加密在设备层按块完成，无共享状态)，
+ * 不碰卷上的 inode 缓存，和 FUSE 线程并行也安全
+ */
+static gpointer name_scan_thread(gpointer udata)
+{
+    NameIndex* idx = udata;
+    const gint64 begin = g_get_monotonic_time();
+    u8* buf = g_malloc(NAME_INDEX_SCAN_CHUNK);
+    guint64 scanned = 0;
+
+    for (const runlist_element* rl = idx->rl; rl->length && !g_atomic_int_get(&idx->stop); ++rl) {
+        if (rl->lcn < 0) {
+            continue;
+        }
+        const s64 bytes = rl->length << idx->clusterBits;
+        for (s64 done = 0; done < bytes && !g_atomic_int_get(&idx->stop); done += NAME_INDEX_SCAN_CHUNK) {
+            const guint64 first = ((rl->vcn << idx->clusterBits) + done) >> idx->recordBits;
+            if (first >= idx->nrRecords) {
+                break;
+            }
+            s64 count = MIN(NAME_INDEX_SCAN_CHUNK, bytes - done) >> idx->recordBits;
+            count = (s64) MIN((guint64) count, idx->nrRecords - first);
+            const s64 got = ntfs_mst_pread(idx->dev, (rl->lcn << idx->clusterBits) + done, count, idx->recordSize, buf);
+            if (got <= 0) {
+                C_LOG_WARNING("read $MFT record %" G_GUINT64_FORMAT " error: %s", first, strerror(errno));
+                continue;
+            }
+
+            g_mutex_lock(&idx->lock);
+            for (s64 i = 0; i < got; ++i) {
+                name_scan_record_locked(idx, first + i, (MFT_RECORD*) (buf + (i << idx->recordBits)));
+            }
+            g_mutex_unlock(&idx->lock);
+            scanned += got;
+        }
+    }
+    g_free(buf);
+
+    g_mutex_lock(&idx->lock);
+    if (!g_atomic_int_get(&idx->stop)) {
+        idx->ready = TRUE;
+        g_hash_table_remove_all(idx->tombstones);
+    }
+    C_LOG_INFO("name index: %" G_GUINT64_FORMAT " records, %u names, %u trigrams, %" G_GINT64_FORMAT " ms",
+        scanned, idx->entries->len, g_hash_table_size(idx->trigrams), (g_get_monotonic_time() - begin) / 1000);
+    g_mutex_unlock(&idx->lock);
+
+    return NULL;
+}
@@ -0,0 +1,47 @@
+//
+// Created by dingjing on 11/28/24.
+//
+
+#ifndef sandbox_NAME_INDEX_H
+#define sandbox_NAME_INDEX_H
+
+/**
+ * 沙箱卷的文件名索引
+ *
+ * FUSE 子进程挂载后由后台线程顺序扫描 $MFT 建立(所有 $FILE_NAME 及其父目录号)，
+ * 之后随 create/link/unlink(rename 由这两者组成) 增量更新，只保存在内存中。
+ * 查询通过对卷内目录发 SANDBOX_FS_IOC_NAME_QUERY 完成，返回该目录下名字包含
+ * pattern 的文件的相对路径；本头文件不依赖 ntfs 头文件，nemo 也直接包含它。
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+
+#define SANDBOX_FS_NAME_QUERY_MORE      (1 << 0)                                                // 结果区已满，带着 cursor 再查一次
+
+typedef struct
+{
+    char            pattern[256];                                                               // in: UTF-8，不区分大小写的子串
+    uint32_t        cursor;                                                                     // in/out: 首次为 0，之后原样回传
+    uint32_t        generation;                                                                 // in/out: 同上；索引压缩后旧的 cursor 失效，返回 ESTALE
+    uint32_t        count;                                                                      // out: results 中的路径数
+    uint32_t        flags;                                                                      // out: SANDBOX_FS_NAME_QUERY_MORE
+    char            results[15356];                                                             // out: 以 '\0' 分隔的相对路径
+} SandboxFsNameQuery;
+
+/* 任何用户都可以发(沙箱内的 nemo 不是 root)，只返回调用者能进入的目录下的名字；索引还没建好时返回 EAGAIN */
+#define SANDBOX_FS_IOC_NAME_QUERY       _IOWR('X', 0x04, SandboxFsNameQuery)
+
+struct _ntfs_volume;
+
+/* 调用者对目录 dir 是否有 mode(R_OK/X_OK 的组合) 权限，在 FUSE 线程中调用 */
+typedef bool (*NameIndexAccessFunc) (uint64_t dir, int mode, void* udata);
+
+bool    name_index_start    (struct _ntfs_volume* vol);                                         // FUSE 线程中调用，快照 $MFT 的 runlist 后启动扫描线程
+void    name_index_stop     (void);                                                             // 卸载前调用，等待扫描线程退出并释放索引
+void    name_index_add      (uint64_t mft, uint64_t parent, const char* name, bool isDir);
+void    name_index_remove   (uint64_t mft, uint64_t parent, const char* name);
+int     name_index_query    (uint64_t root, SandboxFsNameQuery* req,
+                             NameIndexAccessFunc access, void* udata);                          // access 为 NULL 时不过滤；返回 0 或 -errno
+
+#endif // sandbox_NAME_INDEX_H
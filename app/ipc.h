@@ -12,8 +12,17 @@ typedef enum
     IPC_TYPE_OPEN_FM,
     IPC_TYPE_OPEN_TERMINATOR,
     IPC_TYPE_QUIT,
+    IPC_TYPE_GROW,                                  // 在线扩容，新大小放在 IPC_KEY_GROW_SIZE_MB 中
+    IPC_TYPE_IMPORT,                                // 随帧传来的宿主机文件 fd(客户端以只读打开)导入到沙盒内 IPC_KEY_SANDBOX_PATH
+    IPC_TYPE_EXPORT,                                // 沙盒内文件 IPC_KEY_SANDBOX_PATH 导出到随帧传来的 fd(客户端以只写打开)
+    IPC_TYPE_STAT,                                  // 沙盒 cgroup 的 cpu.stat/memory.stat/io.stat，文本跟在 IpcResponse 之后
+    IPC_TYPE_RESPONSE = 0x100,                      // 守护进程应答，载荷为 IpcResponse，部分请求后面还跟着数据
 } IpcType;
 
+#define IPC_KEY_GROW_SIZE_MB        "SANDBOX_GROW_SIZE_MB"
+#define IPC_KEY_HOST_PATH           "SANDBOX_HOST_PATH"         // 宿主机绝对路径，只用于日志，守护进程不打开它
+#define IPC_KEY_SANDBOX_PATH        "SANDBOX_BOX_PATH"          // 沙盒根目录下的路径
+
 
 typedef struct __attribute__((packed)) _IpcMessage
 {
@@ -22,4 +31,29 @@ typedef struct __attribute__((packed)) _IpcMessage
     char                data[];
 } IpcMessage;
 
+/**
+ * 帧格式: 定长帧头 + dataLen 字节载荷，一个连接上可以连续发送多个请求，
+ * 守护进程按 reqId 逐个应答。
+ * 请求载荷为若干以 '\0' 结尾的 "key=value"，解析时直接引用接收缓冲区，不做拷贝
+ * 字段定义与 proto/command-line.proto 保持一致
+ */
+#define IPC_FRAME_MAGIC             0x58424e53      // "SNBX"
+#define IPC_FRAME_MAX               (64 * 1024)     // 单帧(含帧头)上限，同时是接收缓冲区大小
+#define IPC_FRAME_FDS_MAX           8               // 一个连接上最多暂存的未处理 fd
+
+typedef struct __attribute__((packed)) _IpcFrame
+{
+    unsigned int        magic;                      // IPC_FRAME_MAGIC
+    unsigned int        reqId;                      // 请求 ID，应答原样带回
+    unsigned int        type;                       // IpcType
+    unsigned int        dataLen;                    // 载荷长度
+    char                data[];
+} IpcFrame;
+
+typedef struct __attribute__((packed)) _IpcResponse
+{
+    int                 status;                     // 0 成功；启动类请求为 exec 失败时的 errno
+    int                 pid;                        // 启动的进程，没有则为 0
+} IpcResponse;
+
 #endif // sandbox_IPC_H
@@ -5,7 +5,34 @@
 #include "loop.h"
 
 #include <glib.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/loop.h>
+#include <sys/sysmacros.h>
+
+#define LOOP_MAJOR                  7
+#define LOOP_CONTROL                "/dev/loop-control"
+#define LOOP_SYSFS_BLOCK            "/sys/block"
+
+// 旧内核头文件里没有的定义
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO          16
+#endif
+
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE              0x4C0A
+struct loop_config
+{
+    __u32                   fd;
+    __u32                   block_size;
+    struct loop_info64      info;
+    __u64                   __reserved[8];
+};
+#endif
 
 struct _LoopDevice
 {
@@ -17,6 +44,13 @@ G_LOCK_DEFINE(gsLoopDevice);
 static LoopDevice* gsLoopDevices = NULL;
 
 static bool loop_info_update();
+static bool loop_cache_lookup       (bool byFile, const char* key, char** value/*out, nullable*/);
+static void loop_cache_insert       (const char* loopName, const char* fileName);
+static void loop_table_insert       (CHashTable* loopFile, CHashTable* fileLoop, const char* loopName, const char* fileName);
+static bool loop_cache_is_valid     (const char* loopName, const char* fileName);
+static bool loop_read_backing_file  (const char* name, char* buf, gsize bufSize);
+static bool loop_normalize_path     (const char* path, char* buf, gsize bufSize);
+static bool loop_set_fd_legacy      (int devFd, const struct loop_config* conf);
 
 static void debug_print (void* key, void* value, void* udata);
 
@@ -44,15 +78,9 @@ bool loop_check_file_is_inuse(const char* fileName)
 {
     c_return_val_if_fail(fileName, false);
 
-    loop_info_update();
-
-    G_LOCK(gsLoopDevice);
-
-    bool ret = c_hash_table_contains(gsLoopDevices->fileLoop, c_file_path_format_arr(fileName));
+    bool ret = loop_cache_lookup(true, fileName, NULL);
 
-    G_UNLOCK(gsLoopDevice);
-
-    C_LOG_VERB("fileName: %s -- %s -- %s", fileName, c_file_path_format_arr(fileName), ret ? "true" : "false");
+    C_LOG_VERB("fileName: %s -- %s", fileName, ret ? "true" : "false");
 
     return ret;
 }
@@ -61,53 +89,48 @@ bool loop_check_device_is_inuse(const char* devName)
 {
     c_return_val_if_fail(devName, false);
 
-    loop_info_update();
-
-    G_LOCK(gsLoopDevice);
-
-    bool ret = c_hash_table_contains(gsLoopDevices->loopFile, c_file_path_format_arr(devName));
-
-    G_UNLOCK(gsLoopDevice);
-
-    return ret;
+    return loop_cache_lookup(false, devName, NULL);
 }
 
 char *loop_get_free_device_name()
 {
-    loop_info_update();
+    errno = 0;
+    int ctl = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC);
+    if (ctl < 0) {
+        C_LOG_ERROR("open '%s' error: %s", LOOP_CONTROL, c_strerror(errno));
+        return NULL;
+    }
 
-    FILE* fr = popen("losetup -f", "r");
+    // 没有空闲设备时内核会新建一个
+    errno = 0;
+    const int idx = ioctl(ctl, LOOP_CTL_GET_FREE);
+    close(ctl);
+    if (idx < 0) {
+        C_LOG_ERROR("LOOP_CTL_GET_FREE error: %s", c_strerror(errno));
+        return NULL;
+    }
 
-    c_return_val_if_fail(fr, NULL);
+    char* devName = c_strdup_printf("/dev/loop%d", idx);
+    if (devName && !c_file_test(devName, C_FILE_TEST_EXISTS)) {
+        loop_mknod(devName);
+    }
 
-    char line[4096] = {0};
-    do {
-        if (!fgets(line, sizeof(line), fr)) {
-            C_LOG_ERROR("losetup -f read line error!");
-            break;
-        }
-        C_LOG_VERB("Loop device line: %s", (strlen(line) > 0) ? line : "");
-        c_strstrip(line);
-        C_LOG_VERB("Loop device line strip: %s", (strlen(line) > 0) ? line : "");
-        char* s = c_strrstr(line, "\n");
-        C_LOG_VERB("Loop device line strrstr: %s", (strlen(s) > 0) ? s: "");
-        while (s) {s[0] = '\0'; s = c_strrstr(line, "\n");};
-        C_LOG_VERB("Loop device line after strrstr: %s", (strlen(line) > 0) ? line : "");
-    } while (0);
-    pclose(fr);
-
-    C_LOG_VERB("Loop device: %s", (strlen(line) > 0) ? line : "");
-
-    return ((strlen(line) > 0) ? c_strdup(line) : NULL);
+    C_LOG_VERB("Loop device: %s", devName ? devName : "");
+
+    return devName;
 }
 
 bool loop_mknod(const char *devName)
 {
     c_return_val_if_fail(devName, false);
 
+    const char* num = devName + strlen(devName);
+    while (num > devName && num[-1] >= '0' && num[-1] <= '9') { --num; }
+    c_return_val_if_fail('\0' != num[0], false);
+
     errno = 0;
 
-    bool ret = (0 == mknod(devName, S_IFBLK, 7));
+    bool ret = (0 == mknod(devName, S_IFBLK | 0660, makedev(LOOP_MAJOR, atoi(num))));
     if (!ret) {
         C_LOG_ERROR("mknod failed: %s", c_strerror(errno));
     }
@@ -119,48 +142,276 @@ char *loop_get_device_name_by_file_name(const char *fileName)
 {
     c_return_val_if_fail(fileName, NULL);
 
-    loop_info_update();
-
-    G_LOCK(gsLoopDevice);
-
-    char* value = c_hash_table_lookup(gsLoopDevices->fileLoop, c_file_path_format_arr(fileName));
+    char* value = NULL;
+    loop_cache_lookup(true, fileName, &value);
 
-    G_UNLOCK(gsLoopDevice);
-
-    return (value ? c_strdup(value) : NULL);
+    return value;
 }
 
 bool loop_attach_file_to_loop(const char *fileName, const char *devName)
 {
     c_return_val_if_fail(fileName && devName, false);
 
-    FILE* fr = NULL;
-    bool res = true;
+    bool res = false;
+    int devFd = -1;
+    int fileFd = -1;
+    struct stat st;
+    struct loop_config conf;
+    char fullPath[PATH_MAX] = {0};
+
+    memset(&conf, 0, sizeof(conf));
+
     do {
-        char* cmd = c_strdup_printf("losetup %s %s && echo $?", devName, fileName);
-        c_assert(cmd);
-        fr = popen(cmd, "r");
-        c_free(cmd);
-        if (!fr) {
-            C_LOG_ERROR("popen error!");
+        if (!loop_normalize_path(fileName, fullPath, sizeof(fullPath))) {
+            C_LOG_ERROR("file name too long: %s", fileName);
             break;
         }
 
-        char buf[16] = {0};
-        c_file_read_line_arr(fr, buf, sizeof(buf) - 1);
-        if (c_strlen(buf) > 0 && 0 == c_strcmp0("0", buf)) {
-            C_LOG_INFO("error: %s", buf);
-            res = false;
+        errno = 0;
+        fileFd = open(fullPath, O_RDWR | O_CLOEXEC);
+        if (fileFd < 0 && (EROFS == errno || EACCES == errno)) {
+            fileFd = open(fullPath, O_RDONLY | O_CLOEXEC);
+            conf.info.lo_flags |= LO_FLAGS_READ_ONLY;
+        }
+        if (fileFd < 0 || 0 != fstat(fileFd, &st)) {
+            C_LOG_ERROR("open '%s' error: %s", fullPath, c_strerror(errno));
+            break;
         }
+
+        errno = 0;
+        devFd = open(devName, ((conf.info.lo_flags & LO_FLAGS_READ_ONLY) ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+        if (devFd < 0) {
+            C_LOG_ERROR("open '%s' error: %s", devName, c_strerror(errno));
+            break;
+        }
+
+        /**
+         * 块大小跟随底层文件系统(不超过页大小)，文件大小不对齐时退回 512；
+         * 块大小对齐后才能使用直接 I/O，避免数据在页缓存中缓存两次
+         */
+        conf.fd = fileFd;
+        conf.block_size = (st.st_blksize >= 512 && st.st_blksize <= 4096) ? st.st_blksize : 512;
+        if (0 != st.st_size % conf.block_size) {
+            conf.block_size = 512;
+        }
+        conf.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+        c_strlcpy((char*) conf.info.lo_file_name, fullPath, LO_NAME_SIZE);
+
+        errno = 0;
+        if (0 == ioctl(devFd, LOOP_CONFIGURE, &conf)) {
+            res = true;
+            break;
+        }
+
+        // 底层文件系统不支持直接 I/O
+        if (EINVAL == errno) {
+            conf.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+            errno = 0;
+            if (0 == ioctl(devFd, LOOP_CONFIGURE, &conf)) {
+                res = true;
+                break;
+            }
+        }
+
+        // 5.8 之前的内核没有 LOOP_CONFIGURE
+        if (ENOTTY == errno || EINVAL == errno) {
+            res = loop_set_fd_legacy(devFd, &conf);
+            break;
+        }
+
+        C_LOG_ERROR("LOOP_CONFIGURE '%s' -> '%s' error: %s", fullPath, devName, c_strerror(errno));
     } while (false);
-    pclose(fr);
+
+    if (res) {
+        C_LOG_INFO("attach '%s' to '%s', block size: %u, direct io: %s", fullPath, devName,
+            conf.block_size, (conf.info.lo_flags & LO_FLAGS_DIRECT_IO) ? "true" : "false");
+        loop_cache_insert(devName, fullPath);
+    }
+
+    if (fileFd >= 0)    { close(fileFd); }
+    if (devFd >= 0)     { close(devFd); }
 
     return res;
 }
 
+static bool loop_set_fd_legacy (int devFd, const struct loop_config* conf)
+{
+    c_return_val_if_fail(devFd >= 0 && conf, false);
+
+    errno = 0;
+    if (0 != ioctl(devFd, LOOP_SET_FD, conf->fd)) {
+        C_LOG_ERROR("LOOP_SET_FD error: %s", c_strerror(errno));
+        return false;
+    }
+
+    struct loop_info64 info = conf->info;
+    info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+    if (0 != ioctl(devFd, LOOP_SET_STATUS64, &info)) {
+        C_LOG_ERROR("LOOP_SET_STATUS64 error: %s", c_strerror(errno));
+        ioctl(devFd, LOOP_CLR_FD, 0);
+        return false;
+    }
+
+#ifdef LOOP_SET_BLOCK_SIZE
+    ioctl(devFd, LOOP_SET_BLOCK_SIZE, (unsigned long) conf->block_size);
+#endif
+#ifdef LOOP_SET_DIRECT_IO
+    if (conf->info.lo_flags & LO_FLAGS_DIRECT_IO) {
+        ioctl(devFd, LOOP_SET_DIRECT_IO, 1UL);
+    }
+#endif
+
+    return true;
+}
+
+/**
+ * 查缓存，未命中或命中的设备已被外部卸载/换了文件时重新扫描一次 sysfs，
+ * 以便发现其它进程挂接和卸载的设备
+ */
+static bool loop_cache_lookup (bool byFile, const char* key, char** value)
+{
+    c_return_val_if_fail(key, false);
+
+    char path[PATH_MAX] = {0};
+    if (!loop_normalize_path(key, path, sizeof(path))) {
+        return false;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (0 == i && !gsLoopDevices) {
+            continue;
+        }
+        if (1 == i && !loop_info_update()) {
+            break;
+        }
+
+        G_LOCK(gsLoopDevice);
+        const char* found = c_hash_table_lookup(byFile ? gsLoopDevices->fileLoop : gsLoopDevices->loopFile, path);
+        char* val = found ? c_strdup(found) : NULL;
+        G_UNLOCK(gsLoopDevice);
+
+        if (!val) {
+            continue;
+        }
+
+        // 刚扫描出来的结果直接用，缓存里的要核对一下
+        if (0 == i && !loop_cache_is_valid(byFile ? val : path, byFile ? path : val)) {
+            C_LOG_VERB("stale loop cache: %s -- %s", path, val);
+            c_free(val);
+            continue;
+        }
+
+        if (value) {
+            *value = val;
+        }
+        else {
+            c_free(val);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+static bool loop_cache_is_valid (const char* loopName, const char* fileName)
+{
+    c_return_val_if_fail(loopName && fileName, false);
+
+    const char* name = strrchr(loopName, '/');
+    name = name ? name + 1 : loopName;
+
+    char backing[PATH_MAX] = {0};
+    if (!loop_read_backing_file(name, backing, sizeof(backing))) {
+        return false;
+    }
+    c_file_path_format_arr(backing);
+
+    return (0 == c_strcmp0(backing, fileName));
+}
+
+static void loop_cache_insert (const char* loopName, const char* fileName)
+{
+    c_return_if_fail(loopName && fileName && gsLoopDevices);
+
+    G_LOCK(gsLoopDevice);
+    loop_table_insert(gsLoopDevices->loopFile, gsLoopDevices->fileLoop, loopName, fileName);
+    G_UNLOCK(gsLoopDevice);
+}
+
+static void loop_table_insert (CHashTable* loopFile, CHashTable* fileLoop, const char* loopName, const char* fileName)
+{
+    c_return_if_fail(loopFile && fileLoop && loopName && fileName);
+
+    c_hash_table_insert(loopFile, c_strdup(loopName), c_strdup(fileName));
+    if (!c_hash_table_contains(fileLoop, fileName)) {
+        c_hash_table_insert(fileLoop, c_strdup(fileName), c_strdup(loopName));
+    }
+}
+
+static bool loop_normalize_path (const char* path, char* buf, gsize bufSize)
+{
+    c_return_val_if_fail(path && buf && bufSize > 0, false);
+
+    if (strlen(path) >= bufSize) {
+        return false;
+    }
+
+    c_strlcpy(buf, path, bufSize);
+    c_file_path_format_arr(buf);
+
+    return true;
+}
+
+/**
+ * 优先读 sysfs 中的 backing_file(完整路径)，
+ * 没有时用 LOOP_GET_STATUS64(路径最长 64 字节)
+ */
+static bool loop_read_backing_file (const char* name, char* buf, gsize bufSize)
+{
+    c_return_val_if_fail(name && buf && bufSize > 0, false);
+
+    char path[PATH_MAX] = {0};
+    snprintf(path, sizeof(path), LOOP_SYSFS_BLOCK"/%s/loop/backing_file", name);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t len = read(fd, buf, bufSize - 1);
+        close(fd);
+        if (len <= 0) {
+            return false;
+        }
+        buf[len] = '\0';
+        c_strchomp_arr(buf);
+        return ('\0' != buf[0]);
+    }
+
+    // 未挂接的设备没有 loop 目录
+    snprintf(path, sizeof(path), LOOP_SYSFS_BLOCK"/%s/loop", name);
+    if (c_file_test(path, C_FILE_TEST_IS_DIR)) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "/dev/%s", name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct loop_info64 info;
+    memset(&info, 0, sizeof(info));
+    bool ret = (0 == ioctl(fd, LOOP_GET_STATUS64, &info));
+    close(fd);
+
+    if (ret) {
+        c_strlcpy(buf, (const char*) info.lo_file_name, C_MIN(bufSize, LO_NAME_SIZE));
+    }
+
+    return ret && ('\0' != buf[0]);
+}
+
 static bool loop_info_update()
 {
-    cuint64 inited = 0;
+    static cuint64 inited = 0;
 
     if (c_once_init_enter(&inited)) {
         if (!gsLoopDevices) {
@@ -173,78 +424,52 @@ static bool loop_info_update()
         c_once_init_leave(&inited, 1);
     }
 
-    system("losetup -D");
     errno = 0;
-    FILE* fr = popen("losetup -a -O 'NAME,BACK-FILE' | tail +2 | awk -F' ' '{print $1\"\t\"$2}'", "r");
-    if (C_UNLIKELY(!fr)) {
-        C_LOG_ERROR("popen error: %s", c_strerror(errno));
-        pclose(fr);
+    DIR* dir = opendir(LOOP_SYSFS_BLOCK);
+    if (C_UNLIKELY(!dir)) {
+        C_LOG_ERROR("opendir '%s' error: %s", LOOP_SYSFS_BLOCK, c_strerror(errno));
         return false;
     }
 
-    char line[10240] = {0};
-    while (true) {
-        memset(line, 0, sizeof(line));
-        if (!c_file_read_line_arr(fr, line, sizeof(line) - 1)) {
-            C_LOG_ERROR("c file read line arr error!");
-            break;
-        }
-
-        c_strchug_arr(line);
-        c_strchomp_arr(line);
-        c_strtrim_arr(line);
-
-        C_LOG_VERB("%s", line);
+    // 在局部表中整体重建，已卸载的设备随之清除；建好后在锁内替换，读者不会看到空表或半成品
+    CHashTable* loopFile = c_hash_table_new_full(c_str_hash, c_str_equal, c_free0, c_free0);
+    CHashTable* fileLoop = c_hash_table_new_full(c_str_hash, c_str_equal, c_free0, c_free0);
+    if (C_UNLIKELY(!loopFile || !fileLoop)) {
+        if (loopFile) { c_hash_table_unref(loopFile); }
+        if (fileLoop) { c_hash_table_unref(fileLoop); }
+        closedir(dir);
+        return false;
+    }
 
-        char** p = c_strsplit(line, "\t", -1);
-        if (!p) {
-            c_strfreev(p);
+    struct dirent* ent = NULL;
+    while ((ent = readdir(dir))) {
+        if (0 != strncmp(ent->d_name, "loop", 4)) {
             continue;
         }
 
-        if (2 != c_strv_length(p)) {
-            c_strfreev(p);
-            C_LOG_VERB("strsplit failed!");
+        char backing[PATH_MAX] = {0};
+        if (!loop_read_backing_file(ent->d_name, backing, sizeof(backing))) {
             continue;
         }
 
-        char* loopT = c_strdup(p[0]);
-        char* fileT = c_strdup(p[1]);
-        C_LOG_VERB("%s -- %s", loopT, fileT);
-        if (!loopT || !fileT) {
-            c_free(loopT);
-            c_free(fileT);
-            c_strfreev(p);
-            continue;
-        }
-        c_strfreev(p);
+        char loopName[PATH_MAX] = {0};
+        snprintf(loopName, sizeof(loopName), "/dev/%s", ent->d_name);
+        c_file_path_format_arr(backing);
 
-        C_LOG_VERB("start lock");
-        G_LOCK(gsLoopDevice);
-        C_LOG_VERB("lock OK");
-        do {
-            const char* loopF = c_file_path_format_arr(loopT);
-            const char* fileF = c_file_path_format_arr(fileT);
+        C_LOG_VERB("%s -- %s", loopName, backing);
+        loop_table_insert(loopFile, fileLoop, loopName, backing);
+    }
+    closedir(dir);
 
-            if (c_hash_table_contains(gsLoopDevices->loopFile, loopF)) {
-                break;
-            }
-            char* loop1 = c_strdup(loopF);
-            char* file1 = c_strdup(fileF);
-            c_hash_table_insert(gsLoopDevices->loopFile, loop1, file1);
+    G_LOCK(gsLoopDevice);
+    CHashTable* oldLoopFile = gsLoopDevices->loopFile;
+    CHashTable* oldFileLoop = gsLoopDevices->fileLoop;
+    gsLoopDevices->loopFile = loopFile;
+    gsLoopDevices->fileLoop = fileLoop;
+    G_UNLOCK(gsLoopDevice);
 
-            if (c_hash_table_contains(gsLoopDevices->fileLoop, fileF)) {
-                break;
-            }
-            char* loop2 = c_strdup(loopF);
-            char* file2 = c_strdup(fileF);
-            c_hash_table_insert(gsLoopDevices->fileLoop, file2, loop2);
-        } while (false);
-        C_LOG_VERB("start unlock");
-        G_UNLOCK(gsLoopDevice);
-        C_LOG_VERB("unlock OK");
-    }
-    pclose(fr);
+    c_hash_table_unref(oldLoopFile);
+    c_hash_table_unref(oldFileLoop);
 
     return true;
 }
@@ -8,10 +8,6 @@
 
 C_BEGIN_EXTERN_C
 
-/**
- * @todo 替换掉 losetup 命令
- */
-
 typedef struct _LoopDevice LoopDevice;
 
 char*   loop_get_free_device_name           ();
@@ -5,6 +5,7 @@
 #include "namespace.h"
 
 #include <pwd.h>
+#include <fcntl.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +21,8 @@
 
 
 static void     namespace_set_propagation       (unsigned long flags);
+static void     namespace_pin                   (int hostNs, pid_t pid, int readyFd);
+static void     namespace_unpin                 (void);
 static void     signal_process                  (int signum);
 
 extern pid_t mountPid;
@@ -49,9 +52,18 @@ bool namespace_enter()
         signal(SIGUSR1, signal_process);
     }
 
+    // 宿主机的挂载命名空间，新命名空间建好后父进程回到这里钉住它
+    int hostNs = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    int ready[2] = {-1, -1};
+    if (0 != pipe2(ready, O_CLOEXEC)) {
+        ready[0] = ready[1] = -1;
+    }
+
     ret = unshare(flags);
     if (-1 == ret) {
         C_LOG_ERROR("unshared failed!");
+        if (hostNs >= 0) { close(hostNs); }
+        if (ready[0] >= 0) { close(ready[0]); close(ready[1]); }
         return false;
     }
 
@@ -72,6 +84,8 @@ bool namespace_enter()
         }
         case 0: {
             C_LOG_VERB("[child] process");
+            if (hostNs >= 0) { close(hostNs); }
+            if (ready[0] >= 0) { close(ready[0]); }
             if (sigprocmask(SIG_SETMASK, &oldSigset, NULL)) {
                 C_LOG_ERROR("sigprocmask restore failed");
                 return false;
@@ -86,11 +100,18 @@ bool namespace_enter()
 
     if (pid) {
         C_LOG_VERB("[parent] process");
+        if (ready[1] >= 0) { close(ready[1]); }
+        namespace_pin(hostNs, pid, ready[0]);
+        if (hostNs >= 0) { close(hostNs); }
+        if (ready[0] >= 0) { close(ready[0]); }
+
         if (-1 == waitpid(pid, &status, 0)) {
             C_LOG_ERROR("[parent] waitpid failed!");
             exit(-1);
         }
 
+        namespace_unpin();
+
         if (WIFEXITED(status)) {
             C_LOG_VERB("[parent] WIFEXITED!");
             return WEXITSTATUS(status);
@@ -119,6 +140,13 @@ bool namespace_enter()
         namespace_set_propagation(propagation);
     }
 
+    // 改成私有之后父进程再去钉，免得钉住的挂载又传播回来
+    if (ready[1] >= 0) {
+        const char c = 0;
+        ssize_t C_UNUSED w = write(ready[1], &c, 1);
+        close(ready[1]);
+    }
+
     C_LOG_INFO("[child] End enter the new namespace!");
 
     return true;
@@ -136,6 +164,60 @@ static void namespace_set_propagation (unsigned long flags)
     }
 }
 
+/**
+ * @brief 父进程回到宿主机命名空间，把沙盒的挂载命名空间绑定到 NAMESPACE_MNT_PIN，
+ *        守护进程活着期间外部进程可以直接 setns(2)/nsenter 进来，不用再搭一遍 rootfs
+ */
+static void namespace_pin (int hostNs, pid_t pid, int readyFd)
+{
+    if (hostNs < 0 || readyFd < 0) {
+        return;
+    }
+
+    char c = 0;
+    ssize_t n = 0;
+    do {
+        n = read(readyFd, &c, 1);
+    } while (n < 0 && EINTR == errno);
+    if (1 != n) {
+        // 子进程没走到设置传播属性就退出了
+        return;
+    }
+
+    errno = 0;
+    if (0 != setns(hostNs, CLONE_NEWNS)) {
+        // 已经有别的线程时不能切换挂载命名空间
+        C_LOG_WARNING("setns to host mount namespace error: %s", c_strerror(errno));
+        return;
+    }
+
+    // 上次守护进程异常退出留下的，钉着旧命名空间里的挂载不放
+    umount2(NAMESPACE_MNT_PIN, MNT_DETACH);
+
+    mkdir(NAMESPACE_PIN_DIR, 0700);
+    int fd = open(NAMESPACE_MNT_PIN, O_RDONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    char* src = c_strdup_printf("/proc/%d/ns/mnt", pid);
+    errno = 0;
+    if (0 != mount(src, NAMESPACE_MNT_PIN, NULL, MS_BIND, NULL)) {
+        C_LOG_WARNING("pin mount namespace '%s' error: %s", src, c_strerror(errno));
+    }
+    else {
+        C_LOG_INFO("mount namespace pinned at '%s'", NAMESPACE_MNT_PIN);
+    }
+    c_free(src);
+}
+
+static void namespace_unpin (void)
+{
+    if (0 == umount2(NAMESPACE_MNT_PIN, MNT_DETACH)) {
+        unlink(NAMESPACE_MNT_PIN);
+    }
+}
+
 static void signal_process (int signum)
 {
     if (SIGKILL == signum
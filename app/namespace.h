@@ -8,6 +8,13 @@
 
 C_BEGIN_EXTERN_C
 
+/**
+ * 守护进程运行期间，沙盒的挂载命名空间绑定在宿主机的这个文件上，
+ * 沙盒外的进程打开它 setns(fd, CLONE_NEWNS)(或 nsenter --mount=) 即可进入已经搭好的 rootfs
+ */
+#define NAMESPACE_PIN_DIR               "/run/andsec-sandbox-ns"
+#define NAMESPACE_MNT_PIN               NAMESPACE_PIN_DIR "/mnt"
+
 /**
  * @brief 进入命名空间
  */
@@ -5,13 +5,32 @@
 #include "ipc-message.h"
 
 #include <glib.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 struct _IpcMessageData
 {
     IpcType         ipcType;
     GList*          ipcData;
+    bool            borrowed;           // ipcData 中的字符串指向接收缓冲区，不释放
 };
 
+struct _IpcFrameReader
+{
+    char*           buf;
+    gsize           capacity;
+    gsize           start;              // 未处理数据起点
+    gsize           end;                // 已接收数据终点
+    bool            error;              // 帧头非法或帧超过缓冲区
+    int             fds[IPC_FRAME_FDS_MAX]; // SCM_RIGHTS 收到、还没被取走的 fd，按到达顺序
+    guint           nFds;
+};
+
+static bool ipc_wait_fd (int fd, short events);
+static void ipc_frame_reader_keep_fds (IpcFrameReader* reader, struct msghdr* msg);
+
 IpcMessageData* ipc_message_data_new(void)
 {
     IpcMessageData* data = g_malloc0 (sizeof(IpcMessageData));
@@ -29,7 +48,12 @@ void ipc_message_data_free(IpcMessageData** data)
     g_return_if_fail (data != NULL || *data == NULL);
 
     if ((*data)->ipcData) {
-        g_list_free_full((*data)->ipcData, g_free);
+        if ((*data)->borrowed) {
+            g_list_free((*data)->ipcData);
+        }
+        else {
+            g_list_free_full((*data)->ipcData, g_free);
+        }
     }
 
     if (*data) {
@@ -130,3 +154,350 @@ const GList * ipc_message_get_env_list(IpcMessageData * data)
     return data->ipcData;
 }
 
+const char* ipc_message_get_value(IpcMessageData* data, const char* key)
+{
+    g_return_val_if_fail(data != NULL && key != NULL, NULL);
+
+    gsize keyLen = strlen(key);
+
+    for (GList* node = data->ipcData; node; node = node->next) {
+        const char* kv = node->data;
+        if (kv && 0 == strncmp(kv, key, keyLen) && '=' == kv[keyLen]) {
+            return kv + keyLen + 1;
+        }
+    }
+
+    return NULL;
+}
+
+gsize ipc_message_pack_frame(IpcMessageData* data, guint32 reqId, char** outBuf)
+{
+    g_return_val_if_fail(data != NULL && outBuf, 0);
+
+    gsize size = sizeof(IpcFrame);
+    for (GList* node = data->ipcData; node; node = node->next) {
+        size += strlen(node->data) + 1;
+    }
+    g_return_val_if_fail(size <= IPC_FRAME_MAX, 0);
+
+    char* buf = g_malloc0(size);
+    if (NULL == buf) {
+        return 0;
+    }
+
+    IpcFrame* frame = (IpcFrame*) buf;
+    frame->magic = IPC_FRAME_MAGIC;
+    frame->reqId = reqId;
+    frame->type = data->ipcType;
+    frame->dataLen = size - sizeof(IpcFrame);
+
+    gsize curSize = sizeof(IpcFrame);
+    for (GList* node = data->ipcData; node; node = node->next) {
+        gsize strLen = strlen(node->data) + 1;
+        memcpy(buf + curSize, node->data, strLen);
+        curSize += strLen;
+    }
+
+    *outBuf = buf;
+
+    return size;
+}
+
+bool ipc_message_from_frame(IpcMessageData* data, const IpcFrame* frame)
+{
+    g_return_val_if_fail(data != NULL && frame != NULL && NULL == data->ipcData, false);
+
+    data->ipcType = frame->type;
+    data->borrowed = true;
+
+    // 载荷以 '\0' 结尾已在 ipc_frame_reader_next 中校验
+    const char* end = frame->data + frame->dataLen;
+    for (const char* kv = frame->data; kv < end; kv += strlen(kv) + 1) {
+        if ('\0' != kv[0]) {
+            data->ipcData = g_list_prepend(data->ipcData, (gpointer) kv);
+        }
+    }
+    data->ipcData = g_list_reverse(data->ipcData);
+
+    return true;
+}
+
+IpcFrameReader* ipc_frame_reader_new(gsize capacity)
+{
+    g_return_val_if_fail(capacity >= sizeof(IpcFrame), NULL);
+
+    IpcFrameReader* reader = g_malloc0(sizeof(IpcFrameReader));
+    if (NULL == reader) {
+        return NULL;
+    }
+
+    reader->buf = g_malloc(capacity);
+    if (NULL == reader->buf) {
+        g_free(reader);
+        return NULL;
+    }
+    reader->capacity = capacity;
+
+    return reader;
+}
+
+void ipc_frame_reader_free(IpcFrameReader** reader)
+{
+    g_return_if_fail(reader && *reader);
+
+    for (guint i = 0; i < (*reader)->nFds; ++i) {
+        close((*reader)->fds[i]);
+    }
+
+    g_free((*reader)->buf);
+    g_free(*reader);
+    *reader = NULL;
+}
+
+gssize ipc_frame_reader_fill(IpcFrameReader* reader, int fd)
+{
+    g_return_val_if_fail(reader && fd >= 0, -1);
+
+    // 未处理的半帧搬到缓冲区头部
+    if (reader->start > 0) {
+        if (reader->end > reader->start) {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        }
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    if (reader->end >= reader->capacity) {
+        reader->error = true;
+        return -1;
+    }
+
+    while (true) {
+        char ctrl[CMSG_SPACE(sizeof(int) * IPC_FRAME_FDS_MAX)];
+        struct iovec iov = { .iov_base = reader->buf + reader->end, .iov_len = reader->capacity - reader->end };
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+
+        errno = 0;
+        gssize ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (ret >= 0) {
+            ipc_frame_reader_keep_fds(reader, &msg);
+        }
+        if (ret > 0) {
+            reader->end += ret;
+            return ret;
+        }
+        if (0 == ret) {
+            return 0;
+        }
+        if (EINTR == errno) {
+            continue;
+        }
+        if ((EAGAIN == errno || EWOULDBLOCK == errno) && ipc_wait_fd(fd, POLLIN)) {
+            continue;
+        }
+        return -1;
+    }
+}
+
+const IpcFrame* ipc_frame_reader_next(IpcFrameReader* reader)
+{
+    g_return_val_if_fail(reader, NULL);
+
+    if (reader->error || reader->end - reader->start < sizeof(IpcFrame)) {
+        return NULL;
+    }
+
+    const IpcFrame* frame = (const IpcFrame*) (reader->buf + reader->start);
+    if (IPC_FRAME_MAGIC != frame->magic || frame->dataLen > reader->capacity - sizeof(IpcFrame)) {
+        C_LOG_ERROR("Invalid frame, magic: 0x%x, len: %u", frame->magic, frame->dataLen);
+        reader->error = true;
+        return NULL;
+    }
+
+    const gsize frameLen = sizeof(IpcFrame) + frame->dataLen;
+    if (reader->end - reader->start < frameLen) {
+        return NULL;
+    }
+
+    if (frame->dataLen > 0 && '\0' != frame->data[frame->dataLen - 1]) {
+        C_LOG_ERROR("Invalid frame payload, reqId: %u", frame->reqId);
+        reader->error = true;
+        return NULL;
+    }
+
+    reader->start += frameLen;
+
+    return frame;
+}
+
+bool ipc_frame_reader_error(IpcFrameReader* reader)
+{
+    g_return_val_if_fail(reader, true);
+
+    return reader->error;
+}
+
+int ipc_frame_reader_take_fd(IpcFrameReader* reader)
+{
+    g_return_val_if_fail(reader, -1);
+
+    if (0 == reader->nFds) {
+        return -1;
+    }
+
+    const int fd = reader->fds[0];
+    memmove(reader->fds, reader->fds + 1, sizeof(int) * (--reader->nFds));
+
+    return fd;
+}
+
+bool ipc_frame_write_all_fd(int fd, const void* buf, gsize bufSize, int passFd)
+{
+    g_return_val_if_fail(fd >= 0 && buf && bufSize > 0, false);
+
+    if (passFd < 0) {
+        return ipc_frame_write_all(fd, buf, bufSize);
+    }
+
+    // fd 随第一段数据发出，剩下的按普通数据写
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    memset(ctrl, 0, sizeof(ctrl));
+    struct iovec iov = { .iov_base = (void*) buf, .iov_len = bufSize };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &passFd, sizeof(int));
+
+    while (true) {
+        errno = 0;
+        gssize ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (ret > 0) {
+            return ((gsize) ret == bufSize) || ipc_frame_write_all(fd, (const char*) buf + ret, bufSize - ret);
+        }
+        if (ret < 0 && EINTR == errno) {
+            continue;
+        }
+        if (ret < 0 && (EAGAIN == errno || EWOULDBLOCK == errno) && ipc_wait_fd(fd, POLLOUT)) {
+            continue;
+        }
+        return false;
+    }
+}
+
+bool ipc_frame_write_all(int fd, const void* buf, gsize bufSize)
+{
+    g_return_val_if_fail(fd >= 0 && buf, false);
+
+    gsize written = 0;
+    while (written < bufSize) {
+        errno = 0;
+        gssize ret = write(fd, (const char*) buf + written, bufSize - written);
+        if (ret > 0) {
+            written += ret;
+            continue;
+        }
+        if (ret < 0 && EINTR == errno) {
+            continue;
+        }
+        if (ret < 0 && (EAGAIN == errno || EWOULDBLOCK == errno) && ipc_wait_fd(fd, POLLOUT)) {
+            continue;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+bool ipc_frame_write_response(int fd, guint32 reqId, const IpcResponse* resp)
+{
+    g_return_val_if_fail(resp, false);
+
+    char buf[sizeof(IpcFrame) + sizeof(IpcResponse)];
+
+    IpcFrame* frame = (IpcFrame*) buf;
+    frame->magic = IPC_FRAME_MAGIC;
+    frame->reqId = reqId;
+    frame->type = IPC_TYPE_RESPONSE;
+    frame->dataLen = sizeof(IpcResponse);
+    memcpy(frame->data, resp, sizeof(IpcResponse));
+
+    return ipc_frame_write_all(fd, buf, sizeof(buf));
+}
+
+bool ipc_frame_write_response_data(int fd, guint32 reqId, const IpcResponse* resp, const void* data, gsize dataLen)
+{
+    g_return_val_if_fail(resp && (data || 0 == dataLen), false);
+
+    if (0 == dataLen) {
+        return ipc_frame_write_response(fd, reqId, resp);
+    }
+
+    dataLen = MIN(dataLen, IPC_FRAME_MAX - sizeof(IpcFrame) - sizeof(IpcResponse));
+    const gsize bufSize = sizeof(IpcFrame) + sizeof(IpcResponse) + dataLen;
+    char* buf = g_malloc(bufSize);
+    if (!buf) {
+        return false;
+    }
+
+    IpcFrame* frame = (IpcFrame*) buf;
+    frame->magic = IPC_FRAME_MAGIC;
+    frame->reqId = reqId;
+    frame->type = IPC_TYPE_RESPONSE;
+    frame->dataLen = sizeof(IpcResponse) + dataLen;
+    memcpy(frame->data, resp, sizeof(IpcResponse));
+    memcpy(frame->data + sizeof(IpcResponse), data, dataLen);
+
+    const bool ret = ipc_frame_write_all(fd, buf, bufSize);
+    g_free(buf);
+
+    return ret;
+}
+
+static bool ipc_wait_fd (int fd, short events)
+{
+    struct pollfd pfd = { .fd = fd, .events = events, .revents = 0 };
+
+    int ret = 0;
+    do {
+        errno = 0;
+        ret = poll(&pfd, 1, -1);
+    } while (ret < 0 && EINTR == errno);
+
+    return ret > 0;
+}
+
+static void ipc_frame_reader_keep_fds (IpcFrameReader* reader, struct msghdr* msg)
+{
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (SOL_SOCKET != cm->cmsg_level || SCM_RIGHTS != cm->cmsg_type) {
+            continue;
+        }
+        const int n = (int) ((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < n; ++i) {
+            int fd = -1;
+            memcpy(&fd, CMSG_DATA(cm) + sizeof(int) * i, sizeof(int));
+            if (reader->nFds < IPC_FRAME_FDS_MAX) {
+                reader->fds[reader->nFds++] = fd;
+            }
+            else {
+                C_LOG_WARNING("Too many pending fds, drop %d", fd);
+                close(fd);
+            }
+        }
+    }
+
+    if (msg->msg_flags & MSG_CTRUNC) {
+        C_LOG_WARNING("Control message truncated, some fds are lost");
+    }
+}
@@ -10,6 +10,7 @@
 #include <c/clib.h>
 
 typedef struct _IpcMessageData          IpcMessageData;
+typedef struct _IpcFrameReader          IpcFrameReader;
 
 IpcMessageData*     ipc_message_data_new    (void);
 void                ipc_message_data_free   (IpcMessageData** data);
@@ -19,5 +20,21 @@ gsize               ipc_message_pack        (IpcMessageData* data, char** outBuf
 bool                ipc_message_unpack      (IpcMessageData* data, const char* buf, gsize bufSize);
 IpcType             ipc_message_type        (IpcMessageData* data);
 const GList*        ipc_message_get_env_list(IpcMessageData* data);
+const char*         ipc_message_get_value   (IpcMessageData* data, const char* key);
+
+gsize               ipc_message_pack_frame  (IpcMessageData* data, guint32 reqId, char** outBuf/*out, need free*/);
+bool                ipc_message_from_frame  (IpcMessageData* data, const IpcFrame* frame);             // 字符串引用帧内数据，帧失效前有效
+
+IpcFrameReader*     ipc_frame_reader_new    (gsize capacity);
+void                ipc_frame_reader_free   (IpcFrameReader** reader);
+gssize              ipc_frame_reader_fill   (IpcFrameReader* reader, int fd);                           // >0 读取字节数，0 对端关闭，<0 出错
+const IpcFrame*     ipc_frame_reader_next   (IpcFrameReader* reader);                                   // 下次 fill 前有效
+bool                ipc_frame_reader_error  (IpcFrameReader* reader);
+int                 ipc_frame_reader_take_fd(IpcFrameReader* reader);                                   // 取出最早收到的 fd(SCM_RIGHTS)，没有时为 -1，调用者关闭
+bool                ipc_frame_write_all     (int fd, const void* buf, gsize bufSize);
+bool                ipc_frame_write_all_fd  (int fd, const void* buf, gsize bufSize, int passFd);       // passFd 随帧以 SCM_RIGHTS 发出，< 0 时同 ipc_frame_write_all
+bool                ipc_frame_write_response(int fd, guint32 reqId, const IpcResponse* resp);
+bool                ipc_frame_write_response_data(int fd, guint32 reqId, const IpcResponse* resp,
+                                                  const void* data, gsize dataLen);             // 超出单帧上限的部分截掉
 
 #endif // sandbox_IPC_MESSAGE_H
@@ -13,6 +13,12 @@ struct rc4_state
 
 typedef struct rc4_state CRC4State;
 
+/**
+ * lock_file_buffer() 每 LOCK_FILE_BLOCK_SIZE 字节重新初始化一次密钥流，
+ * 密文只与块内偏移有关，按块对齐搬移的密文无需解密/加密即可直接复制
+ */
+#define LOCK_FILE_BLOCK_SIZE    512
+
 
 #ifdef __cplusplus
 extern "C"
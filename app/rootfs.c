@@ -4,12 +4,54 @@
 
 #include "rootfs.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
 
 #include "utils.h"
+#include "fs/change-notify.h"
+#include "../hook/hook-connect.h"
+
+// 新挂载 API(5.2 起，mount_setattr 5.12 起)，老 glibc 没有封装和常量
+#ifndef SYS_open_tree
+#define SYS_open_tree               428
+#endif
+#ifndef SYS_move_mount
+#define SYS_move_mount              429
+#endif
+#ifndef SYS_fsopen
+#define SYS_fsopen                  430
+#endif
+#ifndef SYS_fsconfig
+#define SYS_fsconfig                431
+#endif
+#ifndef SYS_fsmount
+#define SYS_fsmount                 432
+#endif
+#ifndef SYS_mount_setattr
+#define SYS_mount_setattr           442
+#endif
+
+#define ROOTFS_OPEN_TREE_CLONE      1
+#define ROOTFS_AT_RECURSIVE         0x8000
+#define ROOTFS_MOVE_MOUNT_F_EMPTY   0x00000004
+#define ROOTFS_FSOPEN_CLOEXEC       1
+#define ROOTFS_FSMOUNT_CLOEXEC      1
+#define ROOTFS_FSCONFIG_CMD_CREATE  6
+#define ROOTFS_MOUNT_ATTR_RDONLY    0x00000001
+
+typedef struct
+{
+    cuint64     attrSet;
+    cuint64     attrClr;
+    cuint64     propagation;
+    cuint64     usernsFd;
+} RootfsMountAttr;
+
+static int gsNewMountApi = -1;                          // -1 未探测，0 内核不支持，1 支持
 
 
 static bool file_is_link    (const char* path);
@@ -18,6 +60,9 @@ static bool mount_dev       (const char* mountPoint);
 static bool mkdir_parent    (const char* dir, mode_t mode);
 static bool mklink          (const char* src, const char* dest);
 static bool mkbind          (const char* src, const char* dest);
+static bool is_mount_point  (const char* path);
+static bool attach_tree     (const char* src, const char* dest, bool readOnly, bool recursive);
+static bool attach_fs       (const char* fsType, const char* dest);
 
 
 bool rootfs_init(const char * mountPoint)
@@ -42,7 +87,7 @@ bool rootfs_init(const char * mountPoint)
             }
         }
         else {
-            if (!mkbind("/bin", binB)) {
+            if (!attach_tree("/bin", binB, true, true)) {
                 C_LOG_WARNING("mkbind '/bin' failed");
                 c_free(binB);
                 return false;
@@ -62,7 +107,7 @@ bool rootfs_init(const char * mountPoint)
             }
         }
         else {
-            if (!mkbind("/lib", libB)) {
+            if (!attach_tree("/lib", libB, true, true)) {
                 C_LOG_WARNING("mkbind '/lib' failed");
                 c_free(libB);
                 return false;
@@ -81,7 +126,7 @@ bool rootfs_init(const char * mountPoint)
             }
         }
         else {
-            if (!mkbind("/lib64", lib64B)) {
+            if (!attach_tree("/lib64", lib64B, true, true)) {
                 C_LOG_WARNING("mkbind '/lib64' failed");
                 c_free(lib64B);
                 return false;
@@ -97,7 +142,7 @@ bool rootfs_init(const char * mountPoint)
     {
         C_LOG_VERB("mkbind etc/");
         cchar* etcB = c_strdup_printf("%s/etc", mountPoint);
-        if (!mkbind("/etc", etcB)) {
+        if (!attach_tree("/etc", etcB, true, true)) {
             c_free(etcB);
             return false;
         }
@@ -106,9 +151,10 @@ bool rootfs_init(const char * mountPoint)
 
     // 创建 usr/ 绑定
     {
+        // 不能递归: 沙盒自己的 FUSE 卷(SANDBOX_MOUNT_POINT)以及上面的 bin/lib/etc 绑定都在 /usr 下面
         C_LOG_VERB("mkbind 'usr/'");
         cchar* usrB = c_strdup_printf("%s/usr", mountPoint);
-        if (!mkbind("/usr", usrB)) {
+        if (!attach_tree("/usr", usrB, true, false)) {
             c_free(usrB);
             return false;
         }
@@ -143,6 +189,29 @@ bool rootfs_init(const char * mountPoint)
         c_free(tmpB);
     }
 
+    // 网络访问策略和审计队列，守护进程没准备好时沙盒里的 hook 全部放行
+    if (c_file_test(HOOK_CONNECT_DIR, C_FILE_TEST_IS_DIR)) {
+        C_LOG_VERB("mkbind '" HOOK_CONNECT_DIR "'");
+        cchar* connectB = c_strdup_printf("%s%s", mountPoint, HOOK_CONNECT_DIR);
+        if (!mkbind(HOOK_CONNECT_DIR, connectB)) {
+            C_LOG_WARNING("mkbind '%s' failed", HOOK_CONNECT_DIR);
+        }
+        c_free(connectB);
+    }
+
+    // 文件变化通知，FUSE 子进程可能还没建好目录，先建出来，之后创建的 socket 通过绑定可见
+    {
+        C_LOG_VERB("mkbind '" SANDBOX_FS_EVENTS_DIR "'");
+        if (0 != mkdir(SANDBOX_FS_EVENTS_DIR, 0711) && EEXIST != errno) {
+            C_LOG_WARNING("mkdir '%s' failed: %s", SANDBOX_FS_EVENTS_DIR, c_strerror(errno));
+        }
+        cchar* eventsB = c_strdup_printf("%s%s", mountPoint, SANDBOX_FS_EVENTS_DIR);
+        if (!mkbind(SANDBOX_FS_EVENTS_DIR, eventsB)) {
+            C_LOG_WARNING("mkbind '%s' failed", SANDBOX_FS_EVENTS_DIR);
+        }
+        c_free(eventsB);
+    }
+
     // dev
     C_LOG_VERB("mount 'dev/'");
     if (!mount_dev(mountPoint)) {
@@ -209,6 +278,128 @@ static bool mkbind(const char* src, const char* dest)
     return true;
 }
 
+static bool is_mount_point (const char* path)
+{
+    c_return_val_if_fail(path, false);
+
+    // 和上一级不在同一个设备上，或者就是 "/"
+    struct stat st, parent;
+    cchar* up = c_strdup_printf("%s/..", path);
+    const bool ok = (0 == stat(path, &st) && 0 == stat(up, &parent));
+    c_free(up);
+
+    return ok && (st.st_dev != parent.st_dev || st.st_ino == parent.st_ino);
+}
+
+/**
+ * @brief 用 open_tree 克隆 src(recursive 时连同下面的挂载)，按需整体设为只读后 move_mount 到 dest，
+ *        不用再一层层 mount(MS_BIND)，也不用每次读 mtab 判断；内核不支持时退回 mkbind(不递归)
+ */
+static bool attach_tree (const char* src, const char* dest, bool readOnly, bool recursive)
+{
+    c_return_val_if_fail(src && dest, false);
+
+    if (0 == c_atomic_int_get(&gsNewMountApi)) {
+        return mkbind(src, dest);
+    }
+
+    if (!c_file_test(dest, C_FILE_TEST_EXISTS)) {
+        errno = 0;
+        if (-1 == c_mkdir_with_parents(dest, 0755)) {
+            C_LOG_ERROR("%s error: %s", dest, c_strerror(errno));
+            return false;
+        }
+    }
+
+    if (is_mount_point(dest)) {
+        C_LOG_VERB("%s is mount point!", dest);
+        return true;
+    }
+
+    errno = 0;
+    const unsigned int recFlag = recursive ? ROOTFS_AT_RECURSIVE : 0;
+    int fd = (int) syscall(SYS_open_tree, AT_FDCWD, src, ROOTFS_OPEN_TREE_CLONE | O_CLOEXEC | recFlag);
+    if (fd < 0) {
+        if (ENOSYS == errno) {
+            C_LOG_INFO("open_tree is not supported, use mount(MS_BIND)");
+            c_atomic_int_set(&gsNewMountApi, 0);
+            return mkbind(src, dest);
+        }
+        C_LOG_ERROR("open_tree '%s' error: %s", src, c_strerror(errno));
+        return false;
+    }
+    c_atomic_int_set(&gsNewMountApi, 1);
+
+    if (readOnly) {
+        // 5.12 之前没有 mount_setattr，保持和 mkbind 一样可写
+        RootfsMountAttr attr = { .attrSet = ROOTFS_MOUNT_ATTR_RDONLY };
+        if (0 != syscall(SYS_mount_setattr, fd, "", AT_EMPTY_PATH | recFlag, &attr, sizeof(attr))) {
+            C_LOG_VERB("mount_setattr '%s' read-only error: %s", src, c_strerror(errno));
+        }
+    }
+
+    errno = 0;
+    const int ret = (int) syscall(SYS_move_mount, fd, "", AT_FDCWD, dest, ROOTFS_MOVE_MOUNT_F_EMPTY);
+    const int err = errno;
+    close(fd);
+    if (0 != ret) {
+        C_LOG_ERROR("move_mount '%s' -> '%s' error: %s", src, dest, c_strerror(err));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief fsopen/fsmount 新建一个文件系统实例挂到 dest，已经挂过的不重复挂；内核不支持时退回 mount
+ */
+static bool attach_fs (const char* fsType, const char* dest)
+{
+    c_return_val_if_fail(fsType && dest, false);
+
+    if (0 != c_atomic_int_get(&gsNewMountApi)) {
+        if (is_mount_point(dest)) {
+            C_LOG_VERB("%s is mount point!", dest);
+            return true;
+        }
+
+        errno = 0;
+        int fsFd = (int) syscall(SYS_fsopen, fsType, ROOTFS_FSOPEN_CLOEXEC);
+        if (fsFd >= 0) {
+            int mntFd = -1;
+            if (0 == syscall(SYS_fsconfig, fsFd, ROOTFS_FSCONFIG_CMD_CREATE, NULL, NULL, 0)) {
+                mntFd = (int) syscall(SYS_fsmount, fsFd, ROOTFS_FSMOUNT_CLOEXEC, 0);
+            }
+            const int err = errno;
+            close(fsFd);
+
+            int ret = -1;
+            if (mntFd >= 0) {
+                ret = (int) syscall(SYS_move_mount, mntFd, "", AT_FDCWD, dest, ROOTFS_MOVE_MOUNT_F_EMPTY);
+                close(mntFd);
+            }
+            else {
+                errno = err;
+            }
+
+            if (0 != ret) {
+                C_LOG_ERROR("mount %s on '%s' error: %s", fsType, dest, c_strerror(errno));
+                return false;
+            }
+
+            return true;
+        }
+        else if (ENOSYS != errno) {
+            C_LOG_ERROR("fsopen %s error: %s", fsType, c_strerror(errno));
+            return false;
+        }
+        C_LOG_INFO("fsopen is not supported, use mount()");
+        c_atomic_int_set(&gsNewMountApi, 0);
+    }
+
+    return (0 == mount(fsType, dest, fsType, 0, NULL));
+}
+
 static bool mkdir_parent (const char* dir, mode_t mode)
 {
     c_return_val_if_fail(dir, false);
@@ -243,7 +434,7 @@ static bool mount_proc (const char* mountPoint)
         c_mkdir_with_parents(proc, 0777);
     }
 
-    if (0 != mount("proc", proc, "proc", 0, NULL)) {
+    if (!attach_fs("proc", proc)) {
         C_LOG_ERROR("proc mount failed! ");
         c_free(proc);
         return false;
@@ -261,7 +452,8 @@ static bool mount_dev (const char* mountPoint)
         c_mkdir_with_parents(dev, 0755);
     }
     umount(dev);
-    if (true != mkbind("/dev", dev)) {
+    // 不递归，宿主机的 /dev/shm、/dev/mqueue 等不带进来，下面单独挂新的实例
+    if (true != attach_tree("/dev", dev, false, false)) {
         C_LOG_ERROR("proc mount failed! ");
         c_free(dev);
         return false;
@@ -297,6 +489,32 @@ static bool mount_dev (const char* mountPoint)
     }
     c_free(dev);
 
+    // shm
+    dev = c_strdup_printf("%s/dev/shm", mountPoint);
+    if (!c_file_test(dev, C_FILE_TEST_EXISTS)) {
+        errno = 0;
+        c_mkdir_with_parents(dev, 0777);
+    }
+    umount(dev);
+    if (0 != mount("tmpfs", dev, "tmpfs", MS_NOSUID | MS_NODEV, "mode=1777")) {
+        C_LOG_ERROR("mount tmpfs on '%s' error: %s", dev, c_strerror(errno));
+        c_free(dev);
+        return false;
+    }
+    c_free(dev);
+
+    // mqueue，内容跟随 IPC 命名空间
+    dev = c_strdup_printf("%s/dev/mqueue", mountPoint);
+    if (!c_file_test(dev, C_FILE_TEST_EXISTS)) {
+        errno = 0;
+        c_mkdir_with_parents(dev, 0777);
+    }
+    umount(dev);
+    if (0 != mount("mqueue", dev, "mqueue", MS_NOSUID | MS_NODEV | MS_NOEXEC, NULL)) {
+        C_LOG_WARNING("mount mqueue on '%s' error: %s", dev, c_strerror(errno));
+    }
+    c_free(dev);
+
     // ptmx
     dev = c_strdup_printf("%s/dev/ptmx", mountPoint);
     if (!c_file_test(dev, C_FILE_TEST_EXISTS)) {
@@ -101,15 +101,21 @@
 #include <glib.h>
 #include <fuse.h>
 #include <pwd.h>
+#include <sys/ioctl.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
 
+#include "rc4.h"
 #include "utils.h"
 #include "c/clib.h"
 #include "./fs/sd.h"
 #include "./fs/boot.h"
 #include "./fs/utils.h"
 #include "./fs/attrdef.h"
+#include "./fs/name-index.h"
+#include "./fs/change-notify.h"
 #include "../3thrd/fs/dir.h"
 #include "../3thrd/fs/mft.h"
 #include "../3thrd/fs/mst.h"
@@ -174,6 +180,20 @@ switch if you want to be able to build the NTFS utilities."
 #define NTFS_PROGBAR_SUPPRESS               0x0002
 #define NTFS_MBYTE                          (1000 * 1000)
 
+#define RELOCATE_CHUNK_SIZE                 (8 * 1024 * 1024)   /* 簇搬移时单次传输的最大字节数 */
+#define RELOCATE_PIPELINE_DEPTH             4                   /* 读写流水线中缓冲区个数 */
+
+#define SANDBOX_FS_TAIL_MAX                 (64 * 1024)             /* 备份引导扇区 + 沙盒文件头的最大长度 */
+#define SANDBOX_FS_TRANSFER_CHUNK           (8 * 1024 * 1024)       /* 导入导出时单次读写的字节数 */
+#define SANDBOX_FS_TRANSFER_SLICE           (64 * 1024 * 1024)      /* 导入导出时一次 ioctl 最多搬运的字节数，之后让出 FUSE 主循环 */
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open                      434
+#endif
+#ifndef SYS_pidfd_getfd
+#define SYS_pidfd_getfd                     438
+#endif
+
 /*	ACLS may be checked by kernel (requires a fuse patch) or here */
 #define KERNELACLS                          ((HPERMSCONFIG > 6) & (HPERMSCONFIG < 10))
 /*	basic permissions may be checked by kernel or here */
@@ -414,6 +434,32 @@ typedef struct
     enum mirror_source mirr_from;
 } ntfs_resize_t;
 
+/* one multi-cluster transfer of the relocation engine */
+typedef struct
+{
+    s64 src;                        /* first source lcn */
+    s64 dest;                       /* first destination lcn */
+    s64 count;                      /* num of clusters */
+    int err;                        /* errno of the read, 0 = ok */
+    char *buf;
+} relocate_chunk_t;
+
+/* read -> write pipeline used by copy_clusters() */
+typedef struct
+{
+    ntfs_volume *vol;
+    s64 dest;
+    s64 src;
+    s64 len;                        /* num of clusters to copy */
+    s64 step;                       /* max clusters per chunk */
+    s64 nr_chunks;
+    s64 first;                      /* first chunk left to the pipeline */
+    int backward;                   /* copy from the end, for dest > src overlaps */
+    gint abort;                     /* atomic, set by the writer on error */
+    GAsyncQueue *free_chunks;
+    GAsyncQueue *full_chunks;
+} relocate_pipeline_t;
+
 typedef struct EXPAND {
     ntfs_volume *vol;
     u64 original_sectors;
@@ -465,6 +511,7 @@ typedef struct
     BOOL recover;
     BOOL hiberfile;
     BOOL sync;
+    BOOL direct_io;
     BOOL big_writes;
     BOOL debug;
     BOOL no_detach;
@@ -516,6 +563,8 @@ struct _SandboxFs
     char*                       mountPoint;
 
     bool                        isMounted;
+    bool                        directIo;               // O_DIRECT 打开镜像，不占宿主机页缓存
+    char*                       workerCgroup;           // 挂载进程启动后移入的 cgroup.procs，NULL 不移动
 };
 
 G_LOCK_DEFINE(gsSandbox);
@@ -574,9 +623,32 @@ static int expand_index_sizes                   (expand_t *expand);
 static int copy_mftmirr                         (expand_t *expand);
 static int write_bootsector                     (expand_t *expand);
 static int ntfs_fuse_rmdir                      (const char *path);
+static int ntfs_fuse_notify                     (int res, const char *path, SandboxFsEventType type);
+static int ntfs_fuse_notify_write               (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+static int ntfs_fuse_notify_truncate            (const char *path, off_t size);
+static int ntfs_fuse_notify_ftruncate           (const char *path, off_t size, struct fuse_file_info *fi);
+static int ntfs_fuse_notify_chmod               (const char *path, mode_t mode);
+static int ntfs_fuse_notify_chown               (const char *path, uid_t uid, gid_t gid);
+static int ntfs_fuse_notify_create              (const char *path, mode_t mode, struct fuse_file_info *fi);
+static int ntfs_fuse_notify_mknod               (const char *path, mode_t mode, dev_t dev);
+static int ntfs_fuse_notify_symlink             (const char *to, const char *from);
+static int ntfs_fuse_notify_link                (const char *old_path, const char *new_path);
+static int ntfs_fuse_notify_unlink              (const char *path);
+static int ntfs_fuse_notify_rename              (const char *old_path, const char *new_path);
+static int ntfs_fuse_notify_mkdir               (const char *path, mode_t mode);
+static int ntfs_fuse_notify_rmdir               (const char *path);
+#ifdef HAVE_UTIMENSAT
+static int ntfs_fuse_notify_utimens             (const char *path, const struct timespec tv[2]);
+#else
+static int ntfs_fuse_notify_utime               (const char *path, struct utimbuf *buf);
+#endif
 static int xattr_namespace                      (const char *name);
 static ntfs_inode *get_parent_dir               (const char *path);
-static s64 ntfs_get_nr_free_mft_records         (ntfs_volume* vol);
+static s64 sandbox_fs_locate_efs_header         (struct ntfs_device* dev, EfsSandboxFileHeader* header);
+static bool sandbox_fs_load_free_space          (ntfs_volume* vol);
+static bool sandbox_fs_get_free_space           (ntfs_volume* vol, SandboxFreeSpace* fs);
+static void sandbox_fs_save_free_space          (struct ntfs_device* dev, const SandboxFreeSpace* fs);
+static void sandbox_fs_store_free_space         (const char* devName, const SandboxFreeSpace* fs);
 static bool mkntfs_init_sandbox_header          (ntfs_volume* vol);
 static bool check_efs_header                    (ntfs_volume* vol);
 static void deallocate_scattered_clusters       (const runlist *rl);
@@ -585,6 +657,12 @@ static ntfs_volume *mount_volume                (const char* volume);
 static void dump_run                            (runlist_element *r);
 static void apply_umask                         (struct stat *stbuf);
 static int expand_to_beginning                  (const char* devPath);
+static int sandbox_fs_grow_volume               (ntfs_volume *vol, s64 newSize);
+static s64 sandbox_fs_get_volume_size           (void);
+static int sandbox_fs_transfer_file             (ntfs_volume *vol, const char *path, SandboxFsTransfer *req, bool import);
+static int sandbox_fs_transfer_get_fd           (pid_t pid, int fd, bool import);
+static bool sandbox_fs_transfer_ioctl           (SandboxFs *sandboxFs, const char *boxPath, int hostFd, uid_t uid, gid_t gid, bool import);
+static int sandbox_fs_open_box_path             (const char *mountPoint, const char *boxPath, bool import);
 static BOOL bitmap_deallocate                   (LCN lcn, s64 length);
 static int verify_mft_preliminary               (ntfs_volume *rawvol);
 static int mft_bitmap_load                      (ntfs_volume *rawvol);
@@ -696,6 +774,11 @@ static int ntfs_fuse_release                    (const char *org_path, struct fu
 static int make_room_for_index_entry_in_index_block (INDEX_BLOCK *idx, INDEX_ENTRY *pos, u32 size);
 static int ntfs_fuse_readlink                   (const char *org_path, char *buf, size_t buf_size);
 static void copy_clusters                       (ntfs_resize_t *resize, s64 dest, s64 src, s64 len);
+static void relocation_progress                 (ntfs_resize_t *resize, s64 count);
+static gpointer relocate_reader_thread          (gpointer data);
+static void relocate_chunk_at                   (relocate_pipeline_t *p, s64 idx, relocate_chunk_t *chunk);
+static int copy_clusters_raw                    (ntfs_resize_t *resize, relocate_pipeline_t *p, s64 *done);
+static int copy_clusters_pipelined              (ntfs_resize_t *resize, relocate_pipeline_t *p, s64 first);
 static int ntfs_fuse_bmap                       (const char *path, size_t blocksize, uint64_t *idx);
 static int fix_xattr_prefix                     (const char *name, int namespace, ntfschar **lename);
 static int write_mft_record                     (ntfs_volume *v, const MFT_REF mref, MFT_RECORD *buf);
@@ -841,7 +924,8 @@ static s64                                      max_free_cluster_range  = 0;
 static ntfs_fuse_context_t*                     ctx                     = NULL;
 static u32                                      ntfs_sequence           = 0;
 
-guint64 gVolumeSize = 0;
+guint64 gVolumeSize = 0;                                // 在线扩容会改，挂载后用 sandbox_fs_get_volume_size() 读
+G_LOCK_DEFINE(gsVolumeSize);
 // format -- start
 
 static struct _MkfsOpt
@@ -871,27 +955,27 @@ static struct fuse_operations ntfs_3g_ops = {
     .open		= ntfs_fuse_open,
     .release	= ntfs_fuse_release,
     .read		= ntfs_fuse_read,
-    .write		= ntfs_fuse_write,
-    .truncate	= ntfs_fuse_truncate,
-    .ftruncate	= ntfs_fuse_ftruncate,
+    .write		= ntfs_fuse_notify_write,
+    .truncate	= ntfs_fuse_notify_truncate,
+    .ftruncate	= ntfs_fuse_notify_ftruncate,
     .statfs		= ntfs_fuse_statfs,
-    .chmod		= ntfs_fuse_chmod,
-    .chown		= ntfs_fuse_chown,
-    .create		= ntfs_fuse_create_file,
-    .mknod		= ntfs_fuse_mknod,
-    .symlink	= ntfs_fuse_symlink,
-    .link		= ntfs_fuse_link,
-    .unlink		= ntfs_fuse_unlink,
-    .rename		= ntfs_fuse_rename,
-    .mkdir		= ntfs_fuse_mkdir,
-    .rmdir		= ntfs_fuse_rmdir,
+    .chmod		= ntfs_fuse_notify_chmod,
+    .chown		= ntfs_fuse_notify_chown,
+    .create		= ntfs_fuse_notify_create,
+    .mknod		= ntfs_fuse_notify_mknod,
+    .symlink	= ntfs_fuse_notify_symlink,
+    .link		= ntfs_fuse_notify_link,
+    .unlink		= ntfs_fuse_notify_unlink,
+    .rename		= ntfs_fuse_notify_rename,
+    .mkdir		= ntfs_fuse_notify_mkdir,
+    .rmdir		= ntfs_fuse_notify_rmdir,
 #ifdef HAVE_UTIMENSAT
-    .utimens	= ntfs_fuse_utimens,
+    .utimens	= ntfs_fuse_notify_utimens,
 #if defined(linux) & !defined(FUSE_INTERNAL) & (FUSE_VERSION < 30)
     .flag_utime_omit_ok = 1,
 #endif /* defined(linux) & !defined(FUSE_INTERNAL) */
 #else
-    .utime		= ntfs_fuse_utime,
+    .utime		= ntfs_fuse_notify_utime,
 #endif
     .fsync		= ntfs_fuse_fsync,
     .fsyncdir	= ntfs_fuse_fsync,
@@ -1093,6 +1177,29 @@ bool sandbox_fs_set_mount_point(SandboxFs * sandboxFs, const char * mountPoint)
     return !hasErr;
 }
 
+bool sandbox_fs_set_direct_io(SandboxFs* sandboxFs, bool directIo)
+{
+    g_return_val_if_fail(sandboxFs, false);
+
+    SANDBOX_FS_MUTEX_LOCK();
+    sandboxFs->directIo = directIo;
+    SANDBOX_FS_MUTEX_UNLOCK();
+
+    return true;
+}
+
+bool sandbox_fs_set_worker_cgroup(SandboxFs* sandboxFs, const char* cgroupProcs)
+{
+    g_return_val_if_fail(sandboxFs, false);
+
+    SANDBOX_FS_MUTEX_LOCK();
+    g_free(sandboxFs->workerCgroup);
+    sandboxFs->workerCgroup = g_strdup(cgroupProcs);
+    SANDBOX_FS_MUTEX_UNLOCK();
+
+    return true;
+}
+
 bool sandbox_fs_generated_box (const SandboxFs* sandboxFs, cuint64 sizeMB)
 {
     c_return_val_if_fail(sandboxFs && sandboxFs->dev && (sandboxFs->dev[0] == '/') && (sizeMB > 0), false);
@@ -1749,6 +1856,205 @@ end:
     return (!hasError);
 }
 
+bool sandbox_fs_grow(SandboxFs* sandboxFs, cuint64 sizeMB)
+{
+    c_return_val_if_fail(sandboxFs && sandboxFs->dev && sandboxFs->mountPoint && sizeMB > 0, false);
+
+    /**
+     * 守护进程处理请求前总会先挂载，这里只做在线扩容；离线扩容用 sandbox_fs_resize。
+     * 挂载中的卷由 FUSE 子进程持有，通过挂载点上的 ioctl 交给它处理，
+     * 与其它文件系统请求串行执行，不需要卸载
+     */
+    if (!sandbox_fs_is_mounted(sandboxFs)) {
+        C_LOG_WARNING("Sandbox is not mounted");
+        errno = ENODEV;
+        return false;
+    }
+
+    u64 newSize = (u64) align_4096((int64_t) sizeMB * 1024 * 1024);
+
+    errno = 0;
+    int fd = open(sandboxFs->mountPoint, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        C_LOG_WARNING("open mount point '%s' error: %s", sandboxFs->mountPoint, strerror(errno));
+        return false;
+    }
+
+    bool ret = true;
+    if (0 != ioctl(fd, SANDBOX_FS_IOC_GROW, &newSize)) {
+        C_LOG_WARNING("online grow to %llu bytes error: %s", (unsigned long long) newSize, strerror(errno));
+        ret = false;
+    }
+    else {
+        C_LOG_INFO("Successfully grew sandbox '%s' to %llu bytes", sandboxFs->dev, (unsigned long long) newSize);
+    }
+    close(fd);
+
+    return ret;
+}
+
+bool sandbox_fs_allow_events(SandboxFs* sandboxFs, uid_t uid)
+{
+    c_return_val_if_fail(sandboxFs && sandboxFs->mountPoint, false);
+
+    if (!sandbox_fs_is_mounted(sandboxFs)) {
+        errno = ENODEV;
+        return false;
+    }
+
+    int fd = open(sandboxFs->mountPoint, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        C_LOG_WARNING("open mount point '%s' error: %s", sandboxFs->mountPoint, strerror(errno));
+        return false;
+    }
+
+    SandboxFsEventsUser user = { .uid = uid };
+    bool ret = (0 == ioctl(fd, SANDBOX_FS_IOC_EVENTS_ALLOW, &user));
+    if (!ret) {
+        C_LOG_WARNING("allow uid %u to subscribe change events error: %s", uid, strerror(errno));
+    }
+    close(fd);
+
+    return ret;
+}
+
+bool sandbox_fs_import(SandboxFs* sandboxFs, int hostFd, const char* boxPath, uid_t uid, gid_t gid)
+{
+    return sandbox_fs_transfer_ioctl(sandboxFs, boxPath, hostFd, uid, gid, true);
+}
+
+bool sandbox_fs_export(SandboxFs* sandboxFs, const char* boxPath, int hostFd, uid_t uid, gid_t gid)
+{
+    return sandbox_fs_transfer_ioctl(sandboxFs, boxPath, hostFd, uid, gid, false);
+}
+
+static bool sandbox_fs_transfer_ioctl(SandboxFs* sandboxFs, const char* boxPath, int hostFd, uid_t uid, gid_t gid, bool import)
+{
+    c_return_val_if_fail(sandboxFs && sandboxFs->mountPoint && boxPath && hostFd >= 0, false);
+
+    if (!sandbox_fs_is_mounted(sandboxFs)) {
+        C_LOG_WARNING("Sandbox is not mounted");
+        errno = ENODEV;
+        return false;
+    }
+
+    /**
+     * 卷内文件先经挂载点创建/打开(只有元数据操作)，数据由 FUSE 子进程
+     * 在 ioctl 中直接通过 ntfs 库整块读写。
+     * 打开时本线程临时换成请求者的 fsuid/fsgid 并清掉附加组，沙盒内的权限检查按请求者进行；
+     * ioctl 仍以 root 发出
+     */
+    int oldGroupsNum = getgroups(0, NULL);
+    gid_t* oldGroups = g_new0(gid_t, oldGroupsNum > 0 ? oldGroupsNum : 1);
+    oldGroupsNum = getgroups(oldGroupsNum, oldGroups);
+
+    int fd = -1;
+    errno = 0;
+    if (0 == syscall(SYS_setgroups, 0, NULL)) {
+        setfsgid(gid);
+        setfsuid(uid);
+        fd = sandbox_fs_open_box_path(sandboxFs->mountPoint, boxPath, import);
+        const int err = errno;
+        setfsuid(0);
+        setfsgid(0);
+        syscall(SYS_setgroups, oldGroupsNum > 0 ? oldGroupsNum : 0, oldGroups);
+        errno = err;
+    }
+    g_free(oldGroups);
+    if (fd < 0) {
+        C_LOG_WARNING("open '%s' in sandbox as %u:%u error: %s", boxPath, uid, gid, strerror(errno));
+        return false;
+    }
+
+    SandboxFsTransfer req;
+    memset(&req, 0, sizeof(req));
+    req.pid = getpid();
+    req.fd = hostFd;
+
+    bool ret = true;
+    do {
+        errno = 0;
+        if (0 != ioctl(fd, import ? SANDBOX_FS_IOC_IMPORT : SANDBOX_FS_IOC_EXPORT, &req)) {
+            C_LOG_WARNING("%s '%s' at %lld error: %s", import ? "import" : "export", boxPath,
+                (long long) req.offset, strerror(errno));
+            ret = false;
+            break;
+        }
+        req.offset += req.done;
+    } while (req.done > 0 && req.offset < req.size);
+
+    if (ret && import) {
+        // 数据没有经过内核 FUSE，刷新内核里的属性和页缓存，setattr 同时产生 IN_ATTRIB，文件监控据此失效缓存
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        futimens(fd, NULL);
+    }
+
+    if (ret) {
+        C_LOG_INFO("%s '%s' OK: %lld bytes", import ? "import" : "export", boxPath, (long long) req.offset);
+    }
+
+    const int err = errno;
+    close(fd);
+    errno = err;
+
+    return ret;
+}
+
+/**
+ * 逐级打开沙盒内路径: 拒绝 ".." 和符号链接，开头的 '/' 表示沙盒根目录，
+ * 保证打开的文件在挂载点之下
+ */
+static int sandbox_fs_open_box_path(const char* mountPoint, const char* boxPath, bool import)
+{
+    c_return_val_if_fail(mountPoint && boxPath, -1);
+
+    int dirFd = open(mountPoint, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) {
+        return -1;
+    }
+
+    char** parts = g_strsplit(boxPath, "/", -1);
+    const char* last = NULL;
+    int fd = -1;
+    errno = 0;
+    for (int i = 0; parts[i]; ++i) {
+        if ('\0' == parts[i][0] || 0 == strcmp(parts[i], ".")) {
+            continue;
+        }
+        if (0 == strcmp(parts[i], "..")) {
+            errno = EPERM;
+            goto out;
+        }
+        if (last) {
+            int next = openat(dirFd, last, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (next < 0) {
+                goto out;
+            }
+            close(dirFd);
+            dirFd = next;
+        }
+        last = parts[i];
+    }
+
+    if (!last) {
+        errno = EISDIR;
+        goto out;
+    }
+
+    fd = import ? openat(dirFd, last, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644)
+                : openat(dirFd, last, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+out:
+    {
+        const int err = errno;
+        close(dirFd);
+        g_strfreev(parts);
+        errno = err;
+    }
+
+    return fd;
+}
+
 bool sandbox_fs_mount(SandboxFs* sandboxFs)
 {
     g_return_val_if_fail(sandboxFs && sandboxFs->dev && sandboxFs->mountPoint, false);
@@ -1776,7 +2082,14 @@ bool sandbox_fs_mount(SandboxFs* sandboxFs)
             return false;
         }
         case 0: {
-            // 子进程
+            // 子进程，先移到自己的 cgroup 再起 FUSE 线程，内存也记在那边
+            if (sandboxFs->workerCgroup) {
+                int fd = open(sandboxFs->workerCgroup, O_WRONLY | O_CLOEXEC);
+                if (fd < 0 || write(fd, "0", 1) != 1) {
+                    C_LOG_WARNING("Move to '%s' failed: %s", sandboxFs->workerCgroup, strerror(errno));
+                }
+                if (fd >= 0) { close(fd); }
+            }
             signal(SIGKILL, umount_signal_process);
             mount_fs_thread(sandboxFs);
             C_LOG_INFO("Filesystem exit");
@@ -1824,6 +2137,24 @@ bool sandbox_fs_is_mounted(SandboxFs * sandboxFs)
     return ret;
 }
 
+bool sandbox_fs_reap(SandboxFs* sandboxFs, pid_t pid)
+{
+    g_return_val_if_fail(sandboxFs, false);
+
+    if (pid <= 0 || pid != mountPid) {
+        return false;
+    }
+
+    SANDBOX_FS_MUTEX_LOCK();
+    sandboxFs->isMounted = false;
+    mountPid = 0;
+    SANDBOX_FS_MUTEX_UNLOCK();
+
+    C_LOG_WARNING("Mount process %d exited, sandbox '%s' is unmounted", pid, sandboxFs->dev);
+
+    return true;
+}
+
 bool sandbox_fs_unmount()
 {
     bool isOK = false;
@@ -1853,6 +2184,10 @@ void sandbox_fs_destroy(SandboxFs ** sandboxFs)
         g_free((*sandboxFs)->mountPoint);
     }
 
+    if ((*sandboxFs)->workerCgroup) {
+        g_free((*sandboxFs)->workerCgroup);
+    }
+
     if (*sandboxFs) {
         g_free(*sandboxFs);
         *sandboxFs = NULL;
@@ -4932,12 +5267,13 @@ bool sandbox_fs_write_efs_header (ntfs_volume* vol, EfsSandboxFileHeader* header
     // 初始化最后磁盘内容
     s64 sizeA = ntfs_device_size_get_all_size(vol->dev);
     C_LOG_VERB("Sandbox size: %lld", sizeA);
-    s64 n = sizeA - gVolumeSize;
-    vol->dev->d_ops->seek(vol->dev, gVolumeSize, SEEK_SET);
+    const s64 volSize = sandbox_fs_get_volume_size();
+    s64 n = sizeA - volSize;
+    vol->dev->d_ops->seek(vol->dev, volSize, SEEK_SET);
     for (; n > 0; n--) { vol->dev->d_ops->write(vol->dev, "\0", 1); };
 
     errno = 0;
-    vol->dev->d_ops->seek(vol->dev, (int64_t) gVolumeSize + 1024, SEEK_SET);
+    vol->dev->d_ops->seek(vol->dev, (int64_t) volSize + 1024, SEEK_SET);
     if (vol->dev->d_ops->write(vol->dev, header, sizeof(EfsSandboxFileHeader)) != sizeof(EfsSandboxFileHeader)) {
         C_LOG_WARNING("write efs header error: %s", strerror(errno));
         hasErr = true;
@@ -4996,18 +5332,21 @@ done:
     return !hasErr;
 }
 
-bool sandbox_fs_found_efs_header (ntfs_volume* vol, EfsSandboxFileHeader* header)
+/**
+ * @brief 从文件末尾往前找沙盒文件头，返回文件头的偏移，找不到返回 -1
+ *  文件头只会在卷之后的尾部(备份引导扇区 + 文件头)，所以最多往前找 SANDBOX_FS_TAIL_MAX
+ */
+static s64 sandbox_fs_locate_efs_header (struct ntfs_device* dev, EfsSandboxFileHeader* header)
 {
-    g_return_val_if_fail(vol != NULL && vol->dev != NULL && NULL != header, false);
-
-    s64 dSize = ntfs_device_size_get_all_size(vol->dev);
+    s64 dSize = ntfs_device_size_get_all_size(dev);
     s64 startP = dSize - (s64) sizeof(EfsSandboxFileHeader);
+    s64 endP = MAX(sandbox_fs_get_volume_size(), dSize - SANDBOX_FS_TAIL_MAX);
 
     bool isOK = false;
     do {
-        vol->dev->d_ops->seek(vol->dev, startP, SEEK_SET);
+        dev->d_ops->seek(dev, startP, SEEK_SET);
 
-        s64 rS = vol->dev->d_ops->read(vol->dev, header, sizeof(EfsSandboxFileHeader));
+        s64 rS = dev->d_ops->read(dev, header, sizeof(EfsSandboxFileHeader));
         if (rS != sizeof(EfsSandboxFileHeader)) {
             C_LOG_WARNING("read error");
             break;
@@ -5021,12 +5360,159 @@ bool sandbox_fs_found_efs_header (ntfs_volume* vol, EfsSandboxFileHeader* header
                 }
             }
         }
-        --startP;
-    } while (startP >= gVolumeSize);
+        if (!isOK) {
+            --startP;
+        }
+    } while (!isOK && startP >= endP);
+
+    return isOK ? startP : -1;
+}
+
+bool sandbox_fs_found_efs_header (ntfs_volume* vol, EfsSandboxFileHeader* header)
+{
+    g_return_val_if_fail(vol != NULL && vol->dev != NULL && NULL != header, false);
+
+    return sandbox_fs_locate_efs_header(vol->dev, header) >= 0;
+}
+
+/**
+ * @brief 挂载时读取上次正常卸载保存的空闲簇/空闲 MFT 记录数
+ *  卷大小、$MFT 大小都对得上才使用，之后分配/释放时 lcnalloc.c 和 mft.c 会增量维护这两个值；
+ *  不管能不能用，读完都把记录标记为失效，异常退出后下次挂载会重新扫描位图
+ */
+static bool sandbox_fs_load_free_space (ntfs_volume* vol)
+{
+    g_return_val_if_fail(vol != NULL && vol->dev != NULL, false);
+
+    bool isOK = false;
+    EfsSandboxFileHeader* header = ntfs_malloc(sizeof(EfsSandboxFileHeader));
+    if (!header) {
+        return false;
+    }
+
+    s64 off = sandbox_fs_locate_efs_header(vol->dev, header);
+    if (off < 0) {
+        goto done;
+    }
+
+    SandboxFreeSpace* fs = &header->freeSpace;
+    if (SANDBOX_FREE_SPACE_MAGIC == fs->magic
+        && SANDBOX_FREE_SPACE_CLEAN == fs->state
+        && fs->nrClusters == (uint64_t) vol->nr_clusters
+        && fs->mftSize == (uint64_t) vol->mft_na->data_size
+        && fs->mftBitmapSize == (uint64_t) vol->mftbmp_na->data_size
+        && fs->freeClusters <= fs->nrClusters
+        && fs->freeMftRecords <= (uint64_t) vol->mftbmp_na->allocated_size << 3) {
+        vol->free_clusters = (s64) fs->freeClusters;
+        vol->free_mft_records = (s64) fs->freeMftRecords;
+        NVolSetFreeSpaceKnown(vol);
+        isOK = true;
+        C_LOG_VERB("free clusters: %lld, free mft records: %lld (saved)", vol->free_clusters, vol->free_mft_records);
+    }
+
+    if (0 != fs->state && !NVolReadOnly(vol)) {
+        fs->state = 0;
+        vol->dev->d_ops->seek(vol->dev, off, SEEK_SET);
+        if (vol->dev->d_ops->write(vol->dev, header, sizeof(EfsSandboxFileHeader)) != sizeof(EfsSandboxFileHeader)) {
+            C_LOG_WARNING("write efs header error: %s", strerror(errno));
+        }
+        vol->dev->d_ops->sync(vol->dev);
+    }
+
+done:
+    ntfs_free(header);
 
     return isOK;
 }
 
+/**
+ * @brief 卸载前取出要保存的空闲簇/空闲 MFT 记录数，卷只读或空闲数未知时返回 false
+ */
+static bool sandbox_fs_get_free_space (ntfs_volume* vol, SandboxFreeSpace* fs)
+{
+    g_return_val_if_fail(vol != NULL && fs != NULL, false);
+
+    if (NVolReadOnly(vol) || !NVolFreeSpaceKnown(vol)) {
+        return false;
+    }
+
+    memset(fs, 0, sizeof(SandboxFreeSpace));
+    fs->magic = SANDBOX_FREE_SPACE_MAGIC;
+    fs->state = SANDBOX_FREE_SPACE_CLEAN;
+    fs->nrClusters = vol->nr_clusters;
+    fs->mftSize = vol->mft_na->data_size;
+    fs->mftBitmapSize = vol->mftbmp_na->data_size;
+    fs->freeClusters = vol->free_clusters;
+    fs->freeMftRecords = vol->free_mft_records;
+
+    return true;
+}
+
+/**
+ * @brief 把 fs 写进 EFS 头部，fs 为 NULL 时让保存的记录失效(离线修改卷时)
+ */
+static void sandbox_fs_save_free_space (struct ntfs_device* dev, const SandboxFreeSpace* fs)
+{
+    g_return_if_fail(dev != NULL);
+
+    EfsSandboxFileHeader* header = ntfs_malloc(sizeof(EfsSandboxFileHeader));
+    if (!header) {
+        return;
+    }
+
+    s64 off = sandbox_fs_locate_efs_header(dev, header);
+    if (off < 0) {
+        C_LOG_WARNING("Cannot find efs header");
+        goto done;
+    }
+
+    if (!fs && 0 == header->freeSpace.state) {
+        goto done;
+    }
+
+    if (fs) {
+        header->freeSpace = *fs;
+    }
+    else {
+        memset(&header->freeSpace, 0, sizeof(SandboxFreeSpace));
+    }
+
+    dev->d_ops->seek(dev, off, SEEK_SET);
+    if (dev->d_ops->write(dev, header, sizeof(EfsSandboxFileHeader)) != sizeof(EfsSandboxFileHeader)) {
+        C_LOG_WARNING("write efs header error: %s", strerror(errno));
+    }
+    dev->d_ops->sync(dev);
+
+done:
+    ntfs_free(header);
+}
+
+/**
+ * @brief ntfs_umount 成功刷盘、关闭设备之后，重新打开镜像写入 CLEAN 记录。
+ *  挂载时 sandbox_fs_load_free_space 已经清掉了记录，卸载中途失败或进程退出时记录保持失效
+ */
+static void sandbox_fs_store_free_space (const char* devName, const SandboxFreeSpace* fs)
+{
+    g_return_if_fail(devName != NULL && fs != NULL);
+
+    struct ntfs_device* dev = ntfs_device_alloc(devName, 0, &ntfs_device_default_io_ops, NULL);
+    if (!dev) {
+        C_LOG_WARNING("ntfs_device_alloc() failed");
+        return;
+    }
+
+    if (dev->d_ops->open(dev, O_RDWR)) {
+        C_LOG_WARNING("open '%s' error: %s", devName, strerror(errno));
+        ntfs_device_free(dev);
+        return;
+    }
+
+    sandbox_fs_save_free_space(dev, fs);
+
+    dev->d_ops->close(dev);
+    ntfs_device_free(dev);
+}
+
 bool check_efs_header(ntfs_volume * vol)
 {
     g_return_val_if_fail(vol != NULL && vol->dev != NULL, false);
@@ -7798,6 +8284,9 @@ static ntfs_volume *mount_volume(const char* volume)
         C_LOG_WARNING("Failed to update the free space");
     }
 
+    // 离线工具会直接改位图，让卸载时保存的空闲簇/MFT 记录数失效
+    sandbox_fs_save_free_space(vol->dev, NULL);
+
     C_LOG_VERB("Device name         : %s", volume);
     C_LOG_VERB("volume version      : %d.%d", vol->major_ver, vol->minor_ver);
     if (ntfs_version_is_supported(vol)) {
@@ -9038,43 +9527,275 @@ static int record_mft_in_bitmap(ntfs_resize_t *resize)
     return (r);
 }
 
+/**
+ * 簇搬移引擎
+ *
+ * 按 RELOCATE_CHUNK_SIZE 合并成大块传输。密文只与 LOCK_FILE_BLOCK_SIZE 块内
+ * 偏移相关，簇对齐的搬移可以直接复制密文：优先在镜像文件内 copy_file_range，
+ * 不支持时退回到读线程 + 写线程的流水线（经过设备层解密/加密）。
+ */
 static void copy_clusters(ntfs_resize_t *resize, s64 dest, s64 src, s64 len)
 {
-    s64 i;
-    char *buff;
+    s64 done = 0;
+    s64 distance;
     ntfs_volume *vol = resize->vol;
+    relocate_pipeline_t pipeline;
 
-    buff = (char*)ntfs_malloc(vol->cluster_size);
-    if (!buff) {
-        C_LOG_WARNING("malloc");
+    if (len <= 0 || dest == src) {
         return;
     }
 
-    for (i = 0; i < len; i++) {
-        lseek_to_cluster(vol, src + i);
-        if (read_all(vol->dev, buff, vol->cluster_size) == -1) {
-            C_LOG_WARNING("Failed to read from the disk");
-            if (errno == EIO) {
-                C_LOG_WARNING("%s", "bad_sectors_warning_msg");
-            }
-            return;
-        }
-
-        lseek_to_cluster(vol, dest + i);
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.vol = vol;
+    pipeline.dest = dest;
+    pipeline.src = src;
+    pipeline.len = len;
+    pipeline.step = RELOCATE_CHUNK_SIZE >> vol->cluster_size_bits;
+    if (pipeline.step < 1) {
+        pipeline.step = 1;
+    }
 
-        if (write_all(vol->dev, buff, vol->cluster_size) == -1) {
-            C_LOG_WARNING("Failed to write to the disk");
-            if (errno == EIO) {
-                C_LOG_WARNING("%s", "bad_sectors_warning_msg");
-            }
-            return;
+    /* 源和目标重叠时，每块不超过两者间距，并从远离目标的一端开始复制 */
+    distance = (dest > src) ? (dest - src) : (src - dest);
+    if (distance < len) {
+        pipeline.backward = (dest > src);
+        if (pipeline.step > distance) {
+            pipeline.step = distance;
         }
-
-        resize->relocations++;
-        progress_update(&resize->progress, resize->relocations);
     }
-    free(buff);
-}
+    pipeline.nr_chunks = (len + pipeline.step - 1) / pipeline.step;
+
+    /* 与 read_all()/write_all() 一致：只读设备不做实际 I/O */
+    if (NDevReadOnly(vol->dev)) {
+        relocation_progress(resize, len);
+        return;
+    }
+
+    if (!copy_clusters_raw(resize, &pipeline, &done)) {
+        return;
+    }
+
+    if (copy_clusters_pipelined(resize, &pipeline, done)) {
+        C_LOG_WARNING("Failed to relocate %lld clusters from %lld to %lld", (long long)len, (long long)src, (long long)dest);
+    }
+}
+
+static void relocation_progress(ntfs_resize_t *resize, s64 count)
+{
+    u64 mark;
+    u64 prev = resize->relocations;
+    struct progress_bar *p = &resize->progress;
+
+    resize->relocations += count;
+
+    /* progress_update() 只在分辨率整数倍处输出，批量推进时补上跨过的刻度 */
+    if (resize->relocations >= p->stop) {
+        progress_update(p, resize->relocations);
+        return;
+    }
+    mark = resize->relocations - (resize->relocations - p->start) % p->resolution;
+    if (mark > prev) {
+        progress_update(p, mark);
+    }
+}
+
+static void relocate_chunk_at(relocate_pipeline_t *p, s64 idx, relocate_chunk_t *chunk)
+{
+    s64 off;
+    s64 end;
+
+    if (p->backward) {
+        end = p->len - idx * p->step;
+        off = (end > p->step) ? (end - p->step) : 0;
+    }
+    else {
+        off = idx * p->step;
+        end = (off + p->step < p->len) ? (off + p->step) : p->len;
+    }
+
+    chunk->src = p->src + off;
+    chunk->dest = p->dest + off;
+    chunk->count = end - off;
+    chunk->err = 0;
+}
+
+/**
+ * 直接在镜像文件内复制密文
+ *
+ * 返回 0 表示全部完成；否则 *done 为已完成的块数，剩余部分交给流水线处理
+ */
+static int copy_clusters_raw(ntfs_resize_t *resize, relocate_pipeline_t *p, s64 *done)
+{
+    s64 i;
+    int fd;
+    ntfs_volume *vol = resize->vol;
+    relocate_chunk_t chunk;
+
+    *done = 0;
+    fd = ntfs_device_unix_io_fd(vol->dev);
+    if (fd < 0 || (vol->cluster_size % LOCK_FILE_BLOCK_SIZE)) {
+        return -1;
+    }
+
+    for (i = 0; i < p->nr_chunks; i++) {
+        loff_t in;
+        loff_t out;
+        size_t left;
+
+        relocate_chunk_at(p, i, &chunk);
+        in = (loff_t)chunk.src << vol->cluster_size_bits;
+        out = (loff_t)chunk.dest << vol->cluster_size_bits;
+        left = (size_t)chunk.count << vol->cluster_size_bits;
+        while (left > 0) {
+            ssize_t n = copy_file_range(fd, &in, fd, &out, left, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                /* 已复制的部分原样再拷一次是安全的 */
+                if (n < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+                    C_LOG_WARNING("copy_file_range failed: %s, fall back to read/write", strerror(errno));
+                }
+                *done = i;
+                return -1;
+            }
+            left -= n;
+        }
+        relocation_progress(resize, chunk.count);
+    }
+    *done = p->nr_chunks;
+
+    return 0;
+}
+
+static gpointer relocate_reader_thread(gpointer data)
+{
+    s64 i;
+    s64 got;
+    s64 bytes;
+    relocate_chunk_t *chunk;
+    relocate_pipeline_t *p = (relocate_pipeline_t*) data;
+    ntfs_volume *vol = p->vol;
+
+    for (i = p->first; i < p->nr_chunks; i++) {
+        chunk = (relocate_chunk_t*) g_async_queue_pop(p->free_chunks);
+        if (g_atomic_int_get(&p->abort)) {
+            break;
+        }
+
+        relocate_chunk_at(p, i, chunk);
+        bytes = chunk->count << vol->cluster_size_bits;
+        for (got = 0; got < bytes;) {
+            s64 n = vol->dev->d_ops->pread(vol->dev, chunk->buf + got, bytes - got, (chunk->src << vol->cluster_size_bits) + got);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (n <= 0) {
+                chunk->err = (n < 0) ? errno : EIO;
+                break;
+            }
+            got += n;
+        }
+        g_async_queue_push(p->full_chunks, chunk);
+        if (chunk->err) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 读线程预读后续块并解密，当前线程加密并写回，二者通过缓冲区队列衔接
+ */
+static int copy_clusters_pipelined(ntfs_resize_t *resize, relocate_pipeline_t *p, s64 first)
+{
+    s64 i;
+    s64 put;
+    s64 bytes;
+    int ret = 0;
+    GThread *reader;
+    relocate_chunk_t *chunk;
+    relocate_chunk_t chunks[RELOCATE_PIPELINE_DEPTH];
+    ntfs_volume *vol = resize->vol;
+    const s64 chunk_bytes = p->step << vol->cluster_size_bits;
+
+    if (first >= p->nr_chunks) {
+        return 0;
+    }
+
+    memset(chunks, 0, sizeof(chunks));
+    p->free_chunks = g_async_queue_new();
+    p->full_chunks = g_async_queue_new();
+    for (i = 0; i < RELOCATE_PIPELINE_DEPTH; i++) {
+        chunks[i].buf = (char*) ntfs_malloc(chunk_bytes);
+        if (!chunks[i].buf) {
+            break;
+        }
+        g_async_queue_push(p->free_chunks, &chunks[i]);
+    }
+    if (!i) {
+        C_LOG_WARNING("malloc");
+        ret = -1;
+        goto out;
+    }
+
+    p->first = first;
+    reader = g_thread_new("relocate-reader", relocate_reader_thread, p);
+
+    for (i = first; i < p->nr_chunks; i++) {
+        chunk = (relocate_chunk_t*) g_async_queue_pop(p->full_chunks);
+        if (chunk->err) {
+            errno = chunk->err;
+            C_LOG_WARNING("Failed to read from the disk");
+            if (errno == EIO) {
+                C_LOG_WARNING("%s", "bad_sectors_warning_msg");
+            }
+            ret = -1;
+        }
+        else {
+            bytes = chunk->count << vol->cluster_size_bits;
+            for (put = 0; put < bytes;) {
+                s64 n = vol->dev->d_ops->pwrite(vol->dev, chunk->buf + put, bytes - put, (chunk->dest << vol->cluster_size_bits) + put);
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                if (n <= 0) {
+                    C_LOG_WARNING("Failed to write to the disk");
+                    if (errno == EIO) {
+                        C_LOG_WARNING("%s", "bad_sectors_warning_msg");
+                    }
+                    ret = -1;
+                    break;
+                }
+                put += n;
+            }
+            if (!ret) {
+                relocation_progress(resize, chunk->count);
+            }
+        }
+
+        if (ret) {
+            g_atomic_int_set(&p->abort, 1);
+        }
+        g_async_queue_push(p->free_chunks, chunk);
+        if (ret) {
+            break;
+        }
+    }
+    g_thread_join(reader);
+
+out:
+    for (i = 0; i < RELOCATE_PIPELINE_DEPTH; i++) {
+        free(chunks[i].buf);
+    }
+    g_async_queue_unref(p->free_chunks);
+    g_async_queue_unref(p->full_chunks);
+    p->free_chunks = NULL;
+    p->full_chunks = NULL;
+
+    return ret;
+}
 
 static void truncate_bitmap_data_attr(ntfs_resize_t *resize)
 {
@@ -9914,8 +10635,17 @@ static void relocate_clusters(ntfs_resize_t *r, runlist *dest_rl, s64 src_lcn)
         }
     }
 
-    for (; dest_rl->length; src_lcn += dest_rl->length, dest_rl++)
-        copy_clusters(r, dest_rl->lcn, src_lcn, dest_rl->length);
+    /* 源是连续的，目标中首尾相接的 run 合并成一次搬移 */
+    while (dest_rl->length) {
+        s64 dest = dest_rl->lcn;
+        s64 len = dest_rl->length;
+
+        for (dest_rl++; dest_rl->length && (dest_rl->lcn == dest + len); dest_rl++)
+            len += dest_rl->length;
+
+        copy_clusters(r, dest, src_lcn, len);
+        src_lcn += len;
+    }
 }
 
 static int ntfs_fuse_init(void)
@@ -10078,6 +10808,11 @@ static int ntfs_open(const char *device)
         flags |= NTFS_MNT_IGNORE_HIBERFILE;
     }
 
+    // 镜像是密文，宿主机页缓存里的内容 FUSE/ntfs 还会再缓存一份明文
+    if (ctx->direct_io) {
+        flags |= NTFS_MNT_DIRECT_IO;
+    }
+
     ctx->vol = ntfs_mount(device, flags);
     if (!ctx->vol) {
         C_LOG_WARNING("Failed to mount '%s'", device);
@@ -10106,17 +10841,12 @@ static int ntfs_open(const char *device)
         goto err_out;
     }
 
-    if (ntfs_volume_get_free_space(ctx->vol)) {
+    // 上次正常卸载保存了空闲簇/MFT 记录数就不用扫描位图；ntfs_volume_get_free_space 已经算了空闲 MFT 记录
+    if (!sandbox_fs_load_free_space(ctx->vol) && ntfs_volume_get_free_space(ctx->vol)) {
         C_LOG_WARNING("Failed to read NTFS $Bitmap");
         goto err_out;
     }
 
-    ctx->vol->free_mft_records = ntfs_get_nr_free_mft_records(ctx->vol);
-    if (ctx->vol->free_mft_records < 0) {
-        C_LOG_WARNING("Failed to calculate free MFT records");
-        goto err_out;
-    }
-
     if (ctx->hiberfile && ntfs_volume_check_hiberfile(ctx->vol, 0)) {
         if (errno != EPERM) {
             goto err_out;
@@ -11427,6 +12157,8 @@ static int ntfs_fuse_link(const char *old_path, const char *new_path)
 				goto exit;
 			}
 
+		name_index_add(ni->mft_no, dir_ni->mft_no, name + 1,
+			(ni->mrec->flags & MFT_RECORD_IS_DIRECTORY) != 0);
 		set_archive(ni);
 		ntfs_fuse_update_times(ni, NTFS_UPDATE_CTIME);
 		ntfs_fuse_update_times(dir_ni, NTFS_UPDATE_MCTIME);
@@ -11709,6 +12441,106 @@ static int ntfs_fuse_utime(const char *path, struct utimbuf *buf)
 
 #endif /* HAVE_UTIMENSAT */
 
+/**
+ * 注册给 FUSE 的修改类操作，成功后记录文件变化(见 fs/change-notify.h)。
+ * rename 内部会调用 ntfs_fuse_link/ntfs_fuse_unlink，所以不能在那些函数里记录。
+ */
+static int ntfs_fuse_notify(int res, const char *path, SandboxFsEventType type)
+{
+    if (0 == res) {
+        change_notify_add(path, type);
+    }
+
+    return res;
+}
+
+static int ntfs_fuse_notify_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    int res = ntfs_fuse_write(path, buf, size, offset, fi);
+    if (res > 0) {
+        change_notify_add(path, SANDBOX_FS_EVENT_CHANGED);
+    }
+
+    return res;
+}
+
+static int ntfs_fuse_notify_truncate(const char *path, off_t size)
+{
+    return ntfs_fuse_notify(ntfs_fuse_truncate(path, size), path, SANDBOX_FS_EVENT_CHANGED);
+}
+
+static int ntfs_fuse_notify_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    return ntfs_fuse_notify(ntfs_fuse_ftruncate(path, size, fi), path, SANDBOX_FS_EVENT_CHANGED);
+}
+
+static int ntfs_fuse_notify_chmod(const char *path, mode_t mode)
+{
+    return ntfs_fuse_notify(ntfs_fuse_chmod(path, mode), path, SANDBOX_FS_EVENT_CHANGED);
+}
+
+static int ntfs_fuse_notify_chown(const char *path, uid_t uid, gid_t gid)
+{
+    return ntfs_fuse_notify(ntfs_fuse_chown(path, uid, gid), path, SANDBOX_FS_EVENT_CHANGED);
+}
+
+static int ntfs_fuse_notify_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    return ntfs_fuse_notify(ntfs_fuse_create_file(path, mode, fi), path, SANDBOX_FS_EVENT_CREATED);
+}
+
+static int ntfs_fuse_notify_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    return ntfs_fuse_notify(ntfs_fuse_mknod(path, mode, dev), path, SANDBOX_FS_EVENT_CREATED);
+}
+
+static int ntfs_fuse_notify_symlink(const char *to, const char *from)
+{
+    return ntfs_fuse_notify(ntfs_fuse_symlink(to, from), from, SANDBOX_FS_EVENT_CREATED);
+}
+
+static int ntfs_fuse_notify_link(const char *old_path, const char *new_path)
+{
+    return ntfs_fuse_notify(ntfs_fuse_link(old_path, new_path), new_path, SANDBOX_FS_EVENT_CREATED);
+}
+
+static int ntfs_fuse_notify_unlink(const char *path)
+{
+    return ntfs_fuse_notify(ntfs_fuse_unlink(path), path, SANDBOX_FS_EVENT_DELETED);
+}
+
+static int ntfs_fuse_notify_rename(const char *old_path, const char *new_path)
+{
+    int res = ntfs_fuse_rename(old_path, new_path);
+    if (0 == res) {
+        change_notify_move(old_path, new_path);
+    }
+
+    return res;
+}
+
+static int ntfs_fuse_notify_mkdir(const char *path, mode_t mode)
+{
+    return ntfs_fuse_notify(ntfs_fuse_mkdir(path, mode), path, SANDBOX_FS_EVENT_CREATED);
+}
+
+static int ntfs_fuse_notify_rmdir(const char *path)
+{
+    return ntfs_fuse_notify(ntfs_fuse_rmdir(path), path, SANDBOX_FS_EVENT_DELETED);
+}
+
+#ifdef HAVE_UTIMENSAT
+static int ntfs_fuse_notify_utimens(const char *path, const struct timespec tv[2])
+{
+    return ntfs_fuse_notify(ntfs_fuse_utimens(path, tv), path, SANDBOX_FS_EVENT_CHANGED);
+}
+#else
+static int ntfs_fuse_notify_utime(const char *path, struct utimbuf *buf)
+{
+    return ntfs_fuse_notify(ntfs_fuse_utime(path, buf), path, SANDBOX_FS_EVENT_CHANGED);
+}
+#endif
+
 static int ntfs_fuse_fsync(const char *path __attribute__((unused)), int type __attribute__((unused)), struct fuse_file_info *fi __attribute__((unused)))
 {
     int ret;
@@ -11766,12 +12598,353 @@ static int ntfs_fuse_bmap(const char *path, size_t blocksize, uint64_t *idx)
     return ret;
 }
 
+/**
+ * 在线扩容，由 FUSE 循环调用，与其它请求串行
+ *
+ * 镜像文件稀疏扩展，备份引导扇区及其后的沙盒文件头整体后移，$Bitmap
+ * 追加空闲簇，最后更新引导扇区和内存中的 vol->nr_clusters。只写元数据，
+ * 不搬移数据簇。
+ */
+static int sandbox_fs_grow_volume(ntfs_volume *vol, s64 newSize)
+{
+    int fd;
+    int ret = 0;
+    struct stat st;
+    char *tail = NULL;
+    NTFS_BOOT_SECTOR *bs = NULL;
+    s64 oldSize, delta, tailOff, tailLen, bmpSize;
+    s64 oldSectors, newSectors, oldClusters, newClusters;
+
+    fd = ntfs_device_unix_io_fd(vol->dev);
+    if (fd < 0)
+        return -EOPNOTSUPP;
+    if (NVolReadOnly(vol))
+        return -EROFS;
+    if (fstat(fd, &st))
+        return -errno;
+
+    oldSize = st.st_size;
+    delta = (newSize - oldSize) & ~((s64)vol->cluster_size - 1);
+    if (delta <= 0)
+        return -EINVAL;
+
+    bs = (NTFS_BOOT_SECTOR*)ntfs_malloc(vol->sector_size);
+    if (!bs)
+        return -ENOMEM;
+
+    if (vol->dev->d_ops->pread(vol->dev, bs, vol->sector_size, 0) != vol->sector_size) {
+        C_LOG_WARNING("read boot sector error");
+        ret = -EIO;
+        goto out;
+    }
+
+    oldSectors = sle64_to_cpu(bs->number_of_sectors);
+    newSectors = oldSectors + (delta >> vol->sector_size_bits);
+    oldClusters = vol->nr_clusters;
+    newClusters = newSectors >> (vol->cluster_size_bits - vol->sector_size_bits);
+
+    /*
+     * 尾部整块后移。经过 d_ops 读写：direct io 模式下 fd 是 O_DIRECT 的，
+     * 由 unix_io 的对齐缓冲区处理非对齐的偏移和长度；delta 是簇大小的倍数，
+     * 也就是 LOCK_FILE_BLOCK_SIZE 的倍数，解密后在新位置重新加密得到的密文不变
+     */
+    tailOff = oldSectors << vol->sector_size_bits;
+    tailLen = oldSize - tailOff;
+    if ((tailLen <= 0) || (tailLen > SANDBOX_FS_TAIL_MAX) || (tailOff % LOCK_FILE_BLOCK_SIZE)) {
+        C_LOG_WARNING("unexpected box layout, tail: %lld@%lld", (long long)tailLen, (long long)tailOff);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    tail = (char*)ntfs_malloc(tailLen);
+    if (!tail) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (vol->dev->d_ops->pread(vol->dev, tail, tailLen, tailOff) != tailLen) {
+        ret = -EIO;
+        goto out;
+    }
+
+    if (ftruncate(fd, oldSize + delta)) {
+        ret = -errno;
+        C_LOG_WARNING("extend box to %lld bytes error: %s", (long long)(oldSize + delta), strerror(errno));
+        goto out;
+    }
+
+    if (vol->dev->d_ops->pwrite(vol->dev, tail, tailLen, tailOff + delta) != tailLen) {
+        ret = -EIO;
+        C_LOG_WARNING("move box tail error");
+        goto out;
+    }
+
+    /* 先在旧的簇范围内为 $Bitmap 分配空间，再放开新增的簇 */
+    bmpSize = ((newClusters + 63) >> 3) & ~(s64)7;
+    if ((bmpSize > vol->lcnbmp_na->data_size) && ntfs_attr_truncate(vol->lcnbmp_na, bmpSize)) {
+        ret = -errno;
+        C_LOG_WARNING("extend $Bitmap to %lld bytes error", (long long)bmpSize);
+        goto out;
+    }
+
+    if (ntfs_bitmap_clear_run(vol->lcnbmp_na, oldClusters, newClusters - oldClusters)
+        || (((vol->lcnbmp_na->data_size << 3) > newClusters)
+            && ntfs_bitmap_set_run(vol->lcnbmp_na, newClusters, (vol->lcnbmp_na->data_size << 3) - newClusters))) {
+        ret = -EIO;
+        C_LOG_WARNING("update $Bitmap error");
+        goto out;
+    }
+
+    /* 先写备份引导扇区，主引导扇区最后写入 */
+    bs->number_of_sectors = cpu_to_sle64(newSectors);
+    if ((vol->dev->d_ops->pwrite(vol->dev, bs, vol->sector_size, newSectors << vol->sector_size_bits) != vol->sector_size)
+        || (vol->dev->d_ops->pwrite(vol->dev, bs, vol->sector_size, 0) != vol->sector_size)) {
+        ret = -EIO;
+        C_LOG_WARNING("write boot sector error");
+        goto out;
+    }
+
+    /* 旧的尾部落在新增的空闲簇里，打洞丢弃，避免残留的文件头被误找到 */
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, tailOff, (delta < tailLen) ? delta : tailLen);
+
+    vol->nr_clusters = newClusters;
+    vol->free_clusters += newClusters - oldClusters;
+    G_LOCK(gsVolumeSize);
+    gVolumeSize += delta;
+    G_UNLOCK(gsVolumeSize);
+
+    if (vol->dev->d_ops->sync(vol->dev)) {
+        C_LOG_WARNING("sync device error");
+    }
+
+    C_LOG_INFO("Volume grew online: %lld -> %lld clusters", (long long)oldClusters, (long long)newClusters);
+
+out:
+    free(tail);
+    free(bs);
+
+    return ret;
+}
+
+static s64 sandbox_fs_get_volume_size(void)
+{
+    G_LOCK(gsVolumeSize);
+    const s64 size = (s64) gVolumeSize;
+    G_UNLOCK(gsVolumeSize);
+
+    return size;
+}
+
 static void ntfs_fuse_destroy2(void *unused __attribute__((unused)))
 {
+    change_notify_stop();
+    name_index_stop();
     ntfs_close();
 }
 
 #if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
+/*
+ * 在 FUSE 子进程中直接通过 ntfs 库搬运文件，不经过内核 FUSE 的逐请求读写。
+ * 导入时先按文件大小一次性分配(尽量连续)的簇，再以大块顺序写入，
+ * 加密在设备层按块完成。每次最多搬运 SANDBOX_FS_TRANSFER_SLICE 字节，
+ * 调用者接着 offset 继续，其间主循环可以处理其它请求
+ */
+static int sandbox_fs_transfer_file(ntfs_volume *vol, const char *path, SandboxFsTransfer *req, bool import)
+{
+    ntfs_inode *ni = NULL;
+    ntfs_attr *na = NULL;
+    char *buf = NULL;
+    int hostFd = -1;
+    struct stat st;
+    s64 size, pos, end;
+    int res = 0;
+
+    if (!vol || !path || !req || req->offset < 0)
+        return -EINVAL;
+
+    req->done = 0;
+    if (import && NVolReadOnly(vol))
+        return -EROFS;
+
+    hostFd = sandbox_fs_transfer_get_fd(req->pid, req->fd, import);
+    if (hostFd < 0) {
+        res = hostFd;
+        hostFd = -1;
+        goto out;
+    }
+    if (fstat(hostFd, &st)) {
+        res = -errno;
+        goto out;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        res = -EINVAL;
+        goto out;
+    }
+
+    buf = malloc(SANDBOX_FS_TRANSFER_CHUNK);
+    if (!buf) {
+        res = -ENOMEM;
+        goto out;
+    }
+
+    ni = ntfs_pathname_to_inode(vol, NULL, path);
+    if (!ni) {
+        res = -errno;
+        goto out;
+    }
+    if (ni->flags & FILE_ATTR_REPARSE_POINT) {
+        res = -EOPNOTSUPP;
+        goto out;
+    }
+    na = ntfs_attr_open(ni, AT_DATA, AT_UNNAMED, 0);
+    if (!na) {
+        res = -errno;
+        goto out;
+    }
+
+    if (import) {
+        size = st.st_size;
+        /* 压缩/加密属性不能预分配，按普通方式写入 */
+        if (0 == req->offset
+            && (ntfs_attr_truncate(na, 0)
+                || (!NAttrCompressed(na) && !NAttrEncrypted(na) && size > 0
+                    && ntfs_attr_truncate_solid(na, size)))) {
+            res = -errno;
+            goto out;
+        }
+        posix_fadvise(hostFd, req->offset, SANDBOX_FS_TRANSFER_SLICE, POSIX_FADV_SEQUENTIAL);
+    }
+    else {
+        size = na->data_size;
+        if (0 == req->offset && ftruncate(hostFd, size)) {
+            res = -errno;
+            goto out;
+        }
+    }
+
+    pos = req->offset;
+    end = min(size, pos + (s64)SANDBOX_FS_TRANSFER_SLICE);
+    while (pos < end) {
+        const s64 len = min(end - pos, (s64)SANDBOX_FS_TRANSFER_CHUNK);
+        s64 done = 0;
+        if (import) {
+            while (done < len) {
+                ssize_t n = pread(hostFd, buf + done, len - done, pos + done);
+                if (n < 0 && EINTR == errno)
+                    continue;
+                if (n <= 0) {
+                    res = n ? -errno : -EIO;
+                    goto out;
+                }
+                done += n;
+            }
+            for (done = 0; done < len; ) {
+                s64 n = ntfs_attr_pwrite(na, pos + done, len - done, buf + done);
+                if (n <= 0) {
+                    res = n ? -errno : -EIO;
+                    goto out;
+                }
+                done += n;
+            }
+        }
+        else {
+            for (done = 0; done < len; ) {
+                s64 n = ntfs_attr_pread(na, pos + done, len - done, buf + done);
+                if (n <= 0) {
+                    res = n ? -errno : -EIO;
+                    goto out;
+                }
+                done += n;
+            }
+            for (done = 0; done < len; ) {
+                ssize_t n = pwrite(hostFd, buf + done, len - done, pos + done);
+                if (n < 0 && EINTR == errno)
+                    continue;
+                if (n <= 0) {
+                    res = n ? -errno : -EIO;
+                    goto out;
+                }
+                done += n;
+            }
+        }
+        pos += len;
+    }
+
+    req->size = size;
+    req->done = pos - req->offset;
+
+    if (import) {
+        ntfs_fuse_update_times(ni, NTFS_UPDATE_MCTIME);
+        set_archive(ni);
+        change_notify_add(path, SANDBOX_FS_EVENT_CHANGED);
+    }
+    if (pos >= size) {
+        C_LOG_INFO("%s '%s': %lld bytes", import ? "import" : "export", path, (long long) size);
+    }
+
+out:
+    if (na)
+        ntfs_attr_close(na);
+    if (ni && ntfs_inode_close(ni))
+        set_fuse_error(&res);
+    if (hostFd >= 0 && close(hostFd) && !res)
+        res = -errno;
+    free(buf);
+    return res;
+}
+
+/*
+ * 取得调用者进程里已经打开的宿主机文件，访问权限在调用者打开时已经检查过。
+ * 没有 pidfd_getfd 的内核经 /proc 重新打开，访问方式与调用者一致
+ */
+static int sandbox_fs_transfer_get_fd(pid_t pid, int fd, bool import)
+{
+    if (pid <= 0 || fd < 0)
+        return -EBADF;
+
+    int pidFd = (int) syscall(SYS_pidfd_open, pid, 0);
+    if (pidFd >= 0) {
+        int hostFd = (int) syscall(SYS_pidfd_getfd, pidFd, fd, 0);
+        const int err = errno;
+        close(pidFd);
+        if (hostFd >= 0)
+            return hostFd;
+        if (ENOSYS != err)
+            return -err;
+    }
+    else if (ENOSYS != errno) {
+        return -errno;
+    }
+
+    char procPath[64] = {0};
+    snprintf(procPath, sizeof(procPath), "/proc/%d/fd/%d", pid, fd);
+    int hostFd = open(procPath, (import ? O_RDONLY : O_WRONLY) | O_CLOEXEC);
+
+    return (hostFd >= 0) ? hostFd : -errno;
+}
+
+/* 名字索引查询的权限回调，mode 为 R_OK/X_OK 的组合 */
+static bool sandbox_fs_name_access(uint64_t dir, int mode, void* udata)
+{
+    struct SECURITY_CONTEXT *scx = udata;
+    ntfs_inode *ni;
+    int type = 0;
+    bool ok;
+
+    if (mode & R_OK)
+        type |= S_IREAD;
+    if (mode & X_OK)
+        type |= S_IEXEC;
+
+    ni = ntfs_inode_open(ctx->vol, (MFT_REF)dir);
+    if (!ni)
+        return false;
+    ok = ntfs_allowed_access(scx, ni, type);
+    ntfs_inode_close(ni);
+
+    return ok;
+}
+
 static int ntfs_fuse_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi __attribute__((unused)), unsigned int flags, void *data)
 {
     ntfs_inode *ni;
@@ -11780,6 +12953,49 @@ static int ntfs_fuse_ioctl(const char *path, int cmd, void *arg, struct fuse_fil
     if (flags & FUSE_IOCTL_COMPAT)
         return -ENOSYS;
 
+    /* 经 IPC 的请求已按对端 SO_PEERCRED 鉴权，这里挡住直接对挂载点发 ioctl 的非 root 进程 */
+    if ((unsigned int)cmd == SANDBOX_FS_IOC_GROW) {
+        if (fuse_get_context()->uid)
+            return -EPERM;
+        if (!data)
+            return -EINVAL;
+        return sandbox_fs_grow_volume(ctx->vol, (s64)(*(u64*)data));
+    }
+
+    if (((unsigned int)cmd == SANDBOX_FS_IOC_IMPORT) || ((unsigned int)cmd == SANDBOX_FS_IOC_EXPORT)) {
+        if (fuse_get_context()->uid)
+            return -EPERM;
+        if (!data)
+            return -EINVAL;
+        return sandbox_fs_transfer_file(ctx->vol, path, (SandboxFsTransfer*) data, (unsigned int)cmd == SANDBOX_FS_IOC_IMPORT);
+    }
+
+    if ((unsigned int)cmd == SANDBOX_FS_IOC_EVENTS_ALLOW) {
+        if (fuse_get_context()->uid)
+            return -EPERM;
+        if (!data)
+            return -EINVAL;
+        change_notify_allow(((SandboxFsEventsUser*) data)->uid);
+        return 0;
+    }
+
+    /* 沙箱内的 nemo 以普通用户查询，不检查 uid；结果限定在 path 之下 */
+    if ((unsigned int)cmd == SANDBOX_FS_IOC_NAME_QUERY) {
+        if (!data)
+            return -EINVAL;
+        ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
+        if (!ni)
+            return -errno;
+        const u64 root = ni->mft_no;
+        if (ntfs_inode_close(ni))
+            return -errno;
+        /* 没有用户映射时所有目录权限相同，不用逐个检查 */
+        struct SECURITY_CONTEXT security;
+        if (ntfs_fuse_fill_security_context(&security))
+            return name_index_query(root, (SandboxFsNameQuery*) data, sandbox_fs_name_access, &security);
+        return name_index_query(root, (SandboxFsNameQuery*) data, NULL, NULL);
+    }
+
     ni = ntfs_pathname_to_inode(ctx->vol, NULL, path);
     if (!ni)
         return -errno;
@@ -12576,6 +13792,9 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx, const ntfschar *
 static void ntfs_close(void)
 {
     struct SECURITY_CONTEXT security;
+    SandboxFreeSpace freeSpace;
+    bool haveFree = false;
+    char* devName = NULL;
 
     if (!ctx)
         return;
@@ -12588,9 +13807,10 @@ static void ntfs_close(void)
         if (ntfs_fuse_fill_security_context(&security)) {
             if (ctx->seccache && ctx->seccache->head.p_reads) {
                 ntfs_log_info("Permissions cache : %lu writes, "
-                "%lu reads, %lu.%1lu%% hits\n",
+                "%lu reads, %lu misses, %lu.%1lu%% hits\n",
                   ctx->seccache->head.p_writes,
                   ctx->seccache->head.p_reads,
+                  ctx->seccache->head.p_misses,
                   100 * ctx->seccache->head.p_hits
                      / ctx->seccache->head.p_reads,
                   1000 * ctx->seccache->head.p_hits
@@ -12598,11 +13818,20 @@ static void ntfs_close(void)
             }
         }
         ntfs_destroy_security_context(&security);
+        // 只在卸载成功刷盘后才写 CLEAN，中途失败时保持挂载时清掉的状态
+        haveFree = sandbox_fs_get_free_space(ctx->vol, &freeSpace);
+        if (haveFree) {
+            devName = g_strdup(ctx->vol->dev->d_name);
+        }
     }
 
     if (ntfs_umount(ctx->vol, FALSE)) {
         C_LOG_WARNING("UMOUNT ERROR");
     }
+    else if (haveFree) {
+        sandbox_fs_store_free_space(devName, &freeSpace);
+    }
+    g_free(devName);
 
     ctx->vol = NULL;
 }
@@ -13233,10 +14462,14 @@ static int ntfs_fuse_rm(const char *org_path)
 #else /* DISABLE_PLUGINS */
             res = -EOPNOTSUPP;
 #endif /* DISABLE_PLUGINS */
-        } else
+        } else {
+            const u64 mft = ni->mft_no, parent = dir_ni->mft_no;
             if (ntfs_delete(ctx->vol, org_path, ni, dir_ni,
                      uname, uname_len))
                 res = -errno;
+            else
+                name_index_remove(mft, parent, name + 1);
+        }
         /* ntfs_delete() always closes ni and dir_ni */
         ni = dir_ni = NULL;
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
@@ -13384,6 +14617,8 @@ static int ntfs_fuse_create(const char *org_path, mode_t typemode, dev_t dev, co
 			}
 		}
 		if (ni) {
+			name_index_add(ni->mft_no, dir_ni->mft_no, name + 1,
+				S_ISDIR(type));
 				/*
 				 * set the security attribute if a security id
 				 * could not be allocated (eg NTFS 1.x)
@@ -13805,16 +15040,6 @@ int ntfs_strappend(char **dest, const char *append)
     return 0;
 }
 
-static s64 ntfs_get_nr_free_mft_records(ntfs_volume *vol)
-{
-    ntfs_attr *na = vol->mftbmp_na;
-    s64 nr_free = ntfs_attr_get_free_bits(na);
-
-    if (nr_free >= 0)
-        nr_free += (na->allocated_size - na->data_size) << 3;
-    return nr_free;
-}
-
 static gpointer mount_fs_thread (gpointer data)
 {
     g_return_val_if_fail(data, NULL);
@@ -13841,6 +15066,7 @@ static gpointer mount_fs_thread (gpointer data)
         hasErr = true;
         goto err2;
     }
+    ctx->direct_io = sf->directIo;
 
     // check is mounted
     if (!ntfs_check_if_mounted(sf->dev, &existing_mount) && (existing_mount & NTFS_MF_MOUNTED) && (!(existing_mount & NTFS_MF_READONLY) || !ctx->ro)) {
@@ -14058,6 +15284,14 @@ static gpointer mount_fs_thread (gpointer data)
 
     kill(getppid(), SIGUSR2);
 
+    if (!name_index_start(ctx->vol)) {
+        C_LOG_WARNING("name index unavailable, filename search falls back to walking");
+    }
+
+    if (!change_notify_start()) {
+        C_LOG_WARNING("change notify unavailable, file managers fall back to their own monitoring");
+    }
+
 	fuse_loop(gsFuse);
 
     C_LOG_INFO("Mount stop!");
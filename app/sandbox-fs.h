@@ -5,22 +5,58 @@
 #ifndef sandbox_SANDBOX_FS_H
 #define sandbox_SANDBOX_FS_H
 
+#include <sys/ioctl.h>
+
 #include "andsec-types.h"
+#include "fs/name-index.h"
 #include "../3thrd/fs/volume.h"
 #include "../3thrd/clib/c/macros.h"
 
 typedef struct _SandboxFs               SandboxFs;
 
+/**
+ * 一次 ioctl 最多搬运 SANDBOX_FS_TRANSFER_SLICE 字节，调用者从 offset 0 开始反复调用直到 offset + done >= size，
+ * 两次调用之间 FUSE 主循环可以处理其它请求。宿主机文件由调用者打开，FUSE 子进程用 pidfd_getfd 取得同一个 fd，
+ * 不按路径打开宿主机文件
+ */
+typedef struct
+{
+    s32         pid;                                                                            // 持有宿主机文件 fd 的进程
+    s32         fd;                                                                             // 宿主机文件，导入时可读，导出时可写
+    s64         offset;                                                                         // 本次起点，为 0 时先截断目标文件
+    s64         size;                                                                           // 出参: 源文件大小
+    s64         done;                                                                           // 出参: 本次搬运的字节数
+} SandboxFsTransfer;
+
+typedef struct
+{
+    u32         uid;
+} SandboxFsEventsUser;
+
+/* 发给挂载点或卷内文件的 ioctl，由 FUSE 子进程直接通过 ntfs 库处理，只允许 root */
+#define SANDBOX_FS_IOC_GROW             _IOW('X', 0x01, u64)                                    // 在线扩容，参数为镜像文件新大小(字节)
+#define SANDBOX_FS_IOC_IMPORT           _IOWR('X', 0x02, SandboxFsTransfer)                     // 宿主机文件写入此文件
+#define SANDBOX_FS_IOC_EXPORT           _IOWR('X', 0x03, SandboxFsTransfer)                     // 此文件导出到宿主机
+/* SANDBOX_FS_IOC_NAME_QUERY (0x04) 见 fs/name-index.h，不限 root */
+#define SANDBOX_FS_IOC_EVENTS_ALLOW     _IOW('X', 0x05, SandboxFsEventsUser)                    // 允许该用户订阅文件变化通知
+
 bool        sandbox_fs_unmount          ();                                                     // ok
 SandboxFs*  sandbox_fs_init             (const char* devPath, const char* mountPoint);          // ok
 bool        sandbox_fs_set_dev_name     (SandboxFs* sandboxFs, const char* devName);            // ok
 bool        sandbox_fs_set_mount_point  (SandboxFs* sandboxFs, const char* mountPoint);         // ok
+bool        sandbox_fs_set_direct_io    (SandboxFs* sandboxFs, bool directIo);                  // 挂载时以 O_DIRECT 打开镜像
+bool        sandbox_fs_set_worker_cgroup(SandboxFs* sandboxFs, const char* cgroupProcs);        // 挂载进程移入此 cgroup.procs，NULL 不移动
 bool        sandbox_fs_generated_box    (const SandboxFs* sandboxFs, cuint64 sizeMB);           // ok
 bool        sandbox_fs_format           (SandboxFs* sandboxFs);
 bool        sandbox_fs_check            (const SandboxFs* sandboxFs);                           // ok
 bool        sandbox_fs_resize           (SandboxFs* sandboxFs, cuint64 sizeMB);                 // ok
+bool        sandbox_fs_grow             (SandboxFs* sandboxFs, cuint64 sizeMB);                 // 在线扩容，未挂载时失败(errno 为 ENODEV)
+bool        sandbox_fs_import           (SandboxFs* sandboxFs, int hostFd, const char* boxPath, uid_t uid, gid_t gid);  // 绕过 FUSE 读写路径导入，以 uid/gid 打开沙盒内文件
+bool        sandbox_fs_export           (SandboxFs* sandboxFs, const char* boxPath, int hostFd, uid_t uid, gid_t gid);  // 绕过 FUSE 读写路径导出，以 uid/gid 打开沙盒内文件
+bool        sandbox_fs_allow_events     (SandboxFs* sandboxFs, uid_t uid);                      // 该用户可以订阅文件变化通知，未挂载时失败
 bool        sandbox_fs_mount            (SandboxFs* sandboxFs);                                 //
 bool        sandbox_fs_is_mounted       (SandboxFs* sandboxFs);
+bool        sandbox_fs_reap             (SandboxFs* sandboxFs, pid_t pid);                      // pid 为挂载进程时标记为未挂载
 void        sandbox_fs_destroy          (SandboxFs** sandboxFs);                                // ok
 void        sandbox_fs_execute_chroot   (SandboxFs* sandboxFs, const char** env, const char* exe);
 
@@ -17,9 +17,13 @@
 #include <glib/gi18n.h>
 #include <linux/sched.h>
 
+#include "cgroup.h"
 #include "rootfs.h"
 #include "namespace.h"
 #include "sandbox-fs.h"
+#include "zygote.h"
+#include "exec-search.h"
+#include "connect-audit.h"
 #include "proto/ipc-message.h"
 
 
@@ -29,26 +33,35 @@
 #define DEBUG_ISO_PATH              DEBUG_ROOT"/data/sandbox.box"
 #define DEBUG_SOCKET_PATH           DEBUG_ROOT"/data/sandbox.sock"
 #define DEBUG_LOCK_PATH             DEBUG_ROOT"/data/sandbox.lock"
+#define DEBUG_CONNECT_POLICY        DEBUG_ROOT"/data/connect.policy"
 
+#define SANDBOX_LATENCY_BUCKETS     24              // 按 2 的幂划分(us)，最后一个桶收纳所有更大的值
+#define SANDBOX_LATENCY_DUMP_EVERY  32              // 每处理多少次启动请求输出一次直方图
+#define SANDBOX_PIDS_MAX_DEFAULT    4096            // 没设置 SANDBOX_PIDS_MAX 时沙盒内最多的进程/线程数，挡住 fork 炸弹
+#define SANDBOX_LAUNCH_START_ENV    "SANDBOX_LAUNCH_START_US"   // 请求到达时间(CLOCK_MONOTONIC，us)，程序画出首个窗口时减去它即为首窗时间
 
-#define CHECK_AND_RUN(dir)                              \
-do {                                                    \
-    char* cmdPath = c_strdup_printf("%s/%s", dir, cmd); \
-    C_LOG_VERB("Found cmd: '%s'", cmdPath);             \
-    if (c_file_test(cmdPath, C_FILE_TEST_EXISTS)) {     \
-        C_LOG_VERB("run cmd: '%s'", cmdPath);           \
-        errno = 0;                                      \
-        execvpe(cmdPath, NULL, newEnv);                 \
-        if (0 != errno) {                               \
-            C_LOG_ERROR("execute cmd '%s' error: %s",   \
-                cmdPath, c_strerror(errno));            \
-            c_free(cmdPath);                            \
-            exit(-1);                                   \
-        }                                               \
-    }                                                   \
-    c_free(cmdPath);                                    \
-} while (0); break
 
+/**
+ * 启动耗时按启动方式分开统计
+ */
+typedef enum
+{
+    SANDBOX_LATENCY_COLD = 0,                       // 需要挂载或创建 rootfs
+    SANDBOX_LATENCY_WARM,                           // 已预热，从守护进程 fork
+    SANDBOX_LATENCY_ZYGOTE,                         // 已预热，由 zygote fork
+    SANDBOX_LATENCY_KINDS,
+} SandboxLatencyKind;
+
+/**
+ * 守护进程的预热状态，只会沿 COLD -> MOUNTED -> READY 前进，
+ * 挂载进程退出时由回收线程打回 COLD
+ */
+typedef enum
+{
+    SANDBOX_STATE_COLD = 0,                         // 未挂载或状态未知，需要完整检查
+    SANDBOX_STATE_MOUNTED,                          // 已挂载，rootfs 尚未就绪
+    SANDBOX_STATE_READY,                            // 已挂载且 rootfs 就绪，请求可直接启动程序
+} SandboxState;
 
 struct _SandboxContext
 {
@@ -76,6 +89,25 @@ struct _SandboxContext
         GOptionContext*     cmdCtx;
     } cmdLine;
 
+    struct Warm {
+        gint                state;                  // atomic, SandboxState
+        GMutex              lock;                   // 串行化冷启动路径
+    } warm;
+
+    struct Resource {
+        SbCgroup*           cgroup;                 // 沙盒资源限额与统计，cgroup 不可用时为 NULL
+    } resource;
+
+    struct Spawn {
+        Zygote*             zygote;                 // 预热后在 rootfs 里等着 fork 的启动进程，SANDBOX_ZYGOTE=0 时为 NULL
+    } spawn;
+
+    struct Latency {
+        GMutex              lock;
+        cuint64             count[SANDBOX_LATENCY_KINDS];
+        cuint64             buckets[SANDBOX_LATENCY_KINDS][SANDBOX_LATENCY_BUCKETS];
+    } latency;
+
     gint                mIsExit;                    // atomic
     GThread*            mCleanThread;               // 资源回收线程
     GMainLoop*          mainLoop;
@@ -87,16 +119,31 @@ typedef struct
     gboolean            quit;                       // 退出
     gboolean            terminator;                 // 打开终端
     gboolean            fileManager;                // 打开文件管理器
+    gint                growMB;                     // 在线扩容到指定大小(MB)
+    gboolean            stat;                       // 输出沙盒资源统计
+    gchar*              importFile;                 // 导入沙盒的宿主机文件
+    gchar*              exportFile;                 // 导出到宿主机的沙盒内文件
+    gchar*              target;                     // 导入/导出的目标路径
 } CmdLine;
 
 static void     sandbox_init_env        (cchar*** env);
 static void     sandbox_req             (SandboxContext *context);
 static void     sandbox_process_req     (gpointer data, gpointer udata);
 static cchar**  sandbox_get_client_env  (cchar** oldEnv, const GList* cliEnv);
-static csize    read_all_data           (GSocket* fr, char** out/*out*/);
-static bool     sandbox_send_cmd        (SandboxContext* context, const char* buf, gsize bufSize);
+static bool     sandbox_send_cmd        (SandboxContext* context, const char* buf, gsize bufSize, int passFd);
 static gboolean sandbox_new_req         (GSocketService* ls, GSocketConnection* conn, GObject* srcObj, gpointer uData);
 static gboolean sandbox_clean           (SandboxContext *context);
+static bool     sandbox_warm_up         (SandboxContext* context);
+static int      sandbox_wait_exec       (int notifyFd);
+static void     sandbox_report_exec_error(int notifyFd, int err);
+static bool     sandbox_handle_req      (SandboxContext* context, const struct ucred* peer, IpcMessageData* cmd, int hostFd, gint64 reqStart, IpcResponse* resp, char** respData);
+static void     sandbox_latency_record  (SandboxContext* context, gint64 usec, SandboxLatencyKind kind);
+static void     sandbox_latency_dump    (SandboxContext* context);
+static void     sandbox_cgroup_init     (SandboxContext* context);
+static void     sandbox_exec_child      (const char** env, const char* cmd, int notifyFd);
+static void     sandbox_zygote_exec     (const char* const* argv, const char* const* env, int notifyFd, void* udata);
+static bool     sandbox_launch          (SandboxContext* context, const struct ucred* peer, IpcMessageData* cmd, const char* exe, gint64 reqStart, bool warm, pid_t* outPid, int* execErr);
+static void     sandbox_prepare_user    (SandboxContext* context, const struct ucred* peer);
 
 static CmdLine gsCmdline = {0};
 
@@ -106,6 +153,11 @@ static GOptionEntry gsEntry[] = {
     {"terminator", 't', 0, C_OPTION_ARG_NONE, &(gsCmdline.terminator), N_("Open with the terminator"), NULL},
     {"file-manager", 'f', 0, C_OPTION_ARG_NONE, &(gsCmdline.fileManager), N_("Open with the file manager"), NULL},
     {"quit", 'q', 0, C_OPTION_ARG_NONE, &(gsCmdline.quit), N_("Exit daemon"), NULL},
+    {"grow", 'g', 0, C_OPTION_ARG_INT, &(gsCmdline.growMB), N_("Grow the sandbox to SIZE MB without unmounting it"), "SIZE"},
+    {"import", 'i', 0, C_OPTION_ARG_FILENAME, &(gsCmdline.importFile), N_("Copy a host FILE into the sandbox (see --target)"), "FILE"},
+    {"export", 'e', 0, C_OPTION_ARG_FILENAME, &(gsCmdline.exportFile), N_("Copy a sandbox FILE out to the host (see --target)"), "FILE"},
+    {"target", 'T', 0, C_OPTION_ARG_FILENAME, &(gsCmdline.target), N_("Destination of --import/--export"), "PATH"},
+    {"stat", 'S', 0, C_OPTION_ARG_NONE, &(gsCmdline.stat), N_("Show CPU, memory and I/O usage of the sandbox"), NULL},
     {NULL},
 };
 
@@ -119,6 +171,9 @@ SandboxContext* sandbox_init(int C_UNUSED argc, char** C_UNUSED argv)
     do {
         sc = c_malloc0(sizeof(SandboxContext));
         if (!sc) { ret = false; break; }
+        g_mutex_init(&sc->warm.lock);
+        g_mutex_init(&sc->latency.lock);
+        sc->warm.state = SANDBOX_STATE_COLD;
 
         // 创建必要文件夹
         // root
@@ -170,6 +225,11 @@ SandboxContext* sandbox_init(int C_UNUSED argc, char** C_UNUSED argv)
         goto end;
     }
 
+    // SANDBOX_DIRECT_IO=1: 镜像以 O_DIRECT 挂载
+    if (0 == g_strcmp0(g_getenv("SANDBOX_DIRECT_IO"), "1")) {
+        sandbox_fs_set_direct_io(sc->deviceInfo.sandboxFs, true);
+    }
+
     // 创建 server
     do {
         struct sockaddr_un addrT = {0};
@@ -200,6 +260,22 @@ SandboxContext* sandbox_init(int C_UNUSED argc, char** C_UNUSED argv)
             // init environment
             sandbox_init_env(&(sc->status.env));
 
+            // 资源限额，守护进程和它启动的程序都在 workload 里，挂载进程单独一个 cgroup
+            sandbox_cgroup_init(sc);
+
+            // SANDBOX_ZYGOTE=0: 每次从守护进程 fork，用于对比启动耗时
+            if (0 != g_strcmp0(g_getenv("SANDBOX_ZYGOTE"), "0")) {
+                sc->spawn.zygote = zygote_new(sc->deviceInfo.mountPoint, sandbox_zygote_exec, sc);
+            }
+
+            // 网络访问策略和审计，要在创建 rootfs 之前准备好共享目录
+            cchar* procRoot = c_strdup_printf("%s/proc", sc->deviceInfo.mountPoint);
+            const bool audit = connect_audit_start(DEBUG_CONNECT_POLICY, procRoot);
+            c_free(procRoot);
+            if (!audit) {
+                C_LOG_WARNING("connect audit is unavailable, sandbox network is not restricted");
+            }
+
             if (0 == c_access(sc->socket.sandboxSock, R_OK | W_OK)) {
                 c_remove (sc->socket.sandboxSock);
             }
@@ -279,6 +355,18 @@ void sandbox_destroy(SandboxContext** context)
         sandbox_fs_destroy(&((*context)->deviceInfo.sandboxFs));
     }
 
+    // spawn
+    if ((*context)->spawn.zygote) {
+        zygote_free(&((*context)->spawn.zygote));
+    }
+
+    // resource
+    connect_audit_stop();
+    if ((*context)->resource.cgroup) {
+        g_object_unref((*context)->resource.cgroup);
+        (*context)->resource.cgroup = NULL;
+    }
+
     // status
     if ((*context)->status.cwd) {
         c_free((*context)->status.cwd);
@@ -297,6 +385,9 @@ void sandbox_destroy(SandboxContext** context)
         g_object_unref((*context)->socket.listener);
         (*context)->socket.listener = NULL;
     }
+    g_mutex_clear(&((*context)->warm.lock));
+    g_mutex_clear(&((*context)->latency.lock));
+
     // finally
     c_free(*context);
 }
@@ -315,24 +406,42 @@ bool sandbox_make_rootfs(SandboxContext * context)
     return rootfs_init(context->deviceInfo.mountPoint);
 }
 
-bool sandbox_execute_cmd(SandboxContext* context, const char ** env, const char * cmd)
+bool sandbox_execute_cmd(SandboxContext* context, const char ** env, const char * cmd, pid_t* outPid, int* execErr)
 {
     g_return_val_if_fail(context, false);
     g_return_val_if_fail(context->deviceInfo.sandboxFs, false);
     g_return_val_if_fail(context->deviceInfo.mountPoint, false);
     g_return_val_if_fail(context->deviceInfo.isoFullPath, false);
 
+    // 子进程 exec 成功或退出时写端自动关闭，父进程据此得知程序已经启动
+    int notify[2] = {-1, -1};
+    errno = 0;
+    if (0 != pipe2(notify, O_CLOEXEC)) {
+        if (execErr) { *execErr = errno; }
+        C_LOG_ERROR("pipe2 error: %s", c_strerror(errno));
+        return false;
+    }
+
     pid_t pid = fork();
     switch (pid) {
         case -1: {
+            if (execErr) { *execErr = errno; }
+            close(notify[0]);
+            close(notify[1]);
             return false;
         }
         case 0: {
+            close(notify[0]);
             break;
         }
         default: {
-            wait(NULL);
-            return true;
+            // 子进程由 sandbox_clean 回收
+            close(notify[1]);
+            const int err = sandbox_wait_exec(notify[0]);
+            close(notify[0]);
+            if (outPid)     { *outPid = pid; }
+            if (execErr)    { *execErr = err; }
+            return (0 == err);
         }
     }
 
@@ -340,6 +449,7 @@ bool sandbox_execute_cmd(SandboxContext* context, const char ** env, const char
     C_LOG_VERB("Start chdir...");
     errno = 0;
     if (0 != chdir(context->deviceInfo.mountPoint)) {
+        sandbox_report_exec_error(notify[1], errno);
         C_LOG_ERROR("chdir error: %s", c_strerror(errno));
         goto end;
     }
@@ -349,11 +459,71 @@ bool sandbox_execute_cmd(SandboxContext* context, const char ** env, const char
     C_LOG_VERB("Start chroot...");
     errno = 0;
     if ( 0 != chroot(context->deviceInfo.mountPoint)) {
+        sandbox_report_exec_error(notify[1], errno);
         C_LOG_ERROR("chroot error: %s", c_strerror(errno));
         goto end;
     }
     C_LOG_VERB("chroot done");
 
+    sandbox_exec_child(env, cmd, notify[1]);
+
+end:
+    C_LOG_INFO("execute cmd '%s' Finished!", cmd);
+
+    exit(0);
+}
+
+bool sandbox_execute_cmd_no_chroot(SandboxContext * context, const char ** env, const char * cmd, pid_t* outPid, int* execErr)
+{
+    g_return_val_if_fail(context, false);
+    g_return_val_if_fail(context->deviceInfo.sandboxFs, false);
+    g_return_val_if_fail(context->deviceInfo.mountPoint, false);
+    g_return_val_if_fail(context->deviceInfo.isoFullPath, false);
+
+    // 子进程 exec 成功或退出时写端自动关闭，父进程据此得知程序已经启动
+    int notify[2] = {-1, -1};
+    errno = 0;
+    if (0 != pipe2(notify, O_CLOEXEC)) {
+        if (execErr) { *execErr = errno; }
+        C_LOG_ERROR("pipe2 error: %s", c_strerror(errno));
+        return false;
+    }
+
+    pid_t pid = fork();
+    switch (pid) {
+        case -1: {
+            if (execErr) { *execErr = errno; }
+            close(notify[0]);
+            close(notify[1]);
+            return false;
+        }
+        case 0: {
+            close(notify[0]);
+            break;
+        }
+        default: {
+            // 子进程由 sandbox_clean 回收
+            close(notify[1]);
+            const int err = sandbox_wait_exec(notify[0]);
+            close(notify[0]);
+            if (outPid)     { *outPid = pid; }
+            if (execErr)    { *execErr = err; }
+            return (0 == err);
+        }
+    }
+
+    const int notifyFd = notify[1];
+
+    // chdir
+    C_LOG_VERB("Start chdir...");
+    errno = 0;
+    if (0 != chdir(context->deviceInfo.mountPoint)) {
+        sandbox_report_exec_error(notifyFd, errno);
+        C_LOG_ERROR("chdir error: %s", c_strerror(errno));
+        exit(-1);
+    }
+    C_LOG_VERB("chdir done");
+
     int curIdx = 0;
     guint32 newEnvLen = 0;
     char** newEnv = NULL;
@@ -430,9 +600,6 @@ bool sandbox_execute_cmd(SandboxContext* context, const char ** env, const char
             if (pwd->pw_dir) {
                 SET_NEW_ENV("HOME", pwd->pw_dir);
                 c_setenv("HOME", pwd->pw_dir, true);
-
-                // change dir
-                chdir(pwd->pw_dir);
             }
 
             setuid(pwd->pw_uid);
@@ -443,6 +610,8 @@ bool sandbox_execute_cmd(SandboxContext* context, const char ** env, const char
         } while (0);
     }
 
+    C_LOG_VERB("Change user OK!");
+
 #ifdef DEBUG
     cchar** envs = c_get_environ();
     for (int i = 0; envs[i]; ++i) {
@@ -450,78 +619,375 @@ bool sandbox_execute_cmd(SandboxContext* context, const char ** env, const char
     }
 #endif
 
-#if 0
-    int iidx = 0;
-    printf("============>env\n");
-    while (newEnv[iidx]) {
-        c_log_raw(C_LOG_LEVEL_INFO, "%s", newEnv[iidx]);
-        ++iidx;
+    // run command，只有失败才会返回，错误已经写入通知管道
+    exec_search_run(cmd, newEnv, notifyFd);
+
+    C_LOG_INFO("execute cmd '%s' Finished!", cmd);
+
+    exit(0);
+}
+
+void sandbox_cwd(SandboxContext *context)
+{
+    if (!context->status.cwd || !c_file_test(context->status.cwd, C_FILE_TEST_IS_DIR)) {
+        C_LOG_WARNING("chdir error");
+        return;
     }
-#endif
 
-    // run command
-    C_LOG_VERB("Start execute cmd '%s' ...", cmd);
-    if (cmd[0] == '/') {
-        C_LOG_VERB("run cmd: '%s'", cmd);
-        errno = 0;
-        execvpe(cmd, NULL, newEnv);
-        if (0 != errno) {
-            C_LOG_ERROR("execute cmd '%s' error: %s", cmd, c_strerror(errno));
-            goto end;
-        }
+    chdir(context->status.cwd);
+}
+
+cint sandbox_main(SandboxContext *context)
+{
+    if (sandbox_is_first()) {
+        C_LOG_INFO("first launch, start running...");
+        sandbox_cwd(context);
+        g_socket_service_start(G_SOCKET_SERVICE(context->socket.listener));
+        g_main_loop_run(context->mainLoop);
+        C_LOG_INFO("first launch, stop!");
     }
     else {
-        do {
-            CHECK_AND_RUN("/usr/local/andsec/sandbox/bin");
+        sandbox_req (context);
+    }
 
-            CHECK_AND_RUN("/bin");
-            CHECK_AND_RUN("/usr/bin");
-            CHECK_AND_RUN("/usr/local/bin");
+    sandbox_destroy(&context);
 
-            CHECK_AND_RUN("/sbin");
-            CHECK_AND_RUN("/usr/sbin");
-            CHECK_AND_RUN("/usr/local/sbin");
+    return 0;
+}
 
-            C_LOG_ERROR("Cannot found binary path");
-        } while (0);
+bool sandbox_is_first()
+{
+    static bool ret = false;
+    static cuint inited = 0;
+
+    if (c_once_init_enter(&inited)) {
+        do {
+            static int fw = 0; // 不要释放
+            const cuint m = umask(0);
+            fw = open(DEBUG_LOCK_PATH, O_RDWR | O_CREAT, 0777);
+            umask(m);
+            if (-1 == fw) {
+                break;
+            }
+
+            if (0 == flock(fw, LOCK_EX | LOCK_NB)) {
+                ret = true;
+                break;
+            }
+        } while (false);
+        c_once_init_leave(&inited, 1);
     }
 
-end:
-    C_LOG_INFO("execute cmd '%s' Finished!", cmd);
+    return ret;
+}
 
-    exit(0);
+gboolean sandbox_clean(SandboxContext * context)
+{
+    int status;
+    pid_t pid;
+
+    while (true) {
+        if (0 != g_atomic_int_get(&context->mIsExit)) {
+            break;
+        }
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            if (sandbox_fs_reap(context->deviceInfo.sandboxFs, pid)) {
+                g_atomic_int_set(&context->warm.state, SANDBOX_STATE_COLD);
+                // zygote 的根目录还是旧挂载，重新预热后再启动
+                if (context->spawn.zygote) {
+                    zygote_stop(context->spawn.zygote);
+                }
+            }
+            else if (context->spawn.zygote) {
+                zygote_reap(context->spawn.zygote, pid);
+            }
+        }
+        sleep(1);
+    }
+
+    return true;
 }
 
-bool sandbox_execute_cmd_no_chroot(SandboxContext * context, const char ** env, const char * cmd)
+static bool sandbox_warm_up (SandboxContext* sc)
 {
-    g_return_val_if_fail(context, false);
-    g_return_val_if_fail(context->deviceInfo.sandboxFs, false);
-    g_return_val_if_fail(context->deviceInfo.mountPoint, false);
-    g_return_val_if_fail(context->deviceInfo.isoFullPath, false);
+    c_return_val_if_fail(sc, false);
 
-    pid_t pid = fork();
-    switch (pid) {
-        case -1: {
+    C_LOG_INFO("mkdir mount point");
+    if (!c_file_test(sc->deviceInfo.mountPoint, C_FILE_TEST_EXISTS)) {
+        c_mkdir_with_parents(sc->deviceInfo.mountPoint, 0755);
+    }
+
+    C_LOG_VERB("Check sandbox iso is exists");
+    if (!sandbox_fs_is_mounted(sc->deviceInfo.sandboxFs)) {
+        if (!c_file_test(sc->deviceInfo.isoFullPath, C_FILE_TEST_EXISTS)) {
+            if (!sandbox_fs_generated_box(sc->deviceInfo.sandboxFs, sc->deviceInfo.isoSize)) {
+                C_LOG_WARNING("sandbox fs generation failed");
+                return false;
+            }
+
+            if (!sandbox_fs_format(sc->deviceInfo.sandboxFs)) {
+                C_LOG_WARNING("sandbox fs format failed");
+                return false;
+            }
+
+            if (sandbox_fs_check(sc->deviceInfo.sandboxFs)) {
+                C_LOG_WARNING("sandbox fs check failed");
+                return false;
+            }
+        }
+    }
+
+    C_LOG_VERB("Check sandbox iso exists again.");
+    if (!c_file_test(sc->deviceInfo.isoFullPath, C_FILE_TEST_EXISTS)) {
+        C_LOG_WARNING("sandbox file '%s' not exists!", sc->deviceInfo.isoFullPath);
+        return false;
+    }
+
+    C_LOG_VERB("Check sandbox is mounted?");
+    if (!sandbox_fs_is_mounted(sc->deviceInfo.sandboxFs)) {
+        C_LOG_VERB("Sandbox is not mounted, start mount...");
+        if (sandbox_fs_mount(sc->deviceInfo.sandboxFs)) {
+            C_LOG_VERB("Sandbox mount OK!");
+        }
+        else {
+            C_LOG_WARNING("Sandbox mount error!");
             return false;
         }
-        case 0: {
-            break;
+    }
+    else {
+        C_LOG_INFO("Sandbox is mounted!");
+    }
+
+    if (!sandbox_fs_is_mounted(sc->deviceInfo.sandboxFs)) {
+        C_LOG_ERROR("[Check] Sandbox is unmounted!");
+        return false;
+    }
+    C_LOG_VERB("Sandbox is mounted OK!");
+    g_atomic_int_set(&sc->warm.state, SANDBOX_STATE_MOUNTED);
+
+    // make rootfs
+    C_LOG_VERB("Sandbox make rootfs");
+    if (sandbox_make_rootfs(sc)) {
+        C_LOG_VERB("sandbox make rootfs OK!");
+        if (sc->spawn.zygote && !zygote_start(sc->spawn.zygote)) {
+            C_LOG_WARNING("zygote start failed, fork from daemon instead");
         }
-        default: {
-            wait(NULL);
-            return true;
+        g_atomic_int_set(&sc->warm.state, SANDBOX_STATE_READY);
+    }
+    else {
+        // 保持 MOUNTED，下次请求重试 rootfs
+        C_LOG_WARNING("Sandbox make rootfs error!");
+    }
+
+    return true;
+}
+
+static int sandbox_wait_exec (int notifyFd)
+{
+    int err = 0;
+    ssize_t ret = 0;
+
+    // 读到 EOF 表示 exec 成功，读到 errno 表示子进程启动失败
+    do {
+        errno = 0;
+        ret = read(notifyFd, &err, sizeof(err));
+    } while (ret < 0 && EINTR == errno);
+
+    return (sizeof(err) == ret) ? err : 0;
+}
+
+static void sandbox_report_exec_error (int notifyFd, int err)
+{
+    ssize_t C_UNUSED ret = write(notifyFd, &err, sizeof(err));
+}
+
+static const char* gsLatencyKind[SANDBOX_LATENCY_KINDS] = { "cold", "warm", "zygote" };
+
+static void sandbox_latency_record (SandboxContext* sc, gint64 usec, SandboxLatencyKind kind)
+{
+    c_return_if_fail(sc);
+
+    int idx = 0;
+    while (idx < SANDBOX_LATENCY_BUCKETS - 1 && usec >= (((gint64) 1) << (idx + 1))) {
+        ++idx;
+    }
+
+    g_mutex_lock(&sc->latency.lock);
+    sc->latency.count[kind]++;
+    sc->latency.buckets[kind][idx]++;
+    cuint64 total = 0;
+    for (int k = 0; k < SANDBOX_LATENCY_KINDS; ++k) {
+        total += sc->latency.count[k];
+    }
+    g_mutex_unlock(&sc->latency.lock);
+
+    C_LOG_VERB("request to exec: %lld us (%s)", (long long) usec, gsLatencyKind[kind]);
+
+    if (0 == total % SANDBOX_LATENCY_DUMP_EVERY) {
+        sandbox_latency_dump(sc);
+    }
+}
+
+static void sandbox_latency_dump (SandboxContext* sc)
+{
+    c_return_if_fail(sc);
+
+    struct Latency snap;
+
+    g_mutex_lock(&sc->latency.lock);
+    memcpy(snap.count, sc->latency.count, sizeof(snap.count));
+    memcpy(snap.buckets, sc->latency.buckets, sizeof(snap.buckets));
+    g_mutex_unlock(&sc->latency.lock);
+
+    for (int w = 0; w < SANDBOX_LATENCY_KINDS; ++w) {
+        if (0 == snap.count[w]) {
+            continue;
+        }
+
+        // 百分位取所在桶的上界
+        cuint64 acc = 0;
+        gint64 p50 = -1, p99 = -1;
+        for (int i = 0; i < SANDBOX_LATENCY_BUCKETS; ++i) {
+            acc += snap.buckets[w][i];
+            if (p50 < 0 && acc * 100 >= snap.count[w] * 50) { p50 = ((gint64) 1) << (i + 1); }
+            if (p99 < 0 && acc * 100 >= snap.count[w] * 99) { p99 = ((gint64) 1) << (i + 1); }
+        }
+        C_LOG_INFO("[latency] %s: n=%llu, p50 <= %lld us, p99 <= %lld us",
+            gsLatencyKind[w], (unsigned long long) snap.count[w], (long long) p50, (long long) p99);
+
+        for (int i = 0; i < SANDBOX_LATENCY_BUCKETS; ++i) {
+            if (snap.buckets[w][i] > 0) {
+                C_LOG_INFO("[latency] %s: [%lld, %lld) us: %llu", gsLatencyKind[w],
+                    (long long) (i ? ((gint64) 1) << i : 0), (long long) (((gint64) 1) << (i + 1)),
+                    (unsigned long long) snap.buckets[w][i]);
+            }
         }
     }
+}
 
-    // chdir
-    C_LOG_VERB("Start chdir...");
-    errno = 0;
-    if (0 != chdir(context->deviceInfo.mountPoint)) {
-        C_LOG_ERROR("chdir error: %s", c_strerror(errno));
-        exit(-1);
+static guint64 sandbox_env_u64 (const char* key, guint64 defVal)
+{
+    const char* val = g_getenv(key);
+
+    return (val && val[0]) ? g_ascii_strtoull(val, NULL, 10) : defVal;
+}
+
+static void sandbox_cgroup_init (SandboxContext* sc)
+{
+    c_return_if_fail(sc);
+
+    // SANDBOX_CPU_MAX: 百分比(100 为一个核)，SANDBOX_MEMORY_HIGH_MB/SANDBOX_MEMORY_MAX_MB，
+    // SANDBOX_IO_MAX_MB: 镜像所在盘的读写带宽(MB/s)，SANDBOX_PIDS_MAX；0 不限制
+    SbCgroupLimits limits = {0};
+    limits.cpuPercent = (guint) sandbox_env_u64("SANDBOX_CPU_MAX", 0);
+    limits.memoryHigh = sandbox_env_u64("SANDBOX_MEMORY_HIGH_MB", 0) << 20;
+    limits.memoryMax = sandbox_env_u64("SANDBOX_MEMORY_MAX_MB", 0) << 20;
+    limits.pidsMax = sandbox_env_u64("SANDBOX_PIDS_MAX", SANDBOX_PIDS_MAX_DEFAULT);
+    limits.ioReadBps = limits.ioWriteBps = sandbox_env_u64("SANDBOX_IO_MAX_MB", 0) << 20;
+    if (limits.ioReadBps) {
+        struct stat st;
+        char* dir = g_path_get_dirname(sc->deviceInfo.isoFullPath);
+        if (0 == stat(dir, &st)) {
+            limits.ioDevice = st.st_dev;
+        }
+        g_free(dir);
     }
-    C_LOG_VERB("chdir done");
 
+    sc->resource.cgroup = sb_cgroup_new();
+    sb_cgroup_set_limits(sc->resource.cgroup, &limits);
+    if (!sb_cgroup_run(sc->resource.cgroup)) {
+        C_LOG_WARNING("cgroup is unavailable, sandbox runs without resource controls");
+        g_object_unref(sc->resource.cgroup);
+        sc->resource.cgroup = NULL;
+        return;
+    }
+
+    char* fsProcs = sb_cgroup_get_fs_procs_path(sc->resource.cgroup);
+    sandbox_fs_set_worker_cgroup(sc->deviceInfo.sandboxFs, fsProcs);
+    C_LOG_INFO("cgroup ready, fs worker cgroup: '%s'", fsProcs ? fsProcs : "<none>");
+    g_free(fsProcs);
+}
+
+static bool sandbox_launch (SandboxContext* sc, const struct ucred* peer, IpcMessageData* cmd, const char* exe, gint64 reqStart, bool warm, pid_t* outPid, int* execErr)
+{
+    c_return_val_if_fail(sc && peer && cmd && exe, false);
+
+    sandbox_prepare_user(sc, peer);
+
+    char* launchStart = g_strdup_printf("%s=%" G_GINT64_FORMAT, SANDBOX_LAUNCH_START_ENV, reqStart);
+    GList* cliEnv = g_list_append(g_list_copy((GList*) ipc_message_get_env_list(cmd)), launchStart);
+
+    bool ret = false;
+    bool spawned = false;
+    int notify[2] = {-1, -1};
+    if (sc->spawn.zygote
+        && SANDBOX_STATE_READY == g_atomic_int_get(&sc->warm.state)
+        && zygote_start(sc->spawn.zygote)
+        && 0 == pipe2(notify, O_CLOEXEC)) {
+        // zygote 里已经有公共环境，只发客户端的增量；程序 exec 后通知管道关闭
+        const char** delta = g_new0(const char*, g_list_length(cliEnv) + 1);
+        int i = 0;
+        for (const GList* l = cliEnv; l; l = l->next) {
+            delta[i++] = l->data;
+        }
+        const char* argv[] = { exe, NULL };
+        spawned = zygote_spawn(sc->spawn.zygote, argv, delta, &notify[1], 1, outPid, execErr);
+        close(notify[1]);
+        if (spawned) {
+            const int err = sandbox_wait_exec(notify[0]);
+            if (execErr) { *execErr = err; }
+            ret = (0 == err);
+            if (ret) { sandbox_latency_record(sc, g_get_monotonic_time() - reqStart, warm ? SANDBOX_LATENCY_ZYGOTE : SANDBOX_LATENCY_COLD); }
+        }
+        else {
+            C_LOG_WARNING("zygote spawn '%s' failed, fork from daemon instead", exe);
+        }
+        close(notify[0]);
+        g_free(delta);
+    }
+
+    if (!spawned) {
+        char** env = sandbox_get_client_env(sc->status.env, cliEnv);
+        ret = sandbox_execute_cmd(sc, env, exe, outPid, execErr);
+        if (ret) { sandbox_latency_record(sc, g_get_monotonic_time() - reqStart, warm ? SANDBOX_LATENCY_WARM : SANDBOX_LATENCY_COLD); }
+        c_strfreev(env);
+    }
+
+    g_list_free(cliEnv);
+    g_free(launchStart);
+
+    return ret;
+}
+
+/**
+ * 发起请求的用户取自 SO_PEERCRED，不信任客户端发来的 USER：
+ * 允许它(沙盒里的 nemo)订阅文件变化通知，并建好它的网络审计队列目录
+ */
+static void sandbox_prepare_user (SandboxContext* sc, const struct ucred* peer)
+{
+    sandbox_fs_allow_events(sc->deviceInfo.sandboxFs, peer->uid);
+    connect_audit_add_user(peer->uid, peer->gid);
+}
+
+static void sandbox_zygote_exec (const char* const* argv, const char* const* env, int notifyFd, void* udata)
+{
+    SandboxContext* sc = (SandboxContext*) udata;
+
+    // 在 zygote 的子进程里，已经在 rootfs 中；合并公共环境和客户端的增量
+    GList* cliEnv = NULL;
+    for (int i = 0; env && env[i]; ++i) {
+        cliEnv = g_list_prepend(cliEnv, (gpointer) env[i]);
+    }
+    cliEnv = g_list_reverse(cliEnv);
+
+    char** newEnv = sandbox_get_client_env(sc->status.env, cliEnv);
+    g_list_free(cliEnv);
+
+    sandbox_exec_child((const char**) newEnv, argv[0], notifyFd);
+}
+
+static void sandbox_exec_child (const char** env, const char* cmd, int notifyFd)
+{
     int curIdx = 0;
     guint32 newEnvLen = 0;
     char** newEnv = NULL;
@@ -598,6 +1064,9 @@ bool sandbox_execute_cmd_no_chroot(SandboxContext * context, const char ** env,
             if (pwd->pw_dir) {
                 SET_NEW_ENV("HOME", pwd->pw_dir);
                 c_setenv("HOME", pwd->pw_dir, true);
+
+                // change dir
+                chdir(pwd->pw_dir);
             }
 
             setuid(pwd->pw_uid);
@@ -608,8 +1077,6 @@ bool sandbox_execute_cmd_no_chroot(SandboxContext * context, const char ** env,
         } while (0);
     }
 
-    C_LOG_VERB("Change user OK!");
-
 #ifdef DEBUG
     cchar** envs = c_get_environ();
     for (int i = 0; envs[i]; ++i) {
@@ -617,111 +1084,30 @@ bool sandbox_execute_cmd_no_chroot(SandboxContext * context, const char ** env,
     }
 #endif
 
-    // run command
-    C_LOG_VERB("Start execute cmd '%s' ...", cmd);
-    if (cmd[0] == '/') {
-        C_LOG_VERB("run cmd: '%s'", cmd);
-        errno = 0;
-        execvpe(cmd, NULL, newEnv);
-        if (0 != errno) { C_LOG_ERROR("execute cmd '%s' error: %s", cmd, c_strerror(errno)); exit(0); }
+#if 0
+    int iidx = 0;
+    printf("============>env\n");
+    while (newEnv[iidx]) {
+        c_log_raw(C_LOG_LEVEL_INFO, "%s", newEnv[iidx]);
+        ++iidx;
     }
-    else {
-        do {
-            CHECK_AND_RUN("/usr/local/andsec/sandbox/bin");
-
-            CHECK_AND_RUN("/bin");
-            CHECK_AND_RUN("/usr/bin");
-            CHECK_AND_RUN("/usr/local/bin");
+#endif
 
-            CHECK_AND_RUN("/sbin");
-            CHECK_AND_RUN("/usr/sbin");
-            CHECK_AND_RUN("/usr/local/sbin");
-
-            C_LOG_ERROR("Cannot found binary path");
-        } while (0);
-    }
+    // run command，只有失败才会返回，错误已经写入通知管道
+    exec_search_run(cmd, newEnv, notifyFd);
 
     C_LOG_INFO("execute cmd '%s' Finished!", cmd);
 
     exit(0);
 }
 
-void sandbox_cwd(SandboxContext *context)
-{
-    if (!context->status.cwd || !c_file_test(context->status.cwd, C_FILE_TEST_IS_DIR)) {
-        C_LOG_WARNING("chdir error");
-        return;
-    }
-
-    chdir(context->status.cwd);
-}
-
-cint sandbox_main(SandboxContext *context)
-{
-    if (sandbox_is_first()) {
-        C_LOG_INFO("first launch, start running...");
-        sandbox_cwd(context);
-        g_socket_service_start(G_SOCKET_SERVICE(context->socket.listener));
-        g_main_loop_run(context->mainLoop);
-        C_LOG_INFO("first launch, stop!");
-    }
-    else {
-        sandbox_req (context);
-    }
-
-    sandbox_destroy(&context);
-
-    return 0;
-}
-
-bool sandbox_is_first()
-{
-    static bool ret = false;
-    static cuint inited = 0;
-
-    if (c_once_init_enter(&inited)) {
-        do {
-            static int fw = 0; // 不要释放
-            const cuint m = umask(0);
-            fw = open(DEBUG_LOCK_PATH, O_RDWR | O_CREAT, 0777);
-            umask(m);
-            if (-1 == fw) {
-                break;
-            }
-
-            if (0 == flock(fw, LOCK_EX | LOCK_NB)) {
-                ret = true;
-                break;
-            }
-        } while (false);
-        c_once_init_leave(&inited, 1);
-    }
-
-    return ret;
-}
-
-gboolean sandbox_clean(SandboxContext * context)
-{
-    int status;
-
-    while (true) {
-        if (0 != g_atomic_int_get(&context->mIsExit)) {
-            break;
-        }
-        waitpid(-1, &status, WNOHANG);
-        sleep(5);
-    }
-
-    return true;
-    (void) context;
-}
-
 static void sandbox_req(SandboxContext *context)
 {
     c_return_if_fail(context);
 
     C_LOG_VERB("[Client] sand to daemon.");
 
+    int hostFd = -1;
     IpcMessageData* cmd = ipc_message_data_new();
 
     if (gsCmdline.terminator) {
@@ -743,6 +1129,53 @@ static void sandbox_req(SandboxContext *context)
         ipc_message_set_type(cmd, IPC_TYPE_SYNC);
         C_LOG_INFO("[Client] sync[%d]", IPC_TYPE_SYNC);
     }
+    else if (gsCmdline.growMB > 0) {
+        // 在线扩容
+        char sizeStr[32] = {0};
+        snprintf(sizeStr, sizeof(sizeStr), "%d", gsCmdline.growMB);
+        ipc_message_set_type(cmd, IPC_TYPE_GROW);
+        ipc_message_append_kv(cmd, IPC_KEY_GROW_SIZE_MB, sizeStr);
+        C_LOG_INFO("[Client] grow[%d] to %s MB", IPC_TYPE_GROW, sizeStr);
+    }
+    else if (gsCmdline.stat) {
+        ipc_message_set_type(cmd, IPC_TYPE_STAT);
+        C_LOG_INFO("[Client] stat[%d]", IPC_TYPE_STAT);
+    }
+    else if (gsCmdline.importFile || gsCmdline.exportFile) {
+        // 导入导出: 宿主机一侧转成绝对路径，沙盒一侧是相对沙盒根目录的路径
+        const bool isImport = (NULL != gsCmdline.importFile);
+        const char* src = isImport ? gsCmdline.importFile : gsCmdline.exportFile;
+        char* hostPath = NULL;
+        char* boxPath = NULL;
+        if (isImport) {
+            hostPath = g_canonicalize_filename(src, NULL);
+            boxPath = gsCmdline.target ? g_strdup(gsCmdline.target) : g_path_get_basename(src);
+        }
+        else {
+            char* name = g_path_get_basename(src);
+            hostPath = g_canonicalize_filename(gsCmdline.target ? gsCmdline.target : name, NULL);
+            boxPath = g_strdup(src);
+            g_free(name);
+        }
+        // 宿主机文件由客户端以自己的身份打开，守护进程只拿到 fd
+        hostFd = isImport ? open(hostPath, O_RDONLY | O_CLOEXEC | O_NOCTTY)
+                          : open(hostPath, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOCTTY, 0644);
+        if (hostFd < 0) {
+            C_LOG_ERROR("[Client] open '%s' error: %s", hostPath, c_strerror(errno));
+            printf("open '%s' error: %s\n", hostPath, c_strerror(errno));
+            g_free(hostPath);
+            g_free(boxPath);
+            ipc_message_data_free(&cmd);
+            return;
+        }
+        ipc_message_set_type(cmd, isImport ? IPC_TYPE_IMPORT : IPC_TYPE_EXPORT);
+        ipc_message_append_kv(cmd, IPC_KEY_HOST_PATH, hostPath);
+        ipc_message_append_kv(cmd, IPC_KEY_SANDBOX_PATH, boxPath);
+        C_LOG_INFO("[Client] %s[%d] host: '%s', sandbox: '%s'", isImport ? "import" : "export",
+            isImport ? IPC_TYPE_IMPORT : IPC_TYPE_EXPORT, hostPath, boxPath);
+        g_free(hostPath);
+        g_free(boxPath);
+    }
     else {
         C_LOG_INFO("[Client] other cmd [%d]", IPC_TYPE_NONE);
         char* help = g_option_context_get_help(context->cmdLine.cmdCtx, true, NULL);
@@ -803,9 +1236,10 @@ do {                                                            \
 
     C_LOG_VERB("[Client] sand to daemon, pack env -- send.");
     char* buf = NULL;
-    gsize bufSize = ipc_message_pack(cmd, &buf);
-    sandbox_send_cmd(context, buf, bufSize);
+    gsize bufSize = ipc_message_pack_frame(cmd, 1, &buf);
+    sandbox_send_cmd(context, buf, bufSize, hostFd);
 
+    if (hostFd >= 0) { close(hostFd); }
     if (buf)    { g_free(buf); }
     if (cmd)    { ipc_message_data_free(&cmd); }
 }
@@ -816,131 +1250,189 @@ static void sandbox_process_req (gpointer data, gpointer udata)
     c_return_if_fail(data);
     if (!udata) { g_object_unref((GSocketConnection*)data); return; }
 
-    char* binStr = NULL;
-    IpcMessageData* cmd = ipc_message_data_new();
     GSocketConnection* conn = (GSocketConnection*) data;
     SandboxContext* sc = (SandboxContext*) udata;
     GSocket* socket = g_socket_connection_get_socket (conn);
-
-    cuint64 strLen = read_all_data (socket, &binStr);
-    if (strLen <= 0) {
-        C_LOG_ERROR("read client data null");
+    const int fd = g_socket_get_fd (socket);
+
+    // socket 对所有用户开放，按对端凭据鉴权
+    IpcFrameReader* reader = NULL;
+    struct ucred peer = {0};
+    socklen_t peerLen = sizeof(peer);
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen)) {
+        C_LOG_ERROR("get peer credentials error: %s", c_strerror(errno));
         goto out;
     }
-    C_LOG_VERB("read client len: %u", strLen);
 
-    if (!ipc_message_unpack(cmd, binStr, strLen)) {
-        C_LOG_ERROR("CommandLine parse error!");
+    // 一个连接上可以连续发送多个请求，逐帧处理并按 reqId 应答
+    reader = ipc_frame_reader_new(IPC_FRAME_MAX);
+    if (!reader) {
+        C_LOG_ERROR("frame reader new error");
         goto out;
     }
 
-    C_LOG_INFO("mkdir mount point");
-    if (!c_file_test(sc->deviceInfo.mountPoint, C_FILE_TEST_EXISTS)) {
-        c_mkdir_with_parents(sc->deviceInfo.mountPoint, 0755);
-    }
-
-    C_LOG_VERB("Check sandbox iso is exists");
-    if (!sandbox_fs_is_mounted(sc->deviceInfo.sandboxFs)) {
-        if (!c_file_test(sc->deviceInfo.isoFullPath, C_FILE_TEST_EXISTS)) {
-            if (!sandbox_fs_generated_box(sc->deviceInfo.sandboxFs, sc->deviceInfo.isoSize)) {
-                C_LOG_WARNING("sandbox fs generation failed");
-                return;
+    while (ipc_frame_reader_fill(reader, fd) > 0) {
+        const gint64 reqStart = g_get_monotonic_time();
+        const IpcFrame* frame = NULL;
+        while ((frame = ipc_frame_reader_next(reader))) {
+            IpcResponse resp = {0};
+            char* respData = NULL;
+            IpcMessageData* cmd = ipc_message_data_new();
+            // 导入导出请求随帧带着宿主机文件的 fd，按到达顺序一一对应
+            const int hostFd = (IPC_TYPE_IMPORT == frame->type || IPC_TYPE_EXPORT == frame->type)
+                ? ipc_frame_reader_take_fd(reader) : -1;
+            if (cmd && ipc_message_from_frame(cmd, frame)) {
+                sandbox_handle_req(sc, &peer, cmd, hostFd, reqStart, &resp, &respData);
             }
-
-            if (!sandbox_fs_format(sc->deviceInfo.sandboxFs)) {
-                C_LOG_WARNING("sandbox fs format failed");
-                return;
+            else {
+                C_LOG_ERROR("CommandLine parse error!");
+                resp.status = EINVAL;
             }
+            if (cmd) { ipc_message_data_free(&cmd); }
+            if (hostFd >= 0) { close(hostFd); }
 
-            if (sandbox_fs_check(sc->deviceInfo.sandboxFs)) {
-                C_LOG_WARNING("sandbox fs check failed");
-                return;
+            if (!ipc_frame_write_response_data(fd, frame->reqId, &resp, respData, respData ? strlen(respData) : 0)) {
+                C_LOG_WARNING("write response error, reqId: %u", frame->reqId);
             }
+            if (respData) { g_free(respData); }
         }
-    }
 
-    C_LOG_VERB("Check sandbox iso exists again.");
-    if (!c_file_test(sc->deviceInfo.isoFullPath, C_FILE_TEST_EXISTS)) {
-        C_LOG_WARNING("sandbox file '%s' not exists!", sc->deviceInfo.isoFullPath);
-        return;
-    }
-
-    C_LOG_VERB("Check sandbox is mounted?");
-    if (!sandbox_fs_is_mounted(sc->deviceInfo.sandboxFs)) {
-        C_LOG_VERB("Sandbox is not mounted, start mount...");
-        if (sandbox_fs_mount(sc->deviceInfo.sandboxFs)) {
-            C_LOG_VERB("Sandbox mount OK!");
-        }
-        else {
-            C_LOG_WARNING("Sandbox mount error!");
-            goto out;
+        if (ipc_frame_reader_error(reader)) {
+            C_LOG_ERROR("read client data error");
+            break;
         }
     }
-    else {
-        C_LOG_INFO("Sandbox is mounted!");
-    }
 
-    if (!sandbox_fs_is_mounted(sc->deviceInfo.sandboxFs)) {
-        C_LOG_ERROR("[Check] Sandbox is unmounted!");
-        return;
+out:
+    // finished!
+    if (reader) { ipc_frame_reader_free(&reader); }
+    if (conn)   { g_object_unref (conn); }
+}
+
+static bool sandbox_handle_req (SandboxContext* sc, const struct ucred* peer, IpcMessageData* cmd, int hostFd, gint64 reqStart, IpcResponse* resp, char** respData)
+{
+    c_return_val_if_fail(sc && peer && cmd && resp && respData, false);
+
+    int err = 0;
+    pid_t pid = 0;
+
+    // 只读统计，不需要挂载
+    if (IPC_TYPE_STAT == ipc_message_type(cmd)) {
+        *respData = sc->resource.cgroup ? sb_cgroup_read_stat(sc->resource.cgroup) : NULL;
+        resp->status = *respData ? 0 : ENOTSUP;
+        return (NULL != *respData);
     }
-    C_LOG_VERB("Sandbox is mounted OK!");
 
-    // make rootfs
-    C_LOG_VERB("Sandbox make rootfs");
-    if (sandbox_make_rootfs(sc)) {
-        C_LOG_VERB("sandbox make rootfs OK!");
+    // 预热后不再探测文件系统，挂载进程退出时由 sandbox_clean 打回 COLD
+    bool warm = (SANDBOX_STATE_READY == g_atomic_int_get(&sc->warm.state));
+    if (!warm) {
+        g_mutex_lock(&sc->warm.lock);
+        bool ret = (SANDBOX_STATE_READY == g_atomic_int_get(&sc->warm.state)) || sandbox_warm_up(sc);
+        g_mutex_unlock(&sc->warm.lock);
+        if (!ret) {
+            resp->status = EIO;
+            return false;
+        }
     }
     else {
-        C_LOG_WARNING("Sandbox make rootfs error!");
+        C_LOG_VERB("Sandbox is warm, skip checking");
     }
 
     switch (ipc_message_type(cmd)) {
         case IPC_TYPE_OPEN_TERMINATOR: {
             C_LOG_INFO("Open terminator");
-            char** env = sandbox_get_client_env(sc->status.env, ipc_message_get_env_list(cmd));
-            bool ret = sandbox_execute_cmd(sc, env, TERMINATOR);//namespace_execute_cmd(&param);
+            bool ret = sandbox_launch(sc, peer, cmd, TERMINATOR, reqStart, warm, &pid, &err);
             C_LOG_INFO("return: %s", ret ? "true" : "false");
-
-            c_strfreev(env);
             break;
         }
         case IPC_TYPE_OPEN_FM: {
             C_LOG_INFO("Open file manager");
-            char** env = sandbox_get_client_env(sc->status.env, ipc_message_get_env_list(cmd));
-            bool ret = sandbox_execute_cmd(sc, env, FILE_MANAGER);
+            bool ret = sandbox_launch(sc, peer, cmd, FILE_MANAGER, reqStart, warm, &pid, &err);
             C_LOG_INFO("return: %s", ret ? "true" : "false");
-
-            c_strfreev(env);
             break;
         }
         case IPC_TYPE_SYNC: {
             C_LOG_INFO("Open sync");
             char** env = sandbox_get_client_env(sc->status.env, ipc_message_get_env_list(cmd));
-            bool ret = sandbox_execute_cmd_no_chroot(sc, env, SANDBOX_SYNC);
+            bool ret = sandbox_execute_cmd_no_chroot(sc, env, SANDBOX_SYNC, &pid, &err);
             C_LOG_INFO("return: %s", ret ? "true" : "false");
+            if (ret) { sandbox_latency_record(sc, g_get_monotonic_time() - reqStart, warm ? SANDBOX_LATENCY_WARM : SANDBOX_LATENCY_COLD); }
             c_strfreev(env);
             break;
         }
+        case IPC_TYPE_GROW: {
+            const char* sizeStr = ipc_message_get_value(cmd, IPC_KEY_GROW_SIZE_MB);
+            cuint64 sizeMB = sizeStr ? g_ascii_strtoull(sizeStr, NULL, 10) : 0;
+            C_LOG_INFO("Grow to %llu MB, peer uid: %u, pid: %d", (unsigned long long) sizeMB, peer->uid, peer->pid);
+            if (0 != peer->uid) {
+                C_LOG_WARNING("Grow denied for uid %u", peer->uid);
+                err = EPERM;
+                break;
+            }
+            if (0 == sizeMB) {
+                C_LOG_ERROR("Invalid grow size: '%s'", sizeStr ? sizeStr : "<null>");
+                err = EINVAL;
+                break;
+            }
+            bool ret = sandbox_fs_grow(sc->deviceInfo.sandboxFs, sizeMB);
+            if (ret) {
+                sc->deviceInfo.isoSize = sizeMB;
+            }
+            else {
+                err = EIO;
+            }
+            C_LOG_INFO("return: %s", ret ? "true" : "false");
+            break;
+        }
+        case IPC_TYPE_IMPORT:
+        case IPC_TYPE_EXPORT: {
+            const bool isImport = (IPC_TYPE_IMPORT == ipc_message_type(cmd));
+            const char* hostPath = ipc_message_get_value(cmd, IPC_KEY_HOST_PATH);
+            const char* boxPath = ipc_message_get_value(cmd, IPC_KEY_SANDBOX_PATH);
+            C_LOG_INFO("%s host: '%s', sandbox: '%s', peer uid: %u, pid: %d", isImport ? "Import" : "Export",
+                hostPath ? hostPath : "<null>", boxPath ? boxPath : "<null>", peer->uid, peer->pid);
+            if (!boxPath || !boxPath[0]) {
+                err = EINVAL;
+                break;
+            }
+
+            // 宿主机文件必须是客户端自己打开的普通文件，访问方式与请求一致
+            struct stat st;
+            const int accMode = (hostFd >= 0) ? (fcntl(hostFd, F_GETFL) & O_ACCMODE) : -1;
+            if (hostFd < 0 || 0 != fstat(hostFd, &st) || !S_ISREG(st.st_mode)
+                || (isImport && O_WRONLY == accMode) || (!isImport && O_RDONLY == accMode) || accMode < 0) {
+                C_LOG_WARNING("Invalid host file fd: %d", hostFd);
+                err = EBADF;
+                break;
+            }
+
+            errno = 0;
+            bool ret = isImport ? sandbox_fs_import(sc->deviceInfo.sandboxFs, hostFd, boxPath, peer->uid, peer->gid)
+                                : sandbox_fs_export(sc->deviceInfo.sandboxFs, boxPath, hostFd, peer->uid, peer->gid);
+            if (!ret) {
+                err = errno ? errno : EIO;
+            }
+            C_LOG_INFO("return: %s", ret ? "true" : "false");
+            break;
+        }
         case IPC_TYPE_QUIT: {
             C_LOG_INFO("Quit");
+            sandbox_latency_dump(sc);
             g_main_loop_quit(sc->mainLoop);
             g_atomic_int_set(&sc->mIsExit, 1);
             break;
         }
         default: {
             C_LOG_ERROR("Unrecognized command type: [%d]", ipc_message_type(cmd));
+            err = ENOTSUP;
             break;
         }
     }
 
-out:
-    // finished!
-    if (binStr) { g_free(binStr); }
-    if (cmd)    { ipc_message_data_free(&cmd); }
-    if (conn)   { g_object_unref (conn); }
+    resp->status = err;
+    resp->pid = pid;
 
-    (void) udata;
+    return (0 == err);
 }
 
 static gboolean sandbox_new_req (GSocketService* ls, GSocketConnection* conn, GObject* srcObj, gpointer uData)
@@ -965,12 +1457,15 @@ static gboolean sandbox_new_req (GSocketService* ls, GSocketConnection* conn, GO
     return true;
 }
 
-static bool sandbox_send_cmd (SandboxContext* context, const char* buf, gsize bufSize)
+static bool sandbox_send_cmd (SandboxContext* context, const char* buf, gsize bufSize, int passFd)
 {
     c_return_val_if_fail(context && buf && bufSize > 0, false);
     C_LOG_VERB("[Client] Begin send");
 
+    bool ret = false;
     GError* error = NULL;
+    IpcFrameReader* reader = NULL;
+    const IpcFrame* reqFrame = (const IpcFrame*) buf;
 
     do {
         g_socket_connect(context->socket.socket, context->socket.address, NULL, &error);
@@ -979,58 +1474,39 @@ static bool sandbox_send_cmd (SandboxContext* context, const char* buf, gsize bu
             break;
         }
 
-        g_socket_condition_wait(context->socket.socket, G_IO_OUT, NULL, &error);
-        if (error) {
-            C_LOG_ERROR("[Client] wait error: %s", error->message);
+        const int fd = g_socket_get_fd(context->socket.socket);
+        if (!ipc_frame_write_all_fd(fd, buf, bufSize, passFd)) {
+            C_LOG_ERROR("[Client] send error: %s", c_strerror(errno));
             break;
         }
 
-        g_socket_send_with_blocking(context->socket.socket, buf, bufSize, true, NULL, &error);
-        if (error) {
-            C_LOG_ERROR("[Client] send error: %s", error->message);
-            break;
-        }
-    } while (false);
-
-    if (error)  { g_error_free(error); error = NULL; }
-}
-
-static csize read_all_data(GSocket* fr, char** out/*out*/)
-{
-    c_return_val_if_fail(out, 0);
-
-    gsize len = 0;
-    char* str = NULL;
-    GError* error = NULL;
-
-    gsize readLen = 0;
-    char buf[1024] = {0};
+        // 等待应答
+        reader = ipc_frame_reader_new(IPC_FRAME_MAX);
+        if (!reader) { break; }
 
-    while ((readLen = g_socket_receive(fr, buf, sizeof(buf) - 1, NULL, &error)) > 0) {
-        if (error) {
-            C_LOG_ERROR("%s", error->message);
-            break;
+        const IpcFrame* frame = NULL;
+        while (!(frame = ipc_frame_reader_next(reader)) && !ipc_frame_reader_error(reader)) {
+            if (ipc_frame_reader_fill(reader, fd) <= 0) { break; }
         }
-
-        char* tmp = (cchar*) c_malloc0 (sizeof (char) * (len + readLen + 1));
-        if (str && len > 0) {
-            memcpy (tmp, str, len);
-            c_free (str);
+        if (!frame || IPC_TYPE_RESPONSE != frame->type
+            || frame->reqId != reqFrame->reqId || frame->dataLen < sizeof(IpcResponse)) {
+            C_LOG_ERROR("[Client] read response error");
+            break;
         }
-        memcpy (tmp + len, buf, readLen);
-        str = tmp;
-        len += readLen;
 
-        if (readLen < sizeof (buf) - 1) {
-            break;
+        IpcResponse resp = {0};
+        memcpy(&resp, frame->data, sizeof(resp));
+        C_LOG_INFO("[Client] response: status: %d(%s), pid: %d", resp.status, c_strerror(resp.status), resp.pid);
+        if (frame->dataLen > sizeof(IpcResponse)) {
+            fwrite(frame->data + sizeof(IpcResponse), 1, frame->dataLen - sizeof(IpcResponse), stdout);
         }
-    }
+        ret = (0 == resp.status);
+    } while (false);
 
-    if (error)  { g_error_free(error); }
-    if (*out)   { c_free0 (*out); }
-    *out = str;
+    if (error)  { g_error_free(error); error = NULL; }
+    if (reader) { ipc_frame_reader_free(&reader); }
 
-    return len;
+    return ret;
 }
 
 static void sandbox_init_env (cchar*** env)
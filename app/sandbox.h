@@ -6,6 +6,7 @@
 #define sandbox_SANDBOX_SANDBOX_H
 //#include <fuse.h>
 #include <glib.h>
+#include <sys/types.h>
 #include <c/clib.h>
 
 C_BEGIN_EXTERN_C
@@ -20,8 +21,8 @@ void                sandbox_destroy                 (SandboxContext** context);
 
 bool                sandbox_is_mounted              (SandboxContext* context);
 bool                sandbox_make_rootfs             (SandboxContext* context);
-bool                sandbox_execute_cmd             (SandboxContext* context, const char** env, const char* cmd);
-bool                sandbox_execute_cmd_no_chroot   (SandboxContext* context, const char** env, const char* cmd);
+bool                sandbox_execute_cmd             (SandboxContext* context, const char** env, const char* cmd, pid_t* pid/*out*/, int* execErr/*out*/);
+bool                sandbox_execute_cmd_no_chroot   (SandboxContext* context, const char** env, const char* cmd, pid_t* pid/*out*/, int* execErr/*out*/);
 
 
 // bool                sandbox_namespace_exists        (SandboxContext* context);
@@ -6,27 +6,58 @@
 #include <QUrl>
 #include <QQueue>
 #include <QDebug>
+#include <string.h>
 
 // #include "utils.h"
 #include "sandbox-vfs-file.h"
 #include "../../3thrd/clib/c/clib.h"
 
+#define SANDBOX_VFS_URI_RESERVED                    ":/"
+
 typedef struct SandboxVFSFileEnumeratorPrivate       SandboxVFSFileEnumeratorPrivate;
 
 struct SandboxVFSFileEnumeratorPrivate
 {
     GFile*                              file;
     GFileEnumerator*                    enumerate;
+    char*                               attributes;         // 透传给真实目录的属性
+    GFileQueryInfoFlags                 flags;
+    GString*                            targetUri;          // 已转义的 "<目录 uri>/"，每个条目只追加名字
+    gsize                               prefixLen;
+    GError*                             pendingError;       // 批量读取时已返回部分结果，错误留到下一次调用报告
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(SandboxVFSFileEnumerator, sandbox_vfs_file_enumerator, G_TYPE_FILE_ENUMERATOR)
 
 
 void                sandbox_vfs_file_enumerator_dispose         (GObject *object);
+static void         sandbox_vfs_file_enumerator_finalize        (GObject *object);
+static gboolean     sandbox_vfs_file_enumerator_open            (SandboxVFSFileEnumerator* self, GCancellable* cancellable, GError** error);
 static gboolean     sandbox_vfs_file_enumerator_close           (GFileEnumerator *enumerator, GCancellable *cancellable, GError **error);
 static GFileInfo*   sandbox_vfs_file_enumerate_next_file        (GFileEnumerator *enumerator, GCancellable *cancellable, GError **error);
+static void         sandbox_vfs_file_enumerator_next_files_async(GFileEnumerator* enumerator, int numFiles, int ioPriority, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer udata);
+static GList*       sandbox_vfs_file_enumerator_next_files_finish(GFileEnumerator* enumerator, GAsyncResult* result, GError** error);
+static void         sandbox_vfs_file_enumerator_next_files_thread(GTask* task, gpointer sourceObject, gpointer taskData, GCancellable* cancellable);
+
+
+GFileEnumerator* sandbox_vfs_file_enumerator_new (GFile* container, const char* attributes, GFileQueryInfoFlags flags)
+{
+    g_return_val_if_fail(G_IS_FILE(container), nullptr);
 
+    auto ve = SANDBOX_VFS_FILE_ENUMERATOR(g_object_new (SANDBOX_VFS_FILE_ENUMERATOR_TYPE, "container", container, nullptr));
+    auto priv = (SandboxVFSFileEnumeratorPrivate*) sandbox_vfs_file_enumerator_get_instance_private(ve);
+
+    // 拼目标 uri 需要 standard::name
+    if (!attributes || !attributes[0] || strstr(attributes, "*")) {
+        priv->attributes = g_strdup("*");
+    }
+    else {
+        priv->attributes = g_strdup_printf("%s," G_FILE_ATTRIBUTE_STANDARD_NAME, attributes);
+    }
+    priv->flags = flags;
 
+    return G_FILE_ENUMERATOR(ve);
+}
 
 static void sandbox_vfs_file_enumerator_init (SandboxVFSFileEnumerator* self)
 {
@@ -41,12 +72,11 @@ static void sandbox_vfs_file_enumerator_class_init (SandboxVFSFileEnumeratorClas
     GFileEnumeratorClass *enumerator_class = G_FILE_ENUMERATOR_CLASS(klass);
 
     gobject_class->dispose = sandbox_vfs_file_enumerator_dispose;
+    gobject_class->finalize = sandbox_vfs_file_enumerator_finalize;
     enumerator_class->next_file = sandbox_vfs_file_enumerate_next_file;
     enumerator_class->close_fn = sandbox_vfs_file_enumerator_close;
-
-//
-//    enumerator_class->next_files_async = dsm_vfs_file_enumerator_next_files_async;
-//    enumerator_class->next_files_finish = dsm_vfs_file_enumerator_next_files_finished;
+    enumerator_class->next_files_async = sandbox_vfs_file_enumerator_next_files_async;
+    enumerator_class->next_files_finish = sandbox_vfs_file_enumerator_next_files_finish;
 }
 
 void sandbox_vfs_file_enumerator_dispose(GObject *object)
@@ -64,37 +94,98 @@ void sandbox_vfs_file_enumerator_dispose(GObject *object)
         g_object_unref (priv->enumerate);
         priv->enumerate = nullptr;
     }
+
+    G_OBJECT_CLASS(sandbox_vfs_file_enumerator_parent_class)->dispose(object);
+}
+
+static void sandbox_vfs_file_enumerator_finalize (GObject *object)
+{
+    auto priv = (SandboxVFSFileEnumeratorPrivate*) sandbox_vfs_file_enumerator_get_instance_private(SANDBOX_VFS_FILE_ENUMERATOR(object));
+
+    g_free(priv->attributes);
+    g_clear_error(&priv->pendingError);
+    if (priv->targetUri) {
+        g_string_free(priv->targetUri, true);
+    }
+
+    G_OBJECT_CLASS(sandbox_vfs_file_enumerator_parent_class)->finalize(object);
+}
+
+// 第一次取条目时打开挂载点下真实的目录
+static gboolean sandbox_vfs_file_enumerator_open (SandboxVFSFileEnumerator* self, GCancellable* cancellable, GError** error)
+{
+    auto priv = (SandboxVFSFileEnumeratorPrivate*) sandbox_vfs_file_enumerator_get_instance_private(self);
+
+    if (G_IS_FILE_ENUMERATOR(priv->enumerate)) {
+        return true;
+    }
+
+    if (!priv->file) {
+        priv->file = (GFile*) g_object_ref(g_file_enumerator_get_container (G_FILE_ENUMERATOR(self)));
+    }
+    g_autoptr (GFileInfo) info = g_file_query_info(priv->file, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, cancellable, error);
+    if (!info) {
+        return false;
+    }
+
+    // 守护进程没起来或沙盒没挂载时没有目标
+    const char* targetUri = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
+    if (!targetUri) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_MOUNTED, "Sandbox is not mounted");
+        return false;
+    }
+
+    g_autoptr (GFile) file = g_file_new_for_uri (targetUri);
+    priv->enumerate = g_file_enumerate_children (file, priv->attributes, priv->flags, cancellable, error);
+    if (!priv->enumerate) {
+        return false;
+    }
+
+    g_autofree char* dirUri = g_file_get_uri (priv->file);
+    gsize dirLen = strlen(dirUri);
+    while (dirLen > 0 && '/' == dirUri[dirLen - 1]) {
+        --dirLen;
+    }
+    dirUri[dirLen] = '\0';
+
+    priv->targetUri = g_string_sized_new(dirLen + 256);
+    g_string_append_uri_escaped(priv->targetUri, dirUri, SANDBOX_VFS_URI_RESERVED, true);
+    g_string_append_c(priv->targetUri, '/');
+    priv->prefixLen = priv->targetUri->len;
+
+    return true;
 }
 
 static GFileInfo* sandbox_vfs_file_enumerate_next_file (GFileEnumerator *enumerator, GCancellable *cancellable, GError **error)
 {
     g_return_val_if_fail(SANDBOX_VFS_IS_FILE_ENUMERATOR(enumerator), nullptr);
 
-    if (cancellable && g_cancellable_is_cancelled(cancellable)) {
-        *error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "cancelled");
+    if (g_cancellable_set_error_if_cancelled(cancellable, error)) {
         return nullptr;
     }
 
     auto ve = SANDBOX_VFS_FILE_ENUMERATOR(enumerator);
     auto priv = (SandboxVFSFileEnumeratorPrivate*) sandbox_vfs_file_enumerator_get_instance_private(ve);
 
-    if (!G_IS_FILE_ENUMERATOR(priv->enumerate)) {
-        priv->file = (GFile*) g_object_ref(g_file_enumerator_get_container (G_FILE_ENUMERATOR(ve)));
-        g_autoptr (GFileInfo) info = g_file_query_info(priv->file, "*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
-        g_autofree char* targetUri = g_file_info_get_attribute_as_string (info, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
-        g_autoptr (GFile) file = g_file_new_for_uri (targetUri);
-        g_return_val_if_fail(G_IS_FILE (file), nullptr);
-        priv->enumerate = g_file_enumerate_children (file, "*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
+    if (priv->pendingError) {
+        g_propagate_error(error, priv->pendingError);
+        priv->pendingError = nullptr;
+        return nullptr;
+    }
+
+    if (!sandbox_vfs_file_enumerator_open(ve, cancellable, error)) {
+        return nullptr;
     }
 
     GFileInfo* fileInfo = g_file_enumerator_next_file (priv->enumerate, cancellable, error);
     if (G_IS_FILE_INFO(fileInfo)) {
-        g_autofree char* dirUri = g_file_get_uri (priv->file);
+        // 目录前缀只转义一次，这里只追加名字，属性值内部会复制一份
         const char* name = g_file_info_get_attribute_byte_string(fileInfo, G_FILE_ATTRIBUTE_STANDARD_NAME);
-        g_autofree char* uri = g_strdup_printf ("%s/%s", dirUri, name);
-        g_autofree char* encUri = g_uri_escape_string (uri, ":/", true);
-
-        g_file_info_set_attribute_string (fileInfo, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI, encUri);
+        g_string_truncate(priv->targetUri, priv->prefixLen);
+        if (name) {
+            g_string_append_uri_escaped(priv->targetUri, name, SANDBOX_VFS_URI_RESERVED, true);
+        }
+        g_file_info_set_attribute_string (fileInfo, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI, priv->targetUri->str);
     }
 
     return fileInfo;
@@ -102,67 +193,73 @@ static GFileInfo* sandbox_vfs_file_enumerate_next_file (GFileEnumerator *enumera
 
 static gboolean sandbox_vfs_file_enumerator_close(GFileEnumerator *enumerator, GCancellable *cancellable, GError **error)
 {
-//    FavoritesVFSFileEnumerator *self = VFS_FAVORITES_FILE_ENUMERATOR(enumerator);
+    auto priv = (SandboxVFSFileEnumeratorPrivate*) sandbox_vfs_file_enumerator_get_instance_private(SANDBOX_VFS_FILE_ENUMERATOR(enumerator));
+
+    if (G_IS_FILE_ENUMERATOR(priv->enumerate) && !g_file_enumerator_is_closed(priv->enumerate)) {
+        return g_file_enumerator_close(priv->enumerate, cancellable, error);
+    }
 
     return true;
 }
 
-static void sandbox_favorites_file_enumerator_next_files_async (GFileEnumerator* enumerator, int num_files, int io_priority, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data)
+static void sandbox_vfs_file_enumerator_next_files_async (GFileEnumerator* enumerator, int numFiles, int ioPriority, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer udata)
 {
-    GTask* task = g_task_new (enumerator, cancellable, callback, user_data);
-    g_task_set_source_tag (task, (gpointer) sandbox_favorites_file_enumerator_next_files_async);
-    g_task_set_task_data (task, GINT_TO_POINTER (num_files), nullptr);
-    g_task_set_priority (task, io_priority);
+    GTask* task = g_task_new (enumerator, cancellable, callback, udata);
+    g_task_set_source_tag (task, (gpointer) sandbox_vfs_file_enumerator_next_files_async);
+    g_task_set_task_data (task, GINT_TO_POINTER (numFiles), nullptr);
+    g_task_set_priority (task, ioPriority);
 
-//    g_task_run_in_thread (task, next_files_thread);
+    g_task_run_in_thread (task, sandbox_vfs_file_enumerator_next_files_thread);
 
-    if (task) {
-        g_object_unref (task);
-    }
+    g_object_unref (task);
 }
 
-static GList* sandbox_vfs_file_enumerator_next_files_finished(GFileEnumerator* enumerator, GAsyncResult* result, GError** error)
+static GList* sandbox_vfs_file_enumerator_next_files_finish(GFileEnumerator* enumerator, GAsyncResult* result, GError** error)
 {
     g_return_val_if_fail (g_task_is_valid (result, enumerator), NULL);
 
     return (GList*)g_task_propagate_pointer (G_TASK (result), error);
 }
 
-static void next_files_thread (GTask* task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+static void next_async_op_free (GList *files)
+{
+    if (files) {
+        g_list_free_full (files, g_object_unref);
+    }
+}
+
+/**
+ * 在 GIO 线程池里一次取出 numFiles 个条目。
+ * GFileEnumerator 保证同一时刻只有一个未完成的操作，这里不需要加锁
+ */
+static void sandbox_vfs_file_enumerator_next_files_thread (GTask* task, gpointer sourceObject, gpointer taskData, GCancellable *cancellable)
 {
-    auto enumerator = G_FILE_ENUMERATOR(source_object);
-    int num_files = GPOINTER_TO_INT (task_data);
+    auto enumerator = G_FILE_ENUMERATOR(sourceObject);
+    int numFiles = GPOINTER_TO_INT (taskData);
 
-    int i = 0;
     GList *files = nullptr;
     GError *error = nullptr;
-    GFileInfo *info = nullptr;
-    GFileEnumeratorClass* c = G_FILE_ENUMERATOR_GET_CLASS (enumerator);
-
-    for (i = 0; i < num_files; ++i) {
-        if (g_cancellable_set_error_if_cancelled (cancellable, &error)) {
-            info = NULL;
-        } else {
-            info = c->next_file (enumerator, cancellable, &error);
-        }
 
+    for (int i = 0; i < numFiles; ++i) {
+        GFileInfo* info = sandbox_vfs_file_enumerate_next_file (enumerator, cancellable, &error);
         if (nullptr == info) {
             break;
-        } else {
-            files = g_list_prepend (files, info);
         }
+        files = g_list_prepend (files, info);
     }
 
-    if (error) {
+    // 已经取到的先交出去，错误留给下一次调用再报告(被取消除外)
+    if (error && (!files || g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))) {
+        next_async_op_free (files);
         g_task_return_error (task, error);
-    } else {
-//        g_task_return_pointer (task, files, (GDestroyNotify) next_async_op_free);
+        return;
     }
-}
 
-static void next_async_op_free (GList *files)
-{
-    if (files) {
-        g_list_free_full (files, g_object_unref);
+    if (error) {
+        auto priv = (SandboxVFSFileEnumeratorPrivate*) sandbox_vfs_file_enumerator_get_instance_private(SANDBOX_VFS_FILE_ENUMERATOR(enumerator));
+        g_clear_error(&priv->pendingError);
+        priv->pendingError = error;
     }
+
+    g_task_return_pointer (task, g_list_reverse (files), (GDestroyNotify) next_async_op_free);
 }
@@ -23,6 +23,8 @@ struct _SandboxVFSFileEnumerator
     GFileEnumerator                     parent_instance;
 };
 
+GFileEnumerator*    sandbox_vfs_file_enumerator_new     (GFile* container, const char* attributes, GFileQueryInfoFlags flags);
+
 
 G_END_DECLS
 
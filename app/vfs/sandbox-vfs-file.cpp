@@ -9,10 +9,12 @@
 #include <QDebug>
 
 #include <glib.h>
+#include <string.h>
 #include <QDir>
 
 #include "../utils.h"
 #include "../clib/c/log.h"
+#include "sandbox-vfs-info-cache.h"
 #include "sandbox-vfs-file-enumerator.h"
 
 typedef struct SandboxVFSFilePrivate   SandboxVFSFilePrivate;
@@ -36,6 +38,7 @@ G_DEFINE_TYPE_EXTENDED(SandboxVFSFile, sandbox_vfs_file, G_TYPE_OBJECT, 0, G_ADD
 static void sandbox_vfs_file_dispose    (GObject* obj);
 static void sandbox_vfs_file_init       (SandboxVFSFile* self);
 static void sandbox_vfs_file_class_init (SandboxVFSFileClass* klass);
+static GFile* sandbox_vfs_file_get_real (GFile* file);
 
 
 GFile*      sandbox_vfs_file_dup                (GFile* file);
@@ -76,15 +79,13 @@ GFileEnumerator* sandbox_vfs_file_enumerate_children(GFile *file, const char *at
 {
     g_return_val_if_fail(SANDBOX_VFS_IS_FILE (file), nullptr);
 
-    (void) flags;
     (void) error;
     (void) cancel;
-    (void) attribute;
 
     char* uri = g_file_get_uri(file);
     if (g_str_has_prefix(uri, "sandbox://")) {
         g_free(uri);
-        return G_FILE_ENUMERATOR(g_object_new (SANDBOX_VFS_FILE_ENUMERATOR_TYPE, "container", file, nullptr));
+        return sandbox_vfs_file_enumerator_new (file, attribute, flags);
     }
 
     if (uri) { g_free(uri); }
@@ -126,31 +127,60 @@ GFile* sandbox_vfs_file_dup (GFile* file)
 
 gboolean sandbox_vfs_file_move (GFile* src, GFile* dest, GFileCopyFlags flags, GCancellable* cancel, GFileProgressCallback progress, gpointer udata, GError** error)
 {
-    if (error) {
-        *error = g_error_new (G_FILE_ERROR_FAILED, G_IO_ERROR_NOT_SUPPORTED, "不支持");
-    }
+    g_return_val_if_fail(G_IS_FILE (src) && G_IS_FILE (dest), false);
+
+    g_autoptr(GFile) realSrc = sandbox_vfs_file_get_real (src);
+    g_autoptr(GFile) realDest = sandbox_vfs_file_get_real (dest);
+
+    g_autofree char* srcUri = g_file_get_uri (realSrc);
+    g_autofree char* destUri = g_file_get_uri (realDest);
+    C_LOG_DEBUG("move: %s -> %s", srcUri, destUri);
+
+    gboolean ret = g_file_move (realSrc, realDest, flags, cancel, progress, udata, error);
+
+    // 源不再存在，目标可能覆盖了旧文件，失败时也可能已经部分完成
+    sandbox_vfs_info_cache_invalidate (realSrc);
+    sandbox_vfs_info_cache_invalidate (realDest);
 
-    return FALSE;
+    return ret;
 }
 
 gboolean sandbox_vfs_file_copy (GFile* src, GFile* dest, GFileCopyFlags flags, GCancellable* cancel, GFileProgressCallback progress, gpointer udata, GError** error)
 {
     g_return_val_if_fail(G_IS_FILE (src) && G_IS_FILE (dest), false);
 
-return true;
-    g_autofree char* path = g_file_get_uri (src);
+    g_autoptr(GFile) realSrc = sandbox_vfs_file_get_real (src);
+    g_autoptr(GFile) realDest = sandbox_vfs_file_get_real (dest);
 
+    g_autofree char* srcUri = g_file_get_uri (realSrc);
+    g_autofree char* destUri = g_file_get_uri (realDest);
+    C_LOG_DEBUG("copy: %s -> %s", srcUri, destUri);
 
+    gboolean ret = g_file_copy (realSrc, realDest, flags, cancel, progress, udata, error);
 
-    qInfo() << "[COPY] " << g_file_get_uri(src) << " -- " << g_file_get_uri (dest);
+    // 覆盖时目标的大小、时间、类型都变了，失败时也可能留下了部分内容
+    sandbox_vfs_info_cache_invalidate (realDest);
 
-    QString pathT = QString("file://%1").arg (path);
-    pathT = pathT.replace ("sandbox://", SANDBOX_MOUNT_POINT);
+    return ret;
+}
+
+/**
+ * sandbox:// 对应沙盒挂载点下的真实文件，其它 GFile(宿主机文件)原样返回
+ */
+static GFile* sandbox_vfs_file_get_real (GFile* file)
+{
+    if (!SANDBOX_VFS_IS_FILE (file)) {
+        return G_FILE(g_object_ref (file));
+    }
 
-    g_autoptr(GFile) target = g_file_new_for_uri (pathT.toUtf8().constData());      // 备份文件对象
+    auto* priv = (SandboxVFSFilePrivate*) sandbox_vfs_file_get_instance_private (SANDBOX_VFS_FILE(file));
 
+    QString trueUri = QString(priv->uri).replace ("sandbox://", SANDBOX_MOUNT_POINT);
+    if (!trueUri.startsWith ("file://")) {
+        trueUri = "file://" + trueUri;
+    }
 
-    return g_file_copy (src, target, (GFileCopyFlags) (flags | G_FILE_COPY_OVERWRITE), cancel, progress, udata, error);
+    return g_file_new_for_uri (trueUri.toUtf8().constData());
 }
 
 
@@ -237,8 +267,12 @@ GFileInfo* sandbox_vfs_file_query_info (GFile* fileT, const char* attr, GFileQue
 
     auto* priv = (SandboxVFSFilePrivate*) sandbox_vfs_file_get_instance_private (SANDBOX_VFS_FILE(fileT));
 
+    GFileInfo* info = sandbox_vfs_info_cache_lookup (priv->uri, attr, flags);
+    if (info) {
+        return info;
+    }
+
     QUrl url (priv->uri);
-    GFileInfo* info = nullptr;
     QString trueUri = nullptr;
     if ("sandbox:///" == url.toString ()) {
         trueUri = SANDBOX_MOUNT_POINT;
@@ -252,18 +286,19 @@ GFileInfo* sandbox_vfs_file_query_info (GFile* fileT, const char* attr, GFileQue
     }
     g_return_val_if_fail(!trueUri.isEmpty(), nullptr);
 
+    // 只取调用者要的属性，另外带上 standard::type，省掉一次 stat
+    g_autofree char* realAttr = (!attr || !attr[0] || strstr(attr, "*")) ? g_strdup("*")
+                                : g_strdup_printf ("%s," G_FILE_ATTRIBUTE_STANDARD_TYPE, attr);
+
     g_autoptr(GFile) file = g_file_new_for_uri (trueUri.toUtf8().constData());
-    if (G_IS_FILE(file)) {
-        info = g_file_info_new();
-        g_autoptr(GFileInfo) fileInfo = g_file_query_info (file, attr, flags, cancel, error);
-        g_file_info_copy_into (fileInfo, info);
+    g_return_val_if_fail(G_IS_FILE(file), nullptr);
+
+    info = g_file_query_info (file, realAttr, flags, cancel, error);
+    if (!G_IS_FILE_INFO (info)) {
+        return nullptr;
     }
-    g_return_val_if_fail(G_IS_FILE_INFO (info), nullptr);
 
-    g_autofree char* path = g_file_get_path (file);
-    QFile fileQ(path);
-    QFileInfo fileInfoQ(fileQ);
-    if (fileInfoQ.isDir()) {
+    if (G_FILE_TYPE_DIRECTORY == g_file_info_get_file_type (info)) {
         g_file_info_set_attribute_uint32 (info, G_FILE_ATTRIBUTE_STANDARD_TYPE, G_FILE_TYPE_DIRECTORY);
     }
     else {
@@ -277,12 +312,14 @@ GFileInfo* sandbox_vfs_file_query_info (GFile* fileT, const char* attr, GFileQue
     g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_RENAME, false);
     g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI, trueUri.toUtf8().constData());
 
+    sandbox_vfs_info_cache_insert (priv->uri, attr, flags, file, info);
+
     return info;
 }
 
 char* sandbox_vfs_file_get_basename (GFile* file)
 {
-    g_autoptr(GFileInfo) fileInfo = g_file_query_info (file, "*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
+    g_autoptr(GFileInfo) fileInfo = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
 
     g_autofree char* uri = g_file_info_get_attribute_as_string (fileInfo, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
     if (uri) {
@@ -314,12 +351,15 @@ gboolean sandbox_vfs_file_delete (GFile* file, GCancellable* cancel, GError** er
         C_LOG_DEBUG("delete file: %s", pathT.toUtf8().constData());
         g_autoptr(GFile) target = g_file_new_for_path (pathT.toUtf8().constData());
         ret = g_file_delete (target, cancel, error);
+        sandbox_vfs_info_cache_invalidate (target);
     }
     else {
         QDir dir(pathT.replace ("file://", ""));
         qDebug() << dir << dir.removeRecursively();
         fileInfo.dir().rmdir(fileInfo.fileName());
         fileInfo.dir().rmpath (pathT);
+        g_autoptr(GFile) target = g_file_new_for_path (pathT.toUtf8().constData());
+        sandbox_vfs_info_cache_invalidate (target);
     }
 
     return ret;
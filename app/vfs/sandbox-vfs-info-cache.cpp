@@ -0,0 +1,230 @@
+//
+// Created by dingjing on 11/26/24.
+//
+#include "sandbox-vfs-info-cache.h"
+
+#include "../../3thrd/clib/c/clib.h"
+
+#define SANDBOX_VFS_INFO_CACHE_MAX              4096
+#define SANDBOX_VFS_INFO_CACHE_TTL              (2 * G_USEC_PER_SEC)
+
+typedef struct _CacheEntry                      CacheEntry;
+typedef struct _DirWatch                        DirWatch;
+
+struct _CacheEntry
+{
+    char*               key;
+    char*               name;                   // 真实文件名，目录监控按名字失效
+    DirWatch*           dir;
+    GFileInfo*          info;
+    gint64              expire;
+    GList*              link;                   // 在 gsCache.order 中的位置
+};
+
+struct _DirWatch
+{
+    char*               uri;                    // 真实文件所在目录
+    GFileMonitor*       monitor;
+    GHashTable*         entries;                // key -> CacheEntry*，只借用
+};
+
+static struct
+{
+    GMutex              lock;
+    GHashTable*         entries;                // key -> CacheEntry*
+    GHashTable*         dirs;                   // dir uri -> DirWatch*
+    GQueue              order;                  // 插入顺序，头部最旧
+} gsCache;
+
+
+static void     cache_init              (void);
+static char*    cache_make_key          (const char* uri, const char* attributes, GFileQueryInfoFlags flags);
+static void     cache_remove_entry      (CacheEntry* entry);
+static void     cache_dir_changed       (GFileMonitor* monitor, GFile* file, GFile* other, GFileMonitorEvent event, gpointer udata);
+static DirWatch* cache_get_dir          (GFile* realFile);
+
+
+GFileInfo* sandbox_vfs_info_cache_lookup (const char* uri, const char* attributes, GFileQueryInfoFlags flags)
+{
+    g_return_val_if_fail(uri, nullptr);
+
+    cache_init();
+
+    GFileInfo* info = nullptr;
+    g_autofree char* key = cache_make_key(uri, attributes, flags);
+
+    g_mutex_lock(&gsCache.lock);
+    auto entry = (CacheEntry*) g_hash_table_lookup(gsCache.entries, key);
+    if (entry) {
+        if (entry->expire > g_get_monotonic_time()) {
+            info = g_file_info_dup(entry->info);
+        }
+        else {
+            cache_remove_entry(entry);
+        }
+    }
+    g_mutex_unlock(&gsCache.lock);
+
+    return info;
+}
+
+void sandbox_vfs_info_cache_insert (const char* uri, const char* attributes, GFileQueryInfoFlags flags, GFile* realFile, GFileInfo* info)
+{
+    g_return_if_fail(uri && G_IS_FILE(realFile) && G_IS_FILE_INFO(info));
+
+    cache_init();
+
+    char* key = cache_make_key(uri, attributes, flags);
+
+    g_mutex_lock(&gsCache.lock);
+    auto old = (CacheEntry*) g_hash_table_lookup(gsCache.entries, key);
+    if (old) {
+        cache_remove_entry(old);
+    }
+
+    DirWatch* dir = cache_get_dir(realFile);
+    if (!dir) {
+        g_mutex_unlock(&gsCache.lock);
+        g_free(key);
+        return;
+    }
+
+    auto entry = g_new0(CacheEntry, 1);
+    entry->key = key;
+    entry->name = g_file_get_basename(realFile);
+    entry->dir = dir;
+    entry->info = g_file_info_dup(info);
+    entry->expire = g_get_monotonic_time() + SANDBOX_VFS_INFO_CACHE_TTL;
+
+    g_queue_push_tail(&gsCache.order, entry);
+    entry->link = gsCache.order.tail;
+    g_hash_table_insert(gsCache.entries, entry->key, entry);
+    g_hash_table_insert(dir->entries, entry->key, entry);
+
+    while (g_queue_get_length(&gsCache.order) > SANDBOX_VFS_INFO_CACHE_MAX) {
+        cache_remove_entry((CacheEntry*) g_queue_peek_head(&gsCache.order));
+    }
+    g_mutex_unlock(&gsCache.lock);
+}
+
+void sandbox_vfs_info_cache_invalidate (GFile* realFile)
+{
+    g_return_if_fail(G_IS_FILE(realFile));
+
+    cache_init();
+
+    g_autoptr(GFile) parent = g_file_get_parent(realFile);
+    g_autofree char* dirUri = parent ? g_file_get_uri(parent) : nullptr;
+    g_autofree char* name = g_file_get_basename(realFile);
+    g_return_if_fail(dirUri && name);
+
+    g_mutex_lock(&gsCache.lock);
+    auto dir = (DirWatch*) g_hash_table_lookup(gsCache.dirs, dirUri);
+    if (dir) {
+        // 删除条目时 dir 可能随最后一个条目一起释放，先收集
+        GList* victims = nullptr;
+        GHashTableIter iter;
+        gpointer value = nullptr;
+        g_hash_table_iter_init(&iter, dir->entries);
+        while (g_hash_table_iter_next(&iter, nullptr, &value)) {
+            if (0 == g_strcmp0(((CacheEntry*) value)->name, name)) {
+                victims = g_list_prepend(victims, value);
+            }
+        }
+        for (GList* l = victims; l; l = l->next) {
+            cache_remove_entry((CacheEntry*) l->data);
+        }
+        g_list_free(victims);
+    }
+    g_mutex_unlock(&gsCache.lock);
+}
+
+static void cache_init (void)
+{
+    static gsize init = 0;
+
+    if (g_once_init_enter(&init)) {
+        g_mutex_init(&gsCache.lock);
+        g_queue_init(&gsCache.order);
+        gsCache.entries = g_hash_table_new(g_str_hash, g_str_equal);
+        gsCache.dirs = g_hash_table_new(g_str_hash, g_str_equal);
+        g_once_init_leave(&init, 1);
+    }
+}
+
+static char* cache_make_key (const char* uri, const char* attributes, GFileQueryInfoFlags flags)
+{
+    return g_strdup_printf("%s\n%s\n%u", uri, attributes ? attributes : "*", (unsigned) flags);
+}
+
+// 持锁调用
+static void cache_remove_entry (CacheEntry* entry)
+{
+    DirWatch* dir = entry->dir;
+
+    g_hash_table_remove(gsCache.entries, entry->key);
+    g_hash_table_remove(dir->entries, entry->key);
+    g_queue_delete_link(&gsCache.order, entry->link);
+
+    // 目录下已经没有缓存了，不再监控
+    if (0 == g_hash_table_size(dir->entries)) {
+        g_hash_table_remove(gsCache.dirs, dir->uri);
+        g_signal_handlers_disconnect_by_func(dir->monitor, (gpointer) cache_dir_changed, nullptr);
+        g_file_monitor_cancel(dir->monitor);
+        g_object_unref(dir->monitor);
+        g_hash_table_unref(dir->entries);
+        g_free(dir->uri);
+        g_free(dir);
+    }
+
+    g_object_unref(entry->info);
+    g_free(entry->name);
+    g_free(entry->key);
+    g_free(entry);
+}
+
+// 持锁调用
+static DirWatch* cache_get_dir (GFile* realFile)
+{
+    g_autoptr(GFile) parent = g_file_get_parent(realFile);
+    g_return_val_if_fail(parent, nullptr);
+
+    g_autofree char* dirUri = g_file_get_uri(parent);
+    auto dir = (DirWatch*) g_hash_table_lookup(gsCache.dirs, dirUri);
+    if (dir) {
+        return dir;
+    }
+
+    /**
+     * 监控事件在创建时的 thread-default 上下文中派发。GIO 线程池里的线程没有 thread-default 上下文，
+     * 事件落到全局默认上下文，由主线程派发；全局默认上下文归主线程所有，不能在工作线程上 push
+     */
+    GFileMonitor* monitor = g_file_monitor_directory(parent, G_FILE_MONITOR_NONE, nullptr, nullptr);
+    if (!monitor) {
+        return nullptr;
+    }
+
+    dir = g_new0(DirWatch, 1);
+    dir->uri = g_strdup(dirUri);
+    dir->monitor = monitor;
+    dir->entries = g_hash_table_new(g_str_hash, g_str_equal);
+    g_signal_connect(monitor, "changed", G_CALLBACK(cache_dir_changed), nullptr);
+    g_hash_table_insert(gsCache.dirs, dir->uri, dir);
+
+    return dir;
+}
+
+static void cache_dir_changed (GFileMonitor* monitor, GFile* file, GFile* other, GFileMonitorEvent event, gpointer udata)
+{
+    (void) udata;
+    (void) event;
+    (void) monitor;
+
+    if (file) {
+        sandbox_vfs_info_cache_invalidate(file);
+    }
+
+    if (other) {
+        sandbox_vfs_info_cache_invalidate(other);
+    }
+}
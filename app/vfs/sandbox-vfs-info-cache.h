@@ -0,0 +1,23 @@
+//
+// Created by dingjing on 11/26/24.
+//
+
+#ifndef SANDBOX_VFS_INFO_CACHE_H
+#define SANDBOX_VFS_INFO_CACHE_H
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * sandbox:// 的 query_info 结果缓存
+ *  - 键为 uri + 属性列表 + flags，条目数有上限，超出按插入顺序淘汰
+ *  - 条目只保存很短时间，另外对真实文件所在目录建 GFileMonitor，有变化立即失效
+ *  - 取出的是副本，调用者可以随意修改
+ */
+GFileInfo*          sandbox_vfs_info_cache_lookup       (const char* uri, const char* attributes, GFileQueryInfoFlags flags);
+void                sandbox_vfs_info_cache_insert       (const char* uri, const char* attributes, GFileQueryInfoFlags flags, GFile* realFile, GFileInfo* info);
+void                sandbox_vfs_info_cache_invalidate   (GFile* realFile);
+
+G_END_DECLS
+
+#endif
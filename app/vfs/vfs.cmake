@@ -2,4 +2,5 @@ file(GLOB VFS_SRC
         ${CMAKE_SOURCE_DIR}/app/vfs/vfs-manager.cpp                     ${CMAKE_SOURCE_DIR}/app/vfs/vfs-manager.h
         ${CMAKE_SOURCE_DIR}/app/vfs/sandbox-vfs-file.cpp                ${CMAKE_SOURCE_DIR}/app/vfs/sandbox-vfs-file.h
         ${CMAKE_SOURCE_DIR}/app/vfs/sandbox-vfs-file-enumerator.cpp     ${CMAKE_SOURCE_DIR}/app/vfs/sandbox-vfs-file-enumerator.h
+        ${CMAKE_SOURCE_DIR}/app/vfs/sandbox-vfs-info-cache.cpp          ${CMAKE_SOURCE_DIR}/app/vfs/sandbox-vfs-info-cache.h
 )
\ No newline at end of file
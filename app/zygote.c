@@ -0,0 +1,410 @@
+//
+// Created by dingjing on 12/9/24.
+//
+
+#include "zygote.h"
+
+#include <glib.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "../3thrd/clib/c/clib.h"
+
+#define ZYGOTE_MAGIC                    0x54475a59                  // "YZGT"
+#define ZYGOTE_REPLY_TIMEOUT_MS         3000                        // zygote 只做 fork，超时说明它卡住了
+
+typedef struct
+{
+    uint32_t                magic;
+    uint32_t                argc;
+    uint32_t                envc;
+    uint32_t                len;                                    // 后面字符串的总长度，含 '\0'
+} ZygoteRequest;
+
+typedef struct
+{
+    int32_t                 pid;
+    int32_t                 err;
+} ZygoteReply;
+
+struct _Zygote
+{
+    GMutex                  lock;                                   // 串行化请求和启动/停止
+    char*                   root;
+    ZygoteExecFunc          func;
+    void*                   udata;
+
+    pid_t                   pid;                                    // 0 表示没有运行
+    int                     fd;                                     // 守护进程一端
+};
+
+static void         zygote_kill_locked          (Zygote* zygote);
+static bool         zygote_recv_reply           (int fd, ZygoteReply* reply);
+static void         zygote_send_reply           (int fd, pid_t pid, int err);
+static void         zygote_main                 (Zygote* zygote, int fd);
+static void         zygote_handle               (Zygote* zygote, int fd, char* buf, ssize_t len, const int* fds, int nFds);
+
+
+Zygote* zygote_new(const char* root, ZygoteExecFunc func, void* udata)
+{
+    g_return_val_if_fail(root && func, NULL);
+
+    Zygote* zygote = g_new0(Zygote, 1);
+    g_mutex_init(&zygote->lock);
+    zygote->root = g_strdup(root);
+    zygote->func = func;
+    zygote->udata = udata;
+    zygote->fd = -1;
+
+    return zygote;
+}
+
+bool zygote_start(Zygote* zygote)
+{
+    g_return_val_if_fail(zygote, false);
+
+    g_mutex_lock(&zygote->lock);
+    if (zygote->pid > 0) {
+        g_mutex_unlock(&zygote->lock);
+        return true;
+    }
+
+    int sv[2] = {-1, -1};
+    if (0 != socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+        C_LOG_WARNING("zygote socketpair error: %s", strerror(errno));
+        g_mutex_unlock(&zygote->lock);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        C_LOG_WARNING("zygote fork error: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        g_mutex_unlock(&zygote->lock);
+        return false;
+    }
+    else if (0 == pid) {
+        close(sv[0]);
+        zygote_main(zygote, sv[1]);
+        _exit(0);
+    }
+
+    close(sv[1]);
+    zygote->fd = sv[0];
+    zygote->pid = pid;
+
+    // 等它进入 root
+    ZygoteReply reply = {0};
+    if (!zygote_recv_reply(zygote->fd, &reply) || reply.err) {
+        C_LOG_WARNING("zygote %d start error: %s", pid, strerror(reply.err ? reply.err : errno));
+        zygote_kill_locked(zygote);
+        g_mutex_unlock(&zygote->lock);
+        return false;
+    }
+    g_mutex_unlock(&zygote->lock);
+
+    C_LOG_INFO("zygote %d ready, root: '%s'", pid, zygote->root);
+
+    return true;
+}
+
+void zygote_stop(Zygote* zygote)
+{
+    g_return_if_fail(zygote);
+
+    g_mutex_lock(&zygote->lock);
+    if (zygote->pid > 0) {
+        // 收到 EOF 后自己退出，由 sandbox_clean 回收
+        C_LOG_INFO("zygote %d stop", zygote->pid);
+        close(zygote->fd);
+        zygote->fd = -1;
+        zygote->pid = 0;
+    }
+    g_mutex_unlock(&zygote->lock);
+}
+
+bool zygote_is_running(Zygote* zygote)
+{
+    g_return_val_if_fail(zygote, false);
+
+    g_mutex_lock(&zygote->lock);
+    const bool running = (zygote->pid > 0);
+    g_mutex_unlock(&zygote->lock);
+
+    return running;
+}
+
+bool zygote_reap(Zygote* zygote, pid_t pid)
+{
+    g_return_val_if_fail(zygote, false);
+
+    bool ret = false;
+    g_mutex_lock(&zygote->lock);
+    if (pid > 0 && pid == zygote->pid) {
+        C_LOG_WARNING("zygote %d exited", pid);
+        close(zygote->fd);
+        zygote->fd = -1;
+        zygote->pid = 0;
+        ret = true;
+    }
+    g_mutex_unlock(&zygote->lock);
+
+    return ret;
+}
+
+bool zygote_spawn(Zygote* zygote, const char* const* argv, const char* const* env, const int* fds, int nFds, pid_t* outPid, int* err)
+{
+    g_return_val_if_fail(zygote && argv && argv[0] && fds && nFds > 0 && nFds <= ZYGOTE_FDS_MAX, false);
+
+    ZygoteRequest hdr = { .magic = ZYGOTE_MAGIC };
+    GString* payload = g_string_sized_new(4096);
+    g_string_append_len(payload, (const char*) &hdr, sizeof(hdr));
+    for (; argv[hdr.argc]; ++hdr.argc) {
+        g_string_append_len(payload, argv[hdr.argc], (gssize) strlen(argv[hdr.argc]) + 1);
+    }
+    for (; env && env[hdr.envc]; ++hdr.envc) {
+        g_string_append_len(payload, env[hdr.envc], (gssize) strlen(env[hdr.envc]) + 1);
+    }
+    hdr.len = (uint32_t) (payload->len - sizeof(hdr));
+    memcpy(payload->str, &hdr, sizeof(hdr));
+
+    int error = 0;
+    ZygoteReply reply = { .pid = -1 };
+    if (payload->len > ZYGOTE_MSG_MAX) {
+        error = E2BIG;
+    }
+    else {
+        struct iovec iov = { .iov_base = payload->str, .iov_len = payload->len };
+        char control[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS_MAX)] = {0};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nFds);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nFds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nFds);
+
+        g_mutex_lock(&zygote->lock);
+        if (zygote->pid <= 0) {
+            error = ESRCH;
+        }
+        else if (sendmsg(zygote->fd, &msg, MSG_NOSIGNAL) != (ssize_t) payload->len
+                 || !zygote_recv_reply(zygote->fd, &reply)) {
+            // 半途失败，请求和应答对不上了，只能重启
+            error = errno ? errno : EIO;
+            C_LOG_WARNING("zygote %d does not respond: %s", zygote->pid, strerror(error));
+            zygote_kill_locked(zygote);
+        }
+        else {
+            error = reply.err;
+        }
+        g_mutex_unlock(&zygote->lock);
+    }
+    g_string_free(payload, true);
+
+    if (outPid) { *outPid = (pid_t) reply.pid; }
+    if (err)    { *err = error; }
+
+    return (0 == error && reply.pid > 0);
+}
+
+void zygote_free(Zygote** zygote)
+{
+    g_return_if_fail(zygote && *zygote);
+
+    zygote_stop(*zygote);
+    g_mutex_clear(&(*zygote)->lock);
+    g_free((*zygote)->root);
+    g_free(*zygote);
+    *zygote = NULL;
+}
+
+static void zygote_kill_locked (Zygote* zygote)
+{
+    if (zygote->pid > 0) {
+        kill(zygote->pid, SIGKILL);
+    }
+    if (zygote->fd >= 0) {
+        close(zygote->fd);
+    }
+    zygote->fd = -1;
+    zygote->pid = 0;
+}
+
+static bool zygote_recv_reply (int fd, ZygoteReply* reply)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int ret = 0;
+    do {
+        errno = 0;
+        ret = poll(&pfd, 1, ZYGOTE_REPLY_TIMEOUT_MS);
+    } while (ret < 0 && EINTR == errno);
+
+    if (0 == ret) {
+        errno = ETIMEDOUT;
+        return false;
+    }
+    else if (ret < 0) {
+        return false;
+    }
+
+    ssize_t n = 0;
+    do {
+        errno = 0;
+        n = recv(fd, reply, sizeof(*reply), 0);
+    } while (n < 0 && EINTR == errno);
+
+    if (sizeof(*reply) != n) {
+        errno = n ? (errno ? errno : EPROTO) : ECONNRESET;
+        return false;
+    }
+
+    return true;
+}
+
+static void zygote_send_reply (int fd, pid_t pid, int err)
+{
+    ZygoteReply reply = { .pid = pid, .err = err };
+    ssize_t C_UNUSED ret = send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+static void zygote_main (Zygote* zygote, int fd)
+{
+    // 守护进程的信号处理(杀掉挂载进程等)不能带进来；子进程由内核自动回收，exec 前恢复
+    for (int sig = 1; sig < NSIG; ++sig) {
+        signal(sig, SIG_DFL);
+    }
+    signal(SIGCHLD, SIG_IGN);
+    sigset_t set;
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+
+    errno = 0;
+    if (0 != chdir(zygote->root) || 0 != chroot(zygote->root) || 0 != chdir("/")) {
+        zygote_send_reply(fd, -1, errno ? errno : EIO);
+        return;
+    }
+    zygote_send_reply(fd, getpid(), 0);
+
+    char* buf = malloc(ZYGOTE_MSG_MAX + 1);
+    if (!buf) {
+        return;
+    }
+
+    while (true) {
+        char control[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS_MAX)];
+        struct iovec iov = { .iov_base = buf, .iov_len = ZYGOTE_MSG_MAX };
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        const ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        else if (n <= 0) {
+            // 守护进程关闭或退出
+            break;
+        }
+
+        int fds[ZYGOTE_FDS_MAX];
+        int nFds = 0;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type) {
+                continue;
+            }
+            const int num = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < num; ++i) {
+                int rfd = -1;
+                memcpy(&rfd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (nFds < ZYGOTE_FDS_MAX) {
+                    fds[nFds++] = rfd;
+                }
+                else {
+                    close(rfd);
+                }
+            }
+        }
+
+        zygote_handle(zygote, fd, buf, (msg.msg_flags & MSG_TRUNC) ? -1 : n, fds, nFds);
+
+        for (int i = 0; i < nFds; ++i) {
+            close(fds[i]);
+        }
+    }
+
+    free(buf);
+}
+
+static void zygote_handle (Zygote* zygote, int fd, char* buf, ssize_t len, const int* fds, int nFds)
+{
+    ZygoteRequest hdr;
+    if (len < (ssize_t) sizeof(hdr) || nFds < 1) {
+        zygote_send_reply(fd, -1, EINVAL);
+        return;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (ZYGOTE_MAGIC != hdr.magic || hdr.len != (uint32_t) (len - sizeof(hdr)) || 0 == hdr.argc
+        || (size_t) hdr.argc + hdr.envc > hdr.len) {
+        zygote_send_reply(fd, -1, EINVAL);
+        return;
+    }
+
+    // 单线程进程，可以放心分配内存
+    const char** strs = calloc((size_t) hdr.argc + hdr.envc + 2, sizeof(char*));
+    if (!strs) {
+        zygote_send_reply(fd, -1, ENOMEM);
+        return;
+    }
+
+    buf[len] = '\0';
+    char* p = buf + sizeof(hdr);
+    const char* end = buf + len;
+    bool ok = true;
+    for (uint32_t i = 0; i < hdr.argc + hdr.envc; ++i) {
+        const char* nul = (p < end) ? memchr(p, '\0', end - p) : NULL;
+        if (!nul) {
+            ok = false;
+            break;
+        }
+        // argv 和 env 之间留一个 NULL
+        strs[i < hdr.argc ? i : i + 1] = p;
+        p = (char*) nul + 1;
+    }
+    if (!ok) {
+        free(strs);
+        zygote_send_reply(fd, -1, EINVAL);
+        return;
+    }
+
+    const pid_t pid = fork();
+    if (0 == pid) {
+        close(fd);
+        signal(SIGCHLD, SIG_DFL);
+        for (int i = 1; i < nFds && i <= 3; ++i) {
+            dup2(fds[i], i - 1);
+        }
+        for (int i = 1; i < nFds; ++i) {
+            if (fds[i] > 2) {
+                close(fds[i]);
+            }
+        }
+        zygote->func(strs, strs + hdr.argc + 1, fds[0], zygote->udata);
+        _exit(127);
+    }
+
+    zygote_send_reply(fd, pid, (pid < 0) ? errno : 0);
+    free(strs);
+}
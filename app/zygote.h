@@ -0,0 +1,42 @@
+//
+// Created by dingjing on 12/9/24.
+//
+
+#ifndef sandbox_ZYGOTE_H
+#define sandbox_ZYGOTE_H
+
+/**
+ * 预先 fork 好的启动进程: 已经 chroot 到沙盒 rootfs，单线程，保留守护进程准备好的公共环境，
+ * 通过 socketpair(SOCK_SEQPACKET) 接收启动请求后直接 fork + exec，
+ * 不必每次都从多线程的守护进程 fork 再 chroot。
+ *
+ * 请求: ZygoteRequest + argv 和环境变量增量('\0' 分隔)，SCM_RIGHTS 附带 fd:
+ *       fds[0] 为 exec 通知管道的写端，fds[1..3] 有的话成为子进程的 0/1/2
+ * 应答: ZygoteReply，pid 为新进程，失败时 pid 为 -1、err 为 errno；exec 的结果仍由通知管道报告
+ *
+ * rootfs 挂载变化(挂载进程退出重挂)后要 zygote_stop 再重新 zygote_start。
+ */
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define ZYGOTE_FDS_MAX                  4
+#define ZYGOTE_MSG_MAX                  (64 * 1024)
+
+typedef struct _Zygote                  Zygote;
+
+/**
+ * @brief 在 zygote fork 出的子进程里调用，不应返回(返回后子进程以 127 退出)
+ * @param env 客户端发来的环境变量增量，由回调和公共环境合并
+ */
+typedef void (*ZygoteExecFunc)          (const char* const* argv, const char* const* env, int notifyFd, void* udata);
+
+Zygote*     zygote_new                  (const char* root, ZygoteExecFunc func, void* udata);
+bool        zygote_start                (Zygote* zygote);                                       // fork 出 zygote 进程并进入 root
+void        zygote_stop                 (Zygote* zygote);
+bool        zygote_is_running           (Zygote* zygote);
+bool        zygote_reap                 (Zygote* zygote, pid_t pid);                            // pid 为 zygote 进程时标记为已退出
+bool        zygote_spawn                (Zygote* zygote, const char* const* argv, const char* const* env,
+                                         const int* fds, int nFds, pid_t* outPid, int* err);
+void        zygote_free                 (Zygote** zygote);
+
+#endif // sandbox_ZYGOTE_H
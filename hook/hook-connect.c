@@ -1,94 +1,441 @@
 //
 // Created by dingjing on 11/4/24.
 //
-#include <stdio.h>
+// 沙盒内进程的 connect/sendto/sendmsg/sendmmsg 拦截: 按守护进程下发的策略放行或拒绝，需要审计的记到本进程的环形队列
+// 快速路径上没有堆分配和 stdio，进程信息只在启动(和 fork)时取一次
+//
+#include "hook-connect.h"
+
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
-#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
 
+#define HOOK_POLICY_RETRY_SEC       1                           // 守护进程还没发布策略时，最多每秒重试一次映射
+#define HOOK_SEQ_RETRY_MAX          64                          // 策略一直在更新时最多重试次数，之后按默认策略
+
 typedef int(*ConnectPtr)(int sockfd, const struct sockaddr* addr, socklen_t addrlen);
+typedef ssize_t(*SendtoPtr)(int sockfd, const void* buf, size_t len, int flags, const struct sockaddr* addr, socklen_t addrlen);
+typedef ssize_t(*SendmsgPtr)(int sockfd, const struct msghdr* msg, int flags);
+typedef int(*SendmmsgPtr)(int sockfd, struct mmsghdr* msgvec, unsigned int vlen, int flags);
+
+typedef struct
+{
+    uint8_t                 family;
+    uint16_t                port;
+    uint8_t                 addr[16];
+} HookAddr;
+
+static ConnectPtr               gsConnect = NULL;
+static SendtoPtr                gsSendto = NULL;
+static SendmsgPtr               gsSendmsg = NULL;
+static SendmmsgPtr              gsSendmmsg = NULL;
 
-ConnectPtr connectPtr = NULL;
+static char                     gsExe[HOOK_CONNECT_EXE_MAX];
+static const HookConnectPolicy* gsPolicy = NULL;                // 只读映射，原子读写
+static HookConnectRing*         gsRing = NULL;
+static time_t                   gsPolicyRetry = 0;
 
 void hook_connect_init() __attribute__((constructor()));
 void hook_connect_cleanup() __attribute__((destructor()));
 
-int connect (int sockfd, const struct sockaddr* addr, socklen_t addrlen)
+
+static void hook_resolve (void)
 {
-    if (!connectPtr) {
-        printf("connectPtr is null!\n");
-        return -1;
+    // 别的库的构造函数可能先于本库调用 connect
+    if (!__atomic_load_n(&gsConnect, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&gsSendto, (SendtoPtr) dlsym(RTLD_NEXT, "sendto"), __ATOMIC_RELAXED);
+        __atomic_store_n(&gsSendmsg, (SendmsgPtr) dlsym(RTLD_NEXT, "sendmsg"), __ATOMIC_RELAXED);
+        __atomic_store_n(&gsSendmmsg, (SendmmsgPtr) dlsym(RTLD_NEXT, "sendmmsg"), __ATOMIC_RELAXED);
+        __atomic_store_n(&gsConnect, (ConnectPtr) dlsym(RTLD_NEXT, "connect"), __ATOMIC_RELEASE);
+    }
+}
+
+static void hook_map_policy (void)
+{
+    int fd = open(HOOK_CONNECT_POLICY_PATH, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    void* ptr = MAP_FAILED;
+    if (0 == fstat(fd, &st) && st.st_size >= (off_t) sizeof(HookConnectPolicy)) {
+        ptr = mmap(NULL, sizeof(HookConnectPolicy), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (MAP_FAILED == ptr) {
+        return;
+    }
+
+    if (HOOK_CONNECT_POLICY_MAGIC != ((const HookConnectPolicy*) ptr)->magic) {
+        munmap(ptr, sizeof(HookConnectPolicy));
+        return;
+    }
+
+    const HookConnectPolicy* expected = NULL;
+    if (!__atomic_compare_exchange_n(&gsPolicy, &expected, (const HookConnectPolicy*) ptr,
+                                     false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        munmap(ptr, sizeof(HookConnectPolicy));
+    }
+}
+
+static const HookConnectPolicy* hook_get_policy (void)
+{
+    const HookConnectPolicy* policy = __atomic_load_n(&gsPolicy, __ATOMIC_ACQUIRE);
+    if (policy) {
+        return policy;
+    }
+
+    // 粗粒度时钟走 vDSO，不进内核
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    time_t retry = __atomic_load_n(&gsPolicyRetry, __ATOMIC_RELAXED);
+    if (now.tv_sec < retry
+        || !__atomic_compare_exchange_n(&gsPolicyRetry, &retry, now.tv_sec + HOOK_POLICY_RETRY_SEC,
+                                        false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    hook_map_policy();
+
+    return __atomic_load_n(&gsPolicy, __ATOMIC_ACQUIRE);
+}
+
+static void hook_create_ring (void)
+{
+    char path[HOOK_CONNECT_RING_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%u/%s%d", HOOK_CONNECT_RING_DIR, (unsigned) geteuid(), HOOK_CONNECT_RING_PREFIX, getpid());
+
+    // 同 pid 的旧文件(exec 前或 pid 复用)里可能还有没取走的事件，不能截断也不能直接删，改名留给守护进程取空后删除
+    struct stat st;
+    if (0 == lstat(path, &st)) {
+        char old[HOOK_CONNECT_RING_PATH_MAX];
+        snprintf(old, sizeof(old), "%s.%llu", path, (unsigned long long) st.st_ino);
+        if (0 != rename(path, old)) {
+            unlink(path);
+        }
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        return;
+    }
+
+    void* ptr = MAP_FAILED;
+    if (0 == ftruncate(fd, sizeof(HookConnectRing))) {
+        ptr = mmap(NULL, sizeof(HookConnectRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (MAP_FAILED == ptr) {
+        unlink(path);
+        return;
+    }
+
+    HookConnectRing* ring = (HookConnectRing*) ptr;
+    ring->pid = getpid();
+    memcpy(ring->exe, gsExe, sizeof(ring->exe));
+    for (uint64_t i = 0; i < HOOK_CONNECT_RING_SLOTS; ++i) {
+        ring->slots[i].seq = i;
+    }
+    __atomic_store_n(&ring->magic, HOOK_CONNECT_RING_MAGIC, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&gsRing, ring, __ATOMIC_RELEASE);
+}
+
+static void hook_after_fork (void)
+{
+    // 子进程和父进程共享同一块映射，换成自己的队列
+    HookConnectRing* ring = __atomic_exchange_n(&gsRing, NULL, __ATOMIC_ACQ_REL);
+    if (ring) {
+        munmap(ring, sizeof(HookConnectRing));
+    }
+    hook_create_ring();
+}
+
+static bool hook_parse_addr (const struct sockaddr* addr, socklen_t addrLen, HookAddr* out)
+{
+    if (!addr || addrLen < (socklen_t) sizeof(sa_family_t)) {
+        return false;
+    }
+
+    if (AF_INET == addr->sa_family && addrLen >= (socklen_t) sizeof(struct sockaddr_in)) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*) addr;
+        out->family = AF_INET;
+        out->port = ntohs(in->sin_port);
+        memset(out->addr, 0, sizeof(out->addr));
+        memcpy(out->addr, &in->sin_addr, 4);
+        return true;
+    }
+
+    if (AF_INET6 == addr->sa_family && addrLen >= (socklen_t) sizeof(struct sockaddr_in6)) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*) addr;
+        out->port = ntohs(in6->sin6_port);
+        memset(out->addr, 0, sizeof(out->addr));
+        // ::ffff:a.b.c.d 按 IPv4 规则匹配
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            out->family = AF_INET;
+            memcpy(out->addr, &in6->sin6_addr.s6_addr[12], 4);
+        }
+        else {
+            out->family = AF_INET6;
+            memcpy(out->addr, &in6->sin6_addr, 16);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+static inline bool hook_rule_match (const HookConnectRule* rule, const HookAddr* addr, int proto)
+{
+    if ((rule->family && rule->family != addr->family)
+        || (rule->proto && rule->proto != proto)
+        || addr->port < rule->portMin || addr->port > rule->portMax) {
+        return false;
+    }
+
+    const int maxBits = (AF_INET == addr->family) ? 32 : 128;
+    const int bits = (rule->prefixLen < maxBits) ? rule->prefixLen : maxBits;
+    const int bytes = bits / 8;
+    if (bytes && 0 != memcmp(rule->addr, addr->addr, bytes)) {
+        return false;
     }
 
-#define BUF_SIZE 2048
-    int ret = 0;
-    int port = 0;
-    sa_family_t family = addr->sa_family;
+    const int rest = bits % 8;
+    if (rest) {
+        const uint8_t mask = (uint8_t) (0xFF << (8 - rest));
+        if ((rule->addr[bytes] ^ addr->addr[bytes]) & mask) {
+            return false;
+        }
+    }
 
-    printf ("family: '%u'\n", family);
+    return true;
+}
 
-    char* buf1 = (char*) malloc (BUF_SIZE);
-    if (!buf1) {
-        ret = -1;
-        goto err;
+static int hook_socket_proto (int sockfd)
+{
+    int type = 0;
+    socklen_t len = sizeof(type);
+    if (0 != getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &len)) {
+        return 0;
     }
 
-    char* buf2 = (char*) malloc (BUF_SIZE);
-    if (!buf2) {
-        ret = -1;
-        goto err;
+    return (SOCK_STREAM == type) ? IPPROTO_TCP : ((SOCK_DGRAM == type) ? IPPROTO_UDP : 0);
+}
+
+static void hook_audit (const HookAddr* addr, int proto, int action, HookConnectCall call)
+{
+    HookConnectRing* ring = __atomic_load_n(&gsRing, __ATOMIC_ACQUIRE);
+    if (!ring) {
+        return;
+    }
+
+    const uint64_t mask = HOOK_CONNECT_RING_SLOTS - 1;
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    HookConnectEvent* ev = NULL;
+    while (true) {
+        ev = &ring->slots[pos & mask];
+        const uint64_t seq = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+        const int64_t diff = (int64_t) (seq - pos);
+        if (0 == diff) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // 守护进程来不及取
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
     }
 
-    memset(buf1, 0, BUF_SIZE);
-    memset(buf2, 0, BUF_SIZE);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    ev->time = (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+    ev->family = addr->family;
+    ev->proto = (uint8_t) proto;
+    ev->action = (uint8_t) action;
+    ev->call = (uint8_t) call;
+    ev->port = addr->port;
+    ev->reserved = 0;
+    memcpy(ev->addr, addr->addr, sizeof(ev->addr));
+
+    __atomic_store_n(&ev->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return 0 放行；-1 拒绝，errno 为 EACCES
+ */
+static int hook_check (int sockfd, const struct sockaddr* sa, socklen_t saLen, int proto, HookConnectCall call)
+{
+    HookAddr addr;
+    if (!hook_parse_addr(sa, saLen, &addr)) {
+        // AF_UNIX/AF_NETLINK 等不管
+        return 0;
+    }
 
-    // process
-    if (0 >= readlink("/proc/self/exe", buf1, BUF_SIZE - 1)) {
-        ret = -1;
-        printf("readlink error!\n");
-        goto err;
+    const HookConnectPolicy* policy = hook_get_policy();
+    if (!policy) {
+        return 0;
     }
 
-    printf ("process[%d]: '%s'\n", getpid(), buf1);
+    int action = HOOK_CONNECT_ALLOW;
+    uint32_t audit = 0;
+    for (int tries = 0; ; ++tries) {
+        const uint32_t seq = __atomic_load_n(&policy->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            if (tries >= HOOK_SEQ_RETRY_MAX) {
+                action = HOOK_CONNECT_ALLOW;
+                audit = 0;
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+
+        if (!proto && (policy->flags & HOOK_CONNECT_POLICY_NEED_PROTO)) {
+            proto = hook_socket_proto(sockfd);
+        }
+
+        action = (int) policy->defaultAction;
+        audit = policy->audit;
+        uint32_t n = policy->nRules;
+        if (n > HOOK_CONNECT_RULES_MAX) {
+            n = HOOK_CONNECT_RULES_MAX;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            if (hook_rule_match(&policy->rules[i], &addr, proto)) {
+                action = policy->rules[i].action;
+                break;
+            }
+        }
 
-    // ip && port
-    memset(buf1, 0, BUF_SIZE);
-    if (AF_INET != family) {
-        goto out;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&policy->seq, __ATOMIC_RELAXED) == seq || tries >= HOOK_SEQ_RETRY_MAX) {
+            break;
+        }
     }
 
-    struct sockaddr_in* addrIn = (struct sockaddr_in*) addr;
-    inet_ntop(AF_INET, &(addrIn->sin_addr), buf1, BUF_SIZE);
-    port = ntohs(addrIn->sin_port);
+    // 策略文件内容不可信，非 0 都按拒绝
+    action = action ? HOOK_CONNECT_DENY : HOOK_CONNECT_ALLOW;
+    if (audit & (1u << action)) {
+        hook_audit(&addr, proto, action, call);
+    }
 
-    printf("ip: %s:%d\n", buf1, port);
+    if (HOOK_CONNECT_DENY == action) {
+        errno = EACCES;
+        return -1;
+    }
 
-out:
-    ret = connectPtr(sockfd, addr, addrlen);
+    return 0;
+}
 
-err:
-    if (buf1) {
-        free (buf1);
+int connect (int sockfd, const struct sockaddr* addr, socklen_t addrlen)
+{
+    hook_resolve();
+    if (!gsConnect) {
+        errno = ENOSYS;
+        return -1;
     }
 
-    if (buf2) {
-        free (buf2);
+    if (0 != hook_check(sockfd, addr, addrlen, 0, HOOK_CONNECT_CALL_CONNECT)) {
+        return -1;
     }
 
-    return ret;
+    return gsConnect(sockfd, addr, addrlen);
+}
+
+ssize_t sendto (int sockfd, const void* buf, size_t len, int flags, const struct sockaddr* addr, socklen_t addrlen)
+{
+    hook_resolve();
+    if (!gsSendto) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // 没有目的地址的是已连接套接字，connect 时已经检查过；MSG_FASTOPEN 是 TCP 建连
+    if (addr && 0 != hook_check(sockfd, addr, addrlen, (flags & MSG_FASTOPEN) ? IPPROTO_TCP : IPPROTO_UDP,
+                                HOOK_CONNECT_CALL_SENDTO)) {
+        return -1;
+    }
+
+    return gsSendto(sockfd, buf, len, flags, addr, addrlen);
+}
+
+ssize_t sendmsg (int sockfd, const struct msghdr* msg, int flags)
+{
+    hook_resolve();
+    if (!gsSendmsg) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (msg && msg->msg_name && 0 != hook_check(sockfd, (const struct sockaddr*) msg->msg_name, msg->msg_namelen,
+                                                (flags & MSG_FASTOPEN) ? IPPROTO_TCP : IPPROTO_UDP,
+                                                HOOK_CONNECT_CALL_SENDMSG)) {
+        return -1;
+    }
+
+    return gsSendmsg(sockfd, msg, flags);
+}
+
+int sendmmsg (int sockfd, struct mmsghdr* msgvec, unsigned int vlen, int flags)
+{
+    hook_resolve();
+    if (!gsSendmmsg) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // 只发第一条被拒绝的消息之前的部分，和内核中途出错时的语义一致
+    unsigned int allowed = 0;
+    for (; msgvec && allowed < vlen; ++allowed) {
+        const struct msghdr* msg = &msgvec[allowed].msg_hdr;
+        if (msg->msg_name && 0 != hook_check(sockfd, (const struct sockaddr*) msg->msg_name, msg->msg_namelen,
+                                             IPPROTO_UDP, HOOK_CONNECT_CALL_SENDMSG)) {
+            break;
+        }
+    }
+
+    if (msgvec && 0 == allowed && vlen > 0) {
+        return -1;
+    }
+
+    return gsSendmmsg(sockfd, msgvec, msgvec ? allowed : vlen, flags);
 }
 
 
 void hook_connect_init()
 {
-    connectPtr = (ConnectPtr) dlsym(RTLD_NEXT, "connect");
+    hook_resolve();
+
+    ssize_t len = readlink("/proc/self/exe", gsExe, sizeof(gsExe) - 1);
+    gsExe[len > 0 ? len : 0] = '\0';
+
+    hook_map_policy();
+    hook_create_ring();
+
+    pthread_atfork(NULL, NULL, hook_after_fork);
 }
 
 void hook_connect_cleanup()
 {
-    connectPtr = NULL;
+    // 退出时别的线程可能还在发包，不解除映射；队列文件留给守护进程取完后删除
+    __atomic_store_n(&gsRing, NULL, __ATOMIC_RELEASE);
 }
@@ -0,0 +1,100 @@
+//
+// Created by dingjing on 12/8/24.
+//
+
+#ifndef sandbox_HOOK_CONNECT_H
+#define sandbox_HOOK_CONNECT_H
+
+/**
+ * hook-connect.so 与守护进程共享的内存布局，两边都直接包含本头文件
+ *
+ * 策略: 守护进程维护 HOOK_CONNECT_POLICY_PATH，沙盒内进程只读映射。守护进程原地更新，
+ *       更新前后 seq 各加一(奇数表示正在更新)，读者发现 seq 变了就重新匹配。
+ *       规则按顺序匹配，第一条命中的生效，都不命中用 defaultAction。
+ * 审计: 每个进程创建自己的 HOOK_CONNECT_RING_DIR/<euid>/ring-<pid>，多生产者(进程内各线程)
+ *       单消费者(守护进程)的无锁环形队列，守护进程定时取走，进程退出且取空后删除文件。
+ *       exec 时旧队列改名为 ring-<pid>.<inode>，守护进程取空后删除。
+ *
+ * 目录由守护进程创建: 在守护进程私有的挂载命名空间里挂一个 tmpfs(root 所有，0711)，
+ * 宿主机上只能看到底下的空目录；每个用户一个 0700 的子目录，再绑定挂载到沙盒 rootfs 的同一路径下。
+ * 守护进程按目录属主、文件属主和 /proc/<pid>/status 核对队列，进程名取自 /proc/<pid>/exe。
+ */
+#include <stdint.h>
+
+#define HOOK_CONNECT_DIR                "/run/andsec-sandbox-connect"
+#define HOOK_CONNECT_POLICY_PATH        HOOK_CONNECT_DIR "/policy"
+#define HOOK_CONNECT_RING_DIR           HOOK_CONNECT_DIR
+#define HOOK_CONNECT_RING_PREFIX        "ring-"
+#define HOOK_CONNECT_RING_PATH_MAX      (sizeof(HOOK_CONNECT_RING_DIR) + sizeof(HOOK_CONNECT_RING_PREFIX) + 64)
+
+#define HOOK_CONNECT_POLICY_MAGIC       0x594c4f50                                              // "POLY"
+#define HOOK_CONNECT_RING_MAGIC         0x474e4952                                              // "RING"
+#define HOOK_CONNECT_RULES_MAX          1024
+#define HOOK_CONNECT_RING_SLOTS         256                                                     // 2 的幂
+#define HOOK_CONNECT_EXE_MAX            256
+
+#define HOOK_CONNECT_POLICY_NEED_PROTO  (1 << 0)                                                // 有规则限定了 tcp/udp，connect 时要查套接字类型
+
+typedef enum
+{
+    HOOK_CONNECT_ALLOW = 0,
+    HOOK_CONNECT_DENY,
+} HookConnectAction;
+
+#define HOOK_CONNECT_AUDIT_ALLOW        (1 << HOOK_CONNECT_ALLOW)
+#define HOOK_CONNECT_AUDIT_DENY         (1 << HOOK_CONNECT_DENY)
+
+typedef enum
+{
+    HOOK_CONNECT_CALL_CONNECT = 1,
+    HOOK_CONNECT_CALL_SENDTO,
+    HOOK_CONNECT_CALL_SENDMSG,
+} HookConnectCall;
+
+typedef struct
+{
+    uint8_t                 family;                                                             // AF_INET/AF_INET6，0 不限
+    uint8_t                 prefixLen;                                                          // CIDR 前缀长度
+    uint8_t                 action;                                                             // HookConnectAction
+    uint8_t                 proto;                                                              // IPPROTO_TCP/IPPROTO_UDP，0 不限
+    uint16_t                portMin;                                                            // 主机字节序，闭区间
+    uint16_t                portMax;
+    uint8_t                 addr[16];                                                           // 网络字节序，IPv4 在前 4 字节
+} HookConnectRule;
+
+typedef struct
+{
+    uint32_t                magic;                                                              // HOOK_CONNECT_POLICY_MAGIC
+    uint32_t                seq;                                                                // 奇数表示守护进程正在更新
+    uint32_t                defaultAction;                                                      // HookConnectAction
+    uint32_t                audit;                                                              // HOOK_CONNECT_AUDIT_*
+    uint32_t                flags;                                                              // HOOK_CONNECT_POLICY_*
+    uint32_t                nRules;
+    HookConnectRule         rules[HOOK_CONNECT_RULES_MAX];
+} HookConnectPolicy;
+
+typedef struct
+{
+    uint64_t                seq;                                                                // 槽位序号，写完后为 pos + 1，取走后为 pos + HOOK_CONNECT_RING_SLOTS
+    uint64_t                time;                                                               // CLOCK_REALTIME，ns
+    uint8_t                 family;                                                             // AF_INET/AF_INET6，IPv4 映射地址按 AF_INET 记
+    uint8_t                 proto;                                                              // 0 表示未知
+    uint8_t                 action;                                                             // HookConnectAction
+    uint8_t                 call;                                                               // HookConnectCall
+    uint16_t                port;                                                               // 主机字节序
+    uint16_t                reserved;
+    uint8_t                 addr[16];
+} HookConnectEvent;
+
+typedef struct
+{
+    uint32_t                magic;                                                              // HOOK_CONNECT_RING_MAGIC，其余字段初始化完后最后写
+    int32_t                 pid;
+    char                    exe[HOOK_CONNECT_EXE_MAX];                                          // 进程启动时解析一次，只用于调试，守护进程不采信
+    uint64_t                head __attribute__((aligned(64)));                                  // 生产者抢占的下一个位置
+    uint64_t                tail __attribute__((aligned(64)));                                  // 守护进程下一个要取的位置
+    uint64_t                dropped;                                                            // 队列满丢弃的事件数
+    HookConnectEvent        slots[HOOK_CONNECT_RING_SLOTS] __attribute__((aligned(64)));
+} HookConnectRing;
+
+#endif // sandbox_HOOK_CONNECT_H
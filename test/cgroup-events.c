@@ -0,0 +1,142 @@
+//
+// Created by dingjing on 12/6/24.
+//
+// cgroup 进程监控: 在沙盒 cgroup 里连续创建 1000 个短命进程，检查每个进程的 STARTED/EXITED 事件都收到了且只收到一次
+// 用法(需要 root): test-cgroup-events [进程数(默认 1000)]
+//
+#include "../app/cgroup.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define WAIT_SECONDS        10
+
+#define EV_STARTED          (1 << 0)
+#define EV_EXITED           (1 << 1)
+
+static GMutex       gsLocker;
+static GHashTable*  gsEvents = NULL;                // pid -> EV_*
+static int          gsDuplicated = 0;
+
+
+static void on_event (SbCgroup* cgroup, SbCgroupEvent event, pid_t pid, gpointer udata)
+{
+    int flag = 0;
+    switch (event) {
+        case SB_CGROUP_EVENT_PROCESS_STARTED: {
+            flag = EV_STARTED;
+            break;
+        }
+        case SB_CGROUP_EVENT_PROCESS_EXITED: {
+            flag = EV_EXITED;
+            break;
+        }
+        default: {
+            return;
+        }
+    }
+
+    g_mutex_lock(&gsLocker);
+    int flags = GPOINTER_TO_INT(g_hash_table_lookup(gsEvents, GINT_TO_POINTER(pid)));
+    if (flags & flag) {
+        ++gsDuplicated;
+    }
+    g_hash_table_insert(gsEvents, GINT_TO_POINTER(pid), GINT_TO_POINTER(flags | flag));
+    g_mutex_unlock(&gsLocker);
+}
+
+static void count_events (const pid_t* pids, int num, int* started, int* exited)
+{
+    *started = *exited = 0;
+
+    g_mutex_lock(&gsLocker);
+    for (int i = 0; i < num; ++i) {
+        int flags = GPOINTER_TO_INT(g_hash_table_lookup(gsEvents, GINT_TO_POINTER(pids[i])));
+        *started += (flags & EV_STARTED) ? 1 : 0;
+        *exited += (flags & EV_EXITED) ? 1 : 0;
+    }
+    g_mutex_unlock(&gsLocker);
+}
+
+int main (int argc, char* argv[])
+{
+    int num = (argc > 1) ? atoi(argv[1]) : 1000;
+    if (num <= 0) {
+        printf("Usage: %s [processes]\n", argv[0]);
+        return -1;
+    }
+
+    g_mutex_init(&gsLocker);
+    gsEvents = g_hash_table_new(NULL, NULL);
+
+    SbCgroup* cgroup = sb_cgroup_new();
+    sb_cgroup_set_event_func(cgroup, on_event, NULL);
+    if (!sb_cgroup_run(cgroup)) {
+        printf("sb_cgroup_run failed, need root and a writable cgroup hierarchy\n");
+        return -1;
+    }
+
+    // 等监控线程把自己登记进快照
+    for (int i = 0; i < 100; ++i) {
+        SbCgroupProcs* procs = sb_cgroup_get_procs(cgroup);
+        bool ready = sb_cgroup_procs_contains(procs, getpid());
+        sb_cgroup_procs_unref(procs);
+        if (ready) {
+            break;
+        }
+        g_usleep(10 * 1000);
+    }
+
+    pid_t* pids = g_malloc0_n(num, sizeof(pid_t));
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < num; ++i) {
+        pids[i] = fork();
+        if (0 == pids[i]) {
+            _exit(0);
+        }
+        else if (pids[i] < 0) {
+            printf("fork failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    // 全部创建完再回收，避免 pid 被复用
+    for (int i = 0; i < num; ++i) {
+        waitpid(pids[i], NULL, 0);
+    }
+
+    int started = 0, exited = 0;
+    while (g_get_monotonic_time() - start < WAIT_SECONDS * G_USEC_PER_SEC) {
+        count_events(pids, num, &started, &exited);
+        if (started == num && exited == num) {
+            break;
+        }
+        g_usleep(10 * 1000);
+    }
+    gint64 elapsedMs = (g_get_monotonic_time() - start) / 1000;
+
+    // 快照里只剩自己
+    int stale = 0;
+    SbCgroupProcs* procs = sb_cgroup_get_procs(cgroup);
+    for (int i = 0; i < num; ++i) {
+        stale += sb_cgroup_procs_contains(procs, pids[i]) ? 1 : 0;
+    }
+    bool self = sb_cgroup_procs_contains(procs, getpid());
+    sb_cgroup_procs_unref(procs);
+
+    printf("processes : %d, elapsed: %lld ms\n", num, (long long) elapsedMs);
+    printf("started   : %d\n", started);
+    printf("exited    : %d\n", exited);
+    printf("duplicated: %d\n", gsDuplicated);
+    printf("stale     : %d, self in snapshot: %s\n", stale, self ? "yes" : "no");
+
+    g_object_unref(cgroup);
+    g_hash_table_unref(gsEvents);
+    g_free(pids);
+
+    return (started == num && exited == num && !gsDuplicated && !stale && self) ? 0 : -1;
+}
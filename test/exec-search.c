@@ -0,0 +1,71 @@
+//
+// Created by dingjing on 12/16/24.
+//
+// 按沙盒启动的方式 fork 子进程执行命令，检查父进程从通知管道读到的结果:
+// 不存在的命令必须报 ENOENT，不能因为子进程正常退出而被当成启动成功
+//
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../app/exec-search.h"
+
+static int launch (const char* cmd)
+{
+    int notify[2] = {-1, -1};
+    if (0 != pipe2(notify, O_CLOEXEC)) {
+        return errno;
+    }
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+        close(notify[0]);
+        close(notify[1]);
+        return errno;
+    }
+    if (0 == pid) {
+        close(notify[0]);
+        char* env[] = { "PATH=/usr/bin:/bin", NULL };
+        exec_search_run(cmd, env, notify[1]);
+        _exit(0);
+    }
+
+    close(notify[1]);
+    int err = 0;
+    ssize_t ret = 0;
+    do {
+        ret = read(notify[0], &err, sizeof(err));
+    } while (ret < 0 && EINTR == errno);
+    close(notify[0]);
+    waitpid(pid, NULL, 0);
+
+    // 读到 EOF 表示 exec 成功
+    return (sizeof(err) == ret) ? err : 0;
+}
+
+static int check (const char* cmd, int expect)
+{
+    const int err = launch(cmd);
+    printf("%-40s expect: %-24s got: %s\n", cmd, expect ? strerror(expect) : "ok", err ? strerror(err) : "ok");
+
+    return (err == expect) ? 0 : 1;
+}
+
+int main (int argc, char* argv[])
+{
+    int failed = 0;
+
+    failed += check("sandbox-no-such-command", ENOENT);
+    failed += check("/usr/local/andsec/sandbox/bin/sandbox-no-such-command", ENOENT);
+
+    // 不在第一个查找目录里，要接着找后面的目录
+    failed += check("true", 0);
+    failed += check("/bin/true", 0);
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+
+    return failed ? -1 : 0;
+}
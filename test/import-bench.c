@@ -0,0 +1,170 @@
+//
+// Created by dingjing on 11/22/24.
+//
+// 对比两种把宿主机文件写入沙盒的方式: 经挂载点逐块写(FUSE 读写路径) 与 SANDBOX_FS_IOC_IMPORT(FUSE 子进程直接写卷)
+// 之后用 SANDBOX_FS_IOC_EXPORT 导回宿主机，并逐字节校验
+// 用法(需 root，沙盒已挂载): test-import-bench <宿主机文件> <挂载点> [重复次数(默认 3)]
+//
+#include <glib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../app/sandbox-fs.h"
+
+#define BUF_SIZE            (1024 * 1024)
+
+static bool copy_by_fuse (const char* src, const char* dst)
+{
+    bool ret = false;
+    char* buf = g_malloc(BUF_SIZE);
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (in < 0 || out < 0) {
+        goto out;
+    }
+
+    while (true) {
+        ssize_t n = read(in, buf, BUF_SIZE);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n < 0) {
+            goto out;
+        }
+        if (0 == n) {
+            break;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out, buf + off, n - off);
+            if (w < 0 && EINTR == errno) {
+                continue;
+            }
+            if (w <= 0) {
+                goto out;
+            }
+            off += w;
+        }
+    }
+    ret = (0 == fsync(out));
+
+out:
+    if (!ret) { printf("copy '%s' -> '%s' error: %s\n", src, dst, strerror(errno)); }
+    if (in >= 0) { close(in); }
+    if (out >= 0) { close(out); }
+    g_free(buf);
+
+    return ret;
+}
+
+static bool transfer_by_ioctl (const char* hostPath, const char* boxFile, bool import)
+{
+    int fd = import ? open(boxFile, O_WRONLY | O_CREAT | O_CLOEXEC, 0644) : open(boxFile, O_RDONLY | O_CLOEXEC);
+    int hostFd = import ? open(hostPath, O_RDONLY | O_CLOEXEC) : open(hostPath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || hostFd < 0) {
+        printf("open '%s' or '%s' error: %s\n", boxFile, hostPath, strerror(errno));
+        if (fd >= 0)        { close(fd); }
+        if (hostFd >= 0)    { close(hostFd); }
+        return false;
+    }
+
+    SandboxFsTransfer req;
+    memset(&req, 0, sizeof(req));
+    req.pid = getpid();
+    req.fd = hostFd;
+
+    // 每次 ioctl 搬运一段，直到整个文件完成
+    bool ret = true;
+    do {
+        if (0 != ioctl(fd, import ? SANDBOX_FS_IOC_IMPORT : SANDBOX_FS_IOC_EXPORT, &req)) {
+            printf("%s '%s' error: %s\n", import ? "import" : "export", boxFile, strerror(errno));
+            ret = false;
+            break;
+        }
+        req.offset += req.done;
+    } while (req.done > 0 && req.offset < req.size);
+    close(hostFd);
+    close(fd);
+
+    return ret;
+}
+
+static bool same_content (const char* a, const char* b)
+{
+    gsize la = 0, lb = 0;
+    gchar* ca = NULL;
+    gchar* cb = NULL;
+
+    bool ret = g_file_get_contents(a, &ca, &la, NULL)
+            && g_file_get_contents(b, &cb, &lb, NULL)
+            && la == lb && 0 == memcmp(ca, cb, la);
+    g_free(ca);
+    g_free(cb);
+
+    return ret;
+}
+
+static void report (const char* name, gint64 usec, off_t size)
+{
+    printf("%-8s %10.3f ms  %8.1f MiB/s\n", name, usec / 1000.0,
+        (size / 1048576.0) / ((usec ? usec : 1) / 1000000.0));
+}
+
+int main (int argc, char* argv[])
+{
+    if (argc < 3) {
+        printf("usage: %s <host file> <mount point> [rounds]\n", argv[0]);
+        return -1;
+    }
+
+    const int rounds = (argc > 3) ? atoi(argv[3]) : 3;
+    char* src = g_canonicalize_filename(argv[1], NULL);
+    char* viaFuse = g_strdup_printf("%s/.import-bench.fuse", argv[2]);
+    char* viaIoctl = g_strdup_printf("%s/.import-bench.ioctl", argv[2]);
+    char* exported = g_strdup_printf("%s.export", src);
+    bool ok = true;
+
+    struct stat st;
+    if (0 != stat(src, &st)) {
+        printf("stat '%s' error: %s\n", src, strerror(errno));
+        ok = false;
+        goto out;
+    }
+    printf("file: %s, size: %lld bytes, rounds: %d\n", src, (long long) st.st_size, rounds);
+
+    for (int i = 0; ok && i < rounds; ++i) {
+        // 每轮前丢掉宿主机页缓存的影响只能靠 root 手动 drop_caches，这里两种方式交替执行以减小偏差
+        gint64 t = g_get_monotonic_time();
+        ok = copy_by_fuse(src, viaFuse);
+        report("fuse", g_get_monotonic_time() - t, st.st_size);
+
+        t = g_get_monotonic_time();
+        ok = ok && transfer_by_ioctl(src, viaIoctl, true);
+        report("import", g_get_monotonic_time() - t, st.st_size);
+
+        t = g_get_monotonic_time();
+        ok = ok && transfer_by_ioctl(exported, viaIoctl, false);
+        report("export", g_get_monotonic_time() - t, st.st_size);
+    }
+
+    if (ok) {
+        ok = same_content(src, viaFuse) && same_content(src, viaIoctl) && same_content(src, exported);
+        printf("verify: %s\n", ok ? "OK" : "MISMATCH");
+    }
+
+out:
+    unlink(viaFuse);
+    unlink(viaIoctl);
+    unlink(exported);
+    g_free(src);
+    g_free(viaFuse);
+    g_free(viaIoctl);
+    g_free(exported);
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,120 @@
+//
+// Created by dingjing on 11/20/24.
+//
+// 对守护进程连续发送启动请求，统计吞吐和请求到应答的延迟
+// 用法: test-ipc-bench [请求数(默认 5000)] [在途窗口(默认 32)] [IpcType(默认 IPC_TYPE_STAT)]
+// IPC_TYPE_STAT 不启动程序，测协议开销加一次 cgroup 统计；IPC_TYPE_SYNC/IPC_TYPE_OPEN_FM 等会真实启动程序
+//
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "../app/proto/ipc-message.h"
+
+#define SOCKET_PATH         "/usr/local/andsec/sandbox/data/sandbox.sock"
+
+static int compare_gint64 (const void* a, const void* b)
+{
+    const gint64 l = *(const gint64*) a;
+    const gint64 r = *(const gint64*) b;
+
+    return (l > r) - (l < r);
+}
+
+int main (int argc, char* argv[])
+{
+    const guint32 total = (argc > 1) ? (guint32) atoi(argv[1]) : 5000;
+    const guint32 window = (argc > 2) ? (guint32) atoi(argv[2]) : 32;
+    const IpcType type = (argc > 3) ? (IpcType) atoi(argv[3]) : IPC_TYPE_STAT;
+    g_return_val_if_fail(total > 0 && window > 0, -1);
+
+    int fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+    g_return_val_if_fail(fd >= 0, -1);
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_LOCAL;
+    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    if (0 != connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        printf("connect '%s' error: %s\n", SOCKET_PATH, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // 只打包一次，之后每次仅改写 reqId
+    IpcMessageData* cmd = ipc_message_data_new();
+    ipc_message_set_type(cmd, type);
+    if (g_getenv("USER"))       { ipc_message_append_kv(cmd, "USER", g_getenv("USER")); }
+    if (g_getenv("HOME"))       { ipc_message_append_kv(cmd, "HOME", g_getenv("HOME")); }
+    if (g_getenv("DISPLAY"))    { ipc_message_append_kv(cmd, "DISPLAY", g_getenv("DISPLAY")); }
+
+    char* buf = NULL;
+    const gsize bufSize = ipc_message_pack_frame(cmd, 0, &buf);
+    ipc_message_data_free(&cmd);
+    g_return_val_if_fail(bufSize > 0, -1);
+
+    gint64* sendAt = g_malloc0(sizeof(gint64) * total);
+    gint64* latency = g_malloc0(sizeof(gint64) * total);
+    IpcFrameReader* reader = ipc_frame_reader_new(IPC_FRAME_MAX);
+
+    guint32 sent = 0, received = 0, failed = 0;
+    const gint64 start = g_get_monotonic_time();
+
+    while (received < total) {
+        while (sent < total && sent - received < window) {
+            ((IpcFrame*) buf)->reqId = sent;
+            sendAt[sent] = g_get_monotonic_time();
+            if (!ipc_frame_write_all(fd, buf, bufSize)) {
+                printf("send error: %s\n", strerror(errno));
+                goto out;
+            }
+            ++sent;
+        }
+
+        if (ipc_frame_reader_fill(reader, fd) <= 0) {
+            printf("daemon closed the connection after %u responses\n", received);
+            goto out;
+        }
+
+        const gint64 now = g_get_monotonic_time();
+        const IpcFrame* frame = NULL;
+        while ((frame = ipc_frame_reader_next(reader))) {
+            if (IPC_TYPE_RESPONSE != frame->type || frame->reqId >= sent) {
+                printf("unexpected frame, type: %u, reqId: %u\n", frame->type, frame->reqId);
+                goto out;
+            }
+            IpcResponse resp = {0};
+            memcpy(&resp, frame->data, sizeof(resp));
+            if (0 != resp.status) {
+                ++failed;
+            }
+            latency[received++] = now - sendAt[frame->reqId];
+        }
+    }
+
+out:
+    if (received > 0) {
+        const gint64 elapsed = g_get_monotonic_time() - start;
+        qsort(latency, received, sizeof(gint64), compare_gint64);
+        printf("requests: %u, failed: %u, window: %u, elapsed: %.3f ms, %.1f req/s\n",
+            received, failed, window, elapsed / 1000.0, received * 1000000.0 / (elapsed ? elapsed : 1));
+        printf("latency(us): min: %lld, p50: %lld, p99: %lld, max: %lld\n",
+            (long long) latency[0], (long long) latency[received / 2],
+            (long long) latency[(received * 99) / 100], (long long) latency[received - 1]);
+    }
+    if (failed > 0) {
+        printf("warning: %u requests failed, latency includes error replies\n", failed);
+    }
+
+    close(fd);
+    g_free(buf);
+    g_free(sendAt);
+    g_free(latency);
+    ipc_frame_reader_free(&reader);
+
+    return (received == total) ? 0 : -1;
+}
@@ -0,0 +1,131 @@
+//
+// Created by dingjing on 12/3/24.
+//
+// ntfs_attr_find_vcn 微基准: 在内存里构造一个有 10 万个 run 的碎片文件(不需要卷)，
+// 按簇顺序读一遍、再随机读，逐个与线性遍历的结果比对，并和线性遍历比较耗时
+// 用法: test-runlist-bench [run 数(默认 100000)] [随机查找次数(默认 1000000)]
+//
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../3thrd/fs/types.h"
+#include "../3thrd/fs/layout.h"
+#include "../3thrd/fs/inode.h"
+#include "../3thrd/fs/attrib.h"
+#include "../3thrd/fs/runlist.h"
+
+#define RUN_CLUSTERS        4                                   // 每个 run 的簇数
+#define LINEAR_LOOKUPS      10000                               // 线性遍历太慢，只测这么多次
+
+// 修改前 ntfs_attr_find_vcn 的做法
+static runlist_element* find_vcn_linear (runlist_element* rl, VCN vcn)
+{
+    while (rl->length) {
+        if (vcn < rl[1].vcn) {
+            return (rl->lcn >= LCN_HOLE) ? rl : NULL;
+        }
+        rl++;
+    }
+
+    return NULL;
+}
+
+static runlist_element* build_runlist (int runs)
+{
+    runlist_element* rl = g_malloc0_n(runs + 1, sizeof(runlist_element));
+
+    // 每 7 个 run 一个空洞，其余 run 的 lcn 前后不连续
+    for (int i = 0; i < runs; ++i) {
+        rl[i].vcn = (VCN) i * RUN_CLUSTERS;
+        rl[i].lcn = (i % 7 == 6) ? LCN_HOLE : (LCN) (runs - i) * RUN_CLUSTERS * 2;
+        rl[i].length = RUN_CLUSTERS;
+    }
+    rl[runs].vcn = (VCN) runs * RUN_CLUSTERS;
+    rl[runs].lcn = LCN_ENOENT;
+    rl[runs].length = 0;
+
+    return rl;
+}
+
+int main (int argc, char* argv[])
+{
+    int runs = (argc > 1) ? atoi(argv[1]) : 100000;
+    int lookups = (argc > 2) ? atoi(argv[2]) : 1000000;
+    if (runs <= 0 || lookups <= 0) {
+        printf("Usage: %s [runs] [random lookups]\n", argv[0]);
+        return -1;
+    }
+
+    ntfs_inode ni;
+    ntfs_attr* na = g_malloc0(sizeof(ntfs_attr));
+    memset(&ni, 0, sizeof(ni));
+    na->ni = &ni;
+    na->type = AT_DATA;
+    NAttrSetNonResident(na);
+    NAttrSetFullyMapped(na);
+    na->rl = build_runlist(runs);
+    ntfs_attr_rl_changed(na);
+
+    const VCN clusters = (VCN) runs * RUN_CLUSTERS;
+    VCN* vcns = g_malloc_n(lookups, sizeof(VCN));
+    srandom(1234);
+    for (int i = 0; i < lookups; ++i) {
+        vcns[i] = ((VCN) random() << 16 ^ random()) % clusters;
+    }
+
+    int errors = 0;
+
+    // 顺序读: 每个簇一次查找
+    gint64 start = g_get_monotonic_time();
+    for (VCN vcn = 0; vcn < clusters; ++vcn) {
+        runlist_element* rl = ntfs_attr_find_vcn(na, vcn);
+        if (rl != &na->rl[vcn / RUN_CLUSTERS]) {
+            ++errors;
+        }
+    }
+    gint64 seqUs = g_get_monotonic_time() - start;
+
+    // 随机读
+    start = g_get_monotonic_time();
+    for (int i = 0; i < lookups; ++i) {
+        runlist_element* rl = ntfs_attr_find_vcn(na, vcns[i]);
+        if (rl != &na->rl[vcns[i] / RUN_CLUSTERS]) {
+            ++errors;
+        }
+    }
+    gint64 randUs = g_get_monotonic_time() - start;
+
+    // 线性遍历，同时校验结果一致
+    const int linear = MIN(lookups, LINEAR_LOOKUPS);
+    start = g_get_monotonic_time();
+    for (int i = 0; i < linear; ++i) {
+        if (find_vcn_linear(na->rl, vcns[i]) != ntfs_attr_find_vcn(na, vcns[i])) {
+            ++errors;
+        }
+    }
+    gint64 linearUs = g_get_monotonic_time() - start;
+
+    // 超出末尾
+    errno = 0;
+    if (ntfs_attr_find_vcn(na, clusters) || ENOENT != errno) {
+        ++errors;
+    }
+
+    printf("runs: %d, clusters: %lld\n", runs, (long long) clusters);
+    printf("sequential: %lld lookups, %lld us, %.1f ns/lookup\n",
+           (long long) clusters, (long long) seqUs, seqUs * 1000.0 / clusters);
+    printf("random    : %d lookups, %lld us, %.1f ns/lookup\n",
+           lookups, (long long) randUs, randUs * 1000.0 / lookups);
+    printf("linear    : %d lookups, %lld us, %.1f ns/lookup (incl. indexed)\n",
+           linear, (long long) linearUs, linearUs * 1000.0 / linear);
+    printf("errors    : %d\n", errors);
+
+    g_free(vcns);
+    g_free(na->rl);
+    g_free(na);
+
+    return errors ? -1 : 0;
+}
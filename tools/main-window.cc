@@ -15,6 +15,17 @@
 #include <QUrl>
 #include <QVBoxLayout>
 
+#include <QCloseEvent>
+
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
 #include "header-view.h"
 #include "../app/vfs/sandbox-vfs-file.h"
 
@@ -108,305 +119,280 @@ CopyFileThread::CopyFileThread(const QString & srcUri, const QString & dstUri, Q
 
 }
 
+#define COPY_QUEUE_MAX              4096                    // 遍历领先复制的最大文件数
+#define COPY_CHUNK_SIZE             (8 * 1024 * 1024)       // copy_file_range/sendfile 单次长度
+#define COPY_BUFFER_SIZE            (1024 * 1024)           // 回退 read/write 时每个线程的缓冲区
+#define COPY_BUFFER_ALIGN           4096
+#define COPY_PROGRESS_INTERVAL_MS   100
+
+int CopyFileThread::failedCount() const
+{
+    return mFailed.load();
+}
+
+void CopyFileThread::cancel()
+{
+    mCancel.store(true);
+
+    std::lock_guard<std::mutex> lock(mQueueLock);
+    mQueueNotEmpty.notify_all();
+    mQueueNotFull.notify_all();
+}
+
+QString CopyFileThread::uriToLocalPath(const QString& uri)
+{
+    QString path = uri;
+    if (path.startsWith("sandbox://")) {
+        path = path.replace("sandbox://", SANDBOX_MOUNT_POINT);
+    }
+    if (path.startsWith("file://")) {
+        path = path.replace("file://", "");
+    }
+    while (path.contains("//")) { path = path.replace("//", "/"); }
+    while (path.size() > 1 && path.endsWith("/")) { path.chop(1); }
+
+    return path;
+}
+
 void CopyFileThread::doCopyFile()
 {
-    QStringList files;
-    QList<QString> dirs;
-    QSet<QString> dirFileter;
-    QString curUri = mSrcUri;
+    const QString srcPath = uriToLocalPath(mSrcUri);
+    const QString dstDir = uriToLocalPath(mDstUri);
+    const QString dstPath = QString("%1/%2").arg(dstDir, QFileInfo(srcPath).fileName());
 
-    QString srcBasePath = QUrl(mSrcUri).path();
-    QString dstBasePath = QUrl(mDstUri).path();
+    Q_EMIT preparing();
 
+    QDir().mkpath(dstDir);
 
-    auto getGFile = [&] (const QString& uri) -> GFile* {
-        GFile* file = nullptr;
-        if (uri.startsWith("sandbox://")) {
-            file = sandbox_vfs_file_new_for_uri(uri.toUtf8().constData());
-        }
-        else {
-            file = g_file_new_for_uri(uri.toUtf8().constData());
-        }
-        return file;
-    };
-
-    auto getFileType = [&] (const QString& uri) ->GFileType {
-        GFileType type = G_FILE_TYPE_UNKNOWN;
-        GFile* file = getGFile(uri);
-        if (G_IS_FILE(file)) {
-            type = g_file_query_file_type(file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr);
-            g_object_unref(file);
-        }
-        return type;
-    };
+    const int workers = qBound(2, QThread::idealThreadCount(), 8);
+    std::vector<std::thread> threads;
+    mActiveWorkers.store(workers);
+    for (int i = 0; i < workers; ++i) {
+        threads.emplace_back(&CopyFileThread::copyWorker, this);
+    }
 
-    auto checkIsDirByGFile = [&] (GFile* file) ->bool {
-        bool isDir = false;
-        if (G_IS_FILE(file)) {
-            isDir = (G_FILE_TYPE_DIRECTORY == g_file_query_file_type(file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr));
-        }
-        return isDir;
-    };
+    // 遍历与复制同时进行，遍历结束后总大小才确定
+    walk(QFile::encodeName(srcPath), QFile::encodeName(dstPath));
+    {
+        std::lock_guard<std::mutex> lock(mQueueLock);
+        mWalkFinished = true;
+        mQueueNotEmpty.notify_all();
+    }
 
-    auto getNextFileInfo = [&] (GFileEnumerator* em) ->GFileInfo* {
-        GFileInfo* fileInfo = nullptr;
-        if (G_IS_FILE_ENUMERATOR(em)) {
-            fileInfo = g_file_enumerator_next_file(em, nullptr, nullptr);
-        }
-        return fileInfo;
-    };
-
-    auto getFileUriByGFileInfo = [&] (const QString& baseUri, GFileInfo* fileInfo) ->QString {
-        QString uri = "";
-        if (G_IS_FILE_INFO(fileInfo)) {
-            char* path = g_file_info_get_attribute_as_string (fileInfo, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
-            if (path) {
-                uri = path;
-                g_free(path);
-            }
-            else {
-                const char* name = g_file_info_get_display_name(fileInfo);
-                uri = QString("%1/%2").arg(baseUri).arg(name);
-            }
-        }
-        return uri;
-    };
-
-    auto getFileSizeByUri = [=] (const QString & uri) ->guint64 {
-        guint64 size = 1;
-        GFile* file = getGFile(uri);
-        if (G_IS_FILE(file)) {
-            GFileInfo* fi = g_file_query_info(file, G_FILE_ATTRIBUTE_STANDARD_SIZE, G_FILE_QUERY_INFO_NONE, nullptr, nullptr);
-            if (G_IS_FILE_INFO(fi)) {
-                size = g_file_info_get_attribute_uint64(fi, G_FILE_ATTRIBUTE_STANDARD_SIZE);
-                g_object_unref(fi);
-            }
-            g_object_unref(file);
-        }
-        return size;
-    };
+    Q_EMIT prepared(mCopyAllSize);
 
-    auto copyRecursion = [&] (const QString& srcFile) ->void {
+    while (mActiveWorkers.load() > 0) {
+        Q_EMIT progress(qMin(mCopiedSize.load(), mCopyAllSize), mCopyAllSize);
+        std::this_thread::sleep_for(std::chrono::milliseconds(COPY_PROGRESS_INTERVAL_MS));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
 
-        class GFileWrap
-        {
-        public:
-            GFileWrap(GFile* file) : mFile(file) {}
-            ~GFileWrap() { if (mFile) {g_object_unref(mFile); } }
-            void operator=(GFile* file) {mFile = file; };
-            GFile* get() const {return mFile;}
-        private:
-            GFile* mFile = nullptr;
-        };
-
-        class GFileInfoWrap
-        {
-        public:
-            GFileInfoWrap(GFileInfo* file) : mFile(file) {}
-            ~GFileInfoWrap() { if (mFile) {g_object_unref(mFile); } }
-            void operator=(GFileInfo* file) {mFile = file; };
-            GFileInfo* get() const {return mFile;}
-        private:
-            GFileInfo* mFile = nullptr;
-        };
-
-        QString copySrcPath = srcFile;
-        QString copyDstPath = mDstUri;
-
-        if (copySrcPath.startsWith("sandbox://")) {
-            copySrcPath = copySrcPath.replace("sandbox://", SANDBOX_MOUNT_POINT);
-        }
-        if (copyDstPath.startsWith("sandbox://")) {
-            copyDstPath = copyDstPath.replace("sandbox://", SANDBOX_MOUNT_POINT);
-        }
-        if (copySrcPath.startsWith("file://")) {
-            copySrcPath = copySrcPath.replace("file://", "");
+    qInfo() << "[COPY]" << srcPath << "->" << dstPath << "bytes:" << mCopiedSize.load()
+            << "failed:" << mFailed.load() << (mCancel.load() ? "(canceled)" : "");
+
+    Q_EMIT progress(mCopyAllSize, mCopyAllSize);
+    Q_EMIT finished(mCancel.load() ? ECANCELED : (mFailed.load() > 0 ? EIO : 0));
+}
+
+void CopyFileThread::walk(const QByteArray& srcRoot, const QByteArray& dstRoot)
+{
+    struct stat st;
+    if (0 != stat(srcRoot.constData(), &st)) {
+        qWarning() << "[COPY] stat" << srcRoot << "error:" << strerror(errno);
+        mFailed++;
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        mCopyAllSize += st.st_size;
+        pushJob(srcRoot, dstRoot);
+        return;
+    }
+
+    // 深度优先，目录在其中的文件入队之前创建，工作线程不再需要 mkpath
+    std::vector<std::pair<QByteArray, QByteArray>> dirs;
+    dirs.emplace_back(srcRoot, dstRoot);
+
+    while (!dirs.empty() && !mCancel.load()) {
+        const auto cur = dirs.back();
+        dirs.pop_back();
+
+        if (0 != mkdir(cur.second.constData(), 0755) && EEXIST != errno) {
+            qWarning() << "[COPY] mkdir" << cur.second << "error:" << strerror(errno);
+            mFailed++;
+            continue;
         }
-        if (copyDstPath.startsWith("file://")) {
-            copyDstPath = copyDstPath.replace("file://", "");
+
+        DIR* dir = opendir(cur.first.constData());
+        if (!dir) {
+            qWarning() << "[COPY] opendir" << cur.first << "error:" << strerror(errno);
+            mFailed++;
+            continue;
         }
 
-        while (copySrcPath.contains("//")) { copySrcPath = copySrcPath.replace("//", "/"); }
-        while (copyDstPath.contains("//")) { copyDstPath = copyDstPath.replace("//", "/"); }
+        const int dfd = dirfd(dir);
+        struct dirent* ent = nullptr;
+        while (nullptr != (ent = readdir(dir)) && !mCancel.load()) {
+            if (0 == strcmp(ent->d_name, ".") || 0 == strcmp(ent->d_name, "..")) {
+                continue;
+            }
 
-        // qInfo() << "1 copySrcPath:" << copySrcPath << " copyDstPath:" << copyDstPath;
+            const QByteArray src = cur.first + "/" + ent->d_name;
+            const QByteArray dst = cur.second + "/" + ent->d_name;
 
-        {
-            QString srcPath = mSrcUri.replace("sandbox://", SANDBOX_MOUNT_POINT);
-            srcPath = srcPath.replace("file://", "");
-            while (srcPath.contains("//")) { srcPath.replace("//", "/"); }
-            auto st = srcPath.split("/");
-            if (st.count() > 1) {
-                st.removeLast();
-            }
-            srcPath = st.join("/");
-            QString copySrcPathT = copySrcPath;
-            QString subPath = copySrcPathT.replace(srcPath, "");
-            while (subPath.startsWith("/")) { subPath = subPath.remove(0, 1); }
-            while (subPath.endsWith("/")) { subPath = subPath.remove(subPath.size() - 1, 1); }
-
-            if (!subPath.isNull() && !subPath.isEmpty()) {
-                copyDstPath = QString("%1/%2").arg(copyDstPath, subPath);
+            if (DT_DIR == ent->d_type) {
+                dirs.emplace_back(src, dst);
+                continue;
             }
-        }
-        // qInfo() << "2 copySrcPath:" << copySrcPath << " copyDstPath:" << copyDstPath;
 
-        // dir
-        {
-            QFileInfo srcFileInfo(copySrcPath);
-            if (srcFileInfo.isDir()) {
-                QDir dir;
-                dir.mkpath(copyDstPath);
-                return;
+            // 普通文件要取大小；链接按其目标处理，指向目录的链接不跟随
+            const bool isLink = (DT_LNK == ent->d_type);
+            if (0 != fstatat(dfd, ent->d_name, &st, (DT_UNKNOWN == ent->d_type) ? AT_SYMLINK_NOFOLLOW : 0)) {
+                qWarning() << "[COPY] stat" << src << "error:" << strerror(errno);
+                mFailed++;
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                if (!isLink) {
+                    dirs.emplace_back(src, dst);
+                }
+                continue;
+            }
+            if (!S_ISREG(st.st_mode)) {
+                continue;
             }
-        }
 
-        // file dir
-        {
-            auto ls = copyDstPath.split("/");
-            ls.removeLast();
-            auto dstDir = ls.join("/");
-            QDir dir;
-            dir.mkpath(dstDir);
+            mCopyAllSize += st.st_size;
+            pushJob(src, dst);
         }
+        closedir(dir);
+    }
+}
 
-        // file
+void CopyFileThread::pushJob(const QByteArray& src, const QByteArray& dst)
+{
+    std::unique_lock<std::mutex> lock(mQueueLock);
+    mQueueNotFull.wait(lock, [this] () { return mQueue.size() < COPY_QUEUE_MAX || mCancel.load(); });
+    if (mCancel.load()) {
+        return;
+    }
+    mQueue.push_back(CopyJob{src, dst});
+    mQueueNotEmpty.notify_one();
+}
+
+void CopyFileThread::copyWorker()
+{
+    char* buf = nullptr;
+    if (0 != posix_memalign((void**) &buf, COPY_BUFFER_ALIGN, COPY_BUFFER_SIZE)) {
+        buf = nullptr;
+    }
+
+    while (true) {
+        CopyJob job;
         {
-            if (!QFile::copy(copySrcPath, copyDstPath)) {
-                qWarning() << "[COPY] File: " << copySrcPath << "  ->  " << copyDstPath;
-            }
-            else {
-                QFile::setPermissions(copyDstPath, QFile::permissions(copySrcPath));
-                // qInfo() << "[COPY] File: " << copySrcPath << "  ->  " << copyDstPath;
+            std::unique_lock<std::mutex> lock(mQueueLock);
+            mQueueNotEmpty.wait(lock, [this] () { return !mQueue.empty() || mWalkFinished || mCancel.load(); });
+            if (mCancel.load() || mQueue.empty()) {
+                break;
             }
+            job = std::move(mQueue.front());
+            mQueue.pop_front();
+            mQueueNotFull.notify_one();
         }
 
-#if 0
-        GFileWrap copySrc = getGFile(srcFile);
-        if (!G_IS_FILE(copySrc.get())) { qWarning() << "malloc GFile error!"; return; }
-        auto filePath = QUrl(srcFile).path();
-        auto subPath = filePath.replace(srcBasePath, "/");
-        while (subPath.startsWith("/")) {
-            subPath = subPath.remove(0, 1);
+        if (!copyOneFile(job, buf, buf ? COPY_BUFFER_SIZE : 0)) {
+            mFailed++;
         }
+    }
 
-        // 创建 dst 目录
-        {
-            QString dstBasePath = mDstUri;
-            if (mDstUri.startsWith("sandbox://")) {
-                dstBasePath = dstBasePath.replace("sandbox://", SANDBOX_MOUNT_POINT);
-            }
-            else if (mDstUri.startsWith("file://")) {
-                dstBasePath = dstBasePath.replace("file://", "");
-            }
+    free(buf);
+    mActiveWorkers--;
+}
 
-            QDir dir(dstBasePath);
-            QString filePathT = subPath;
-
-            // 如果是文件夹，则创建文件夹
-            GFileInfoWrap fi = g_file_query_info(copySrc.get(), "standard::*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
-            if (G_FILE_TYPE_DIRECTORY == g_file_info_get_attribute_uint32(fi.get(), G_FILE_ATTRIBUTE_STANDARD_TYPE)) {
-                QDir dir;
-            qInfo() << "filePath:" << srcFile << "is dir";
-                QString dstDir = QString("%1/%2").arg(dstBasePath).arg(subPath);
-                if (dstDir.startsWith("file://")) {
-                    dstDir.replace("file://", "");
-                }
-                else if (dstDir.startsWith("sandbox://")) {
-                    dstDir.replace("sandbox://", SANDBOX_MOUNT_POINT);
-                }
-                dir.mkpath(dstDir);
-                return;
-            }
+bool CopyFileThread::copyOneFile(const CopyJob& job, char* buf, gsize bufSize)
+{
+    typedef enum { COPY_RANGE, COPY_SENDFILE, COPY_READ_WRITE } CopyMethod;
+
+    struct stat st;
+    int in = open(job.src.constData(), O_RDONLY | O_CLOEXEC);
+    if (in < 0 || 0 != fstat(in, &st)) {
+        qWarning() << "[COPY] open" << job.src << "error:" << strerror(errno);
+        if (in >= 0) { close(in); }
+        return false;
+    }
+
+    int out = open(job.dst.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+    if (out < 0) {
+        qWarning() << "[COPY] open" << job.dst << "error:" << strerror(errno);
+        close(in);
+        return false;
+    }
 
-            qInfo() << "filePath:" << srcFile << "is file";
-            // 如果是文件，则继续
-            auto filePathT1 = subPath.split("/");
-            if (filePathT1.size() > 1) {
-                filePathT1.pop_back();
-                filePathT = filePathT1.join("/");
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // 两端都支持时在内核中完成复制，否则逐级回退
+    bool ok = true;
+    CopyMethod method = COPY_RANGE;
+    guint64 done = 0;
+    while (!mCancel.load()) {
+        ssize_t n = -1;
+        switch (method) {
+            case COPY_RANGE: {
+                n = copy_file_range(in, nullptr, out, nullptr, COPY_CHUNK_SIZE, 0);
+                break;
             }
-            if (filePathT.startsWith("/")) {
-                filePathT = filePathT.remove(0, 1);
+            case COPY_SENDFILE: {
+                n = sendfile(out, in, nullptr, COPY_CHUNK_SIZE);
+                break;
             }
-            QString mkPath = dir.absoluteFilePath(filePathT);
-            if (!dir.exists(mkPath)) {
-                if (!dir.mkpath(mkPath)) {
-                    qWarning() << "Failed to create directory" << mkPath;
+            case COPY_READ_WRITE: {
+                if (!buf || 0 == bufSize) { errno = ENOMEM; break; }
+                n = read(in, buf, bufSize);
+                for (ssize_t w = 0, r = 0; n > 0 && w < n; w += r) {
+                    r = write(out, buf + w, n - w);
+                    if (r < 0 && EINTR == errno) { r = 0; continue; }
+                    if (r <= 0) { n = -1; break; }
                 }
+                break;
             }
         }
 
-        auto targetFilePath = QString("%1/%2").arg(mDstUri).arg(subPath);
-        qInfo () << "Copying file " << srcFile << " to " << targetFilePath;
-        GFileWrap copyDst = getGFile(targetFilePath);
-        if (G_IS_FILE(copyDst.get())) {
-            GError* error = nullptr;
-            bool ret = g_file_copy(copySrc.get(), copyDst.get(),
-                (GFileCopyFlags)(G_FILE_COPY_NOFOLLOW_SYMLINKS | G_FILE_COPY_OVERWRITE | G_FILE_COPY_ALL_METADATA),
-                nullptr, nullptr, nullptr, &error);
-            if (!ret) {
-                qWarning() << "Failed to copy file: " << srcFile << " error: " << (error->message ? error->message : "");
-                g_error_free(error);
-                error = nullptr;
-            }
-        }
-#endif
-    };
-
-    do {
-        GFile* file = getGFile(curUri);
-        GFileType fileType1 = getFileType(curUri);
-
-        if (G_FILE_TYPE_REGULAR != fileType1) {
-            GFileInfo* fileInfo = nullptr;
-            GFileEnumerator* em = g_file_enumerate_children (file, "*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
-            while (nullptr != (fileInfo = getNextFileInfo(em))) {
-                QString uri = getFileUriByGFileInfo(curUri, fileInfo);
-                if (!uri.isNull() && !uri.isEmpty()) {
-                    GFileType fileType = getFileType(uri);
-                    if (!dirFileter.contains(uri) && (G_FILE_TYPE_DIRECTORY == fileType)) {
-                        dirs.append(uri);
-                        files.append(uri);
-                        dirFileter.insert(uri);
-                    }
-                    else {
-                        files.append(uri);
-                        mCopyAllSize += getFileSizeByUri(uri);
-                    }
-                }
-                g_object_unref(fileInfo);
-            }
-            if (em)     { g_object_unref(em); em = nullptr; }
+        if (n > 0) {
+            done += n;
+            mCopiedSize += n;
+            continue;
         }
-        else {
-            files.append(curUri);
+        if (0 == n) {
+            break;
         }
-        if (file)   { g_object_unref(file); file = nullptr; }
-
-        if (!dirs.isEmpty()) {
-            curUri = dirs.first();
-            dirs.pop_front();
+        if (EINTR == errno) {
+            continue;
         }
-        else {
-            curUri.clear();
+        if (0 == done && COPY_READ_WRITE != method
+            && (EXDEV == errno || ENOSYS == errno || EINVAL == errno || EOPNOTSUPP == errno || EBADF == errno)) {
+            method = (COPY_RANGE == method) ? COPY_SENDFILE : COPY_READ_WRITE;
+            continue;
         }
+        qWarning() << "[COPY]" << job.src << "->" << job.dst << "error:" << strerror(errno);
+        ok = false;
+        break;
+    }
 
-    } while(!dirs.isEmpty());
-
-    Q_EMIT prepared(mCopyAllSize);
+    if (ok && !mCancel.load()) {
+        fchmod(out, st.st_mode & 07777);
+    }
+    close(in);
+    close(out);
 
-    qInfo() << "file count: " << files.size();
-    for (auto& i : files) {
-        // qInfo() << "[FILE] " << i;
-        copyRecursion(i);
-        mCopiedSize += getFileSizeByUri(i);
-        Q_EMIT progress(mCopiedSize, mCopyAllSize);
+    // 失败或取消时不留下不完整的文件
+    if (!ok || mCancel.load()) {
+        unlink(job.dst.constData());
+        return mCancel.load();
     }
 
-    Q_EMIT progress(mCopyAllSize, mCopyAllSize);
-    qInfo("OK!\n");
-    Q_EMIT finished(0);
+    return true;
 }
 
 MainWindow::MainWindow(QWidget * parent)
@@ -501,6 +487,13 @@ MainWindow::MainWindow(QWidget * parent)
     });
 }
 
+void MainWindow::closeEvent(QCloseEvent* event)
+{
+    Q_EMIT cancelCopy();
+
+    QWidget::closeEvent(event);
+}
+
 bool MainWindow::copyFile(SplitterWidget* view, const QString & srcUri, const QString & dstUri, GError ** error)
 {
     // printf("[COPY] %s --> %s\n", srcUri.toUtf8().constData(), dstUri.toUtf8().constData());
@@ -516,7 +509,10 @@ bool MainWindow::copyFile(SplitterWidget* view, const QString & srcUri, const QS
         mEventLoop.quit();
     });
     cp.connect(&mThread, &QThread::started, &cp, &CopyFileThread::doCopyFile);
+    int result = 0;
+    cp.connect(this, &MainWindow::cancelCopy, &cp, &CopyFileThread::cancel, Qt::DirectConnection);
     cp.connect(&cp, &CopyFileThread::finished, this, [&] (int ret) {
+        result = ret;
         mThread.exit(ret);
     });
     cp.connect(&cp, &CopyFileThread::prepared, this, [&] () {
@@ -531,5 +527,14 @@ bool MainWindow::copyFile(SplitterWidget* view, const QString & srcUri, const QS
 
     // qInfo() << "[COPY] " << dstUri;
 
+    if (ECANCELED == result) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "复制已取消");
+        return false;
+    }
+    else if (0 != result) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "%d 个文件复制失败", cp.failedCount());
+        return false;
+    }
+
     return true;
 }
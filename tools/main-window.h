@@ -12,6 +12,11 @@
 
 #include <glib.h>
 
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <condition_variable>
+
 #include "sandbox-view.h"
 #include "sandbox-model.h"
 
@@ -46,12 +51,18 @@ private:
     QLabel*                         mTitle = nullptr;
 };
 
+/**
+ * 复制引擎: 当前线程遍历目录(同时创建目标目录)，把文件放入有界队列，
+ * 多个工作线程并行复制，进度按字节汇总后由当前线程发出
+ */
 class CopyFileThread : public QObject
 {
     Q_OBJECT
 public:
     explicit CopyFileThread(const QString& srcUri, const QString& dstUri, QObject *parent = nullptr);
 
+    int failedCount() const;
+
 Q_SIGNALS:
     void preparing();
     void prepared(quint64);
@@ -60,10 +71,33 @@ Q_SIGNALS:
 
 public Q_SLOTS:
     void doCopyFile();
+    void cancel();                                  // 可在任意线程调用
+
+private:
+    typedef struct {
+        QByteArray      src;
+        QByteArray      dst;
+    } CopyJob;
+
+    static QString uriToLocalPath(const QString& uri);
+
+    void walk(const QByteArray& srcRoot, const QByteArray& dstRoot);
+    void pushJob(const QByteArray& src, const QByteArray& dst);
+    void copyWorker();
+    bool copyOneFile(const CopyJob& job, char* buf, gsize bufSize);
 
 private:
-    guint64             mCopiedSize = 0;
-    guint64             mCopyAllSize = 0;
+    std::atomic<bool>               mCancel {false};
+    std::atomic<int>                mFailed {0};
+    std::atomic<int>                mActiveWorkers {0};
+    std::atomic<guint64>            mCopiedSize {0};
+    guint64                         mCopyAllSize = 0;
+
+    std::mutex                      mQueueLock;
+    std::condition_variable         mQueueNotEmpty;
+    std::condition_variable         mQueueNotFull;
+    std::deque<CopyJob>             mQueue;
+    bool                            mWalkFinished = false;
 
     QString             mSrcUri;
     QString             mDstUri;
@@ -81,6 +115,10 @@ public:
 Q_SIGNALS:
     void startCopy();
     void stopCopy();
+    void cancelCopy();
+
+protected:
+    void closeEvent(QCloseEvent* event) override;
 
 private:
     SplitterWidget*                 mHost = nullptr;
@@ -10,274 +10,323 @@
 #include "../app/utils.h"
 
 
-SandboxItem::SandboxItem(const QString& uri, SandboxItem* parent)
-    : QObject(parent), mParent(parent), mStatus(SI_STATUS_NONE), mProgress(0.0)
-{
-    auto uriFormat = [=] (const QString& uri) -> QString {
-        QUrl url(uri);
-        auto path = url.path();
-        while (path.startsWith("//")) {
-            path.remove(0, 1);
-        }
-        while ("/" != path && path.endsWith("/")) {
-            path.remove(path.size() - 1, 1);
-        }
-        return QString("%1://%2").arg(url.scheme(), path);
-    };
+// 只取界面上用到的属性，不再用 "*"
+#define SANDBOX_MODEL_ATTRS                                 \
+    G_FILE_ATTRIBUTE_STANDARD_NAME ","                      \
+    G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME ","              \
+    G_FILE_ATTRIBUTE_STANDARD_TYPE ","                      \
+    G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","                \
+    G_FILE_ATTRIBUTE_STANDARD_TARGET_URI
 
-    mUri = uriFormat(uri);
-    mFile = g_file_new_for_uri(mUri.toUtf8().constData());
-}
+#define SANDBOX_MODEL_BATCH         256                     // 每次 next_files_async 取的条目数
+#define SANDBOX_MODEL_PAGE          512                     // 每次 fetchMore 插入的行数
 
-SandboxItem::~SandboxItem()
+static QString uri_format (const QString& uri)
 {
-    if (mFile) {
-        g_object_unref(mFile);
+    QUrl url(uri);
+    auto path = url.path();
+    while (path.startsWith("//")) {
+        path.remove(0, 1);
     }
-    if (mParent) {
-        mParent = nullptr;
+    while ("/" != path && path.endsWith("/")) {
+        path.remove(path.size() - 1, 1);
     }
-    for (auto c : mChilds) {
-        if (c) delete c;
-    }
-    mIndex.clear();
-    mChilds.clear();
+    return QString("%1://%2").arg(url.scheme(), path);
 }
 
-QString SandboxItem::getPath() const
+QIcon SandboxItem::icon() const
 {
-    return QUrl(mUri).path();
+    QIcon icon;
+    if (!uri.isEmpty()) {
+        icon = isDir() ? QIcon::fromTheme (":/icons/dir.png") : (isLink() ? QIcon(":/icons/link.png") : QIcon(":/icons/file.png"));
+    }
+
+    return icon;
 }
 
-int SandboxItem::row() const
+SandboxItem* SandboxItem::child(int row) const
 {
-    if (mParent) {
-        return mParent->mChilds.indexOf (const_cast<SandboxItem*>(this));
+    if (row >= 0 && row < children.count()) {
+        return children.at (row);
     }
 
-    return 0;
+    return nullptr;
 }
 
-QString SandboxItem::getUri()
+void SandboxItem::setProgress(float process)
 {
-    return mUri;
+    if (process > mProgress) {
+        mProgress = process;
+    }
 }
 
-bool SandboxItem::isDir()
+SandboxItem* SandboxItemArena::alloc()
 {
-    bool isDir = false;
-    GFileInfo* fileInfo = g_file_query_info (G_FILE(mFile), "*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
-    if (G_IS_FILE_INFO(fileInfo)) {
-        auto type = (GFileType) g_file_info_get_attribute_uint32(fileInfo, G_FILE_ATTRIBUTE_STANDARD_TYPE);
-        if (G_FILE_TYPE_DIRECTORY == type) {
-            isDir = true;
-        }
-        g_object_unref(fileInfo);
+    const int idx = mUsed % BLOCK_ITEMS;
+    if (0 == idx) {
+        mBlocks.emplace_back(new SandboxItem[BLOCK_ITEMS]);
     }
+    ++mUsed;
 
-    // qDebug() << "SandboxItem::uri: " << mUri << " isDir: " << isDir;
-
-    return isDir;
+    return &mBlocks.back()[idx];
 }
 
-bool SandboxItem::isFile()
+void SandboxItemArena::clear()
 {
-    bool isDir = false;
-    GFileInfo* fileInfo = g_file_query_info (G_FILE(mFile), "*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
-    if (G_IS_FILE_INFO(fileInfo)) {
-        auto type = (GFileType) g_file_info_get_attribute_uint32(fileInfo, G_FILE_ATTRIBUTE_STANDARD_TYPE);
-        if (G_FILE_TYPE_REGULAR == type) {
-            isDir = true;
-        }
-        g_object_unref(fileInfo);
-    }
-
-    // qDebug() << "SandboxItem::uri: " << mUri << " isDir: " << isDir;
-
-    return isDir;
+    mBlocks.clear();
+    mUsed = 0;
 }
 
-bool SandboxItem::isLink()
+/**
+ * 一次目录枚举的上下文，回调里先检查 cancel，
+ * 被取消时 model/item 可能已经释放，不能再访问
+ */
+struct SandboxModel::DirLoad
 {
-    bool isDir = false;
-    GFileInfo* fileInfo = g_file_query_info (G_FILE(mFile), "*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
-    if (G_IS_FILE_INFO(fileInfo)) {
-        auto type = (GFileType) g_file_info_get_attribute_uint32(fileInfo, G_FILE_ATTRIBUTE_STANDARD_TYPE);
-        if (G_FILE_TYPE_SYMBOLIC_LINK == type) {
-            isDir = true;
-        }
-        g_object_unref(fileInfo);
-    }
+    SandboxModel*           model;
+    SandboxItem*            item;
+    GCancellable*           cancel;
+    GFileEnumerator*        enumerator;
+};
 
-    // qDebug() << "SandboxItem::uri: " << mUri << " isDir: " << isDir;
-
-    return isDir;
+SandboxModel::SandboxModel(QObject * parent)
+    : QAbstractTableModel(parent), mRootItem(nullptr), mCancel(g_cancellable_new())
+{
 }
 
-QIcon SandboxItem::icon()
+SandboxModel::~SandboxModel()
 {
-    QIcon icon;
-    QString uri = getUri();
-    if (nullptr != uri && "" != uri) {
-        icon = isDir() ? QIcon::fromTheme (":/icons/dir.png") : (isLink() ? QIcon(":/icons/link.png") : QIcon(":/icons/file.png"));
-    }
-
-    return icon;
+    g_cancellable_cancel(mCancel);
+    g_object_unref(mCancel);
 }
 
-QString SandboxItem::fileName() const
-{
-    QString qname = "";
-    char* name = g_file_get_basename(mFile);
-    if (name) {
-        qname = name;
-        g_free(name);
-    }
-
-    return qname;
-}
-
-int SandboxItem::findChildren()
-{
-    if (!isDir()) return 0;
-
-    int add = 0;
-    GFile* file = g_object_ref(mFile);
-    GFileEnumerator* em = g_file_enumerate_children (file, "*", G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, nullptr, nullptr);
-    if (G_IS_FILE_ENUMERATOR(em)) {
-        while (GFileInfo* info = g_file_enumerator_next_file (em, nullptr, nullptr)) {
-            if (G_IS_FILE_INFO(info)) {
-                QString pathUri = "";
-                char* path = g_file_info_get_attribute_as_string (info, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
-                if (path) {
-                    pathUri = path;
-                    g_free(path);
-                }
-                else {
-                    const char* name = g_file_info_get_display_name(info);
-                    pathUri = QString("%1/%2").arg(mUri).arg(name);
-                }
-
-                auto item = new SandboxItem(pathUri, this);
-                if (mIndex.contains (pathUri)) {
-                    delete item;
-                    g_object_unref(info);
-                    continue;
-                }
-                ++add;
-                mChilds << item;
-                mIndex[pathUri] = item;
-                g_object_unref(info);
-            }
-        }
-        g_object_unref(em);
+void SandboxModel::setRootDir(const QString & uri)
+{
+    GFile* file = g_file_new_for_uri (uri.toUtf8().data());
+    if (!G_IS_FILE(file)) {
+        qWarning() << "file is nullptr";
+        return;
     }
-    if (file) {
+
+    if (G_FILE_TYPE_DIRECTORY != g_file_query_file_type(file, G_FILE_QUERY_INFO_NONE, nullptr)) {
         g_object_unref(file);
+        qWarning() << "file type is not directory";
+        return;
     }
+    g_object_unref(file);
 
-    return add;
+    beginResetModel();
+    resetTree(uri_format(uri));
+    endResetModel();
+
+    startLoad(mRootItem);
 }
 
-SandboxItem * SandboxItem::child(int row)
+void SandboxModel::refresh()
 {
-    if (row >= 0 && row < mChilds.count()) {
-        return mChilds.at (row);
+    if (!mRootItem) {
+        return;
     }
 
-    return nullptr;
-}
+    const QString uri = mRootItem->uri;
 
-void SandboxItem::setRootDir(const QString & uri)
-{
-    mUri = uri;
-    if (mFile) { g_object_unref(mFile); mFile = nullptr; }
+    beginResetModel();
+    resetTree(uri);
+    endResetModel();
 
-    mFile = g_file_new_for_uri(mUri.toUtf8().data());
+    startLoad(mRootItem);
+}
 
-    for (auto i : mChilds) {
-        delete i;
-    }
+// 丢弃整棵树，重新建立根节点，子节点由 startLoad 异步加载
+void SandboxModel::resetTree(const QString& rootUri)
+{
+    // 还在进行的枚举全部作废
+    g_cancellable_cancel(mCancel);
+    g_object_unref(mCancel);
+    mCancel = g_cancellable_new();
 
-    mChilds.clear();
+    mLocker.lock();
+    mCurrItem = nullptr;
+    mCurrIdx = QModelIndex();
+    mRootItem = nullptr;
     mIndex.clear();
+    mArena.clear();
+    mLocker.unlock();
 
-    findChildren();
+    const QString path = QUrl(rootUri).path();
+    char* name = g_path_get_basename(path.toUtf8().constData());
+    mRootItem = newItem(nullptr, rootUri, path);
+    mRootItem->name = QString::fromUtf8(name);
+    mRootItem->type = G_FILE_TYPE_DIRECTORY;
+    g_free(name);
 }
 
-void SandboxItem::setStatus(SandboxItemStatus status)
+SandboxItem* SandboxModel::newItem(SandboxItem* parent, const QString& uri, const QString& path)
 {
-    mStatus = status;
-}
+    SandboxItem* item = mArena.alloc();
+    item->uri = uri;
+    item->path = path;
+    item->parent = parent;
 
-SandboxItem::SandboxItemStatus SandboxItem::status() const
-{
-    return mStatus;
+    QMutexLocker locker(&mLocker);
+    mIndex.insert(path, item);
+
+    return item;
 }
 
-void SandboxItem::setProgress(float process)
+QModelIndex SandboxModel::indexOf(SandboxItem* item, int column) const
 {
-    if (process > mProgress) {
-        mProgress = process;
+    if (!item) {
+        return {};
     }
-}
 
-QVector<SandboxItem *> SandboxItem::getChildren() const
-{
-    return mChilds;
+    return createIndex((item == mRootItem) ? 0 : item->rowInParent, column, item);
 }
 
-SandboxModel::SandboxModel(QObject * parent)
-    : QAbstractTableModel(parent), mRootItem(nullptr)
+void SandboxModel::startLoad(SandboxItem* item)
 {
+    g_return_if_fail(item && SandboxItem::SI_LOAD_NONE == item->load);
+
+    item->load = SandboxItem::SI_LOAD_LOADING;
+
+    auto ctx = g_new0(DirLoad, 1);
+    ctx->model = this;
+    ctx->item = item;
+    ctx->cancel = G_CANCELLABLE(g_object_ref(mCancel));
+
+    GFile* file = g_file_new_for_uri(item->uri.toUtf8().constData());
+    g_file_enumerate_children_async(file, SANDBOX_MODEL_ATTRS, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                    G_PRIORITY_DEFAULT, ctx->cancel, onEnumerateReady, ctx);
+    g_object_unref(file);
 }
 
-SandboxModel::~SandboxModel()
+void SandboxModel::onEnumerateReady(GObject* obj, GAsyncResult* res, gpointer udata)
 {
-    delete mRootItem;
+    auto ctx = static_cast<DirLoad*>(udata);
+
+    GError* error = nullptr;
+    GFileEnumerator* en = g_file_enumerate_children_finish(G_FILE(obj), res, &error);
+    if (g_cancellable_is_cancelled(ctx->cancel)) {
+        if (en) { g_object_unref(en); }
+        goto out;
+    }
+
+    if (!en) {
+        qWarning() << "enumerate" << ctx->item->uri << "error:" << (error ? error->message : "");
+        ctx->item->load = SandboxItem::SI_LOAD_DONE;
+        // 可能由有子节点变为没有，刷新展开箭头
+        Q_EMIT ctx->model->dataChanged(ctx->model->indexOf(ctx->item, 0), ctx->model->indexOf(ctx->item, 1));
+        goto out;
+    }
+
+    ctx->enumerator = en;
+    g_file_enumerator_next_files_async(en, SANDBOX_MODEL_BATCH, G_PRIORITY_DEFAULT, ctx->cancel, onNextFilesReady, ctx);
+    if (error) { g_error_free(error); }
+    return;
+
+out:
+    if (error) { g_error_free(error); }
+    g_object_unref(ctx->cancel);
+    g_free(ctx);
 }
 
-void SandboxModel::setRootDir(const QString & uri)
+void SandboxModel::onNextFilesReady(GObject* obj, GAsyncResult* res, gpointer udata)
 {
-    GFile* file = g_file_new_for_uri (uri.toUtf8().data());
-    if (!G_IS_FILE(file)) {
-        qWarning() << "file is nullptr";
-        return;
+    auto ctx = static_cast<DirLoad*>(udata);
+
+    GError* error = nullptr;
+    GList* infos = g_file_enumerator_next_files_finish(G_FILE_ENUMERATOR(obj), res, &error);
+    if (g_cancellable_is_cancelled(ctx->cancel)) {
+        g_list_free_full(infos, g_object_unref);
+        goto out;
     }
 
-    if (G_FILE_TYPE_DIRECTORY != g_file_query_file_type(file, G_FILE_QUERY_INFO_NONE, nullptr)) {
-        g_object_unref(file);
-        qWarning() << "file type is not directory";
+    if (infos) {
+        ctx->model->appendBatch(ctx->item, infos);
+        g_list_free_full(infos, g_object_unref);
+        g_file_enumerator_next_files_async(ctx->enumerator, SANDBOX_MODEL_BATCH, G_PRIORITY_DEFAULT, ctx->cancel, onNextFilesReady, ctx);
         return;
     }
-    g_object_unref(file);
 
-    beginResetModel();
-    mCurrIdx = QModelIndex();
-    mCurrItem = nullptr;
-    if (!mRootItem) {
-        mRootItem = new SandboxItem(uri);
+    if (error) {
+        qWarning() << "enumerate" << ctx->item->uri << "error:" << error->message;
     }
-    else {
-        mRootItem->setRootDir (uri);
+    ctx->item->load = SandboxItem::SI_LOAD_DONE;
+    if (ctx->item->children.isEmpty()) {
+        Q_EMIT ctx->model->dataChanged(ctx->model->indexOf(ctx->item, 0), ctx->model->indexOf(ctx->item, 1));
     }
-    endResetModel();
+
+out:
+    if (error) { g_error_free(error); }
+    g_file_enumerator_close_async(ctx->enumerator, G_PRIORITY_DEFAULT, nullptr, nullptr, nullptr);
+    g_object_unref(ctx->enumerator);
+    g_object_unref(ctx->cancel);
+    g_free(ctx);
 }
 
-void SandboxModel::refresh()
+void SandboxModel::appendBatch(SandboxItem* item, GList* infos)
 {
-    beginResetModel();
+    const bool rootSlash = item->uri.endsWith("/");
+    const QString pathPrefix = ("/" == item->path) ? QString() : item->path;
+
+    for (GList* l = infos; l; l = l->next) {
+        auto info = G_FILE_INFO(l->data);
+        const char* name = g_file_info_get_name(info);
+        if (!name) {
+            continue;
+        }
 
-    for (auto i : mRootItem->mChilds) {
-        delete i;
+        QString uri;
+        QString path;
+        const char* target = g_file_info_get_attribute_string(info, G_FILE_ATTRIBUTE_STANDARD_TARGET_URI);
+        if (target) {
+            uri = target;
+            path = QUrl(uri).path();
+        }
+        else {
+            const QByteArray rawName(name);
+            path = QString("%1/%2").arg(pathPrefix, QString::fromLocal8Bit(rawName));
+            uri = QString("%1%2%3").arg(item->uri, rootSlash ? "" : "/",
+                    QString::fromLatin1(QUrl::toPercentEncoding(QString::fromLocal8Bit(rawName), "!$&'()*+,;=:@")));
+        }
+
+        if (mIndex.contains(path)) {
+            continue;
+        }
+
+        SandboxItem* child = newItem(item, uri, path);
+        child->name = QString::fromUtf8(g_file_info_get_display_name(info));
+        child->type = g_file_info_get_file_type(info);
+        child->isSymlink = g_file_info_get_is_symlink(info);
+        item->pending << child;
     }
 
-    mCurrItem = nullptr;
-    mCurrIdx = QModelIndex();
-    mRootItem->mChilds.clear();
-    mRootItem->mIndex.clear();
-    mRootItem->findChildren();
-    endResetModel();
+    // 第一页直接显示，其余等视图滚动到底部时 fetchMore
+    if (item->children.count() < SANDBOX_MODEL_PAGE) {
+        insertPending(item, SANDBOX_MODEL_PAGE - item->children.count());
+    }
+}
+
+void SandboxModel::insertPending(SandboxItem* item, int max)
+{
+    const int n = qMin(max, item->pending.count() - item->pendingPos);
+    if (n <= 0) {
+        return;
+    }
+
+    const int first = item->children.count();
+    beginInsertRows(indexOf(item, 0), first, first + n - 1);
+    for (int i = 0; i < n; ++i) {
+        SandboxItem* child = item->pending.at(item->pendingPos + i);
+        child->rowInParent = first + i;
+        item->children << child;
+    }
+    item->pendingPos += n;
+    if (item->pendingPos >= item->pending.count()) {
+        item->pending.clear();
+        item->pendingPos = 0;
+    }
+    endInsertRows();
 }
 
 void SandboxModel::setItemProcessByUri(const QString & uri, float progress)
@@ -301,7 +350,7 @@ void SandboxModel::setItemStatusByUri(const QString & uri, SandboxItem::SandboxI
 
     SandboxItem * resItem = findSandboxItemByUri(uri);
     if (resItem) {
-        resItem->setStatus(status);
+        resItem->mStatus = status;
     }
     else {
         qWarning() << "item not found";
@@ -330,55 +379,22 @@ SandboxItem * SandboxModel::findSandboxItemByUri(const QString & uri)
     if (nullptr == uri || uri.isEmpty() || !mRootItem) { return nullptr; }
 
     QString pathF = QUrl(uri).path();
+    while ("/" != pathF && pathF.endsWith("/")) {
+        pathF.chop(1);
+    }
 
-    if (mCurrItem && pathF == mCurrItem->getPath()) {
+    if (mCurrItem && pathF == mCurrItem->path) {
         return mCurrItem;
     }
 
-    mCurrIdx = index(0, 1);
-
-    // 深度优先
-    std::function<SandboxItem*(SandboxItem*, QModelIndex)> findItem = [&] (SandboxItem* item, const QModelIndex& parentIdx=QModelIndex()) ->SandboxItem* {
-        if (!item) { return nullptr; }
-
-        if (pathF == item->getPath()) {
-            return item;
-        }
-
-        mCurrIdx = index(0, 1, parentIdx);
-        QModelIndex indexT = mCurrIdx;
-
-        int count = item->mChilds.size();
-        for (int i = 0; i < count; ++i) {
-            indexT = index(i, 1, parentIdx);
-            mCurrIdx = indexT;
-            auto res = findItem(item->mChilds.at(i), indexT);
-            if (res) {
-                return res;
-            }
-        }
-
-        mCurrIdx = parentIdx;
-        return nullptr;
-    };
-
-    SandboxItem * item = mRootItem;
-    SandboxItem* resItem = findItem(item, mCurrIdx);
-
-    // if (!uri.isEmpty()) {
-        // printf("uri: '%s', path: '%s'\n", uri.toUtf8().constData(), pathF.toUtf8().constData());
-    // }
-
-    // printf("start root: '%s'\n", mRootItem->getPath().toUtf8().data());
-
+    SandboxItem* resItem = mIndex.value(pathF, nullptr);
     if (resItem) {
         if (mCurrItem) {
-            mCurrItem->setStatus(SandboxItem::SI_STATUS_NONE);
+            mCurrItem->mStatus = SandboxItem::SI_STATUS_NONE;
         }
         mCurrItem = resItem;
-        // printf("Found item '%s'\n", resItem->getPath().toUtf8().constData());
+        mCurrIdx = indexOf(resItem, 1);
     }
-    // printf("\n");
 
     return resItem;
 }
@@ -407,9 +423,7 @@ QModelIndex SandboxModel::parent(const QModelIndex & index) const
         return {};
     }
 
-    auto parentItem = item->mParent;
-
-    return createIndex (parentItem->row(), 0, parentItem);
+    return indexOf(item->parent, 0);
 }
 
 int SandboxModel::rowCount(const QModelIndex & parent) const
@@ -420,7 +434,7 @@ int SandboxModel::rowCount(const QModelIndex & parent) const
 
     auto parentItem = static_cast<SandboxItem*>(parent.internalPointer());
 
-    return parentItem->mChilds.count();
+    return parentItem->children.count();
 }
 
 int SandboxModel::columnCount(const QModelIndex & parent) const
@@ -505,18 +519,20 @@ bool SandboxModel::hasChildren(const QModelIndex & parent) const
     if (!parent.isValid()) return true;
 
     auto item = static_cast<SandboxItem*>(parent.internalPointer());
-    if (!item) { return false; }
-    int currentNum = item->mChilds.count();
-    int addItem = item->findChildren();
+    if (!item || !item->isDir()) { return false; }
 
-    return (currentNum + addItem > 0);
+    // 没枚举完之前都当作有子节点，不在这里同步枚举
+    return (SandboxItem::SI_LOAD_DONE != item->load) || !item->children.isEmpty() || !item->pending.isEmpty();
 }
 
 bool SandboxModel::canFetchMore(const QModelIndex & parent) const
 {
     if (!parent.isValid()) return false;
 
-    return true;
+    auto item = static_cast<SandboxItem*>(parent.internalPointer());
+    if (!item || !item->isDir()) { return false; }
+
+    return (SandboxItem::SI_LOAD_NONE == item->load) || (item->pendingPos < item->pending.count());
 }
 
 void SandboxModel::fetchMore(const QModelIndex & parent)
@@ -524,11 +540,12 @@ void SandboxModel::fetchMore(const QModelIndex & parent)
     if (!parent.isValid()) return;
 
     auto item = static_cast<SandboxItem*>(parent.internalPointer());
+    if (!item || !item->isDir()) { return; }
 
-    int currentNum = item->mChilds.count();
-    int addItem = item->findChildren();
-    if (addItem > 0) {
-        beginInsertRows (parent, currentNum, addItem);
-        endInsertRows();
+    if (SandboxItem::SI_LOAD_NONE == item->load) {
+        startLoad(item);
+        return;
     }
+
+    insertPending(item, SANDBOX_MODEL_PAGE);
 }
@@ -5,18 +5,24 @@
 #ifndef sandbox_SANDBOX_MODEL_H
 #define sandbox_SANDBOX_MODEL_H
 
+#include <QHash>
 #include <QIcon>
 #include <QMutex>
+#include <QVector>
 #include <QAbstractTableModel>
 #include <gio/gio.h>
 
+#include <memory>
+#include <vector>
+
 class SandboxModel;
 
-class SandboxItem : public QObject
+/**
+ * 树上的一个节点，不再是 QObject，只在 SandboxItemArena 中分配，
+ * 地址在整棵树重置前保持不变，可以直接作为 QModelIndex::internalPointer
+ */
+struct SandboxItem
 {
-    Q_OBJECT
-    friend class SandboxModel;
-public:
     typedef enum {
         SI_STATUS_NONE = 0,
         SI_STATUS_PREPARE,
@@ -24,35 +30,57 @@ public:
         SI_STATUS_FINISHED,
     } SandboxItemStatus;
 
-    explicit SandboxItem(const QString& uri, SandboxItem* parent = nullptr);
-    ~SandboxItem() override;
-
-    QString                 getPath             () const;
-    QString                 getUri              ();
-    bool                    isDir               ();
-    bool                    isFile              ();
-    bool                    isLink              ();
-    QIcon                   icon                ();
-    int                     findChildren        ();
-    int                     row                 () const;
-    QString                 fileName            () const;
-    SandboxItem*            child               (int row);
-    void                    setRootDir          (const QString& uri);
-    SandboxItemStatus       status              () const;
+    typedef enum {
+        SI_LOAD_NONE = 0,                               // 还没有枚举
+        SI_LOAD_LOADING,                                // 后台分批枚举中
+        SI_LOAD_DONE,                                   // 枚举结束(可能还有 pending 没有插入)
+    } SandboxItemLoad;
+
+    QString                 getUri              () const { return uri; }
+    QString                 getPath             () const { return path; }
+    QString                 fileName            () const { return name; }
+    bool                    isDir               () const { return G_FILE_TYPE_DIRECTORY == type; }
+    bool                    isFile              () const { return G_FILE_TYPE_REGULAR == type; }
+    bool                    isLink              () const { return isSymlink; }
+    int                     row                 () const { return rowInParent; }
+    SandboxItemStatus       status              () const { return mStatus; }
+    QIcon                   icon                () const;
+    SandboxItem*            child               (int row) const;
     void                    setProgress         (float process);
-    QVector<SandboxItem*>   getChildren         () const;
+    QVector<SandboxItem*>   getChildren         () const { return children; }
+
+    QString                         uri;
+    QString                         path;           // 哈希索引的键
+    QString                         name;           // 显示名
+    GFileType                       type = G_FILE_TYPE_UNKNOWN;
+    bool                            isSymlink = false;
+    int                             rowInParent = 0;
+    SandboxItem*                    parent = nullptr;
+    SandboxItemLoad                 load = SI_LOAD_NONE;
+    QVector<SandboxItem*>           children;       // 已经插入模型的行
+    QVector<SandboxItem*>           pending;        // 已枚举、等待 fetchMore 插入的行
+    int                             pendingPos = 0;
 
 private:
-    void                setStatus       (SandboxItemStatus status);
+    friend class SandboxModel;
+    SandboxItemStatus               mStatus = SI_STATUS_NONE;
+    float                           mProgress = 0.0;
+};
+
+/**
+ * 按块分配 SandboxItem，块不搬移，只在 clear() 时整体释放
+ */
+class SandboxItemArena
+{
+public:
+    SandboxItem*            alloc               ();
+    void                    clear               ();
+    int                     size                () const { return mUsed; }
 
 private:
-    QString                         mUri;
-    SandboxItemStatus               mStatus;
-    float                           mProgress;
-    GFile*                          mFile = nullptr;
-    SandboxItem*                    mParent = nullptr;
-    QMap<QString, SandboxItem*>     mIndex;
-    QVector<SandboxItem*>           mChilds;
+    static constexpr int                        BLOCK_ITEMS = 4096;
+    std::vector<std::unique_ptr<SandboxItem[]>> mBlocks;
+    int                                         mUsed = 0;
 };
 
 class SandboxModel : public QAbstractTableModel
@@ -72,7 +100,18 @@ public Q_SLOTS:
     void updateCurrent();
 
 private:
+    struct DirLoad;
+
     SandboxItem* findSandboxItemByUri   (const QString& uri);
+    SandboxItem* newItem                (SandboxItem* parent, const QString& uri, const QString& path);
+    QModelIndex  indexOf                (SandboxItem* item, int column) const;
+    void         resetTree              (const QString& rootUri);
+    void         startLoad              (SandboxItem* item);
+    void         appendBatch            (SandboxItem* item, GList* infos);
+    void         insertPending          (SandboxItem* item, int max);
+
+    static void  onEnumerateReady       (GObject* obj, GAsyncResult* res, gpointer udata);
+    static void  onNextFilesReady       (GObject* obj, GAsyncResult* res, gpointer udata);
 
 public:
     Qt::ItemFlags   flags       (const QModelIndex &index) const override;
@@ -87,10 +126,13 @@ public:
     void            fetchMore   (const QModelIndex &parent) override;
 
 private:
-    QMutex                  mLocker;
-    QModelIndex             mCurrIdx;
-    SandboxItem*            mCurrItem = nullptr;
-    SandboxItem*            mRootItem = nullptr;
+    QMutex                          mLocker;
+    QModelIndex                     mCurrIdx;
+    SandboxItem*                    mCurrItem = nullptr;
+    SandboxItem*                    mRootItem = nullptr;
+    SandboxItemArena                mArena;
+    QHash<QString, SandboxItem*>    mIndex;         // path -> item
+    GCancellable*                   mCancel = nullptr;
 };
 
 
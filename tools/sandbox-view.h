@@ -9,7 +9,7 @@
 
 class QTimer;
 class QPainter;
-class SandboxItem;
+struct SandboxItem;
 class SandboxView : public QTreeView
 {
     Q_OBJECT